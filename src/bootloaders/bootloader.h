@@ -33,6 +33,14 @@ typedef bool (*boot_loader_remove)(const BootManager *);
 typedef void (*boot_loader_destroy)(const BootManager *);
 typedef int (*boot_loader_caps)(const BootManager *);
 
+/**
+ * Receives each file a bootloader owns on the boot partition, with the file
+ * it is a verbatim copy of, or NULL if it is generated
+ */
+typedef void (*boot_loader_file_func)(const char *source, const char *target, void *userdata);
+typedef void (*boot_loader_list_files)(const BootManager *, const Kernel *kernel,
+                                       boot_loader_file_func func, void *userdata);
+
 typedef enum {
         BOOTLOADER_CAP_MIN = 1 << 0,
         BOOTLOADER_CAP_UEFI = 1 << 1,   /**<Bootloader supports UEFI */
@@ -62,6 +70,7 @@ typedef struct BootLoader {
         boot_loader_remove remove;         /**<Remove this bootloader from the disk */
         boot_loader_destroy destroy;       /**<Perform necessary cleanups */
         boot_loader_caps get_capabilities; /**<Check capabilities */
+        boot_loader_list_files list_files; /**<List files owned for a kernel, or NULL for itself */
 } BootLoader;
 
 #define __cbm_export__ __attribute__((visibility("default")))
@@ -27,13 +27,14 @@
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "run.h"
 #include "system_stub.h"
 #include "util.h"
 #include "writer.h"
 #include "mbr.h"
 
 static KernelArray *kernel_queue = NULL;
-static char *extlinux_cmd = NULL;
+static char **extlinux_cmd = NULL;
 static char *base_path = NULL;
 
 static bool extlinux_init(const BootManager *manager)
@@ -41,6 +42,7 @@ static bool extlinux_init(const BootManager *manager)
         autofree(char) *ldlinux = NULL;
         const char *prefix = NULL;
         autofree(char) *boot_device = NULL;
+        autofree(char) *extlinux_bin = NULL;
 
         if (kernel_queue) {
                 kernel_array_free(kernel_queue);
@@ -57,10 +59,8 @@ static bool extlinux_init(const BootManager *manager)
         base_path = boot_manager_get_boot_dir((BootManager *)manager);
         OOM_CHECK_RET(base_path, false);
 
-        if (extlinux_cmd) {
-                free(extlinux_cmd);
-                extlinux_cmd = NULL;
-        }
+        cbm_argv_free(extlinux_cmd);
+        extlinux_cmd = NULL;
 
         ldlinux = string_printf("%s/ldlinux.sys", base_path);
 
@@ -71,8 +71,14 @@ static bool extlinux_init(const BootManager *manager)
                 boot_device = get_boot_device();
         }
 
-        extlinux_cmd = string_printf("%s/usr/bin/extlinux -i %s --device %s &> /dev/null",
-                                     prefix, base_path, boot_device);
+        extlinux_bin = string_printf("%s/usr/bin/extlinux", prefix);
+        /* Without a known device extlinux uses the one holding base_path */
+        if (boot_device) {
+                extlinux_cmd =
+                    cbm_argv_new(extlinux_bin, "-i", base_path, "--device", boot_device, NULL);
+        } else {
+                extlinux_cmd = cbm_argv_new(extlinux_bin, "-i", base_path, NULL);
+        }
 
         return true;
 }
@@ -110,10 +116,11 @@ static bool extlinux_set_default_kernel(const BootManager *manager, const Kernel
 {
         autofree(char) *config_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
+        CbmArena *scratch = boot_manager_get_scratch(manager);
+        CbmArenaMark mark = cbm_arena_mark(scratch);
 
         root_dev = boot_manager_get_root_device((BootManager *)manager);
         if (!root_dev) {
@@ -124,7 +131,8 @@ static bool extlinux_set_default_kernel(const BootManager *manager, const Kernel
         config_path = string_printf("%s/syslinux.cfg", base_path);
         LOG_DEBUG("Writing extlinux config to: %s", config_path);
 
-        if (!cbm_writer_open(writer)) {
+        if (!cbm_writer_open_sized(writer,
+                                   (size_t)kernel_queue->len * CBM_WRITER_ENTRY_SIZE_HINT)) {
                 DECLARE_OOM();
                 abort();
         }
@@ -136,9 +144,7 @@ static bool extlinux_set_default_kernel(const BootManager *manager, const Kernel
 
         for (uint16_t i = 0; i < kernel_queue->len; i++) {
                 const Kernel *k = nc_array_get(kernel_queue, i);
-                autofree(char) *initrd_paths = NULL;
-                initrd_paths = malloc(1);
-                initrd_paths[0] = '\0';
+                const char *initrd_paths = "";
 
                 /* Mark it default */
                 if (default_kernel && streq(k->source.path, default_kernel->source.path)) {
@@ -150,15 +156,15 @@ static bool extlinux_set_default_kernel(const BootManager *manager, const Kernel
 
                 /* Add the initrd if we found one */
                 if (k->target.initrd_path) {
-                        char *tmp = initrd_paths;
-                        initrd_paths = string_printf("%s,%s", initrd_paths, k->target.initrd_path);
-                        free(tmp);
+                        initrd_paths = cbm_arena_printf(scratch,
+                                                        "%s,%s",
+                                                        initrd_paths,
+                                                        k->target.initrd_path);
                 }
                 boot_manager_initrd_iterator_init(manager, &iter);
                 while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
-                        char *tmp = initrd_paths;
-                        initrd_paths = string_printf("%s,%s", initrd_paths, initrd_name);
-                        free(tmp);
+                        initrd_paths =
+                            cbm_arena_printf(scratch, "%s,%s", initrd_paths, initrd_name);
                 }
 
                 if (strlen(initrd_paths)) {
@@ -181,6 +187,7 @@ static bool extlinux_set_default_kernel(const BootManager *manager, const Kernel
 
                 /* Write out the cmdline */
                 cbm_writer_append_printf(writer, "%s\n", k->meta.cmdline);
+                cbm_arena_rewind(scratch, mark);
         }
 
         cbm_writer_close(writer);
@@ -191,13 +198,11 @@ static bool extlinux_set_default_kernel(const BootManager *manager, const Kernel
         }
 
         /* If the file is the same, don't write it again or sync */
-        if (file_get_text(config_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
+        if (cbm_file_content_equals(config_path, writer->buffer, writer->buffer_n)) {
+                return true;
         }
 
-        if (!file_set_text(config_path, writer->buffer)) {
+        if (!cbm_writer_write_file(writer, config_path)) {
                 LOG_FATAL("extlinux_set_default_kernel: Failed to write %s: %s",
                           config_path,
                           strerror(errno));
@@ -250,8 +255,8 @@ static bool extlinux_install(const BootManager *manager)
 
         close(mbr);
 
-        CHECK_ERR_RET_VAL(cbm_system_system(extlinux_cmd) != 0, false,
-                          "cbm_system_system() returned value != 0");
+        CHECK_ERR_RET_VAL(cbm_system_run(extlinux_cmd, 0) != 0, false,
+                          "cbm_system_run() returned value != 0");
 
         cbm_sync();
         return true;
@@ -278,10 +283,8 @@ static void extlinux_destroy(__cbm_unused__ const BootManager *manager)
                 /* kernels pointers inside are not owned by the array */
                 nc_array_free(&kernel_queue, NULL);
         }
-        if (extlinux_cmd) {
-                free(extlinux_cmd);
-                extlinux_cmd = NULL;
-        }
+        cbm_argv_free(extlinux_cmd);
+        extlinux_cmd = NULL;
         if (base_path) {
                 free(base_path);
                 base_path = NULL;
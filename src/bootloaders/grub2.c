@@ -27,6 +27,7 @@
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "run.h"
 #include "system_stub.h"
 #include "util.h"
 #include "writer.h"
@@ -175,9 +176,11 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         const char *root_tab = config->submenu ? "\t" : "";
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
-        autofree(char) *initrd_paths = NULL;
-        initrd_paths = malloc(1);
-        initrd_paths[0] = '\0';
+        CbmArena *scratch = boot_manager_get_scratch(config->manager);
+        CbmArenaMark mark = cbm_arena_mark(scratch);
+        const char *initrd_paths = "";
+        /* i.e. /boot */
+        const char *boot_prefix = (!config->is_separate) ? BOOT_DIRECTORY : "";
 
         /* Write the start of the entry
          * e.g. menuentry 'Some Linux OS (4.4.9-12.lts)' --class some-linux-os --class gnu-linux
@@ -246,21 +249,19 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
 
         /* Optional initrd */
         if (kernel->target.initrd_path) {
-                char *tmp = initrd_paths;
-                initrd_paths = string_printf("%s %s/%s",
-                                         initrd_paths,
-                                         (!config->is_separate) ? BOOT_DIRECTORY : "", /* i.e. /boot */
-                                         kernel->target.initrd_path);
-                free(tmp);
+                initrd_paths = cbm_arena_printf(scratch,
+                                                "%s %s/%s",
+                                                initrd_paths,
+                                                boot_prefix,
+                                                kernel->target.initrd_path);
         }
         boot_manager_initrd_iterator_init(config->manager, &iter);
         while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
-                char *tmp = initrd_paths;
-                initrd_paths = string_printf("%s %s/%s",
-                                         initrd_paths,
-                                         (!config->is_separate) ? BOOT_DIRECTORY : "", /* i.e. /boot */
-                                         initrd_name);
-                free(tmp);
+                initrd_paths = cbm_arena_printf(scratch,
+                                                "%s %s/%s",
+                                                initrd_paths,
+                                                boot_prefix,
+                                                initrd_name);
         }
 
         if (strlen(initrd_paths)) {
@@ -275,6 +276,7 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
 
         /* Finalize the entry */
         cbm_writer_append_printf(config->writer, "echo \"%s}\"\n\n", root_tab);
+        cbm_arena_rewind(scratch, mark);
 
         return true;
 }
@@ -290,7 +292,6 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         const CbmDeviceProbe *root_dev = NULL;
         const char *os_name = NULL;
         const char *os_id = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(char) *conf_path = NULL;
         autofree(char) *boot_dir = NULL;
         const char *prefix = NULL;
@@ -298,7 +299,8 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         Grub2Config config = { 0 };
         bool wrote_submenu = false;
 
-        if (!cbm_writer_open(writer)) {
+        if (!cbm_writer_open_sized(writer,
+                                   (size_t)kernel_queue->len * CBM_WRITER_ENTRY_SIZE_HINT)) {
                 return false;
         }
 
@@ -392,10 +394,8 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
 
         conf_path = string_printf("%s/etc/grub.d/10_%s", prefix, KERNEL_NAMESPACE);
         /* If our new config matches the old config, just return. */
-        if (file_get_text(conf_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
+        if (cbm_file_content_equals(conf_path, writer->buffer, writer->buffer_n)) {
+                return true;
         }
 
         /* Ensure the grub.d directory actually exists (should do..) */
@@ -405,7 +405,7 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
                 return false;
         }
 
-        if (!file_set_text(conf_path, writer->buffer)) {
+        if (!cbm_writer_write_file(writer, conf_path)) {
                 LOG_FATAL("Failed to create loader entry for: %s", strerror(errno));
                 return false;
         }
@@ -430,13 +430,15 @@ bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_
         }
         autofree(char) *vmlinuz_path = NULL;
         autofree(char) *initrd_path = NULL;
-        autofree(char) *command = NULL;
+        autofree(char) *mkconfig = NULL;
+        autofree(char) *grub_cfg = NULL;
         autofree(char) *boot_dir = NULL;
         autofree(char) *grub_dir = NULL;
         autofree(char) *vmlinuz_rel = NULL;
         autofree(char) *initrd_rel = NULL;
         autofree(char) *boot_rel = NULL;
         const char *prefix = NULL;
+        char **argv = NULL;
         int ret;
 
         prefix = boot_manager_get_prefix((BootManager *)manager);
@@ -476,8 +478,11 @@ bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_
         }
 
         /* Run grub-mkconfig now */
-        command = string_printf("%s/usr/sbin/grub-mkconfig -o %s/grub/grub.cfg", prefix, boot_dir);
-        ret = cbm_system_system(command);
+        mkconfig = string_printf("%s/usr/sbin/grub-mkconfig", prefix);
+        grub_cfg = string_printf("%s/grub/grub.cfg", boot_dir);
+        argv = cbm_argv_new(mkconfig, "-o", grub_cfg, NULL);
+        ret = cbm_system_run(argv, 0);
+        cbm_argv_free(argv);
         if (ret != 0) {
                 LOG_FATAL("grub2_set_default_kernel: grub-mkconfig exited with status code %d: %s",
                           ret,
@@ -69,6 +69,8 @@ static bool shim_systemd_remove(const BootManager *);
 static bool shim_systemd_init(const BootManager *);
 static void shim_systemd_destroy(const BootManager *);
 static int shim_systemd_get_capabilities(const BootManager *);
+static void shim_systemd_list_files(const BootManager *, const Kernel *, boot_loader_file_func,
+                                    void *);
 
 __cbm_export__ const BootLoader
     shim_systemd_bootloader = {.name = "shim-systemd",
@@ -84,7 +86,8 @@ __cbm_export__ const BootLoader
                                .update = shim_systemd_update,
                                .remove = shim_systemd_remove,
                                .destroy = shim_systemd_destroy,
-                               .get_capabilities = shim_systemd_get_capabilities };
+                               .get_capabilities = shim_systemd_get_capabilities,
+                               .list_files = shim_systemd_list_files };
 
 #if UINTPTR_MAX == 0xffffffffffffffff
 #define EFI_SUFFIX "x64.efi"
@@ -224,40 +227,73 @@ static bool shim_systemd_needs_update(__cbm_unused__ const BootManager *manager)
         return !config.has_boot_rec;
 }
 
+static void shim_systemd_list_files(const BootManager *manager, const Kernel *kernel,
+                                    boot_loader_file_func func, void *userdata)
+{
+        if (!kernel) {
+                func(config.shim_src, config.shim_dst_host, userdata);
+                func(config.systemd_src, config.systemd_dst_host, userdata);
+                if (config.is_image_mode) {
+                        func(config.systemd_src, config.efi_fallback_dst_host, userdata);
+                }
+        }
+        sd_class_list_config(manager, kernel, func, userdata);
+}
+
 static bool make_layout(const BootManager *manager)
 {
         autofree(char) *boot_root = boot_manager_get_boot_dir((BootManager *)manager);
         autofree(char) *systemd_config_entries = NULL;
+        CbmCaseCache *case_cache = boot_manager_get_case_cache(manager);
 
         if (!nc_mkdir_p(config.bin_dst_host, 00755)) {
                 return false;
         }
+        cbm_case_cache_invalidate(case_cache, config.bin_dst_host);
 
-        systemd_config_entries =
-            nc_build_case_correct_path(boot_root, SYSTEMD_CONFIG_DIR, SYSTEMD_ENTRIES_DIR, NULL);
+        systemd_config_entries = cbm_case_cache_build_path(case_cache,
+                                                           boot_root,
+                                                           SYSTEMD_CONFIG_DIR,
+                                                           SYSTEMD_ENTRIES_DIR,
+                                                           NULL);
         if (!nc_mkdir_p(systemd_config_entries, 00755)) {
                 return false;
         }
+        cbm_case_cache_invalidate(case_cache, systemd_config_entries);
         /* in case of image creation, override the fallback bootloader, so the
          * media will be bootable. */
         if (config.is_image_mode) {
                 if (!nc_mkdir_p(config.efi_fallback_dir, 00755)) {
                         return false;
                 }
+                cbm_case_cache_invalidate(case_cache, config.efi_fallback_dir);
         }
         return true;
 }
 
-/* Installs EFI fallback (default) bootloader at /EFI/Boot/BOOTX64.EFI */
-static bool shim_systemd_install_fallback_bootloader(__cbm_unused__ const BootManager *manager)
+/* Installs systemd-boot for shim to chain to and, in image mode, as the EFI
+ * fallback (default) bootloader at /EFI/Boot/BOOTX64.EFI, reading it once */
+static bool shim_systemd_install_systemd(const BootManager *manager)
 {
-        bool result = true;
-
-        if (!copy_file_atomic(config.systemd_src, config.efi_fallback_dst_host, 00644)) {
-                LOG_FATAL("Cannot copy %s to %s", config.systemd_src, config.efi_fallback_dst_host);
-                result = false;
+        const char *paths[] = { config.systemd_dst_host, config.efi_fallback_dst_host };
+        size_t n_paths = config.is_image_mode ? 2 : 1;
+        bool copied[ARRAY_SIZE(paths)];
+
+        if (!copy_file_fanout(config.systemd_src, paths, n_paths, 00644, copied)) {
+                LOG_FATAL("Cannot copy %s to %s%s%s",
+                          config.systemd_src,
+                          config.systemd_dst_host,
+                          config.is_image_mode ? " and " : "",
+                          config.is_image_mode ? config.efi_fallback_dst_host : "");
+                return false;
         }
-        return result;
+        for (size_t i = 0; i < n_paths; i++) {
+                if (copied[i]) {
+                        cbm_case_cache_note_created(boot_manager_get_case_cache(manager),
+                                                    paths[i]);
+                }
+        }
+        return true;
 }
 
 static bool shim_systemd_install(const BootManager *manager)
@@ -273,8 +309,8 @@ static bool shim_systemd_install(const BootManager *manager)
                 LOG_FATAL("Cannot copy %s to %s", config.shim_src, config.shim_dst_host);
                 return false;
         }
-        if (!copy_file_atomic(config.systemd_src, config.systemd_dst_host, 00644)) {
-                LOG_FATAL("Cannot copy %s to %s", config.systemd_src, config.systemd_dst_host);
+        cbm_case_cache_note_created(boot_manager_get_case_cache(manager), config.shim_dst_host);
+        if (!shim_systemd_install_systemd(manager)) {
                 return false;
         }
 
@@ -285,12 +321,6 @@ static bool shim_systemd_install(const BootManager *manager)
                                 LOG_ERROR("Please manually update your bios to add a boot entry for Clear Linux");
                         }
                 }
-        } else {
-                /* override the fallback bootloader in case it's the image mode,
-                 * create EFI boot entry otherwise. */
-                if (!shim_systemd_install_fallback_bootloader(manager)) {
-                        return false;
-                }
         }
 
         return true;
@@ -312,6 +342,7 @@ static bool shim_systemd_init(const BootManager *manager)
         size_t len;
         autofree(char) *prefix = NULL;
         autofree(char) *boot_root = NULL;
+        CbmCaseCache *case_cache = boot_manager_get_case_cache(manager);
 
         if (!boot_manager_is_image_mode((BootManager *)manager)) {
                 if (bootvar_init()) {
@@ -342,23 +373,25 @@ static bool shim_systemd_init(const BootManager *manager)
 
         boot_root = boot_manager_get_boot_dir((BootManager *)manager);
         config.bin_dst_host =
-            nc_build_case_correct_path(boot_root, ESP_EFI, KERNEL_NAMESPACE, NULL);
+            cbm_case_cache_build_path(case_cache, boot_root, ESP_EFI, KERNEL_NAMESPACE, NULL);
         /* bin_dst_esp is the ESP-absolute path which will be consumed by
          * bootloaders and it have to be case-correct too, extract it from
          * case-corrected bin_dst_host. */
         config.bin_dst_esp = strdup(config.bin_dst_host + strlen(boot_root));
 
-        config.shim_dst_host = nc_build_case_correct_path(config.bin_dst_host, SHIM_DST, NULL);
+        config.shim_dst_host =
+            cbm_case_cache_build_path(case_cache, config.bin_dst_host, SHIM_DST, NULL);
         config.systemd_dst_host =
-            nc_build_case_correct_path(config.bin_dst_host, SYSTEMD_DST, NULL);
+            cbm_case_cache_build_path(case_cache, config.bin_dst_host, SYSTEMD_DST, NULL);
 
         /* extract case-corrected ESP-absolute path. needed for the boot record
          * (EFI BootXXXX variable). */
         config.shim_dst_esp = strdup(config.shim_dst_host + strlen(boot_root));
 
-        config.efi_fallback_dir = nc_build_case_correct_path(boot_root, ESP_EFI, ESP_BOOT, NULL);
+        config.efi_fallback_dir =
+            cbm_case_cache_build_path(case_cache, boot_root, ESP_EFI, ESP_BOOT, NULL);
         config.efi_fallback_dst_host =
-            nc_build_case_correct_path(config.efi_fallback_dir, EFI_FALLBACK, NULL);
+            cbm_case_cache_build_path(case_cache, config.efi_fallback_dir, EFI_FALLBACK, NULL);
 
         return true;
 }
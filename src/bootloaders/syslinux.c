@@ -27,6 +27,7 @@
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "run.h"
 #include "system_stub.h"
 #include "util.h"
 #include "writer.h"
@@ -34,14 +35,17 @@
 #include "lib/probe.h"
 
 static KernelArray *kernel_queue = NULL;
-static char *syslinux_cmd = NULL;
-static char *sgdisk_cmd = NULL;
+static char **syslinux_cmd = NULL;
+static char **sgdisk_cmd = NULL;
 static char *base_path = NULL;
 
 static bool syslinux_init(const BootManager *manager)
 {
         autofree(char) *parent_disk = NULL;
         autofree(char) *boot_device = NULL;
+        autofree(char) *syslinux_bin = NULL;
+        autofree(char) *sgdisk_bin = NULL;
+        autofree(char) *attributes = NULL;
         const char *prefix = NULL;
         int partition_index;
 
@@ -60,15 +64,11 @@ static bool syslinux_init(const BootManager *manager)
         base_path = boot_manager_get_boot_dir((BootManager *)manager);
         OOM_CHECK_RET(base_path, false);
 
-        if (syslinux_cmd) {
-                free(syslinux_cmd);
-                syslinux_cmd = NULL;
-        }
+        cbm_argv_free(syslinux_cmd);
+        syslinux_cmd = NULL;
 
-        if (sgdisk_cmd) {
-                free(sgdisk_cmd);
-                sgdisk_cmd = NULL;
-        }
+        cbm_argv_free(sgdisk_cmd);
+        sgdisk_cmd = NULL;
 
         prefix = boot_manager_get_prefix((BootManager *)manager);
         boot_device = get_legacy_boot_device((char *)prefix);
@@ -79,8 +79,8 @@ static bool syslinux_init(const BootManager *manager)
 
         // syslinux -U will not work with a partuuid, the effect of "install" and
         // "update" will always be the same, so assume install for all scenarios
-        syslinux_cmd = string_printf("%s/usr/bin/syslinux -i %s &> /dev/null",
-                                     prefix, boot_device);
+        syslinux_bin = string_printf("%s/usr/bin/syslinux", prefix);
+        syslinux_cmd = cbm_argv_new(syslinux_bin, "-i", boot_device, NULL);
 
         partition_index = get_partition_index(prefix, boot_device);
         if (partition_index == -1) {
@@ -94,15 +94,16 @@ static bool syslinux_init(const BootManager *manager)
                 goto cleanup;
         }
 
-        sgdisk_cmd = string_printf("%s/usr/bin/sgdisk %s --attributes=%d:set:2",
-                                   prefix, parent_disk, partition_index + 1);
+        sgdisk_bin = string_printf("%s/usr/bin/sgdisk", prefix);
+        attributes = string_printf("--attributes=%d:set:2", partition_index + 1);
+        sgdisk_cmd = cbm_argv_new(sgdisk_bin, parent_disk, attributes, NULL);
         return true;
 
  cleanup:
-        free(syslinux_cmd);
+        cbm_argv_free(syslinux_cmd);
         syslinux_cmd = NULL;
 
-        free(sgdisk_cmd);
+        cbm_argv_free(sgdisk_cmd);
         sgdisk_cmd = NULL;
         return false;
 }
@@ -140,10 +141,11 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
 {
         autofree(char) *config_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
+        CbmArena *scratch = boot_manager_get_scratch(manager);
+        CbmArenaMark mark = cbm_arena_mark(scratch);
 
         root_dev = boot_manager_get_root_device((BootManager *)manager);
         if (!root_dev) {
@@ -153,7 +155,8 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
 
         config_path = string_printf("%s/syslinux.cfg", base_path);
 
-        if (!cbm_writer_open(writer)) {
+        if (!cbm_writer_open_sized(writer,
+                                   (size_t)kernel_queue->len * CBM_WRITER_ENTRY_SIZE_HINT)) {
                 DECLARE_OOM();
                 abort();
         }
@@ -165,9 +168,7 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
 
         for (uint16_t i = 0; i < kernel_queue->len; i++) {
                 const Kernel *k = nc_array_get(kernel_queue, i);
-                autofree(char) *initrd_paths = NULL;
-                initrd_paths = malloc(1);
-                initrd_paths[0] = '\0';
+                const char *initrd_paths = "";
 
                 /* Mark it default */
                 if (default_kernel && streq(k->source.path, default_kernel->source.path)) {
@@ -179,15 +180,15 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
 
                 /* Add the initrd if we found one */
                 if (k->target.initrd_path) {
-                        char *tmp = initrd_paths;
-                        initrd_paths = string_printf("%s,%s", initrd_paths, k->target.initrd_path);
-                        free(tmp);
+                        initrd_paths = cbm_arena_printf(scratch,
+                                                        "%s,%s",
+                                                        initrd_paths,
+                                                        k->target.initrd_path);
                 }
                 boot_manager_initrd_iterator_init(manager, &iter);
                 while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
-                        char *tmp = initrd_paths;
-                        initrd_paths = string_printf("%s,%s", initrd_paths, initrd_name);
-                        free(tmp);
+                        initrd_paths =
+                            cbm_arena_printf(scratch, "%s,%s", initrd_paths, initrd_name);
                 }
 
                 if (strlen(initrd_paths)) {
@@ -210,6 +211,7 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
 
                 /* Write out the cmdline */
                 cbm_writer_append_printf(writer, "%s\n", k->meta.cmdline);
+                cbm_arena_rewind(scratch, mark);
         }
 
         cbm_writer_close(writer);
@@ -220,13 +222,11 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
         }
 
         /* If the file is the same, don't write it again or sync */
-        if (file_get_text(config_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
+        if (cbm_file_content_equals(config_path, writer->buffer, writer->buffer_n)) {
+                return true;
         }
 
-        if (!file_set_text(config_path, writer->buffer)) {
+        if (!cbm_writer_write_file(writer, config_path)) {
                 LOG_FATAL("syslinux_set_default_kernel: Failed to write %s: %s",
                           config_path,
                           strerror(errno));
@@ -279,13 +279,13 @@ static bool syslinux_install(const BootManager *manager)
         }
         close(mbr);
 
-        if (cbm_system_system(syslinux_cmd) != 0) {
-                LOG_DEBUG("Failed to run syslinux command: %s", syslinux_cmd);
+        if (cbm_system_run(syslinux_cmd, 0) != 0) {
+                LOG_DEBUG("Failed to run syslinux command: %s", syslinux_cmd[0]);
                 return false;
         }
 
-        if (cbm_system_system(sgdisk_cmd) != 0) {
-                LOG_DEBUG("Failed to run sgdisk command: %s", sgdisk_cmd);
+        if (cbm_system_run(sgdisk_cmd, 0) != 0) {
+                LOG_DEBUG("Failed to run sgdisk command: %s", sgdisk_cmd[0]);
                 return false;
         }
 
@@ -310,14 +310,10 @@ static void syslinux_destroy(__cbm_unused__ const BootManager *manager)
                 /* kernels pointers inside are not owned by the array */
                 nc_array_free(&kernel_queue, NULL);
         }
-        if (syslinux_cmd) {
-                free(syslinux_cmd);
-                syslinux_cmd = NULL;
-        }
-        if (sgdisk_cmd) {
-                free(sgdisk_cmd);
-                sgdisk_cmd = NULL;
-        }
+        cbm_argv_free(syslinux_cmd);
+        syslinux_cmd = NULL;
+        cbm_argv_free(sgdisk_cmd);
+        sgdisk_cmd = NULL;
         if (base_path) {
                 free(base_path);
                 base_path = NULL;
@@ -37,7 +37,8 @@ __cbm_export__ const BootLoader
                           .update = sd_class_update,
                           .remove = sd_class_remove,
                           .destroy = sd_class_destroy,
-                          .get_capabilities = sd_class_get_capabilities };
+                          .get_capabilities = sd_class_get_capabilities,
+                          .list_files = sd_class_list_files };
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
@@ -40,6 +40,7 @@ typedef struct SdClassConfig {
         char *loader_config;
         char *kernel_dir;
         char *kernel_dir_esp;
+        CbmCaseCache *case_cache; /**<Owned by the BootManager */
 } SdClassConfig;
 
 static SdClassConfig sd_class_config = { 0 };
@@ -80,16 +81,26 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
         base_path = boot_manager_get_boot_dir((BootManager *)manager);
         OOM_CHECK_RET(base_path, false);
         sd_class_config.base_path = base_path;
+        sd_class_config.case_cache = boot_manager_get_case_cache(manager);
 
-        efi_dir = nc_build_case_correct_path(base_path, "EFI", "Boot", NULL);
+        efi_dir =
+            cbm_case_cache_build_path(sd_class_config.case_cache, base_path, "EFI", "Boot", NULL);
         OOM_CHECK_RET(efi_dir, false);
         sd_class_config.efi_dir = efi_dir;
 
-        vendor_dir = nc_build_case_correct_path(base_path, "EFI", sd_config->vendor_dir, NULL);
+        vendor_dir = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                               base_path,
+                                               "EFI",
+                                               sd_config->vendor_dir,
+                                               NULL);
         OOM_CHECK_RET(vendor_dir, false);
         sd_class_config.vendor_dir = vendor_dir;
 
-        entries_dir = nc_build_case_correct_path(base_path, "loader", "entries", NULL);
+        entries_dir = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                                base_path,
+                                                "loader",
+                                                "entries",
+                                                NULL);
         OOM_CHECK_RET(entries_dir, false);
         sd_class_config.entries_dir = entries_dir;
 
@@ -100,31 +111,39 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
             string_printf("%s/%s/%s", prefix, sd_config->efi_dir, sd_config->efi_blob);
         sd_class_config.efi_blob_source = efi_blob_source;
 
-        efi_blob_dest = nc_build_case_correct_path(sd_class_config.base_path,
-                                                   "EFI",
-                                                   sd_config->vendor_dir,
-                                                   sd_config->efi_blob,
-                                                   NULL);
+        efi_blob_dest = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                                  sd_class_config.base_path,
+                                                  "EFI",
+                                                  sd_config->vendor_dir,
+                                                  sd_config->efi_blob,
+                                                  NULL);
         OOM_CHECK_RET(efi_blob_dest, false);
         sd_class_config.efi_blob_dest = efi_blob_dest;
 
         /* default EFI loader path */
-        default_path_efi_blob = nc_build_case_correct_path(sd_class_config.base_path,
-                                                           "EFI",
-                                                           "Boot",
-                                                           DEFAULT_EFI_BLOB,
-                                                           NULL);
+        default_path_efi_blob = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                                          sd_class_config.base_path,
+                                                          "EFI",
+                                                          "Boot",
+                                                          DEFAULT_EFI_BLOB,
+                                                          NULL);
         OOM_CHECK_RET(default_path_efi_blob, false);
         sd_class_config.default_path_efi_blob = default_path_efi_blob;
 
         /* Loader entry */
-        loader_config =
-            nc_build_case_correct_path(sd_class_config.base_path, "loader", "loader.conf", NULL);
+        loader_config = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                                  sd_class_config.base_path,
+                                                  "loader",
+                                                  "loader.conf",
+                                                  NULL);
         OOM_CHECK_RET(loader_config, false);
         sd_class_config.loader_config = loader_config;
 
-        sd_class_config.kernel_dir = nc_build_case_correct_path(sd_class_config.base_path,
-                                                                "EFI", KERNEL_NAMESPACE, NULL);
+        sd_class_config.kernel_dir = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                                               sd_class_config.base_path,
+                                                               "EFI",
+                                                               KERNEL_NAMESPACE,
+                                                               NULL);
         sd_class_config.kernel_dir_esp = strdup(sd_class_config.kernel_dir + strlen(sd_class_config.base_path));
 
         return true;
@@ -152,6 +171,7 @@ void sd_class_destroy(__cbm_unused__ const BootManager *manager)
         FREE_IF_SET(sd_class_config.loader_config);
         FREE_IF_SET(sd_class_config.kernel_dir);
         FREE_IF_SET(sd_class_config.kernel_dir_esp);
+        sd_class_config.case_cache = NULL;
 }
 
 /* i.e. $prefix/$boot/loader/entries/Clear-linux-native-4.1.6-113.conf */
@@ -160,45 +180,67 @@ static char *get_entry_path_for_kernel(BootManager *manager, const Kernel *kerne
         if (!manager || !kernel) {
                 return NULL;
         }
-        autofree(char) *item_name = NULL;
+        CbmArena *scratch = boot_manager_get_scratch(manager);
+        CbmArenaMark mark = cbm_arena_mark(scratch);
+        const char *item_name = NULL;
         const char *prefix = NULL;
+        char *ret = NULL;
 
         prefix = boot_manager_get_vendor_prefix(manager);
 
-        item_name = string_printf("%s-%s-%s-%d.conf",
-                                  prefix,
-                                  kernel->meta.ktype,
-                                  kernel->meta.version,
-                                  kernel->meta.release);
-
-        return nc_build_case_correct_path(sd_class_config.base_path,
-                                          "loader",
-                                          "entries",
-                                          item_name,
-                                          NULL);
+        item_name = cbm_arena_printf(scratch,
+                                     "%s-%s-%s-%d.conf",
+                                     prefix,
+                                     kernel->meta.ktype,
+                                     kernel->meta.version,
+                                     kernel->meta.release);
+
+        ret = cbm_case_cache_build_path(sd_class_config.case_cache,
+                                        sd_class_config.base_path,
+                                        "loader",
+                                        "entries",
+                                        item_name,
+                                        NULL);
+        cbm_arena_rewind(scratch, mark);
+        return ret;
+}
+
+/**
+ * nc_mkdir_p wrapper keeping the case cache in sync
+ */
+static bool sd_class_mkdir(const char *path)
+{
+        if (nc_file_exists(path)) {
+                return true;
+        }
+        if (!nc_mkdir_p(path, 00755)) {
+                return false;
+        }
+        cbm_case_cache_invalidate(sd_class_config.case_cache, path);
+        return true;
 }
 
 static bool sd_class_ensure_dirs(void)
 {
-        if (!nc_mkdir_p(sd_class_config.efi_dir, 00755)) {
+        if (!sd_class_mkdir(sd_class_config.efi_dir)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.efi_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.vendor_dir, 00755)) {
+        if (!sd_class_mkdir(sd_class_config.vendor_dir)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.vendor_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.kernel_dir, 00755)) {
+        if (!sd_class_mkdir(sd_class_config.kernel_dir)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.kernel_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.entries_dir, 00755)) {
+        if (!sd_class_mkdir(sd_class_config.entries_dir)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.entries_dir, strerror(errno));
                 return false;
         }
@@ -215,7 +257,6 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
         autofree(char) *conf_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
         const char *os_name = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
@@ -280,18 +321,17 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
         }
 
         /* If our new config matches the old config, just return. */
-        if (file_get_text(conf_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
+        if (cbm_file_content_equals(conf_path, writer->buffer, writer->buffer_n)) {
+                return true;
         }
 
-        if (!file_set_text(conf_path, writer->buffer)) {
+        if (!cbm_writer_write_file(writer, conf_path)) {
                 LOG_FATAL("Failed to create loader entry for: %s [%s]",
                           kernel->source.path,
                           strerror(errno));
                 return false;
         }
+        cbm_case_cache_note_created(sd_class_config.case_cache, conf_path);
 
         cbm_sync();
 
@@ -316,6 +356,7 @@ bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
                                   conf_path,
                                   strerror(errno));
                 } else {
+                        cbm_case_cache_note_removed(sd_class_config.case_cache, conf_path);
                         cbm_sync();
                 }
         }
@@ -332,7 +373,6 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
         autofree(char) *item_name = NULL;
         int timeout = 0;
         const char *prefix = NULL;
-        autofree(char) *old_conf = NULL;
 
         prefix = boot_manager_get_vendor_prefix((BootManager *)manager);
 
@@ -366,10 +406,8 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
         }
 
 write_config:
-        if (file_get_text(sd_class_config.loader_config, &old_conf)) {
-                if (streq(old_conf, item_name)) {
-                        return true;
-                }
+        if (cbm_file_content_equals(sd_class_config.loader_config, item_name, strlen(item_name))) {
+                return true;
         }
 
         if (!file_set_text(sd_class_config.loader_config, item_name)) {
@@ -378,6 +416,7 @@ write_config:
                           strerror(errno));
                 return false;
         }
+        cbm_case_cache_note_created(sd_class_config.case_cache, sd_class_config.loader_config);
 
         cbm_sync();
 
@@ -557,40 +596,48 @@ bool sd_class_needs_update(const BootManager *manager)
         return false;
 }
 
-bool sd_class_install(const BootManager *manager)
+/**
+ * Install the EFI blob at both the vendor and the default path, reading
+ * the source once and leaving identical copies alone
+ */
+static bool sd_class_copy_blobs(const char *action)
 {
-        if (!manager) {
+        const char *paths[] = { sd_class_config.efi_blob_dest,
+                                sd_class_config.default_path_efi_blob };
+        bool copied[ARRAY_SIZE(paths)];
+
+        if (!copy_file_fanout(sd_class_config.efi_blob_source,
+                              paths,
+                              ARRAY_SIZE(paths),
+                              00644,
+                              copied)) {
+                LOG_FATAL("Failed to %s %s: %s",
+                          action,
+                          sd_class_config.efi_blob_source,
+                          strerror(errno));
                 return false;
         }
-
-        if (!sd_class_ensure_dirs()) {
-                LOG_FATAL("Failed to create required directories for %s", sd_config->name);
-                return false;
+        for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
+                if (copied[i]) {
+                        cbm_case_cache_note_created(sd_class_config.case_cache, paths[i]);
+                }
         }
+        return true;
+}
 
-        /* Install vendor EFI blob */
-        if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                              sd_class_config.efi_blob_dest,
-                              00644)) {
-                LOG_FATAL("Failed to install %s: %s",
-                          sd_class_config.efi_blob_dest,
-                          strerror(errno));
+bool sd_class_install(const BootManager *manager)
+{
+        if (!manager) {
                 return false;
         }
-        cbm_sync();
 
-        /* Install default EFI blob */
-        if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                              sd_class_config.default_path_efi_blob,
-                              00644)) {
-                LOG_FATAL("Failed to install %s: %s",
-                          sd_class_config.default_path_efi_blob,
-                          strerror(errno));
+        if (!sd_class_ensure_dirs()) {
+                LOG_FATAL("Failed to create required directories for %s", sd_config->name);
                 return false;
         }
-        cbm_sync();
 
-        return true;
+        /* Install vendor and default EFI blobs */
+        return sd_class_copy_blobs("install");
 }
 
 bool sd_class_update(const BootManager *manager)
@@ -603,32 +650,7 @@ bool sd_class_update(const BootManager *manager)
                 return false;
         }
 
-        if (!cbm_files_match(sd_class_config.efi_blob_source, sd_class_config.efi_blob_dest)) {
-                if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                                      sd_class_config.efi_blob_dest,
-                                      00644)) {
-                        LOG_FATAL("Failed to update %s: %s",
-                                  sd_class_config.efi_blob_dest,
-                                  strerror(errno));
-                        return false;
-                }
-        }
-        cbm_sync();
-
-        if (!cbm_files_match(sd_class_config.efi_blob_source,
-                             sd_class_config.default_path_efi_blob)) {
-                if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                                      sd_class_config.default_path_efi_blob,
-                                      00644)) {
-                        LOG_FATAL("Failed to update %s: %s",
-                                  sd_class_config.default_path_efi_blob,
-                                  strerror(errno));
-                        return false;
-                }
-        }
-        cbm_sync();
-
-        return true;
+        return sd_class_copy_blobs("update");
 }
 
 bool sd_class_remove(const BootManager *manager)
@@ -643,6 +665,7 @@ bool sd_class_remove(const BootManager *manager)
                 LOG_FATAL("Failed to remove vendor dir: %s", strerror(errno));
                 return false;
         }
+        cbm_case_cache_invalidate(sd_class_config.case_cache, sd_class_config.vendor_dir);
         cbm_sync();
 
         if (nc_file_exists(sd_class_config.default_path_efi_blob) &&
@@ -652,6 +675,8 @@ bool sd_class_remove(const BootManager *manager)
                           strerror(errno));
                 return false;
         }
+        cbm_case_cache_note_removed(sd_class_config.case_cache,
+                                    sd_class_config.default_path_efi_blob);
         cbm_sync();
 
         if (nc_file_exists(sd_class_config.loader_config) &&
@@ -661,11 +686,38 @@ bool sd_class_remove(const BootManager *manager)
                           strerror(errno));
                 return false;
         }
+        cbm_case_cache_note_removed(sd_class_config.case_cache, sd_class_config.loader_config);
         cbm_sync();
 
         return true;
 }
 
+void sd_class_list_config(const BootManager *manager, const Kernel *kernel,
+                          boot_loader_file_func func, void *userdata)
+{
+        autofree(char) *conf_path = NULL;
+
+        if (!kernel) {
+                func(NULL, sd_class_config.loader_config, userdata);
+                return;
+        }
+        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+        OOM_CHECK(conf_path);
+        func(NULL, conf_path, userdata);
+}
+
+void sd_class_list_files(const BootManager *manager, const Kernel *kernel,
+                         boot_loader_file_func func, void *userdata)
+{
+        if (!kernel) {
+                func(sd_class_config.efi_blob_source, sd_class_config.efi_blob_dest, userdata);
+                func(sd_class_config.efi_blob_source,
+                     sd_class_config.default_path_efi_blob,
+                     userdata);
+        }
+        sd_class_list_config(manager, kernel, func, userdata);
+}
+
 int sd_class_get_capabilities(__cbm_unused__ const BootManager *manager)
 {
         /* Very trivial bootloader, we support UEFI/GPT only */
@@ -55,6 +55,15 @@ void sd_class_destroy(const BootManager *manager);
 
 int sd_class_get_capabilities(const BootManager *manager);
 
+/**
+ * Report the loader entry of @kernel, or loader.conf if @kernel is NULL
+ */
+void sd_class_list_config(const BootManager *manager, const Kernel *kernel,
+                          boot_loader_file_func func, void *userdata);
+
+void sd_class_list_files(const BootManager *manager, const Kernel *kernel,
+                         boot_loader_file_func func, void *userdata);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -80,6 +81,8 @@ BootManager *boot_manager_new()
         r->initrd_freestanding = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
         OOM_CHECK(r->initrd_freestanding);
 
+        r->scratch = cbm_arena_new();
+        r->case_cache = cbm_case_cache_new();
 
         return r;
 }
@@ -90,6 +93,8 @@ void boot_manager_free(BootManager *self)
                 return;
         }
 
+        boot_manager_drop_install_context(self);
+
         if (self->bootloader) {
                 self->bootloader->destroy(self);
         }
@@ -104,6 +109,8 @@ void boot_manager_free(BootManager *self)
         nc_hashmap_free(self->initrd_freestanding);
         free(self->abs_bootdir);
         free(self->cmdline);
+        cbm_arena_free(self->scratch);
+        cbm_case_cache_free(self->case_cache);
         free(self);
 }
 
@@ -157,6 +164,8 @@ bool boot_manager_set_prefix(BootManager *self, char *prefix)
 
         CHECK_DBG_RET_VAL(!prefix, false, "Invalid prefix value: null");
 
+        boot_manager_drop_install_context(self);
+        cbm_case_cache_clear(self->case_cache);
         cbm_free_sysconfig(self->sysconfig);
         self->sysconfig = NULL;
 
@@ -275,12 +284,38 @@ bool boot_manager_install_kernel(BootManager *self, const Kernel *kernel)
                 return false;
         }
 
+        uint64_t start = cbm_log_now_us();
+        CbmArenaMark mark = cbm_arena_mark(self->scratch);
+        const CbmInstallContext *ctx = NULL;
+        struct stat st = { 0 };
+        bool ret = false;
+
+        cbm_log_set_kernel(kernel->meta.bpath);
+        boot_manager_forget_update(self);
+
+        ctx = boot_manager_prepare_install_context(self);
+        if (!ctx) {
+                goto done;
+        }
+
         /* Install the kernel blob first */
-        if (!boot_manager_install_kernel_internal(self, kernel)) {
-                return false;
+        if (!boot_manager_install_kernel_internal(self, ctx, kernel)) {
+                goto done;
         }
         /* Hand over to the bootloader to finish it up */
-        return self->bootloader->install_kernel(self, kernel);
+        ret = self->bootloader->install_kernel(self, kernel);
+        if (ret) {
+                (void)stat(kernel->source.path, &st);
+                LOG_METRIC(cbm_log_now_us() - start,
+                           (uint64_t)st.st_size,
+                           "Installed kernel %s",
+                           kernel->meta.bpath);
+        }
+
+done:
+        cbm_arena_rewind(self->scratch, mark);
+        cbm_log_set_kernel(NULL);
+        return ret;
 }
 
 bool boot_manager_remove_kernel(BootManager *self, const Kernel *kernel)
@@ -293,12 +328,33 @@ bool boot_manager_remove_kernel(BootManager *self, const Kernel *kernel)
         if (!cbm_is_sysconfig_sane(self->sysconfig)) {
                 return false;
         }
+        uint64_t start = cbm_log_now_us();
+        CbmArenaMark mark = cbm_arena_mark(self->scratch);
+        const CbmInstallContext *ctx = NULL;
+        bool ret = false;
+
+        cbm_log_set_kernel(kernel->meta.bpath);
+        boot_manager_forget_update(self);
+
+        ctx = boot_manager_prepare_install_context(self);
+        if (!ctx) {
+                goto done;
+        }
+
         /* Remove the kernel blob first */
-        if (!boot_manager_remove_kernel_internal(self, kernel)) {
-                return false;
+        if (!boot_manager_remove_kernel_internal(self, ctx, kernel)) {
+                goto done;
         }
         /* Hand over to the bootloader to finish it up */
-        return self->bootloader->remove_kernel(self, kernel);
+        ret = self->bootloader->remove_kernel(self, kernel);
+        if (ret) {
+                LOG_METRIC(cbm_log_now_us() - start, 0, "Removed kernel %s", kernel->meta.bpath);
+        }
+
+done:
+        cbm_arena_rewind(self->scratch, mark);
+        cbm_log_set_kernel(NULL);
+        return ret;
 }
 
 int detect_and_mount_boot(BootManager *self, char **boot_dir) {
@@ -337,6 +393,8 @@ bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
         CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
                           "Sysconfig is not sane");
 
+        boot_manager_forget_update(self);
+
         /* Grab the available kernels */
         kernels = boot_manager_get_kernels(self);
         CHECK_ERR_RET_VAL(!kernels || kernels->len == 0, false,
@@ -588,6 +646,104 @@ char *boot_manager_get_boot_dir(BootManager *self)
         return ret;
 }
 
+CbmArena *boot_manager_get_scratch(const BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->scratch;
+}
+
+CbmCaseCache *boot_manager_get_case_cache(const BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->case_cache;
+}
+
+const CbmInstallContext *boot_manager_prepare_install_context(BootManager *self)
+{
+        assert(self != NULL);
+
+        CbmInstallContext *ctx = NULL;
+        const char *efi_boot_dir = NULL;
+
+        if (self->install_ctx) {
+                return self->install_ctx;
+        }
+        if (!self->bootloader) {
+                return NULL;
+        }
+
+        ctx = calloc(1, sizeof(CbmInstallContext));
+        OOM_CHECK_RET(ctx, NULL);
+        ctx->boot_fd = -1;
+        ctx->dest_fd = -1;
+
+        ctx->is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
+                        BOOTLOADER_CAP_UEFI);
+        if (ctx->is_uefi) {
+                /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
+                efi_boot_dir = self->bootloader->get_kernel_destination(self);
+                if (!efi_boot_dir) {
+                        goto fail;
+                }
+        }
+
+        ctx->boot_dir = boot_manager_get_boot_dir(self);
+        if (!ctx->boot_dir) {
+                DECLARE_OOM();
+                goto fail;
+        }
+
+        /* efi_boot_dir is guaranteed to start with '/' since it's its absolute
+         * path on the ESP. */
+        ctx->dest_dir = string_printf("%s%s", ctx->boot_dir, efi_boot_dir ? efi_boot_dir : "");
+
+        if (!nc_file_exists(ctx->dest_dir) && !nc_mkdir_p(ctx->dest_dir, 00755)) {
+                LOG_ERROR("Failed to create %s: %s", ctx->dest_dir, strerror(errno));
+                goto fail;
+        }
+
+        ctx->boot_fd = open(ctx->boot_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ctx->boot_fd < 0) {
+                LOG_ERROR("Failed to open %s: %s", ctx->boot_dir, strerror(errno));
+                goto fail;
+        }
+        ctx->dest_fd = open(ctx->dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ctx->dest_fd < 0) {
+                LOG_ERROR("Failed to open %s: %s", ctx->dest_dir, strerror(errno));
+                goto fail;
+        }
+
+        self->install_ctx = ctx;
+        return ctx;
+
+fail:
+        self->install_ctx = ctx;
+        boot_manager_drop_install_context(self);
+        return NULL;
+}
+
+void boot_manager_drop_install_context(BootManager *self)
+{
+        CbmInstallContext *ctx = NULL;
+
+        if (!self || !self->install_ctx) {
+                return;
+        }
+        ctx = self->install_ctx;
+        if (ctx->boot_fd >= 0) {
+                close(ctx->boot_fd);
+        }
+        if (ctx->dest_fd >= 0) {
+                close(ctx->dest_fd);
+        }
+        free(ctx->boot_dir);
+        free(ctx->dest_dir);
+        free(ctx);
+        self->install_ctx = NULL;
+}
+
 bool boot_manager_set_boot_dir(BootManager *self, const char *bootdir)
 {
         assert(self != NULL);
@@ -606,6 +762,8 @@ bool boot_manager_set_boot_dir(BootManager *self, const char *bootdir)
                 free(self->abs_bootdir);
         }
         self->abs_bootdir = nboot;
+        boot_manager_drop_install_context(self);
+        cbm_case_cache_clear(self->case_cache);
 
         if (!self->bootloader) {
                 return true;
@@ -630,6 +788,11 @@ bool boot_manager_modify_bootloader(BootManager *self, int flags)
         CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
                           "The sysconfig values are not sane");
 
+        boot_manager_forget_update(self);
+
+        /* The bootloader may recreate the directories the context holds open */
+        boot_manager_drop_install_context(self);
+
         /* Ensure we're up to date here on the bootloader */
         boot_dir = boot_manager_get_boot_dir(self);
         CHECK_DBG_RET_VAL(!boot_manager_set_boot_dir(self, boot_dir), false,
@@ -675,6 +838,13 @@ void boot_manager_set_image_mode(BootManager *self, bool image_mode)
         self->image_mode = image_mode;
 }
 
+void boot_manager_set_deadline(BootManager *self, uint64_t budget_us)
+{
+        assert(self != NULL);
+
+        self->deadline_us = budget_us ? cbm_log_now_us() + budget_us : 0;
+}
+
 bool boot_manager_needs_install(BootManager *self)
 {
         assert(self != NULL);
@@ -734,12 +904,9 @@ bool boot_manager_enumerate_initrds_freestanding(BootManager *self)
         while ((ent = readdir(initrd_dir)) != NULL) {
                 char *initrd_name_key = NULL;
                 char *initrd_name_val = NULL;
-                autofree(char) *path = NULL;
-
-                path = string_printf("%s/%s", self->initrd_freestanding_dir, ent->d_name);
 
                 /* Some kind of broken link */
-                if (lstat(path, &st) != 0) {
+                if (fstatat(dirfd(initrd_dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
                         continue;
                 }
 
@@ -769,103 +936,103 @@ bool boot_manager_enumerate_initrds_freestanding(BootManager *self)
         return true;
 }
 
-bool boot_manager_copy_initrd_freestanding(BootManager *self)
+/**
+ * Whether @target is known to be a copy of @source without reading either
+ */
+static bool boot_manager_initrd_installed(BootManager *self, const CbmInstallContext *ctx,
+                                          const char *source, const char *target)
+{
+        autofree(char) *path = NULL;
+        struct stat src = { 0 };
+        struct stat dst = { 0 };
+
+        if (stat(source, &src) != 0 || fstatat(ctx->dest_fd, target, &dst, 0) != 0 ||
+            src.st_size != dst.st_size) {
+                return false;
+        }
+        if (src.st_dev == dst.st_dev && src.st_ino == dst.st_ino) {
+                return true;
+        }
+        path = string_printf("%s/%s", ctx->dest_dir, target);
+        return cbm_manifest_trusts(self->manifest, source, path);
+}
+
+bool boot_manager_reconcile_initrds_freestanding(BootManager *self, const CbmInstallContext *ctx,
+                                                 NcArray *copy)
 {
-        autofree(char) *base_path = NULL;
+        CbmArenaMark mark;
         NcHashmapIter iter = { 0 };
         void *key = NULL;
         void *val = NULL;
-        bool is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? self->bootloader->get_kernel_destination(self) : NULL;
-        base_path = boot_manager_get_boot_dir((BootManager *)self);
-        if (!self || !self->initrd_freestanding_dir || !self->initrd_freestanding) {
-                return false;
-        }
 
-        /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
-        if (is_uefi && !efi_boot_dir) {
-                return false;
+        if (!self->initrd_freestanding_dir || !self->initrd_freestanding) {
+                return true;
         }
+        mark = cbm_arena_mark(self->scratch);
 
         nc_hashmap_iter_init(self->initrd_freestanding, &iter);
         while (nc_hashmap_iter_next(&iter, &key, &val)) {
-                autofree(char) *initrd_target = NULL;
-                autofree(char) *initrd_source = NULL;
-
-                initrd_target = string_printf("%s%s/%s",
-                                              base_path,
-                                              (is_uefi ? efi_boot_dir : ""),
-                                              (char*)key);
-                initrd_source = string_printf("%s/%s",
-                                              self->initrd_freestanding_dir,
-                                              (char*)val);
-                if (!cbm_files_match(initrd_source, initrd_target)) {
-                        if (!copy_file_atomic(initrd_source, initrd_target, 00644)) {
-                                LOG_FATAL("Failed to install initrd %s: %s",
-                                          initrd_target,
-                                          strerror(errno));
-                                return false;
-                        }
+                const char *source =
+                    cbm_arena_join(self->scratch, self->initrd_freestanding_dir, (char *)val, NULL);
+
+                if (!boot_manager_initrd_installed(self, ctx, source, key)) {
+                        OOM_CHECK_RET(nc_array_add(copy, key), false);
                 }
+                cbm_arena_rewind(self->scratch, mark);
         }
         return true;
 }
 
-bool boot_manager_remove_initrd_freestanding(BootManager * self)
+bool boot_manager_sync_initrds_freestanding(BootManager *self)
 {
-        autofree(char) *base_path = NULL;
-        autofree(char) *initrd_efi_path = NULL;
-        autofree(DIR) *initrd_dir = NULL;
-        struct dirent *ent = NULL;
-        bool is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? self->bootloader->get_kernel_destination(self) : NULL;
-        if (!self || !self->initrd_freestanding_dir) {
-                return false;
-        }
-        /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
-        if (is_uefi && !efi_boot_dir) {
+        const CbmInstallContext *ctx = NULL;
+        CbmArenaMark mark;
+        NcArray *copy = NULL;
+        bool ret = false;
+
+        if (!self || !self->initrd_freestanding_dir || !self->initrd_freestanding) {
                 return false;
         }
 
-        base_path = boot_manager_get_boot_dir((BootManager *)self);
-
-        initrd_efi_path = string_printf("%s/%s",
-                                        base_path,
-                                        (is_uefi ? efi_boot_dir : ""));
-
-        initrd_dir = opendir(initrd_efi_path);
-        if (!initrd_dir) {
-                LOG_ERROR("Error opening %s: %s", initrd_efi_path, strerror(errno));
+        ctx = boot_manager_prepare_install_context(self);
+        if (!ctx) {
                 return false;
         }
-
-        while ((ent = readdir(initrd_dir)) != NULL) {
-                autofree(char) *initrd_target = NULL;
-
-                if (strstr(ent->d_name, "freestanding-") != ent->d_name) {
-                        continue;
-                }
-
-                if (!nc_hashmap_get(self->initrd_freestanding, ent->d_name)) {
-                        initrd_target = string_printf("%s/%s",
-                                                      initrd_efi_path,
-                                                      ent->d_name);
-                        /* Remove old initrd */
-                        if (nc_file_exists(initrd_target)) {
-                                if (unlink(initrd_target) < 0) {
-                                        LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
-                                                  initrd_target,
-                                                  strerror(errno));
-                                        return false;
-                                }
+        copy = nc_array_new();
+        OOM_CHECK_RET(copy, false);
+        if (!boot_manager_reconcile_initrds_freestanding(self, ctx, copy) ||
+            !boot_manager_reconcile_freestanding(self, ctx)) {
+                goto end;
+        }
+        mark = cbm_arena_mark(self->scratch);
+
+        for (int i = 0; i < copy->len; i++) {
+                const char *initrd_target = nc_array_get(copy, i);
+                const char *initrd_source = NULL;
+
+                initrd_source = cbm_arena_join(self->scratch,
+                                               self->initrd_freestanding_dir,
+                                               nc_hashmap_get(self->initrd_freestanding,
+                                                              initrd_target),
+                                               NULL);
+                if (!cbm_files_match_at(initrd_source, ctx->dest_fd, initrd_target)) {
+                        if (!copy_file_atomic_at(initrd_source,
+                                                 ctx->dest_fd,
+                                                 initrd_target,
+                                                 00644)) {
+                                LOG_FATAL("Failed to install initrd %s/%s: %s",
+                                          ctx->dest_dir,
+                                          initrd_target,
+                                          strerror(errno));
+                                goto end;
                         }
                 }
+                cbm_arena_rewind(self->scratch, mark);
         }
-        return true;
+        ret = true;
+end:
+        nc_array_free(&copy, NULL);
+        return ret;
 }
 
 void boot_manager_initrd_iterator_init(const BootManager *manager, NcHashmapIter *iter)
@@ -12,7 +12,11 @@
 #pragma once
 
 #include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
 
+#include "arena.h"
+#include "case-cache.h"
 #include "nica/array.h"
 #include "nica/hashmap.h"
 #include "probe.h"
@@ -257,6 +261,20 @@ bool boot_manager_install_kernel(BootManager *manager, const Kernel *kernel);
  */
 char *boot_manager_get_boot_dir(BootManager *manager);
 
+/**
+ * Return the scratch arena for transient strings, such as the paths built
+ * while installing a kernel. Allocations are released when the current
+ * BootManager operation completes, so must not be kept beyond it.
+ */
+CbmArena *boot_manager_get_scratch(const BootManager *manager);
+
+/**
+ * Return the directory listing cache used to resolve case-correct paths on
+ * the ESP. It is cleared when the boot directory changes and at the end of
+ * each update.
+ */
+CbmCaseCache *boot_manager_get_case_cache(const BootManager *manager);
+
 /**
  * Attempt to uninstall a previously installed kernel
  *
@@ -301,6 +319,13 @@ bool boot_manager_is_image_mode(BootManager *manager);
  */
 void boot_manager_set_image_mode(BootManager *manager, bool image_mode);
 
+/**
+ * Give boot_manager_update() @budget_us microseconds from now, 0 for no
+ * limit. The boot critical steps always run, housekeeping that would
+ * overrun the budget is left to the next update.
+ */
+void boot_manager_set_deadline(BootManager *manager, uint64_t budget_us);
+
 /**
  * Determine the default timeout based on the contents of
  * SYSCONFDIR/boot_timeout
@@ -403,14 +428,11 @@ static inline void kernel_array_free(void *v)
 bool boot_manager_enumerate_initrds_freestanding(BootManager *self);
 
 /**
- * Copy freestanding initrd
+ * Bring the freestanding initrds in the kernel destination in step with the
+ * enumerated ones, copying only those that are new or changed and removing
+ * those that no longer have a source
  */
-bool boot_manager_copy_initrd_freestanding(BootManager *self);
-
-/**
- * Remove old freestanding initrd
- */
-bool boot_manager_remove_initrd_freestanding(BootManager * self);
+bool boot_manager_sync_initrds_freestanding(BootManager *self);
 
 /*
  * Iterate initrd elements
@@ -422,10 +444,175 @@ void boot_manager_initrd_iterator_init(const BootManager *manager, NcHashmapIter
  */
 bool boot_manager_initrd_iterator_next(NcHashmapIter *iter, char **name);
 
+/**
+ * Declarative kernel retention, read from KERNEL_CONF_DIRECTORY/retention.conf
+ * as "key = value" lines:
+ *
+ *      keep_newest = N     Keep the N newest kernels of each type (default 0)
+ *      keep_booting = N    Keep the N newest known-booting kernels (default 1)
+ *      max_bytes = SIZE    ESP budget per type, K/M/G suffixes (default 0, none)
+ *      pin = BASENAME      Never remove this kernel, may be repeated
+ *
+ * The running and default kernels of each type are always kept, as are pins.
+ * The budget only limits what keep_booting and keep_newest add on top.
+ */
+typedef struct CbmRetentionPolicy {
+        int keep_newest;    /**<Newest kernels kept per type */
+        int keep_booting;   /**<Known-booting kernels kept per type */
+        uint64_t max_bytes; /**<ESP bytes per type, 0 for unlimited */
+        NcArray *pins;      /**<Kernel basenames that are never removed */
+} CbmRetentionPolicy;
+
+/**
+ * Load the retention policy for @prefix, falling back to the defaults for
+ * anything missing or invalid
+ */
+CbmRetentionPolicy *cbm_retention_policy_load(const char *prefix);
+
+/**
+ * Free a previously loaded policy
+ */
+void cbm_retention_policy_free(CbmRetentionPolicy *policy);
+
+/**
+ * Evaluate @policy over the kernels of a single type
+ *
+ * @param kernels Kernels of one type, sorted highest release first
+ * @param running The running kernel, if known
+ * @param tip The default kernel for this type, if known
+ * @param keep If not NULL, receives the kernels to keep installed
+ * @param removals If not NULL, receives the kernels to remove
+ */
+bool cbm_retention_plan(const CbmRetentionPolicy *policy, KernelArray *kernels,
+                        const Kernel *running, const Kernel *tip, NcArray *keep,
+                        NcArray *removals);
+
+/**
+ * Kinds of step in an update plan
+ */
+typedef enum {
+        CBM_PLAN_COMPARE = 0,  /**<Compare a source with its installed copy */
+        CBM_PLAN_COPY,         /**<Copy a file into the boot directory */
+        CBM_PLAN_CONFIG,       /**<Write or remove bootloader configuration */
+        CBM_PLAN_BOOTLOADER,   /**<Install or update the bootloader itself */
+        CBM_PLAN_EFI_VARIABLE, /**<Write a UEFI boot variable */
+        CBM_PLAN_COMMAND,      /**<Run an external command */
+        CBM_PLAN_DELETE,       /**<Delete a file */
+        CBM_PLAN_DEFER,        /**<Queue an artifact for background removal */
+        CBM_PLAN_MAX
+} CbmPlanAction;
+
+/**
+ * A single operation the update would perform
+ */
+typedef struct CbmPlanStep {
+        CbmPlanAction action;
+        char *target;         /**<Path, variable or command affected */
+        char *source;         /**<Source of a compare or copy, else NULL */
+        char *kernel;         /**<Basename of the kernel concerned, if any */
+        const char *reason;   /**<Why the step is needed */
+        uint64_t bytes;       /**<Bytes read, written or freed */
+        uint64_t estimate_us; /**<Estimated cost */
+} CbmPlanStep;
+
+/**
+ * Everything boot_manager_update() would do, computed without changing the
+ * system
+ */
+typedef struct CbmUpdatePlan {
+        char *prefix;           /**<Root being updated */
+        const char *bootloader; /**<Name of the selected bootloader */
+        bool image_mode;        /**<Planned as an image update */
+        NcArray *steps;         /**<CbmPlanStep, in execution order */
+        uint64_t copy_bytes;    /**<Total bytes to be copied */
+        uint64_t estimate_us;   /**<Estimated duration of the whole update */
+} CbmUpdatePlan;
+
+/**
+ * Run kernel enumeration and selection, and the bootloader checks, exactly
+ * as boot_manager_update() would, recording each mutation instead of
+ * performing it. The boot partition is mounted for the duration if needed.
+ *
+ * @return A newly allocated plan, or NULL on failure
+ */
+CbmUpdatePlan *boot_manager_plan_update(BootManager *manager);
+
+/**
+ * Free a plan returned by boot_manager_plan_update()
+ */
+void cbm_update_plan_free(CbmUpdatePlan *plan);
+
+/**
+ * Write @plan to @out, as a human readable table or as a JSON object
+ */
+bool cbm_update_plan_write(const CbmUpdatePlan *plan, FILE *out, bool json);
+
+/**
+ * Determine whether the last successful native update under @prefix is
+ * still current, i.e. none of its inputs (kernels, cmdline and initrd
+ * configuration, os-release, bootloader sources, root device, running
+ * kernel) nor the mounted boot directory have changed since.
+ *
+ * Only stat data is consulted: nothing is mounted, probed or compared, so
+ * this may be called before boot_manager_set_prefix(). Image mode is never
+ * current, and neither is a boot partition that is not mounted.
+ */
+bool boot_manager_update_is_current(BootManager *manager, const char *prefix);
+
+/**
+ * Outcome of checking one file on the boot partition
+ */
+typedef enum {
+        CBM_VERIFY_OK = 0,     /**<Present and, if copied, identical to its source */
+        CBM_VERIFY_MISMATCH,   /**<Differs from the file it was copied from */
+        CBM_VERIFY_MISSING,    /**<Should be installed but is not */
+        CBM_VERIFY_ORPHAN,     /**<Named as ours but belongs to nothing installed */
+        CBM_VERIFY_UNREADABLE, /**<It or its source could not be read */
+        CBM_VERIFY_MAX
+} CbmVerifyStatus;
+
+typedef struct CbmVerifyItem {
+        CbmVerifyStatus status;
+        char *target; /**<File on the boot partition */
+        char *source; /**<File it was copied from, NULL if generated or orphaned */
+} CbmVerifyItem;
+
+/**
+ * What boot_manager_verify() found
+ */
+typedef struct CbmVerifyReport {
+        char *prefix;               /**<Root being verified */
+        const char *bootloader;     /**<Name of the selected bootloader */
+        NcArray *items;             /**<CbmVerifyItem, sorted by target */
+        int counts[CBM_VERIFY_MAX]; /**<Number of items with each status */
+        uint64_t bytes_read;        /**<Total bytes hashed */
+} CbmVerifyReport;
+
+/**
+ * Check everything installed on the boot partition against what an update
+ * would install: kernels, initrds, freestanding initrds and the files the
+ * bootloader owns. Copied files are hashed in parallel and compared with
+ * their sources, each file being read at most once. Nothing is changed, but
+ * the boot partition is mounted for the duration if needed.
+ *
+ * @return A newly allocated report, or NULL on failure
+ */
+CbmVerifyReport *boot_manager_verify(BootManager *manager);
+
+void cbm_verify_report_free(CbmVerifyReport *report);
+
+/**
+ * Write the problems in @report to @out, or every item as a JSON object
+ */
+bool cbm_verify_report_write(const CbmVerifyReport *report, FILE *out, bool json);
+
 DEF_AUTOFREE(BootManager, boot_manager_free)
 DEF_AUTOFREE(KernelArray, kernel_array_free)
 DEF_AUTOFREE(Kernel, free_kernel)
 DEF_AUTOFREE(DIR, closedir)
+DEF_AUTOFREE(CbmRetentionPolicy, cbm_retention_policy_free)
+DEF_AUTOFREE(CbmUpdatePlan, cbm_update_plan_free)
+DEF_AUTOFREE(CbmVerifyReport, cbm_verify_report_free)
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
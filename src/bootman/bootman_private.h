@@ -22,8 +22,22 @@
 
 #include "bootloader.h"
 #include "bootman.h"
+#include "manifest.h"
 #include "os-release.h"
 
+/**
+ * Immutable per-session view of where kernel blobs are installed, computed
+ * once by boot_manager_prepare_install_context() so that each install and
+ * removal is a handful of dirfd-relative syscalls.
+ */
+typedef struct CbmInstallContext {
+        char *boot_dir;  /**<Absolute root of the ESP or /boot */
+        char *dest_dir;  /**<Absolute kernel destination directory */
+        int boot_fd;     /**<Directory fd for boot_dir */
+        int dest_fd;     /**<Directory fd for dest_dir */
+        bool is_uefi;    /**<Bootloader has BOOTLOADER_CAP_UEFI */
+} CbmInstallContext;
+
 struct BootManager {
         char *kernel_dir;              /**<Kernel directory */
         const BootLoader *bootloader;  /**<Selected bootloader */
@@ -36,17 +50,52 @@ struct BootManager {
         char *cmdline;                 /**<Additional cmdline to append */
         char *initrd_freestanding_dir; /**<Initrd without kernel deps directory */
         NcHashmap *initrd_freestanding;/**<Array of initrds without kernel deps */
+        CbmArena *scratch;             /**<Per-operation transient allocations */
+        CbmCaseCache *case_cache;      /**<ESP directory listings */
+        CbmInstallContext *install_ctx;/**<Cached install context, if prepared */
+        uint64_t deadline_us;          /**<cbm_log_now_us() to finish by, 0 for none */
+        CbmManifest *manifest;         /**<Hashes of installed blobs, during an update */
 };
 
+/**
+ * Compute the install context for the current bootloader and boot dir, or
+ * return the cached one. The kernel destination directory is created if
+ * needed. Returns NULL on failure.
+ */
+const CbmInstallContext *boot_manager_prepare_install_context(BootManager *self);
+
+/**
+ * Close and forget the cached install context. Must happen before the boot
+ * directory is unmounted, and whenever the boot dir or bootloader changes.
+ */
+void boot_manager_drop_install_context(BootManager *self);
+
+/**
+ * Name of the kernel blob relative to the install context's dest_fd
+ */
+static inline const char *cbm_install_context_kernel_name(const CbmInstallContext *ctx,
+                                                          const Kernel *kernel)
+{
+        return ctx->is_uefi ? kernel->target.path : kernel->target.legacy_path;
+}
+
 /**
  * Internal function to install the kernel blob itself
  */
-bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel);
+bool boot_manager_install_kernel_internal(const BootManager *manager,
+                                          const CbmInstallContext *ctx, const Kernel *kernel);
+
+/**
+ * Sum of the fingerprint entries of the update inputs that removing @kernel
+ * deletes, see boot_manager_fingerprint_inputs()
+ */
+uint64_t boot_manager_kernel_input_entries(const Kernel *kernel);
 
 /**
  * Internal function to remove the kernel blob itself
  */
-bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel);
+bool boot_manager_remove_kernel_internal(const BootManager *manager,
+                                         const CbmInstallContext *ctx, const Kernel *kernel);
 
 /**
  * Internal function to unmount boot directory
@@ -74,6 +123,222 @@ int detect_and_mount_boot(BootManager *self, char **boot_dir);
  */
 int kernel_compare_reverse(const void *a, const void *b);
 
+/**
+ * The running kernel from @kernels, trying the fallback comparison if the
+ * exact match fails. Returns NULL if unknown.
+ */
+Kernel *boot_manager_select_running(BootManager *self, KernelArray *kernels);
+
+/**
+ * The default kernel for @kernel_type, or the highest release in
+ * @typed_kernels (sorted highest first) when there is no default.
+ */
+Kernel *boot_manager_select_tip(BootManager *self, KernelArray *typed_kernels,
+                                const char *kernel_type);
+
+/**
+ * Stat based fingerprint of everything a native update under @prefix reads.
+ * @removed is the cbm_fingerprint_entry() sum of inputs the caller removed
+ * itself, so that the result is as it was before they were removed.
+ */
+uint64_t boot_manager_fingerprint_inputs(BootManager *self, const char *prefix, uint64_t removed);
+
+/**
+ * Record a successful native update made from @inputs, along with the
+ * current state of the boot directory and the identity of its partition.
+ * Must be called while the boot partition is mounted.
+ */
+void boot_manager_record_update(BootManager *self, uint64_t inputs);
+
+/**
+ * Forget the last recorded update, before anything modifies the boot
+ * partition outside of an update
+ */
+void boot_manager_forget_update(BootManager *self);
+
+/**
+ * Remove kernel and initrd blobs left at the root of the ESP by releases
+ * prior to namespacing
+ */
+bool boot_manager_remove_legacy_uefi_kernel(const CbmInstallContext *ctx, const Kernel *kernel);
+
+/**
+ * Add the name of each enumerated freestanding initrd that is missing from
+ * the kernel destination, or may differ from its source, to @copy. Sizes are
+ * compared first and the manifest vouches for the rest, so nothing is read.
+ */
+bool boot_manager_reconcile_initrds_freestanding(BootManager *self, const CbmInstallContext *ctx,
+                                                 NcArray *copy);
+
+/**
+ * Called for each stale file found by boot_manager_find_stale(), @name being
+ * relative to @dirfd, an open handle on @dir
+ */
+typedef void (*boot_manager_stale_func)(int dirfd, const char *dir, const char *name,
+                                        void *userdata);
+
+/**
+ * Read the kernel destination, the legacy ESP root and the loader entry
+ * directories once each, passing every file named as ours that no kernel in
+ * @kernels or freestanding initrd accounts for to @func. Copies at the legacy
+ * ESP paths are stale once migrated to the kernel destination. Leftover
+ * temporary copies are always stale.
+ */
+bool boot_manager_find_stale(BootManager *self, const char *boot_dir, const char *dest_dir,
+                             bool is_uefi, KernelArray *kernels, boot_manager_stale_func func,
+                             void *userdata);
+
+/**
+ * Remove everything boot_manager_find_stale() reports, with a single flush
+ */
+bool boot_manager_reconcile_boot_dir(BootManager *self, const CbmInstallContext *ctx,
+                                     KernelArray *kernels);
+
+/**
+ * Remove installed freestanding initrds that no longer have a source, and
+ * leftover temporary copies, from the kernel destination with a single flush.
+ * Used by image updates, native ones leave this to the reconcile step.
+ */
+bool boot_manager_reconcile_freestanding(BootManager *self, const CbmInstallContext *ctx);
+
+/**
+ * Cost model for update plans and deadlines. These are deliberately
+ * pessimistic figures for a slow vfat ESP, an update mostly waits on flushes.
+ */
+#define CBM_PLAN_WRITE_BPS (32ULL * 1024 * 1024) /**<Copy throughput */
+#define CBM_PLAN_READ_BPS (256ULL * 1024 * 1024) /**<Compare throughput */
+#define CBM_PLAN_SYNC_US 50000ULL                /**<fsync and rename per copy */
+#define CBM_PLAN_CONFIG_US 50000ULL              /**<Rewrite and sync a config file */
+#define CBM_PLAN_BOOTLOADER_US 500000ULL         /**<Bootloader install or update */
+#define CBM_PLAN_EFI_VARIABLE_US 200000ULL       /**<NVRAM write */
+#define CBM_PLAN_COMMAND_US 2000000ULL           /**<External command */
+#define CBM_PLAN_DELETE_US 20000ULL              /**<Unlink and sync */
+#define CBM_PLAN_DEFER_US 5000ULL                /**<Append to the removal queue */
+
+/**
+ * Upper bound on threads staging copies onto the boot partition
+ */
+#define CBM_OP_GRAPH_MAX_WORKERS 4
+
+/**
+ * Kinds of node in an update operation graph
+ */
+typedef enum {
+        CBM_OP_STAGE = 0, /**<Compare a blob, staging a new copy if it differs */
+        CBM_OP_COMMIT,    /**<Rename a staged copy into place */
+        CBM_OP_SYNC,      /**<Filesystem wide flush barrier */
+        CBM_OP_ENTRY,     /**<Write the bootloader entry for a kernel */
+        CBM_OP_DEFAULT,   /**<Set the default kernel */
+        CBM_OP_REMOVE,    /**<Garbage collect a kernel */
+        CBM_OP_RECONCILE, /**<Remove every stale file from the boot partition */
+} CbmOpKind;
+
+typedef enum {
+        CBM_OP_PENDING = 0,
+        CBM_OP_DONE,
+        CBM_OP_FAILED,
+        CBM_OP_SKIPPED,
+        CBM_OP_DEFERRED, /**<Left for the next update by the deadline */
+} CbmOpState;
+
+/**
+ * A single operation of an update. Only stage ops run concurrently, every
+ * other kind runs on the calling thread in the order it was added, once
+ * its dependencies are complete.
+ */
+typedef struct CbmOp {
+        CbmOpKind kind;
+        CbmOpState state;
+        const Kernel *kernel;       /**<Kernel concerned, if any */
+        const char *reason;         /**<Why the kernel is installed, for logging */
+        char *source;               /**<Stage: absolute source path */
+        char *target;               /**<Stage/commit: name in the kernel destination */
+        struct CbmOp *stage;        /**<Commit: the stage op it completes */
+        bool staged;                /**<Stage: a copy awaits its commit */
+        bool optional;              /**<Failure is logged rather than fatal */
+        bool skip;                  /**<An optional prerequisite failed */
+        bool deferrable;            /**<May be left to the next update */
+        uint64_t estimate_us;       /**<Estimated cost, for deferrable ops */
+        uint64_t inputs;            /**<Remove: fingerprint entries of the inputs it deletes */
+        uint8_t digest[CBM_SHA256_LEN]; /**<Stage: SHA-256 of what was staged */
+        int index;                  /**<Insertion order */
+        int pending;                /**<Incomplete dependencies */
+        int n_dependents;           /**<Length of dependents */
+        struct CbmOp **dependents;  /**<Ops waiting on this one */
+        struct CbmOp *next;         /**<Ready list link */
+} CbmOp;
+
+/**
+ * An ordered operation DAG, built by a pure planning pass and then run by
+ * boot_manager_run_op_graph()
+ */
+typedef struct CbmOpGraph {
+        NcArray *ops;         /**<CbmOp, in insertion order */
+        uint64_t deadline_us; /**<Deferrable ops that would overrun this are deferred */
+        int deferred;         /**<Ops deferred by the last run */
+        KernelArray *kernels; /**<Every kernel known to the update, not owned */
+} CbmOpGraph;
+
+CbmOpGraph *cbm_op_graph_new(void);
+
+void cbm_op_graph_free(CbmOpGraph *graph);
+
+/**
+ * Append an op. Dependencies may only point at earlier ops.
+ */
+CbmOp *cbm_op_graph_add(CbmOpGraph *graph, CbmOpKind kind, const Kernel *kernel,
+                        const char *reason);
+
+/**
+ * Append a stage op for @source and the commit op for @target, a name
+ * within the kernel destination. Returns the commit op.
+ */
+CbmOp *cbm_op_graph_add_copy(CbmOpGraph *graph, const Kernel *kernel, const char *reason,
+                             const char *source, const char *target);
+
+/**
+ * Short name of an op kind, for logs and the deferred record
+ */
+const char *cbm_op_kind_name(CbmOpKind kind);
+
+/**
+ * Make @op wait for @dependency
+ */
+void cbm_op_depends(CbmOp *op, CbmOp *dependency);
+
+/**
+ * Run @graph with up to @workers threads. A failed required op stops any
+ * further ops from starting, and staged copies never committed are removed.
+ * Deferrable ops that would run past the graph's deadline are not started.
+ *
+ * @return true if every required op completed
+ */
+bool boot_manager_run_op_graph(BootManager *self, const CbmInstallContext *ctx,
+                               CbmOpGraph *graph, unsigned int workers);
+
+/**
+ * Record the ops of @graph that were deferred by the deadline, or clear the
+ * record when there are none. While a record exists the update is never
+ * considered current.
+ */
+void boot_manager_record_deferred(BootManager *self, const CbmOpGraph *graph);
+
+/**
+ * Number of steps the previous update deferred, 0 if it finished everything
+ */
+int boot_manager_count_deferred(BootManager *self, const char *prefix);
+
+/**
+ * Bring every mirror configured in KERNEL_CONF_DIRECTORY/esp.conf in step
+ * with the boot directory, which must be mounted. Each mirror is mounted and
+ * written by its own thread.
+ *
+ * @return true if there are no mirrors, or all of them are now current
+ */
+bool boot_manager_update_mirrors(BootManager *self);
+
+DEF_AUTOFREE(CbmOpGraph, cbm_op_graph_free)
+
 /**
  * Given a boot_device returns the filesystem name, if unknown filesystem returns NULL.
  */
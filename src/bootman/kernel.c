@@ -22,8 +22,11 @@
 #include "bootman_private.h"
 #include "cmdline.h"
 #include "files.h"
+#include "fingerprint.h"
+#include "gc-queue.h"
 #include "log.h"
 #include "nica/files.h"
+#include "rmtree.h"
 
 #include "config.h"
 
@@ -558,44 +561,35 @@ Kernel *boot_manager_get_last_booted(BootManager *self, KernelArray *kernels)
  *
  * It is *not fatal* for this to fail, just highly undesirable.
  */
-static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, const Kernel *kernel)
+bool boot_manager_remove_legacy_uefi_kernel(const CbmInstallContext *ctx, const Kernel *kernel)
 {
-        autofree(char) *base_path = NULL;
-        autofree(char) *initrd_target = NULL;
-        autofree(char) *kfile_target = NULL;
         bool ret = true;
         bool migrated = false;
 
-        assert(manager != NULL);
+        assert(ctx != NULL);
         assert(kernel != NULL);
 
-        /* Boot path */
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
-
-        kfile_target = string_printf("%s/%s", base_path, kernel->target.legacy_path);
-        initrd_target = string_printf("%s/%s", base_path, kernel->target.initrd_path);
-
         /* Remove old kernel */
-        if (nc_file_exists(kfile_target)) {
-                if (unlink(kfile_target) < 0) {
-                        LOG_ERROR("Failed to remove legacy-path UEFI kernel %s: %s",
-                                  kfile_target,
-                                  strerror(errno));
-                        ret = false;
-                } else {
-                        migrated = true;
-                }
+        if (unlinkat(ctx->boot_fd, kernel->target.legacy_path, 0) == 0) {
+                migrated = true;
+        } else if (errno != ENOENT) {
+                LOG_ERROR("Failed to remove legacy-path UEFI kernel %s/%s: %s",
+                          ctx->boot_dir,
+                          kernel->target.legacy_path,
+                          strerror(errno));
+                ret = false;
         }
 
         /* Remove old initrd */
-        if (nc_file_exists(initrd_target)) {
-                if (unlink(initrd_target) < 0) {
-                        LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
-                                  initrd_target,
+        if (kernel->target.initrd_path) {
+                if (unlinkat(ctx->boot_fd, kernel->target.initrd_path, 0) == 0) {
+                        migrated = true;
+                } else if (errno != ENOENT) {
+                        LOG_ERROR("Failed to remove legacy-path UEFI initrd %s/%s: %s",
+                                  ctx->boot_dir,
+                                  kernel->target.initrd_path,
                                   strerror(errno));
                         ret = false;
-                } else {
-                        migrated = true;
                 }
         }
 
@@ -611,39 +605,25 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
 /**
  * Internal function to install the kernel blob itself
  */
-bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel)
+bool boot_manager_install_kernel_internal(const BootManager *manager,
+                                          const CbmInstallContext *ctx, const Kernel *kernel)
 {
-        autofree(char) *kfile_target = NULL;
-        autofree(char) *base_path = NULL;
-        autofree(char) *initrd_target = NULL;
+        const char *kfile_target = NULL;
         const char *initrd_source = NULL;
-        bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? manager->bootloader->get_kernel_destination(manager) : NULL;
 
         assert(manager != NULL);
+        assert(ctx != NULL);
         assert(kernel != NULL);
 
-        if (is_uefi && !efi_boot_dir) {
-                return false;
-        }
-
-        /* Boot path */
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
-        OOM_CHECK_RET(base_path, false);
-
-        /* for UEFI, the kernel location is prefixed with efi_boot_dir which is
-         * guaranteed to start with '/' since it's its absolute path on ESP. */
-        kfile_target = string_printf("%s%s/%s",
-                                     base_path,
-                                     (is_uefi ? efi_boot_dir : ""),
-                                     (is_uefi ? kernel->target.path : kernel->target.legacy_path));
+        kfile_target = cbm_install_context_kernel_name(ctx, kernel);
 
         /* Now copy the kernel file to it's new location */
-        if (!cbm_files_match(kernel->source.path, kfile_target)) {
-                if (!copy_file_atomic(kernel->source.path, kfile_target, 00644)) {
-                        LOG_FATAL("Failed to install kernel %s: %s", kfile_target, strerror(errno));
+        if (!cbm_files_match_at(kernel->source.path, ctx->dest_fd, kfile_target)) {
+                if (!copy_file_atomic_at(kernel->source.path, ctx->dest_fd, kfile_target, 00644)) {
+                        LOG_FATAL("Failed to install kernel %s/%s: %s",
+                                  ctx->dest_dir,
+                                  kfile_target,
+                                  strerror(errno));
                         return false;
                 }
         }
@@ -658,15 +638,14 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
                 return true;
         }
 
-        initrd_target = string_printf("%s%s/%s",
-                                      base_path,
-                                      (is_uefi ? efi_boot_dir : ""),
-                                      kernel->target.initrd_path);
-
-        if (!cbm_files_match(initrd_source, initrd_target)) {
-                if (!copy_file_atomic(initrd_source, initrd_target, 00644)) {
-                        LOG_FATAL("Failed to install initrd %s: %s",
-                                  initrd_target,
+        if (!cbm_files_match_at(initrd_source, ctx->dest_fd, kernel->target.initrd_path)) {
+                if (!copy_file_atomic_at(initrd_source,
+                                         ctx->dest_fd,
+                                         kernel->target.initrd_path,
+                                         00644)) {
+                        LOG_FATAL("Failed to install initrd %s/%s: %s",
+                                  ctx->dest_dir,
+                                  kernel->target.initrd_path,
                                   strerror(errno));
                         return false;
                 }
@@ -676,7 +655,7 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
          * from previous runs, and then continue and let the bootloader configure
          * as appropriate.
          */
-        if (is_uefi && !boot_manager_remove_legacy_uefi_kernel(manager, kernel)) {
+        if (ctx->is_uefi && !boot_manager_remove_legacy_uefi_kernel(ctx, kernel)) {
                 LOG_WARNING("Failed to remove legacy kernel on ESP: %s",
                             kernel->target.legacy_path);
         }
@@ -685,70 +664,114 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
 }
 
 /**
- * Internal function to remove the kernel blob itself
+ * Gather the large per-kernel artifacts outside of the boot path: modules,
+ * headers, System.map and vmlinux. Returns how many exist.
  */
-bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel)
+static size_t boot_manager_kernel_artifacts(const Kernel *kernel, const char *artifacts[4])
 {
-        autofree(char) *kfile_target = NULL;
-        autofree(char) *base_path = NULL;
-        autofree(char) *initrd_target = NULL;
-        bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? manager->bootloader->get_kernel_destination(manager) : NULL;
+        const char *candidates[] = {
+                kernel->source.module_dir,
+                kernel->source.headers_dir,
+                kernel->source.sysmap_file,
+                kernel->source.vmlinux_file,
+        };
+        size_t n = 0;
 
-        assert(manager != NULL);
-        assert(kernel != NULL);
+        for (size_t i = 0; i < ARRAY_SIZE(candidates); i++) {
+                if (candidates[i] && nc_file_exists(candidates[i])) {
+                        artifacts[n++] = candidates[i];
+                }
+        }
+        return n;
+}
+
+/**
+ * Queue the heavy artifacts for the background collector. Image builds
+ * have no later run to rely on, so they always purge inline.
+ */
+static bool boot_manager_defer_kernel_artifacts(const BootManager *manager, const Kernel *kernel)
+{
+        const char *artifacts[4] = { 0 };
+        size_t n;
 
-        /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
-        if (is_uefi && !efi_boot_dir) {
+        if (manager->image_mode) {
                 return false;
         }
+        n = boot_manager_kernel_artifacts(kernel, artifacts);
+        if (n == 0) {
+                return true;
+        }
+        if (!cbm_gc_queue_push(manager->sysconfig->prefix, kernel->source.path, artifacts, n)) {
+                LOG_WARNING("Unable to defer cleanup of %s, removing now", kernel->meta.bpath);
+                return false;
+        }
+        LOG_DEBUG("Deferred removal of %zu artifacts for %s", n, kernel->meta.bpath);
+        return true;
+}
 
-        /* Boot path */
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
-        OOM_CHECK_RET(base_path, false);
-
-        /* Remove old blobs */
-        kfile_target = string_printf("%s%s/%s",
-                                     base_path,
-                                     (is_uefi ? efi_boot_dir : ""),
-                                     (is_uefi ? kernel->target.path : kernel->target.legacy_path));
+/**
+ * Remove the heavy artifacts immediately. These trees are large, so remove
+ * them in parallel and flush once afterwards.
+ */
+static void boot_manager_purge_kernel_artifacts(const Kernel *kernel)
+{
+        const char *artifacts[4] = { 0 };
+        size_t n = boot_manager_kernel_artifacts(kernel, artifacts);
+        bool purged = false;
 
-        if (kernel->source.initrd_file) {
-                initrd_target = string_printf("%s%s/%s",
-                                              base_path,
-                                              (is_uefi ? efi_boot_dir : ""),
-                                              kernel->target.initrd_path);
+        for (size_t i = 0; i < n; i++) {
+                if (!cbm_rm_rf_parallel(artifacts[i], 0)) {
+                        LOG_ERROR("Failed to remove %s: %s", artifacts[i], strerror(errno));
+                        continue;
+                }
+                purged = true;
         }
-
-        /* Remove the kernel from the ESP */
-        if (nc_file_exists(kfile_target) && unlink(kfile_target) < 0) {
-                LOG_ERROR("Failed to remove kernel %s: %s", kfile_target, strerror(errno));
-        } else {
+        if (purged) {
                 cbm_sync();
         }
+}
 
-        /* Purge the kernel modules from disk */
-        if (kernel->source.module_dir && nc_file_exists(kernel->source.module_dir)) {
-                if (!nc_rm_rf(kernel->source.module_dir)) {
-                        LOG_ERROR("Failed to remove module dir (-rf) %s: %s",
-                                  kernel->source.module_dir,
-                                  strerror(errno));
-                } else {
-                        cbm_sync();
+uint64_t boot_manager_kernel_input_entries(const Kernel *kernel)
+{
+        const char *inputs[] = {
+                kernel->source.path,         kernel->source.cmdline_file,
+                kernel->source.kconfig_file, kernel->source.kboot_file,
+                kernel->source.initrd_file,
+        };
+        uint64_t sum = 0;
+
+        /* Exactly what boot_manager_remove_kernel_internal() unlinks */
+        for (size_t i = 0; i < ARRAY_SIZE(inputs); i++) {
+                if (inputs[i]) {
+                        sum += cbm_fingerprint_entry(inputs[i]);
                 }
         }
+        return sum;
+}
 
-        /* Purge the kernel headers from disk */
-        if (kernel->source.headers_dir && nc_file_exists(kernel->source.headers_dir)) {
-                if (!nc_rm_rf(kernel->source.headers_dir)) {
-                        LOG_ERROR("Failed to remove headers dir (-rf) %s: %s",
-                                  kernel->source.module_dir,
-                                  strerror(errno));
-                } else {
-                        cbm_sync();
-                }
+/**
+ * Internal function to remove the kernel blob itself
+ */
+bool boot_manager_remove_kernel_internal(const BootManager *manager,
+                                         const CbmInstallContext *ctx, const Kernel *kernel)
+{
+        const char *kfile_target = NULL;
+
+        assert(manager != NULL);
+        assert(ctx != NULL);
+        assert(kernel != NULL);
+
+        /* Remove old blobs */
+        kfile_target = cbm_install_context_kernel_name(ctx, kernel);
+
+        /* Remove the kernel from the ESP */
+        if (unlinkat(ctx->dest_fd, kfile_target, 0) < 0 && errno != ENOENT) {
+                LOG_ERROR("Failed to remove kernel %s/%s: %s",
+                          ctx->dest_dir,
+                          kfile_target,
+                          strerror(errno));
+        } else {
+                cbm_sync();
         }
 
         if (kernel->source.cmdline_file && nc_file_exists(kernel->source.cmdline_file)) {
@@ -765,20 +788,6 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
                                   strerror(errno));
                 }
         }
-        if (kernel->source.sysmap_file && nc_file_exists(kernel->source.sysmap_file)) {
-                if (unlink(kernel->source.sysmap_file) < 0) {
-                        LOG_ERROR("Failed to remove System.map file %s: %s",
-                                  kernel->source.sysmap_file,
-                                  strerror(errno));
-                }
-        }
-        if (kernel->source.vmlinux_file && nc_file_exists(kernel->source.vmlinux_file)) {
-                if (unlink(kernel->source.vmlinux_file) < 0) {
-                        LOG_ERROR("Failed to remove vmlinux file %s: %s",
-                                  kernel->source.vmlinux_file,
-                                  strerror(errno));
-                }
-        }
         if (kernel->source.kboot_file && nc_file_exists(kernel->source.kboot_file)) {
                 if (unlink(kernel->source.kboot_file) < 0) {
                         LOG_ERROR("Failed to remove kboot file %s: %s",
@@ -794,9 +803,11 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
                                   kernel->source.initrd_file,
                                   strerror(errno));
                 }
-                if (nc_file_exists(initrd_target) && unlink(initrd_target) < 0) {
-                        LOG_ERROR("Failed to remove initrd blob %s: %s",
-                                  initrd_target,
+                if (unlinkat(ctx->dest_fd, kernel->target.initrd_path, 0) < 0 &&
+                    errno != ENOENT) {
+                        LOG_ERROR("Failed to remove initrd blob %s/%s: %s",
+                                  ctx->dest_dir,
+                                  kernel->target.initrd_path,
                                   strerror(errno));
                 }
         }
@@ -809,10 +820,18 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
                 return false;
         }
 
+        /* The heavy on-disk artifacts are left to the deferred collector so
+         * that update returns as soon as the ESP is correct. Only queued once
+         * the source is gone, as the collector takes a present source to mean
+         * the kernel was reinstalled. */
+        if (!boot_manager_defer_kernel_artifacts(manager, kernel)) {
+                boot_manager_purge_kernel_artifacts(kernel);
+        }
+
         /* Our portion is complete, remove any legacy uefi bits we might have
          * from previous runs.
          */
-        if (is_uefi && !boot_manager_remove_legacy_uefi_kernel(manager, kernel)) {
+        if (ctx->is_uefi && !boot_manager_remove_legacy_uefi_kernel(ctx, kernel)) {
                 LOG_WARNING("Failed to remove legacy kernel on ESP: %s",
                             kernel->target.legacy_path);
         }
@@ -0,0 +1,175 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "esp-mirror.h"
+#include "iosched.h"
+#include "log.h"
+#include "nica/files.h"
+#include "system_stub.h"
+
+/**
+ * One secondary ESP, brought in step with the primary by its own thread
+ */
+typedef struct CbmMirrorJob {
+        const char *primary; /**<Boot directory of the primary */
+        const char *target;  /**<Configured device or directory */
+        char *mount_dir;     /**<Where to mount @target if it is an unmounted device */
+        pthread_t thread;
+        bool started;
+        bool ok;
+} CbmMirrorJob;
+
+static bool boot_manager_mirror_same_dir(const char *a, const char *b)
+{
+        struct stat sa = { 0 };
+        struct stat sb = { 0 };
+
+        return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev &&
+               sa.st_ino == sb.st_ino;
+}
+
+static void *boot_manager_mirror_run(void *data)
+{
+        CbmMirrorJob *job = data;
+        autofree(char) *mountpoint = NULL;
+        const char *fs_name = NULL;
+        const char *dir = job->target;
+        struct stat st = { 0 };
+        bool mounted = false;
+
+        (void)cbm_io_set_phase(CBM_IO_PHASE_COPY);
+
+        if (stat(job->target, &st) != 0) {
+                LOG_ERROR("Cannot find mirror %s: %s", job->target, strerror(errno));
+                return NULL;
+        }
+        if (S_ISBLK(st.st_mode)) {
+                mountpoint = cbm_system_get_mountpoint_for_device(job->target);
+                if (!mountpoint) {
+                        fs_name = cbm_get_fstype_name(job->target);
+                        if (!fs_name) {
+                                LOG_ERROR("Could not determine fstype of: %s", job->target);
+                                return NULL;
+                        }
+                        if (!nc_file_exists(job->mount_dir)) {
+                                nc_mkdir_p(job->mount_dir, 0755);
+                        }
+                        if (cbm_system_mount(job->target,
+                                             job->mount_dir,
+                                             fs_name,
+                                             MS_MGC_VAL,
+                                             "") < 0) {
+                                LOG_ERROR("Cannot mount mirror %s on %s: %s",
+                                          job->target,
+                                          job->mount_dir,
+                                          strerror(errno));
+                                return NULL;
+                        }
+                        mounted = true;
+                }
+                dir = mountpoint ? mountpoint : job->mount_dir;
+        } else if (!S_ISDIR(st.st_mode)) {
+                LOG_ERROR("Mirror %s is neither a block device nor a directory", job->target);
+                return NULL;
+        }
+
+        if (boot_manager_mirror_same_dir(dir, job->primary)) {
+                LOG_DEBUG("Mirror %s is the boot directory, skipping", job->target);
+                job->ok = true;
+        } else {
+                job->ok = cbm_esp_mirror_sync(job->primary, dir);
+        }
+
+        if (mounted && cbm_system_umount(job->mount_dir) < 0) {
+                LOG_WARNING("Could not unmount mirror %s from %s", job->target, job->mount_dir);
+        }
+        return NULL;
+}
+
+bool boot_manager_update_mirrors(BootManager *self)
+{
+        autofree(char) *primary = NULL;
+        CbmMirrorJob *jobs = NULL;
+        NcArray *targets = NULL;
+        bool ret = true;
+
+        assert(self != NULL);
+
+        targets = cbm_esp_mirror_load(self->sysconfig->prefix, self->sysconfig->boot_device);
+        if (!targets) {
+                return true;
+        }
+        primary = boot_manager_get_boot_dir(self);
+        jobs = calloc((size_t)targets->len, sizeof(*jobs));
+        OOM_CHECK(primary);
+        OOM_CHECK(jobs);
+
+        LOG_INFO("Mirroring %s to %d other boot partitions", primary, targets->len);
+
+        /* Each mirror is a different disk, so they are all written at once */
+        for (int i = 0; i < targets->len; i++) {
+                CbmMirrorJob *job = &jobs[i];
+
+                job->primary = primary;
+                job->target = nc_array_get(targets, i);
+                job->mount_dir = string_printf("%s/run/clr-boot-manager/mirror%d",
+                                               self->sysconfig->prefix,
+                                               i);
+                job->started = pthread_create(&job->thread,
+                                              NULL,
+                                              boot_manager_mirror_run,
+                                              job) == 0;
+                if (!job->started) {
+                        boot_manager_mirror_run(job);
+                }
+        }
+        for (int i = 0; i < targets->len; i++) {
+                CbmMirrorJob *job = &jobs[i];
+
+                if (job->started) {
+                        pthread_join(job->thread, NULL);
+                }
+                if (!job->ok) {
+                        LOG_ERROR("Failed to update mirror %s", job->target);
+                        ret = false;
+                }
+                free(job->mount_dir);
+        }
+
+        free(jobs);
+        nc_array_free(&targets, free);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,484 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "iosched.h"
+#include "log.h"
+
+/**
+ * Fragments a freshly installed blob may be split into before we complain
+ */
+#define CBM_FRAGMENTS_WARN 8
+
+/**
+ * Shared executor state, guarded by lock
+ */
+typedef struct CbmOpRun {
+        BootManager *manager;
+        const CbmInstallContext *ctx;
+        CbmOpGraph *graph;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        CbmOp *ready;   /**<Ops whose dependencies are all complete */
+        int completed;  /**<Ops that succeeded, failed or were skipped */
+        bool cancelled; /**<A required op failed, start nothing new */
+        bool done;      /**<Every op has completed */
+} CbmOpRun;
+
+CbmOpGraph *cbm_op_graph_new(void)
+{
+        CbmOpGraph *graph = calloc(1, sizeof(CbmOpGraph));
+
+        OOM_CHECK_RET(graph, NULL);
+        graph->ops = nc_array_new();
+        if (!graph->ops) {
+                free(graph);
+                return NULL;
+        }
+        return graph;
+}
+
+static void cbm_op_free(void *v)
+{
+        CbmOp *op = v;
+
+        if (!op) {
+                return;
+        }
+        free(op->source);
+        free(op->target);
+        free(op->dependents);
+        free(op);
+}
+
+void cbm_op_graph_free(CbmOpGraph *graph)
+{
+        if (!graph) {
+                return;
+        }
+        nc_array_free(&graph->ops, cbm_op_free);
+        free(graph);
+}
+
+CbmOp *cbm_op_graph_add(CbmOpGraph *graph, CbmOpKind kind, const Kernel *kernel,
+                        const char *reason)
+{
+        CbmOp *op = calloc(1, sizeof(CbmOp));
+
+        OOM_CHECK(op);
+        op->kind = kind;
+        op->kernel = kernel;
+        op->reason = reason;
+        op->index = graph->ops->len;
+        if (!nc_array_add(graph->ops, op)) {
+                DECLARE_OOM();
+                abort();
+        }
+        return op;
+}
+
+CbmOp *cbm_op_graph_add_copy(CbmOpGraph *graph, const Kernel *kernel, const char *reason,
+                             const char *source, const char *target)
+{
+        CbmOp *stage = cbm_op_graph_add(graph, CBM_OP_STAGE, kernel, reason);
+        CbmOp *commit = cbm_op_graph_add(graph, CBM_OP_COMMIT, kernel, reason);
+
+        stage->source = strdup(source);
+        stage->target = strdup(target);
+        commit->target = strdup(target);
+        OOM_CHECK(stage->source);
+        OOM_CHECK(stage->target);
+        OOM_CHECK(commit->target);
+        commit->stage = stage;
+        cbm_op_depends(commit, stage);
+        return commit;
+}
+
+void cbm_op_depends(CbmOp *op, CbmOp *dependency)
+{
+        CbmOp **dependents = NULL;
+
+        assert(dependency->index < op->index);
+
+        dependents = realloc(dependency->dependents,
+                             sizeof(CbmOp *) * (size_t)(dependency->n_dependents + 1));
+        OOM_CHECK(dependents);
+        dependents[dependency->n_dependents++] = op;
+        dependency->dependents = dependents;
+        op->pending++;
+}
+
+/**
+ * Compare a blob with the installed copy, staging a new copy if they differ.
+ * Runs on any thread: touches nothing but the two files.
+ */
+static bool cbm_op_stage(CbmOpRun *run, CbmOp *op)
+{
+        const CbmInstallContext *ctx = run->ctx;
+        CbmManifest *manifest = run->manager->manifest;
+        CbmIoPhase io_phase = cbm_io_set_phase(CBM_IO_PHASE_COPY);
+        autofree(char) *path = string_printf("%s/%s", ctx->dest_dir, op->target);
+        bool ret = true;
+
+        /* Neither side changed since it was verified, no need to read them */
+        if (cbm_manifest_trusts(manifest, op->source, path)) {
+                goto done;
+        }
+        /* Installed before the manifest existed, or touched since */
+        if (cbm_files_match_hashed_at(op->source,
+                                      ctx->dest_fd,
+                                      op->target,
+                                      manifest ? op->digest : NULL)) {
+                cbm_manifest_record(manifest, op->source, path, op->digest);
+                goto done;
+        }
+        if (!copy_file_stage_hashed_at(op->source, ctx->dest_fd, op->target, 00644, op->digest)) {
+                LOG_FATAL("Failed to install %s/%s: %s",
+                          ctx->dest_dir,
+                          op->target,
+                          strerror(errno));
+                ret = false;
+                goto done;
+        }
+        op->staged = true;
+
+done:
+        cbm_io_set_phase(io_phase);
+        return ret;
+}
+
+static bool cbm_op_commit(CbmOpRun *run, CbmOp *op)
+{
+        const CbmInstallContext *ctx = run->ctx;
+        autofree(char) *path = NULL;
+        int fragments;
+
+        if (!op->stage->staged) {
+                return true;
+        }
+        if (!copy_file_commit_at(ctx->dest_fd, op->target)) {
+                LOG_FATAL("Failed to install %s/%s: %s",
+                          ctx->dest_dir,
+                          op->target,
+                          strerror(errno));
+                return false;
+        }
+        op->stage->staged = false;
+
+        /* Only now, as the record holds the identity of the renamed file */
+        path = string_printf("%s/%s", ctx->dest_dir, op->target);
+        cbm_manifest_record(run->manager->manifest, op->stage->source, path, op->stage->digest);
+
+        /* Firmware has to read all of it at boot, tell when that is slow */
+        fragments = cbm_file_fragments_at(ctx->dest_fd, op->target);
+        if (fragments > CBM_FRAGMENTS_WARN) {
+                LOG_WARNING("%s/%s is split into %d fragments, the boot partition may need "
+                            "defragmenting",
+                            ctx->dest_dir,
+                            op->target,
+                            fragments);
+        } else if (fragments >= 0) {
+                LOG_DEBUG("%s/%s is in %d fragments", ctx->dest_dir, op->target, fragments);
+        }
+        return true;
+}
+
+static bool cbm_op_entry(CbmOpRun *run, CbmOp *op)
+{
+        BootManager *self = run->manager;
+        CbmArenaMark mark = cbm_arena_mark(self->scratch);
+        bool ret = false;
+
+        cbm_log_set_kernel(op->kernel->meta.bpath);
+        ret = self->bootloader->install_kernel(self, op->kernel);
+        cbm_arena_rewind(self->scratch, mark);
+        cbm_log_set_kernel(NULL);
+
+        if (!ret) {
+                LOG_FATAL("Failed to install %s kernel: %s", op->reason, op->kernel->source.path);
+                return false;
+        }
+        LOG_SUCCESS("update_native: Installed %s kernel (%s) %s",
+                    op->reason,
+                    op->kernel->meta.ktype,
+                    op->kernel->source.path);
+        return true;
+}
+
+const char *cbm_op_kind_name(CbmOpKind kind)
+{
+        static const char *names[] = {
+                [CBM_OP_STAGE] = "stage",   [CBM_OP_COMMIT] = "commit",
+                [CBM_OP_SYNC] = "sync",     [CBM_OP_ENTRY] = "entry",
+                [CBM_OP_DEFAULT] = "default", [CBM_OP_REMOVE] = "remove",
+                [CBM_OP_RECONCILE] = "reconcile",
+        };
+
+        if ((size_t)kind >= ARRAY_SIZE(names)) {
+                return "unknown";
+        }
+        return names[kind];
+}
+
+static bool cbm_op_execute(CbmOpRun *run, CbmOp *op)
+{
+        BootManager *self = run->manager;
+
+        switch (op->kind) {
+        case CBM_OP_STAGE:
+                return cbm_op_stage(run, op);
+        case CBM_OP_COMMIT:
+                return cbm_op_commit(run, op);
+        case CBM_OP_SYNC:
+                cbm_sync();
+                return true;
+        case CBM_OP_ENTRY:
+                return cbm_op_entry(run, op);
+        case CBM_OP_DEFAULT:
+                if (!boot_manager_set_default_kernel(self, op->kernel)) {
+                        LOG_ERROR("Failed to set the default kernel to: %s",
+                                  op->kernel->source.path);
+                        return false;
+                }
+                LOG_SUCCESS("update_native: Default kernel for %s is %s",
+                            op->kernel->meta.ktype,
+                            op->kernel->source.path);
+                return true;
+        case CBM_OP_REMOVE:
+                LOG_INFO("update_native: Garbage collecting %s: %s",
+                         op->kernel->meta.ktype,
+                         op->kernel->source.path);
+                if (!boot_manager_remove_kernel(self, op->kernel)) {
+                        LOG_ERROR("Failed to remove kernel: %s", op->kernel->source.path);
+                        return false;
+                }
+                return true;
+        case CBM_OP_RECONCILE:
+                if (!boot_manager_reconcile_boot_dir(self, run->ctx, run->graph->kernels)) {
+                        LOG_WARNING("Failed to remove stale files from the boot partition");
+                        return false;
+                }
+                return true;
+        default:
+                return false;
+        }
+}
+
+/**
+ * Pop the next op this thread may run. Stage ops may run anywhere, the
+ * rest only on the calling thread and in the order they were added.
+ */
+static CbmOp *cbm_op_run_pop(CbmOpRun *run, bool serial)
+{
+        CbmOp **best = NULL;
+        CbmOp *ret = NULL;
+
+        for (CbmOp **link = &run->ready; *link; link = &(*link)->next) {
+                bool parallel = (*link)->kind == CBM_OP_STAGE;
+
+                if (!serial && !parallel) {
+                        continue;
+                }
+                if (!best || (*link)->index < (*best)->index) {
+                        best = link;
+                }
+        }
+        if (!best) {
+                return NULL;
+        }
+        ret = *best;
+        *best = ret->next;
+        ret->next = NULL;
+        return ret;
+}
+
+/**
+ * Record the outcome of @op and release its dependents. Called with the
+ * lock held.
+ */
+static void cbm_op_run_finish(CbmOpRun *run, CbmOp *op, CbmOpState state)
+{
+        op->state = state;
+        run->completed++;
+
+        if (state == CBM_OP_FAILED && !op->optional) {
+                run->cancelled = true;
+        }
+        for (int i = 0; i < op->n_dependents; i++) {
+                CbmOp *dep = op->dependents[i];
+
+                /* Optional work is skipped along with what it builds on */
+                if (state != CBM_OP_DONE && op->optional && dep->optional) {
+                        dep->skip = true;
+                }
+                if (--dep->pending == 0) {
+                        dep->next = run->ready;
+                        run->ready = dep;
+                }
+        }
+        if (run->completed == run->graph->ops->len) {
+                run->done = true;
+        }
+        pthread_cond_broadcast(&run->cond);
+}
+
+/**
+ * Run @op unless the graph was cancelled or its prerequisites were
+ * skipped. Called with the lock held, which is dropped while it runs.
+ */
+static void cbm_op_run_one(CbmOpRun *run, CbmOp *op)
+{
+        bool ok = false;
+
+        if (run->cancelled || op->skip) {
+                cbm_op_run_finish(run, op, CBM_OP_SKIPPED);
+                return;
+        }
+        /* Boot critical work always runs, the rest only while it fits */
+        if (op->deferrable && run->graph->deadline_us &&
+            cbm_log_now_us() + op->estimate_us > run->graph->deadline_us) {
+                LOG_INFO("Deadline reached, deferring %s%s%s to the next update",
+                         cbm_op_kind_name(op->kind),
+                         op->kernel ? " of " : "",
+                         op->kernel ? op->kernel->meta.bpath : "");
+                cbm_op_run_finish(run, op, CBM_OP_DEFERRED);
+                return;
+        }
+        pthread_mutex_unlock(&run->lock);
+        ok = cbm_op_execute(run, op);
+        pthread_mutex_lock(&run->lock);
+        if (!ok && op->optional) {
+                LOG_ERROR("Optional operation failed, continuing: %s",
+                          op->kernel ? op->kernel->source.path : op->target);
+        }
+        cbm_op_run_finish(run, op, ok ? CBM_OP_DONE : CBM_OP_FAILED);
+}
+
+static void *cbm_op_worker(void *data)
+{
+        CbmOpRun *run = data;
+
+        pthread_mutex_lock(&run->lock);
+        while (!run->done) {
+                CbmOp *op = cbm_op_run_pop(run, false);
+
+                if (!op) {
+                        pthread_cond_wait(&run->cond, &run->lock);
+                        continue;
+                }
+                cbm_op_run_one(run, op);
+        }
+        pthread_mutex_unlock(&run->lock);
+        return NULL;
+}
+
+bool boot_manager_run_op_graph(BootManager *self, const CbmInstallContext *ctx,
+                               CbmOpGraph *graph, unsigned int workers)
+{
+        CbmOpRun run = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+        pthread_t threads[CBM_OP_GRAPH_MAX_WORKERS];
+        unsigned int started = 0;
+        bool ret = true;
+
+        assert(self != NULL);
+        assert(ctx != NULL);
+
+        if (!graph || graph->ops->len == 0) {
+                return true;
+        }
+        run.manager = self;
+        run.ctx = ctx;
+        run.graph = graph;
+        graph->deferred = 0;
+
+        for (int i = graph->ops->len - 1; i >= 0; i--) {
+                CbmOp *op = nc_array_get(graph->ops, i);
+
+                if (op->pending == 0) {
+                        op->next = run.ready;
+                        run.ready = op;
+                }
+        }
+
+        if (workers > CBM_OP_GRAPH_MAX_WORKERS) {
+                workers = CBM_OP_GRAPH_MAX_WORKERS;
+        }
+        /* The calling thread is always a worker, the rest are best effort */
+        for (unsigned int i = 1; i < workers; i++) {
+                if (pthread_create(&threads[started], NULL, cbm_op_worker, &run) != 0) {
+                        break;
+                }
+                started++;
+        }
+
+        /* Serial ops run here, in order, while stage ops overlap around them.
+         * With no other workers this thread runs the stage ops too. */
+        pthread_mutex_lock(&run.lock);
+        while (!run.done) {
+                CbmOp *op = cbm_op_run_pop(&run, true);
+
+                if (!op) {
+                        pthread_cond_wait(&run.cond, &run.lock);
+                        continue;
+                }
+                cbm_op_run_one(&run, op);
+        }
+        pthread_mutex_unlock(&run.lock);
+
+        for (unsigned int i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&run.lock);
+        pthread_cond_destroy(&run.cond);
+
+        for (int i = 0; i < graph->ops->len; i++) {
+                CbmOp *op = nc_array_get(graph->ops, i);
+
+                /* Never leave half finished copies behind on the ESP */
+                if (op->kind == CBM_OP_STAGE && op->staged) {
+                        copy_file_abort_at(ctx->dest_fd, op->target);
+                        op->staged = false;
+                }
+                if (op->state == CBM_OP_DEFERRED) {
+                        graph->deferred++;
+                }
+                if (op->state != CBM_OP_DONE && op->state != CBM_OP_DEFERRED &&
+                    !op->optional) {
+                        ret = false;
+                }
+        }
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
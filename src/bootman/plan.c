@@ -0,0 +1,701 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+
+static const char *cbm_plan_action_names[CBM_PLAN_MAX] = {
+        [CBM_PLAN_COMPARE] = "compare",  [CBM_PLAN_COPY] = "copy",
+        [CBM_PLAN_CONFIG] = "config",    [CBM_PLAN_BOOTLOADER] = "bootloader",
+        [CBM_PLAN_EFI_VARIABLE] = "efivar", [CBM_PLAN_COMMAND] = "command",
+        [CBM_PLAN_DELETE] = "delete",    [CBM_PLAN_DEFER] = "defer",
+};
+
+/**
+ * State carried while walking the update. Files the plan has already
+ * written or deleted are tracked so that later steps see the system as it
+ * would be at that point, not as it is now.
+ */
+typedef struct CbmPlanner {
+        BootManager *manager;
+        CbmUpdatePlan *plan;
+        const char *boot_dir; /**<Root of the boot partition */
+        char *dest_dir;       /**<Where kernel blobs are installed */
+        bool is_uefi;         /**<Bootloader has BOOTLOADER_CAP_UEFI */
+        NcHashmap *written;   /**<Targets already copied by the plan */
+        NcHashmap *deleted;   /**<Targets already deleted by the plan */
+        CbmManifest *manifest;/**<Installs known intact without reading them */
+} CbmPlanner;
+
+static void cbm_plan_step_free(void *v)
+{
+        CbmPlanStep *step = v;
+
+        if (!step) {
+                return;
+        }
+        free(step->target);
+        free(step->source);
+        free(step->kernel);
+        free(step);
+}
+
+void cbm_update_plan_free(CbmUpdatePlan *plan)
+{
+        if (!plan) {
+                return;
+        }
+        nc_array_free(&plan->steps, cbm_plan_step_free);
+        free(plan->prefix);
+        free(plan);
+}
+
+static uint64_t cbm_plan_estimate(CbmPlanAction action, uint64_t bytes)
+{
+        switch (action) {
+        case CBM_PLAN_COMPARE:
+                return bytes * 1000000ULL / CBM_PLAN_READ_BPS;
+        case CBM_PLAN_COPY:
+                return bytes * 1000000ULL / CBM_PLAN_WRITE_BPS + CBM_PLAN_SYNC_US;
+        case CBM_PLAN_CONFIG:
+                return CBM_PLAN_CONFIG_US;
+        case CBM_PLAN_BOOTLOADER:
+                return CBM_PLAN_BOOTLOADER_US;
+        case CBM_PLAN_EFI_VARIABLE:
+                return CBM_PLAN_EFI_VARIABLE_US;
+        case CBM_PLAN_COMMAND:
+                return CBM_PLAN_COMMAND_US;
+        case CBM_PLAN_DELETE:
+                return CBM_PLAN_DELETE_US;
+        case CBM_PLAN_DEFER:
+                return CBM_PLAN_DEFER_US;
+        default:
+                return 0;
+        }
+}
+
+/**
+ * Record a step. @target is copied, @source and @kernel may be NULL.
+ */
+static void cbm_plan_add(CbmPlanner *planner, CbmPlanAction action, const Kernel *kernel,
+                         const char *reason, const char *target, const char *source,
+                         uint64_t bytes)
+{
+        CbmPlanStep *step = calloc(1, sizeof(CbmPlanStep));
+
+        OOM_CHECK(step);
+        step->action = action;
+        step->target = strdup(target);
+        OOM_CHECK(step->target);
+        if (source) {
+                step->source = strdup(source);
+                OOM_CHECK(step->source);
+        }
+        if (kernel) {
+                step->kernel = strdup(kernel->meta.bpath);
+                OOM_CHECK(step->kernel);
+        }
+        step->reason = reason;
+        step->bytes = bytes;
+        step->estimate_us = cbm_plan_estimate(action, bytes);
+
+        if (!nc_array_add(planner->plan->steps, step)) {
+                DECLARE_OOM();
+                abort();
+        }
+        if (action == CBM_PLAN_COPY) {
+                planner->plan->copy_bytes += bytes;
+        }
+        planner->plan->estimate_us += step->estimate_us;
+}
+
+static void cbm_plan_mark(NcHashmap *map, const char *target)
+{
+        char *key = NULL;
+
+        if (nc_hashmap_get(map, target)) {
+                return;
+        }
+        key = strdup(target);
+        OOM_CHECK(key);
+        if (!nc_hashmap_put(map, key, key)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+/**
+ * Whether @target exists at this point of the plan
+ */
+static bool cbm_plan_exists(CbmPlanner *planner, const char *target)
+{
+        if (nc_hashmap_get(planner->written, target)) {
+                return true;
+        }
+        if (nc_hashmap_get(planner->deleted, target)) {
+                return false;
+        }
+        return nc_file_exists(target);
+}
+
+/**
+ * Mirror the stage op: the compare runs unless the manifest vouches for the
+ * target or it is a hardlink of the source, the copy only when the contents
+ * differ and shares the data on the same filesystem
+ */
+static void cbm_plan_copy(CbmPlanner *planner, const Kernel *kernel, const char *reason,
+                          const char *source, const char *target)
+{
+        autofree(char) *parent = NULL;
+        struct stat src = { 0 };
+        struct stat dst = { 0 };
+        struct stat dir = { 0 };
+        uint64_t compared = 0;
+        uint64_t copied = 0;
+        bool same = false;
+
+        if (stat(source, &src) != 0) {
+                LOG_WARNING("plan: Cannot stat %s: %s", source, strerror(errno));
+                return;
+        }
+
+        /* Only same-length files have their contents read */
+        if (nc_hashmap_get(planner->written, target)) {
+                /* An earlier step of this update leaves an identical copy */
+                compared = 2 * (uint64_t)src.st_size;
+                same = true;
+        } else if (!nc_hashmap_get(planner->deleted, target) &&
+                   cbm_manifest_trusts(planner->manifest, source, target)) {
+                same = true;
+        } else if (!nc_hashmap_get(planner->deleted, target) && stat(target, &dst) == 0 &&
+                   dst.st_dev == src.st_dev && dst.st_ino == src.st_ino) {
+                same = true;
+        } else if (!nc_hashmap_get(planner->deleted, target) && stat(target, &dst) == 0 &&
+                   dst.st_size == src.st_size) {
+                compared = 2 * (uint64_t)src.st_size;
+                same = cbm_files_match(source, target);
+        }
+
+        cbm_plan_add(planner, CBM_PLAN_COMPARE, kernel, reason, target, source, compared);
+        if (same) {
+                return;
+        }
+        parent = strdup(target);
+        OOM_CHECK(parent);
+        if (stat(dirname(parent), &dir) != 0 || dir.st_dev != src.st_dev) {
+                copied = (uint64_t)src.st_size;
+        }
+        cbm_plan_add(planner, CBM_PLAN_COPY, kernel, reason, target, source, copied);
+        cbm_plan_mark(planner->written, target);
+        nc_hashmap_remove(planner->deleted, target);
+}
+
+/**
+ * Plan the removal of @target if it exists at this point
+ */
+static void cbm_plan_delete(CbmPlanner *planner, const Kernel *kernel, const char *reason,
+                            const char *target)
+{
+        struct stat st = { 0 };
+
+        if (!target || !cbm_plan_exists(planner, target)) {
+                return;
+        }
+        (void)stat(target, &st);
+        cbm_plan_add(planner, CBM_PLAN_DELETE, kernel, reason, target, NULL, (uint64_t)st.st_size);
+        cbm_plan_mark(planner->deleted, target);
+        nc_hashmap_remove(planner->written, target);
+}
+
+static void cbm_plan_install_kernel(CbmPlanner *planner, const Kernel *kernel, const char *reason)
+{
+        autofree(char) *kfile = NULL;
+        autofree(char) *initrd = NULL;
+        autofree(char) *entry = NULL;
+        const char *initrd_source = kernel->source.user_initrd_file
+                                        ? kernel->source.user_initrd_file
+                                        : kernel->source.initrd_file;
+
+        kfile = string_printf("%s/%s",
+                              planner->dest_dir,
+                              planner->is_uefi ? kernel->target.path : kernel->target.legacy_path);
+        cbm_plan_copy(planner, kernel, reason, kernel->source.path, kfile);
+
+        if (initrd_source) {
+                initrd = string_printf("%s/%s", planner->dest_dir, kernel->target.initrd_path);
+                cbm_plan_copy(planner, kernel, reason, initrd_source, initrd);
+        }
+        /* A native update leaves this to the reconcile step */
+        if (planner->is_uefi && planner->plan->image_mode) {
+                autofree(char) *legacy = NULL;
+
+                legacy = string_printf("%s/%s", planner->boot_dir, kernel->target.legacy_path);
+                cbm_plan_delete(planner, kernel, reason, legacy);
+        }
+
+        entry = string_printf("%s entry for %s", planner->plan->bootloader, kernel->meta.bpath);
+        cbm_plan_add(planner, CBM_PLAN_CONFIG, kernel, reason, entry, NULL, 0);
+}
+
+static void cbm_plan_remove_kernel(CbmPlanner *planner, const Kernel *kernel)
+{
+        const char *reason = "garbage";
+        const char *artifacts[] = {
+                kernel->source.module_dir,
+                kernel->source.headers_dir,
+                kernel->source.sysmap_file,
+                kernel->source.vmlinux_file,
+        };
+        autofree(char) *kfile = NULL;
+        autofree(char) *entry = NULL;
+
+        kfile = string_printf("%s/%s",
+                              planner->dest_dir,
+                              planner->is_uefi ? kernel->target.path : kernel->target.legacy_path);
+        cbm_plan_delete(planner, kernel, reason, kfile);
+
+        for (size_t i = 0; i < ARRAY_SIZE(artifacts); i++) {
+                if (!artifacts[i] || !nc_file_exists(artifacts[i])) {
+                        continue;
+                }
+                if (planner->plan->image_mode) {
+                        cbm_plan_delete(planner, kernel, reason, artifacts[i]);
+                } else {
+                        cbm_plan_add(planner,
+                                     CBM_PLAN_DEFER,
+                                     kernel,
+                                     reason,
+                                     artifacts[i],
+                                     NULL,
+                                     0);
+                }
+        }
+
+        cbm_plan_delete(planner, kernel, reason, kernel->source.cmdline_file);
+        cbm_plan_delete(planner, kernel, reason, kernel->source.kconfig_file);
+        cbm_plan_delete(planner, kernel, reason, kernel->source.kboot_file);
+        if (kernel->source.initrd_file) {
+                autofree(char) *initrd = NULL;
+
+                initrd = string_printf("%s/%s", planner->dest_dir, kernel->target.initrd_path);
+                cbm_plan_delete(planner, kernel, reason, kernel->source.initrd_file);
+                cbm_plan_delete(planner, kernel, reason, initrd);
+        }
+        cbm_plan_delete(planner, kernel, reason, kernel->source.path);
+        if (planner->is_uefi) {
+                autofree(char) *legacy = NULL;
+
+                legacy = string_printf("%s/%s", planner->boot_dir, kernel->target.legacy_path);
+                cbm_plan_delete(planner, kernel, reason, legacy);
+        }
+
+        entry = string_printf("%s entry for %s", planner->plan->bootloader, kernel->meta.bpath);
+        cbm_plan_add(planner, CBM_PLAN_CONFIG, kernel, reason, entry, NULL, 0);
+}
+
+/**
+ * Mirror boot_manager_update_bootloader(), with the side effects each
+ * implementation has beyond its own files
+ */
+static void cbm_plan_bootloader(CbmPlanner *planner)
+{
+        BootManager *self = planner->manager;
+        const char *name = planner->plan->bootloader;
+        const char *reason = NULL;
+
+        if (boot_manager_needs_install(self)) {
+                reason = "install";
+        } else if (boot_manager_needs_update(self)) {
+                reason = "update";
+        } else {
+                return;
+        }
+        cbm_plan_add(planner, CBM_PLAN_BOOTLOADER, NULL, reason, name, NULL, 0);
+
+        if (!streq(reason, "install")) {
+                return;
+        }
+        if (streq(name, "shim-systemd")) {
+                cbm_plan_add(planner, CBM_PLAN_EFI_VARIABLE, NULL, reason, "Boot####", NULL, 0);
+                cbm_plan_add(planner, CBM_PLAN_EFI_VARIABLE, NULL, reason, "BootOrder", NULL, 0);
+        } else if (streq(name, "extlinux")) {
+                cbm_plan_add(planner, CBM_PLAN_COMMAND, NULL, reason, "extlinux", NULL, 0);
+        } else if (streq(name, "syslinux")) {
+                cbm_plan_add(planner, CBM_PLAN_COMMAND, NULL, reason, "syslinux", NULL, 0);
+                cbm_plan_add(planner, CBM_PLAN_COMMAND, NULL, reason, "sgdisk", NULL, 0);
+        }
+}
+
+static void cbm_plan_set_default(CbmPlanner *planner, const Kernel *kernel)
+{
+        cbm_plan_add(planner,
+                     CBM_PLAN_CONFIG,
+                     kernel,
+                     "default",
+                     planner->plan->bootloader,
+                     NULL,
+                     0);
+        if (streq(planner->plan->bootloader, "grub2")) {
+                cbm_plan_add(planner,
+                             CBM_PLAN_COMMAND,
+                             kernel,
+                             "default",
+                             "grub-mkconfig",
+                             NULL,
+                             0);
+        }
+}
+
+static void cbm_plan_copy_initrds(CbmPlanner *planner)
+{
+        BootManager *self = planner->manager;
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+        void *val = NULL;
+
+        nc_hashmap_iter_init(self->initrd_freestanding, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &val)) {
+                autofree(char) *source = NULL;
+                autofree(char) *target = NULL;
+
+                source = string_printf("%s/%s", self->initrd_freestanding_dir, (char *)val);
+                target = string_printf("%s/%s", planner->dest_dir, (char *)key);
+                cbm_plan_copy(planner, NULL, "initrd", source, target);
+        }
+}
+
+static void cbm_plan_stale_file(__cbm_unused__ int dirfd, const char *dir, const char *name,
+                                void *userdata)
+{
+        CbmPlanner *planner = userdata;
+        autofree(char) *target = NULL;
+
+        target = string_printf("%s/%s", dir, name);
+        cbm_plan_delete(planner, NULL, "stale", target);
+}
+
+/**
+ * Mirror boot_manager_update_image()
+ */
+static bool cbm_plan_image(CbmPlanner *planner, KernelArray *kernels)
+{
+        cbm_plan_bootloader(planner);
+        cbm_plan_copy_initrds(planner);
+        for (int i = 0; i < kernels->len; i++) {
+                cbm_plan_install_kernel(planner, nc_array_get(kernels, i), "image");
+        }
+        cbm_plan_set_default(planner, nc_array_get(kernels, 0));
+        return true;
+}
+
+/**
+ * Mirror boot_manager_update_native()
+ */
+static bool cbm_plan_native(CbmPlanner *planner, KernelArray *kernels)
+{
+        BootManager *self = planner->manager;
+        autofree(NcHashmap) *mapped_kernels = NULL;
+        autofree(CbmRetentionPolicy) *policy = NULL;
+        NcHashmapIter map_iter = { 0 };
+        const char *kernel_type = NULL;
+        KernelArray *typed_kernels = NULL;
+        const SystemKernel *system_kernel = NULL;
+        Kernel *running = NULL;
+        Kernel *new_default = NULL;
+        NcArray *removals = NULL;
+        bool ret = false;
+
+        running = boot_manager_select_running(self, kernels);
+        system_kernel = boot_manager_get_system_kernel(self);
+
+        mapped_kernels = boot_manager_map_kernels(self, kernels);
+        if (!mapped_kernels || nc_hashmap_size(mapped_kernels) == 0) {
+                LOG_FATAL("Failed to map kernels by type, bailing");
+                return false;
+        }
+
+        cbm_plan_bootloader(planner);
+        cbm_plan_copy_initrds(planner);
+        if (running) {
+                cbm_plan_install_kernel(planner, running, "running");
+        }
+
+        policy = cbm_retention_policy_load(self->sysconfig->prefix);
+        removals = nc_array_new();
+        if (!policy || !removals) {
+                DECLARE_OOM();
+                goto done;
+        }
+
+        nc_hashmap_iter_init(mapped_kernels, &map_iter);
+        while (nc_hashmap_iter_next(&map_iter, (void **)&kernel_type, (void **)&typed_kernels)) {
+                NcArray *keep = NULL;
+                Kernel *tip = NULL;
+
+                nc_array_qsort(typed_kernels, kernel_compare_reverse);
+                tip = boot_manager_select_tip(self, typed_kernels, kernel_type);
+                cbm_plan_install_kernel(planner, tip, "tip");
+
+                keep = nc_array_new();
+                OOM_CHECK(keep);
+                if (!cbm_retention_plan(policy,
+                                        typed_kernels,
+                                        running,
+                                        tip,
+                                        keep,
+                                        running ? removals : NULL)) {
+                        nc_array_free(&keep, NULL);
+                        goto done;
+                }
+                for (int i = 0; i < keep->len; i++) {
+                        Kernel *tk = nc_array_get(keep, i);
+
+                        if (tk != tip && tk != running) {
+                                cbm_plan_install_kernel(planner, tk, "retained");
+                        }
+                }
+                nc_array_free(&keep, NULL);
+        }
+
+        if (running) {
+                new_default = boot_manager_get_default_for_type(self, kernels, running->meta.ktype);
+        } else if (system_kernel && system_kernel->ktype[0] != '\0') {
+                new_default =
+                    boot_manager_get_default_for_type(self, kernels, system_kernel->ktype);
+        }
+        if (new_default) {
+                cbm_plan_set_default(planner, new_default);
+        }
+
+        /* The update only reconciles when it knows the running kernel */
+        if (running) {
+                (void)boot_manager_find_stale(self,
+                                              planner->boot_dir,
+                                              planner->dest_dir,
+                                              planner->is_uefi,
+                                              kernels,
+                                              cbm_plan_stale_file,
+                                              planner);
+        }
+        for (int i = 0; i < removals->len; i++) {
+                cbm_plan_remove_kernel(planner, nc_array_get(removals, i));
+        }
+        ret = true;
+
+done:
+        if (removals) {
+                nc_array_free(&removals, NULL);
+        }
+        return ret;
+}
+
+CbmUpdatePlan *boot_manager_plan_update(BootManager *self)
+{
+        assert(self != NULL);
+        autofree(KernelArray) *kernels = NULL;
+        autofree(char) *boot_dir = NULL;
+        autofree(char) *mount_dir = NULL;
+        autofree(NcHashmap) *written = NULL;
+        autofree(NcHashmap) *deleted = NULL;
+        CbmUpdatePlan *plan = NULL;
+        CbmPlanner planner = { 0 };
+        const char *efi_dir = NULL;
+        int did_mount = 0;
+        bool ok = false;
+
+        if (!self->bootloader || !cbm_is_sysconfig_sane(self->sysconfig)) {
+                return NULL;
+        }
+
+        kernels = boot_manager_get_kernels(self);
+        if (!kernels || kernels->len == 0) {
+                LOG_ERROR("No kernels discovered in %s, bailing", self->kernel_dir);
+                return NULL;
+        }
+        nc_array_qsort(kernels, kernel_compare_reverse);
+
+        if (self->image_mode) {
+                boot_dir = boot_manager_get_boot_dir(self);
+                if (!boot_dir || !nc_file_exists(boot_dir)) {
+                        LOG_ERROR("Cannot find boot directory, ensure it is mounted: %s",
+                                  boot_dir);
+                        return NULL;
+                }
+                if (!boot_manager_set_boot_dir(self, boot_dir)) {
+                        return NULL;
+                }
+        } else {
+                /* Comparisons need the installed copies in view */
+                did_mount = detect_and_mount_boot(self, &mount_dir);
+                if (did_mount < 0) {
+                        return NULL;
+                }
+        }
+
+        plan = calloc(1, sizeof(CbmUpdatePlan));
+        if (!plan) {
+                DECLARE_OOM();
+                goto done;
+        }
+        plan->prefix = strdup(self->sysconfig->prefix);
+        plan->steps = nc_array_new();
+        plan->bootloader = self->bootloader->name;
+        plan->image_mode = self->image_mode;
+        written = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        deleted = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!plan->prefix || !plan->steps || !written || !deleted) {
+                DECLARE_OOM();
+                goto done;
+        }
+
+        planner.manager = self;
+        planner.plan = plan;
+        planner.written = written;
+        planner.deleted = deleted;
+        planner.is_uefi = (self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
+                          BOOTLOADER_CAP_UEFI;
+        if (planner.is_uefi) {
+                efi_dir = self->bootloader->get_kernel_destination(self);
+        }
+        if (!boot_dir) {
+                boot_dir = boot_manager_get_boot_dir(self);
+                if (!boot_dir) {
+                        DECLARE_OOM();
+                        goto done;
+                }
+        }
+        planner.boot_dir = boot_dir;
+        planner.dest_dir = string_printf("%s%s", boot_dir, efi_dir ? efi_dir : "");
+
+        if (!self->image_mode) {
+                planner.manifest = cbm_manifest_load(self->sysconfig->prefix);
+        }
+
+        ok = self->image_mode ? cbm_plan_image(&planner, kernels)
+                              : cbm_plan_native(&planner, kernels);
+        free(planner.dest_dir);
+        cbm_manifest_free(planner.manifest);
+
+done:
+        if (did_mount > 0) {
+                umount_boot(mount_dir);
+        }
+        cbm_case_cache_clear(self->case_cache);
+        if (!ok) {
+                cbm_update_plan_free(plan);
+                return NULL;
+        }
+        return plan;
+}
+
+static void cbm_plan_write_json(const CbmUpdatePlan *plan, FILE *out)
+{
+        fputs("{\n  \"prefix\": ", out);
+        cbm_json_write_string(out, plan->prefix);
+        fputs(",\n  \"bootloader\": ", out);
+        cbm_json_write_string(out, plan->bootloader);
+        fprintf(out,
+                ",\n  \"image_mode\": %s,\n  \"copy_bytes\": %" PRIu64
+                ",\n  \"estimate_us\": %" PRIu64 ",\n  \"steps\": [",
+                plan->image_mode ? "true" : "false",
+                plan->copy_bytes,
+                plan->estimate_us);
+
+        for (int i = 0; i < plan->steps->len; i++) {
+                const CbmPlanStep *step = nc_array_get(plan->steps, i);
+
+                fputs(i ? ",\n    {\"action\": " : "\n    {\"action\": ", out);
+                cbm_json_write_string(out, cbm_plan_action_names[step->action]);
+                fputs(", \"target\": ", out);
+                cbm_json_write_string(out, step->target);
+                fputs(", \"source\": ", out);
+                cbm_json_write_string(out, step->source);
+                fputs(", \"kernel\": ", out);
+                cbm_json_write_string(out, step->kernel);
+                fputs(", \"reason\": ", out);
+                cbm_json_write_string(out, step->reason);
+                fprintf(out,
+                        ", \"bytes\": %" PRIu64 ", \"estimate_us\": %" PRIu64 "}",
+                        step->bytes,
+                        step->estimate_us);
+        }
+        fputs(plan->steps->len ? "\n  ]\n}\n" : "]\n}\n", out);
+}
+
+static void cbm_plan_write_text(const CbmUpdatePlan *plan, FILE *out)
+{
+        fprintf(out,
+                "Update plan for %s (%s%s)\n",
+                plan->prefix,
+                plan->bootloader,
+                plan->image_mode ? ", image mode" : "");
+
+        for (int i = 0; i < plan->steps->len; i++) {
+                const CbmPlanStep *step = nc_array_get(plan->steps, i);
+
+                fprintf(out,
+                        "  %-10s %-9s %12" PRIu64 "  %s",
+                        cbm_plan_action_names[step->action],
+                        step->reason,
+                        step->bytes,
+                        step->target);
+                if (step->source) {
+                        fprintf(out, " <- %s", step->source);
+                }
+                fputc('\n', out);
+        }
+        fprintf(out,
+                "%d steps, %" PRIu64 " bytes to copy, estimated %" PRIu64 ".%03" PRIu64 "s\n",
+                plan->steps->len,
+                plan->copy_bytes,
+                plan->estimate_us / 1000000,
+                (plan->estimate_us / 1000) % 1000);
+}
+
+bool cbm_update_plan_write(const CbmUpdatePlan *plan, FILE *out, bool json)
+{
+        if (!plan || !out) {
+                return false;
+        }
+        if (json) {
+                cbm_plan_write_json(plan, out);
+        } else {
+                cbm_plan_write_text(plan, out);
+        }
+        return fflush(out) == 0 && !ferror(out);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
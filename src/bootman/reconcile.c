@@ -0,0 +1,353 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+
+/**
+ * Suffix of a copy that never made it into place
+ */
+#define CBM_STALE_TMP_SUFFIX ".TmpWrite"
+
+typedef struct CbmReconcile {
+        BootManager *manager;
+        int removed;
+        bool ok;
+} CbmReconcile;
+
+static bool boot_manager_stale_has_prefix(const char *name, const char *const *prefixes, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+static bool boot_manager_stale_has_suffix(const char *name, const char *suffix)
+{
+        size_t len = strlen(name);
+        size_t slen = strlen(suffix);
+
+        return len >= slen && streq(name + len - slen, suffix);
+}
+
+/**
+ * Filter for the legacy ESP root, passing on only the copies that have been
+ * migrated to the kernel destination
+ */
+typedef struct CbmStaleLegacy {
+        const char *dest_dir;
+        boot_manager_stale_func func;
+        void *userdata;
+} CbmStaleLegacy;
+
+static void boot_manager_stale_legacy(int dirfd, const char *dir, const char *name, void *userdata)
+{
+        CbmStaleLegacy *l = userdata;
+        autofree(char) *migrated = NULL;
+
+        if (!boot_manager_stale_has_suffix(name, CBM_STALE_TMP_SUFFIX)) {
+                /* Kernel blobs gained a prefix, initrds kept their name */
+                if (strncmp(name, "initrd-", strlen("initrd-")) == 0) {
+                        migrated = string_printf("%s/%s", l->dest_dir, name);
+                } else {
+                        migrated = string_printf("%s/kernel-%s", l->dest_dir, name);
+                }
+                if (!nc_file_exists(migrated)) {
+                        return;
+                }
+        }
+        l->func(dirfd, dir, name, l->userdata);
+}
+
+static void boot_manager_stale_names_free(void *v)
+{
+        nc_hashmap_free(v);
+}
+
+/**
+ * Collect the names of generated files, the loader entries, by directory
+ */
+static void boot_manager_stale_entry(const char *source, const char *target, void *userdata)
+{
+        NcHashmap *dirs = userdata;
+        NcHashmap *names = NULL;
+        char *dir = NULL;
+        char *name = NULL;
+
+        if (source) {
+                return;
+        }
+        dir = strdup(target);
+        OOM_CHECK(dir);
+        name = strrchr(dir, '/');
+        if (!name) {
+                free(dir);
+                return;
+        }
+        *name++ = '\0';
+        name = strdup(name);
+        OOM_CHECK(name);
+
+        names = nc_hashmap_get(dirs, dir);
+        if (!names) {
+                names = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+                OOM_CHECK(names);
+                OOM_CHECK(nc_hashmap_put(dirs, dir, names));
+        } else {
+                free(dir);
+        }
+        if (nc_hashmap_get(names, name)) {
+                free(name);
+                return;
+        }
+        OOM_CHECK(nc_hashmap_put(names, name, name));
+}
+
+/**
+ * Read @dir once, passing every regular file named like one of @prefixes
+ * (and ending in @suffix, if set) that is not in @wanted to @func. Leftover
+ * temporary copies are always passed on.
+ */
+static bool boot_manager_scan_stale(const char *dir, NcHashmap *wanted,
+                                    const char *const *prefixes, size_t n_prefixes,
+                                    const char *suffix, boot_manager_stale_func func,
+                                    void *userdata)
+{
+        autofree(DIR) *d = NULL;
+        struct dirent *ent = NULL;
+
+        d = opendir(dir);
+        if (!d) {
+                if (errno == ENOENT) {
+                        return true;
+                }
+                LOG_ERROR("Error opening %s: %s", dir, strerror(errno));
+                return false;
+        }
+        while ((ent = readdir(d)) != NULL) {
+                struct stat st = { 0 };
+
+                if (!boot_manager_stale_has_suffix(ent->d_name, CBM_STALE_TMP_SUFFIX)) {
+                        if (!boot_manager_stale_has_prefix(ent->d_name, prefixes, n_prefixes)) {
+                                continue;
+                        }
+                        if (suffix && !boot_manager_stale_has_suffix(ent->d_name, suffix)) {
+                                continue;
+                        }
+                        if (wanted && nc_hashmap_get(wanted, ent->d_name)) {
+                                continue;
+                        }
+                }
+
+                /* Only the filesystems that can't say need a stat */
+                if (ent->d_type == DT_UNKNOWN) {
+                        if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                            !S_ISREG(st.st_mode)) {
+                                continue;
+                        }
+                } else if (ent->d_type != DT_REG) {
+                        continue;
+                }
+                func(dirfd(d), dir, ent->d_name, userdata);
+        }
+        return true;
+}
+
+bool boot_manager_find_stale(BootManager *self, const char *boot_dir, const char *dest_dir,
+                             bool is_uefi, KernelArray *kernels, boot_manager_stale_func func,
+                             void *userdata)
+{
+        autofree(NcHashmap) *wanted = NULL;
+        autofree(NcHashmap) *entry_dirs = NULL;
+        autofree(char) *entry_prefix = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *dir = NULL;
+        NcHashmap *names = NULL;
+        void *key = NULL;
+        void *val = NULL;
+        bool ret = true;
+
+        wanted = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        entry_dirs = nc_hashmap_new_full(nc_string_hash,
+                                         nc_string_compare,
+                                         free,
+                                         boot_manager_stale_names_free);
+        OOM_CHECK_RET(wanted, false);
+        OOM_CHECK_RET(entry_dirs, false);
+
+        /* Everything known is wanted, removing a kernel is not our job */
+        for (int i = 0; i < kernels->len; i++) {
+                const Kernel *kernel = nc_array_get(kernels, i);
+                const char *name = is_uefi ? kernel->target.path : kernel->target.legacy_path;
+
+                OOM_CHECK_RET(nc_hashmap_put(wanted, (void *)name, (void *)name), false);
+                if (kernel->target.initrd_path) {
+                        OOM_CHECK_RET(nc_hashmap_put(wanted,
+                                                     kernel->target.initrd_path,
+                                                     kernel->target.initrd_path),
+                                      false);
+                }
+                if (self->bootloader && self->bootloader->list_files) {
+                        self->bootloader->list_files(self,
+                                                     kernel,
+                                                     boot_manager_stale_entry,
+                                                     entry_dirs);
+                }
+        }
+        if (self->initrd_freestanding) {
+                nc_hashmap_iter_init(self->initrd_freestanding, &iter);
+                while (nc_hashmap_iter_next(&iter, &key, &val)) {
+                        OOM_CHECK_RET(nc_hashmap_put(wanted, key, key), false);
+                }
+        }
+
+        if (is_uefi) {
+                const char *prefixes[] = { "kernel-" KERNEL_NAMESPACE ".",
+                                           "initrd-" KERNEL_NAMESPACE ".",
+                                           "freestanding-" };
+                const char *legacy[] = { KERNEL_NAMESPACE ".", "initrd-" KERNEL_NAMESPACE "." };
+                size_t n = ARRAY_SIZE(prefixes);
+
+                /* Without a source directory nothing says which are current */
+                if (!self->initrd_freestanding_dir) {
+                        n--;
+                }
+                ret = boot_manager_scan_stale(dest_dir, wanted, prefixes, n, NULL, func, userdata);
+
+                /* A copy at the legacy paths is only stale once migrated,
+                 * until then it may be what the firmware still boots */
+                if (!streq(dest_dir, boot_dir)) {
+                        CbmStaleLegacy l = {.dest_dir = dest_dir,
+                                            .func = func,
+                                            .userdata = userdata };
+
+                        ret &= boot_manager_scan_stale(boot_dir,
+                                                       NULL,
+                                                       legacy,
+                                                       ARRAY_SIZE(legacy),
+                                                       NULL,
+                                                       boot_manager_stale_legacy,
+                                                       &l);
+                }
+        } else {
+                const char *prefixes[] = { KERNEL_NAMESPACE ".",
+                                           "initrd-" KERNEL_NAMESPACE ".",
+                                           "freestanding-" };
+                size_t n = ARRAY_SIZE(prefixes);
+
+                if (!self->initrd_freestanding_dir) {
+                        n--;
+                }
+                ret = boot_manager_scan_stale(dest_dir, wanted, prefixes, n, NULL, func, userdata);
+        }
+
+        entry_prefix = string_printf("%s-", boot_manager_get_vendor_prefix(self));
+        nc_hashmap_iter_init(entry_dirs, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&dir, (void **)&names)) {
+                const char *prefixes[] = { entry_prefix };
+
+                ret &= boot_manager_scan_stale(dir, names, prefixes, 1, ".conf", func, userdata);
+        }
+        return ret;
+}
+
+static void boot_manager_remove_stale(int dirfd, const char *dir, const char *name,
+                                      void *userdata)
+{
+        CbmReconcile *r = userdata;
+        autofree(char) *path = NULL;
+
+        path = string_printf("%s/%s", dir, name);
+        if (unlinkat(dirfd, name, 0) != 0) {
+                if (errno != ENOENT) {
+                        LOG_ERROR("Failed to remove stale %s: %s", path, strerror(errno));
+                        r->ok = false;
+                }
+                return;
+        }
+        LOG_INFO("Removed stale %s", path);
+        cbm_case_cache_note_removed(r->manager->case_cache, path);
+        cbm_manifest_forget(r->manager->manifest, path);
+        r->removed++;
+}
+
+bool boot_manager_reconcile_boot_dir(BootManager *self, const CbmInstallContext *ctx,
+                                     KernelArray *kernels)
+{
+        CbmReconcile r = {.manager = self, .ok = true };
+
+        if (!boot_manager_find_stale(self,
+                                     ctx->boot_dir,
+                                     ctx->dest_dir,
+                                     ctx->is_uefi,
+                                     kernels,
+                                     boot_manager_remove_stale,
+                                     &r)) {
+                r.ok = false;
+        }
+        if (r.removed > 0) {
+                cbm_sync();
+        }
+        return r.ok;
+}
+
+bool boot_manager_reconcile_freestanding(BootManager *self, const CbmInstallContext *ctx)
+{
+        CbmReconcile r = {.manager = self, .ok = true };
+        const char *prefixes[] = { "freestanding-" };
+
+        if (!self->initrd_freestanding_dir || !self->initrd_freestanding) {
+                return true;
+        }
+        if (!boot_manager_scan_stale(ctx->dest_dir,
+                                     self->initrd_freestanding,
+                                     prefixes,
+                                     ARRAY_SIZE(prefixes),
+                                     NULL,
+                                     boot_manager_remove_stale,
+                                     &r)) {
+                r.ok = false;
+        }
+        if (r.removed > 0) {
+                cbm_sync();
+        }
+        return r.ok;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,267 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bootman.h"
+#include "config.h"
+#include "log.h"
+#include "nica/files.h"
+
+/**
+ * Why a kernel survives the plan
+ */
+typedef enum {
+        RETAIN_NONE = 0, /**<Proposed for removal */
+        RETAIN_REQUIRED, /**<Running, default or pinned: never removed */
+        RETAIN_BOOTING,  /**<Within keep_booting */
+        RETAIN_NEWEST,   /**<Within keep_newest */
+} CbmRetainReason;
+
+static void cbm_retention_policy_defaults(CbmRetentionPolicy *policy)
+{
+        policy->keep_newest = 0;
+        policy->keep_booting = 1;
+        policy->max_bytes = 0;
+}
+
+/**
+ * Parse a count, rejecting negative and trailing garbage
+ */
+static bool cbm_retention_parse_count(const char *value, int *out)
+{
+        char *end = NULL;
+        long v;
+
+        errno = 0;
+        v = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || v < 0 || v > 1024) {
+                return false;
+        }
+        *out = (int)v;
+        return true;
+}
+
+static bool cbm_retention_parse_line(const char *key, const char *value, void *userdata)
+{
+        CbmRetentionPolicy *policy = userdata;
+        char *pin = NULL;
+
+        if (streq(key, "keep_newest")) {
+                return cbm_retention_parse_count(value, &policy->keep_newest);
+        }
+        if (streq(key, "keep_booting")) {
+                return cbm_retention_parse_count(value, &policy->keep_booting);
+        }
+        if (streq(key, "max_bytes")) {
+                return cbm_parse_bytes(value, &policy->max_bytes);
+        }
+        if (!streq(key, "pin")) {
+                errno = ENOENT;
+                return false;
+        }
+        if (*value == '\0') {
+                return false;
+        }
+        pin = strdup(value);
+        OOM_CHECK(pin);
+        if (!nc_array_add(policy->pins, pin)) {
+                DECLARE_OOM();
+                abort();
+        }
+        return true;
+}
+
+CbmRetentionPolicy *cbm_retention_policy_load(const char *prefix)
+{
+        autofree(char) *path = NULL;
+        CbmRetentionPolicy *policy = NULL;
+
+        policy = calloc(1, sizeof(CbmRetentionPolicy));
+        OOM_CHECK_RET(policy, NULL);
+        cbm_retention_policy_defaults(policy);
+        policy->pins = nc_array_new();
+        OOM_CHECK(policy->pins);
+
+        path = string_printf("%s%s/retention.conf", prefix ? prefix : "", KERNEL_CONF_DIRECTORY);
+        if (!cbm_config_read(path, cbm_retention_parse_line, policy) && errno != ENOENT) {
+                LOG_WARNING("Unable to open %s, using default retention: %s",
+                            path,
+                            strerror(errno));
+        }
+        return policy;
+}
+
+void cbm_retention_policy_free(CbmRetentionPolicy *policy)
+{
+        if (!policy) {
+                return;
+        }
+        nc_array_free(&policy->pins, free);
+        free(policy);
+}
+
+static bool cbm_retention_is_pinned(const CbmRetentionPolicy *policy, const Kernel *kernel)
+{
+        for (int i = 0; i < policy->pins->len; i++) {
+                if (streq(nc_array_get(policy->pins, i), kernel->meta.bpath)) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Bytes this kernel occupies on the ESP: the blob plus its initrd
+ */
+static uint64_t cbm_retention_kernel_bytes(const Kernel *kernel)
+{
+        const char *initrd = kernel->source.user_initrd_file ? kernel->source.user_initrd_file
+                                                             : kernel->source.initrd_file;
+        struct stat st = { 0 };
+        uint64_t ret = 0;
+
+        if (stat(kernel->source.path, &st) == 0) {
+                ret += (uint64_t)st.st_size;
+        }
+        if (initrd && stat(initrd, &st) == 0) {
+                ret += (uint64_t)st.st_size;
+        }
+        return ret;
+}
+
+/**
+ * Grant @reason to up to @limit kernels, newest first, while the budget
+ * allows it. Kernels that are already kept count towards the limit.
+ */
+static void cbm_retention_grant(const CbmRetentionPolicy *policy, KernelArray *kernels,
+                                CbmRetainReason *reasons, uint64_t *sizes, uint64_t *total,
+                                CbmRetainReason reason, int limit)
+{
+        int granted = 0;
+
+        for (int i = 0; i < kernels->len && granted < limit; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+
+                if (reason == RETAIN_BOOTING && !k->meta.boots) {
+                        continue;
+                }
+                if (reasons[i] != RETAIN_NONE) {
+                        granted++;
+                        continue;
+                }
+                if (policy->max_bytes && *total + sizes[i] > policy->max_bytes) {
+                        LOG_INFO("retention: %s exceeds the ESP budget for %s",
+                                 k->meta.bpath,
+                                 k->meta.ktype);
+                        continue;
+                }
+                reasons[i] = reason;
+                *total += sizes[i];
+                granted++;
+        }
+}
+
+bool cbm_retention_plan(const CbmRetentionPolicy *policy, KernelArray *kernels,
+                        const Kernel *running, const Kernel *tip, NcArray *keep,
+                        NcArray *removals)
+{
+        CbmRetainReason *reasons = NULL;
+        uint64_t *sizes = NULL;
+        uint64_t total = 0;
+        bool ret = false;
+
+        if (!policy || !kernels) {
+                return false;
+        }
+        if (kernels->len == 0) {
+                return true;
+        }
+
+        reasons = calloc((size_t)kernels->len, sizeof(CbmRetainReason));
+        sizes = calloc((size_t)kernels->len, sizeof(uint64_t));
+        if (!reasons || !sizes) {
+                DECLARE_OOM();
+                goto done;
+        }
+
+        /* Required kernels are kept whatever they cost */
+        for (int i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+
+                if (policy->max_bytes) {
+                        sizes[i] = cbm_retention_kernel_bytes(k);
+                }
+                if (k == running || k == tip || cbm_retention_is_pinned(policy, k)) {
+                        reasons[i] = RETAIN_REQUIRED;
+                        total += sizes[i];
+                }
+        }
+
+        /* Known-booting kernels are the safer fallback, so claim budget first */
+        cbm_retention_grant(policy,
+                            kernels,
+                            reasons,
+                            sizes,
+                            &total,
+                            RETAIN_BOOTING,
+                            policy->keep_booting);
+        cbm_retention_grant(policy,
+                            kernels,
+                            reasons,
+                            sizes,
+                            &total,
+                            RETAIN_NEWEST,
+                            policy->keep_newest);
+
+        for (int i = 0; i < kernels->len; i++) {
+                Kernel *k = nc_array_get(kernels, i);
+                NcArray *target = reasons[i] == RETAIN_NONE ? removals : keep;
+
+                if (!target) {
+                        continue;
+                }
+                if (!nc_array_add(target, k)) {
+                        DECLARE_OOM();
+                        goto done;
+                }
+                if (target == removals) {
+                        LOG_INFO("retention: Proposed for deletion from %s: %s",
+                                 k->meta.ktype,
+                                 k->source.path);
+                }
+        }
+        ret = true;
+
+done:
+        free(reasons);
+        free(sizes);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
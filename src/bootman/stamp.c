@@ -0,0 +1,352 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "config.h"
+#include "files.h"
+#include "fingerprint.h"
+#include "log.h"
+#include "nica/files.h"
+#include "system_stub.h"
+
+/**
+ * Records the fingerprints of the last successful native update
+ */
+#define CBM_UPDATE_STAMP "update.stamp"
+#define CBM_UPDATE_DEFERRED "update.deferred"
+
+/**
+ * How far below the boot directory to look: deep enough for
+ * EFI/<namespace>/<kernel> and loader/entries/<entry>
+ */
+#define CBM_STAMP_BOOT_DEPTH 3
+
+/**
+ * Directories whose listing, and the identity of every file in them, are
+ * inputs to an update
+ */
+static const char *cbm_stamp_input_trees[] = {
+        KERNEL_DIRECTORY,
+        INITRD_DIRECTORY,
+        KERNEL_CONF_DIRECTORY,
+        KERNEL_CONF_DIRECTORY "/cmdline.d",
+        KERNEL_CONF_DIRECTORY "/cmdline-removal.d",
+        VENDOR_KERNEL_CONF_DIRECTORY "/cmdline.d",
+        "/var/lib/kernel",
+        "/usr/lib/systemd/boot/efi",
+        "/usr/lib/shim",
+};
+
+/**
+ * Single files that are inputs to an update
+ */
+static const char *cbm_stamp_input_files[] = {
+        "/etc/os-release",
+        "/usr/lib/os-release",
+        "/usr/bin/syslinux",
+        "/usr/bin/extlinux",
+};
+
+static char *cbm_stamp_path(const char *prefix)
+{
+        return string_printf("%s%s/%s", prefix, CBM_STATE_DIR, CBM_UPDATE_STAMP);
+}
+
+uint64_t boot_manager_fingerprint_inputs(BootManager *self, const char *prefix, uint64_t removed)
+{
+        autofree(char) *efi = NULL;
+        struct stat st = { 0 };
+        CbmFingerprint fp;
+        uint64_t entries = removed;
+
+        assert(self != NULL);
+
+        cbm_fingerprint_init(&fp);
+        cbm_fingerprint_add_string(&fp, PACKAGE_VERSION);
+
+        /* Listings are summed rather than mixed in, so that what an update
+         * removes itself can be added back */
+        for (size_t i = 0; i < ARRAY_SIZE(cbm_stamp_input_trees); i++) {
+                autofree(char) *path = string_printf("%s%s", prefix, cbm_stamp_input_trees[i]);
+
+                entries += cbm_fingerprint_entries(path);
+        }
+        cbm_fingerprint_add(&fp, &entries, sizeof(entries));
+        for (size_t i = 0; i < ARRAY_SIZE(cbm_stamp_input_files); i++) {
+                autofree(char) *path = string_printf("%s%s", prefix, cbm_stamp_input_files[i]);
+
+                cbm_fingerprint_add_path(&fp, path);
+        }
+
+        /* The root device and whether we booted via UEFI stand in for probing */
+        efi = string_printf("%s/firmware/efi", cbm_system_get_sysfs_path());
+        if (stat(prefix, &st) == 0) {
+                cbm_fingerprint_add(&fp, &st.st_dev, sizeof(st.st_dev));
+        }
+        cbm_fingerprint_add_path(&fp, efi);
+
+        /* The running kernel decides what is repaired, retained and default */
+        if (self->have_sys_kernel) {
+                cbm_fingerprint_add_string(&fp, self->sys_kernel.ktype);
+                cbm_fingerprint_add_string(&fp, self->sys_kernel.version);
+                cbm_fingerprint_add(&fp,
+                                    &self->sys_kernel.release,
+                                    sizeof(self->sys_kernel.release));
+        } else {
+                cbm_fingerprint_add_string(&fp, NULL);
+        }
+        return fp.hash;
+}
+
+/**
+ * The boot directory @boot as it is visible now
+ */
+static uint64_t cbm_stamp_boot_digest(const char *boot)
+{
+        CbmFingerprint fp;
+
+        cbm_fingerprint_init(&fp);
+        cbm_fingerprint_add_tree(&fp, boot, CBM_STAMP_BOOT_DEPTH);
+        return fp.hash;
+}
+
+/**
+ * Whether the boot partition is in view at @boot, with the same test that
+ * mount_boot() uses to decide there is nothing to mount
+ */
+static bool cbm_stamp_boot_in_view(const char *boot)
+{
+        return cbm_system_is_mounted(boot) || (nc_file_exists(boot) && !cbm_is_dir_empty(boot));
+}
+
+bool boot_manager_update_is_current(BootManager *self, const char *prefix)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *boot = NULL;
+        autofree(char) *device = NULL;
+        autofree(char) *mountpoint = NULL;
+        autofree(FILE) *fp = NULL;
+        char recorded[PATH_MAX] = { 0 };
+        uint64_t inputs = 0;
+        uint64_t digest = 0;
+
+        assert(self != NULL);
+
+        if (!prefix || boot_manager_is_image_mode(self)) {
+                return false;
+        }
+        path = cbm_stamp_path(prefix);
+        fp = fopen(path, "re");
+        if (!fp) {
+                return false;
+        }
+        if (fscanf(fp,
+                   "inputs %" SCNx64 "\nboot %" SCNx64 "\ndevice %4095s\n",
+                   &inputs,
+                   &digest,
+                   recorded) != 3) {
+                return false;
+        }
+        /* Work left over by a deadline always needs another run */
+        if (boot_manager_count_deferred(self, prefix) > 0) {
+                LOG_DEBUG("The last update deferred some of its work");
+                return false;
+        }
+        if (inputs != boot_manager_fingerprint_inputs(self, prefix, 0)) {
+                LOG_DEBUG("Update inputs changed since the last update");
+                return false;
+        }
+
+        /* Mounted, or no partition of its own, so look at it as it is */
+        boot = string_printf("%s%s", streq(prefix, "/") ? "" : prefix, BOOT_DIRECTORY);
+        if (cbm_stamp_boot_in_view(boot)) {
+                if (digest != cbm_stamp_boot_digest(boot)) {
+                        LOG_DEBUG("Boot directory changed since the last update");
+                        return false;
+                }
+                return true;
+        }
+
+        /* Everything that writes the boot partition forgets the stamp, so
+         * while the same partition stays unmounted it is as it was left */
+        device = get_boot_device();
+        if (!device || !streq(device, recorded)) {
+                LOG_DEBUG("Boot partition changed since the last update");
+                return false;
+        }
+        mountpoint = cbm_system_get_mountpoint_for_device(device);
+        if (mountpoint && digest != cbm_stamp_boot_digest(mountpoint)) {
+                LOG_DEBUG("Boot partition changed since the last update");
+                return false;
+        }
+        LOG_DEBUG("Boot partition %s is as the last update left it", device);
+        return true;
+}
+
+void boot_manager_record_update(BootManager *self, uint64_t inputs)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *path = NULL;
+        autofree(char) *tmp = NULL;
+        autofree(FILE) *fp = NULL;
+        autofree(char) *boot = NULL;
+        autofree(char) *device = NULL;
+        const char *prefix = NULL;
+
+        assert(self != NULL);
+
+        prefix = self->sysconfig->prefix;
+        dir = string_printf("%s%s", prefix, CBM_STATE_DIR);
+        path = cbm_stamp_path(prefix);
+        tmp = string_printf("%s.tmp", path);
+        boot = boot_manager_get_boot_dir(self);
+        if (!boot) {
+                return;
+        }
+
+        /* Only a partition found the same cheap way can be trusted unmounted */
+        device = get_boot_device();
+        if (device && (!self->sysconfig->boot_device ||
+                       !streq(device, self->sysconfig->boot_device))) {
+                free(device);
+                device = NULL;
+        }
+
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_DEBUG("Cannot record update in %s: %s", dir, strerror(errno));
+                return;
+        }
+        fp = fopen(tmp, "we");
+        if (!fp) {
+                LOG_DEBUG("Cannot record update in %s: %s", tmp, strerror(errno));
+                return;
+        }
+        fprintf(fp,
+                "inputs %016" PRIx64 "\nboot %016" PRIx64 "\ndevice %s\n",
+                inputs,
+                cbm_stamp_boot_digest(boot),
+                device ? device : "-");
+        if (fflush(fp) != 0 || rename(tmp, path) != 0) {
+                LOG_DEBUG("Cannot record update in %s: %s", path, strerror(errno));
+                (void)unlink(tmp);
+        }
+}
+
+void boot_manager_forget_update(BootManager *self)
+{
+        autofree(char) *path = NULL;
+
+        assert(self != NULL);
+
+        if (!self->sysconfig) {
+                return;
+        }
+        path = cbm_stamp_path(self->sysconfig->prefix);
+        if (unlink(path) != 0 && errno != ENOENT) {
+                LOG_WARNING("Failed to remove %s: %s", path, strerror(errno));
+        }
+}
+
+void boot_manager_record_deferred(BootManager *self, const CbmOpGraph *graph)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *path = NULL;
+        autofree(char) *tmp = NULL;
+        autofree(FILE) *fp = NULL;
+        const char *prefix = NULL;
+
+        assert(self != NULL);
+        assert(graph != NULL);
+
+        prefix = self->sysconfig->prefix;
+        dir = string_printf("%s%s", prefix, CBM_STATE_DIR);
+        path = string_printf("%s/%s", dir, CBM_UPDATE_DEFERRED);
+        if (graph->deferred == 0) {
+                if (unlink(path) != 0 && errno != ENOENT) {
+                        LOG_WARNING("Failed to remove %s: %s", path, strerror(errno));
+                }
+                return;
+        }
+
+        tmp = string_printf("%s.tmp", path);
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_WARNING("Cannot record deferred work in %s: %s", path, strerror(errno));
+                return;
+        }
+        fp = fopen(tmp, "we");
+        if (!fp) {
+                LOG_WARNING("Cannot record deferred work in %s: %s", tmp, strerror(errno));
+                return;
+        }
+        /* One line per step, for whoever looks after the next window */
+        for (int i = 0; i < graph->ops->len; i++) {
+                const CbmOp *op = nc_array_get(graph->ops, i);
+
+                if (op->state != CBM_OP_DEFERRED) {
+                        continue;
+                }
+                fprintf(fp,
+                        "%s %s\n",
+                        cbm_op_kind_name(op->kind),
+                        op->kernel ? op->kernel->meta.bpath : "-");
+        }
+        if (fflush(fp) != 0 || rename(tmp, path) != 0) {
+                LOG_WARNING("Cannot record deferred work in %s: %s", path, strerror(errno));
+                (void)unlink(tmp);
+        }
+}
+
+int boot_manager_count_deferred(BootManager *self, const char *prefix)
+{
+        autofree(char) *path = NULL;
+        autofree(FILE) *fp = NULL;
+        int ret = 0;
+        int c;
+
+        assert(self != NULL);
+
+        path = string_printf("%s%s/%s", prefix ? prefix : "", CBM_STATE_DIR, CBM_UPDATE_DEFERRED);
+        fp = fopen(path, "re");
+        if (!fp) {
+                return 0;
+        }
+        while ((c = fgetc(fp)) != EOF) {
+                if (c == '\n') {
+                        ret++;
+                }
+        }
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -20,12 +20,13 @@
 #include "bootman.h"
 #include "bootman_private.h"
 #include "files.h"
+#include "iosched.h"
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
 
 static bool boot_manager_update_image(BootManager *self);
-static bool boot_manager_update_native(BootManager *self);
+static bool boot_manager_update_native(BootManager *self, uint64_t *removed);
 static bool boot_manager_update_bootloader(BootManager *self);
 
 bool boot_manager_update(BootManager *self)
@@ -34,23 +35,65 @@ bool boot_manager_update(BootManager *self)
         bool ret = false;
         autofree(char) *boot_dir = NULL;
         int did_mount = -1;
+        uint64_t start = cbm_log_now_us();
+        uint64_t inputs = 0;
+        uint64_t removed = 0;
+        const char *prefix = NULL;
+        CbmIoPolicy io_policy = { 0 };
+        CbmIoPhase io_phase;
+
+        /* Share the disk on the configured terms for the whole update */
+        cbm_io_policy_load(self->sysconfig->prefix, &io_policy);
+        cbm_io_policy_set(&io_policy);
+        io_phase = cbm_io_set_phase(CBM_IO_PHASE_UPDATE);
 
         /* Image mode is very simple, no prep/cleanup */
         if (boot_manager_is_image_mode(self)) {
                 LOG_DEBUG("Skipping to image-update");
-                return boot_manager_update_image(self);
+                cbm_log_set_phase("update-image");
+                ret = boot_manager_update_image(self);
+                goto done;
         }
 
+        cbm_log_set_phase("update-native");
+        prefix = self->sysconfig->prefix;
+        inputs = boot_manager_fingerprint_inputs(self, prefix, 0);
+        boot_manager_forget_update(self);
         did_mount = detect_and_mount_boot(self, &boot_dir);
         if (did_mount >= 0) {
                 /* Do a native update */
-                ret = boot_manager_update_native(self);
+                ret = boot_manager_update_native(self, &removed);
+                /* Release our directory fds before any umount */
+                boot_manager_drop_install_context(self);
+
+                /* Only a complete primary is worth copying */
+                if (ret) {
+                        cbm_log_set_phase("update-mirror");
+                        ret = boot_manager_update_mirrors(self);
+                }
+
+                /* Record while the boot partition is still in view. The
+                 * kernels removed by this update are accounted for, any
+                 * other change to the inputs underneath us leaves the
+                 * stamp unwritten so that the next update runs in full. */
+                if (ret && boot_manager_fingerprint_inputs(self, prefix, removed) == inputs) {
+                        inputs = boot_manager_fingerprint_inputs(self, prefix, 0);
+                        boot_manager_record_update(self, inputs);
+                }
                 if (did_mount > 0) {
                         umount_boot(boot_dir);
                 }
         }
 
-        /* Done */
+done:
+        LOG_METRIC(cbm_log_now_us() - start, 0, "Update %s", ret ? "complete" : "failed");
+        cbm_log_set_phase(NULL);
+        /* Nothing transient outlives the update */
+        boot_manager_drop_install_context(self);
+        cbm_case_cache_clear(self->case_cache);
+        cbm_arena_reset(self->scratch);
+        cbm_io_policy_set(NULL);
+        cbm_io_set_phase(io_phase);
         return ret;
 }
 
@@ -114,7 +157,7 @@ static bool boot_manager_update_image(BootManager *self)
                 LOG_SUCCESS("update_image: Bootloader update successful");
         }
 
-        if (!boot_manager_copy_initrd_freestanding(self)) {
+        if (!boot_manager_sync_initrds_freestanding(self)) {
                 LOG_ERROR("Failed to copying freestanding initrd");
                 return false;
         }
@@ -144,25 +187,116 @@ static bool boot_manager_update_image(BootManager *self)
 }
 
 /**
- * Update the target with logical view of a native installation
+ * Queue the blob copies for a kernel: the kernel itself, then the user
+ * initrd if it exists, otherwise the system initrd
+ */
+static void boot_manager_graph_add_kernel(CbmOpGraph *graph, const CbmInstallContext *ctx,
+                                          const Kernel *kernel, const char *reason,
+                                          bool optional)
+{
+        const char *initrd_source = kernel->source.user_initrd_file;
+        CbmOp *commit = NULL;
+
+        if (!initrd_source) {
+                initrd_source = kernel->source.initrd_file;
+        }
+        commit = cbm_op_graph_add_copy(graph,
+                                       kernel,
+                                       reason,
+                                       kernel->source.path,
+                                       cbm_install_context_kernel_name(ctx, kernel));
+        commit->optional = commit->stage->optional = optional;
+        if (!initrd_source) {
+                return;
+        }
+        commit =
+            cbm_op_graph_add_copy(graph, kernel, reason, initrd_source, kernel->target.initrd_path);
+        commit->optional = commit->stage->optional = optional;
+}
+
+/**
+ * Queue the bootloader entry for @kernel once its blobs are on disk
+ */
+static CbmOp *boot_manager_graph_add_entry(CbmOpGraph *graph, CbmOp *barrier,
+                                           const Kernel *kernel, const char *reason,
+                                           bool optional)
+{
+        CbmOp *entry = NULL;
+        int n_ops = graph->ops->len;
+
+        entry = cbm_op_graph_add(graph, CBM_OP_ENTRY, kernel, reason);
+        entry->optional = optional;
+        cbm_op_depends(entry, barrier);
+        for (int i = 0; i < n_ops; i++) {
+                CbmOp *op = nc_array_get(graph->ops, i);
+
+                if (op->kind == CBM_OP_COMMIT && op->kernel == kernel) {
+                        cbm_op_depends(entry, op);
+                }
+        }
+        return entry;
+}
+
+/**
+ * Make @op wait for the default to be set, or for every entry when no
+ * default will be
+ */
+static void boot_manager_graph_after_entries(CbmOp *op, CbmOp *set_default, NcArray *entries)
+{
+        if (set_default) {
+                cbm_op_depends(op, set_default);
+                return;
+        }
+        for (int i = 0; i < entries->len; i++) {
+                cbm_op_depends(op, nc_array_get(entries, i));
+        }
+}
+
+/**
+ * Update the target with logical view of a native installation.
+ *
+ * Everything to be done is worked out first and recorded in an op graph,
+ * which is then executed: blob comparisons and copies overlap, while the
+ * bootloader entries, default and removals follow in order after a single
+ * flush of the boot partition. Only the housekeeping after the default may
+ * be deferred by a deadline.
  */
-static bool boot_manager_update_native(BootManager *self)
+static bool boot_manager_update_native(BootManager *self, uint64_t *removed)
 {
         assert(self != NULL);
         autofree(KernelArray) *kernels = NULL;
         autofree(NcHashmap) *mapped_kernels = NULL;
+        autofree(CbmOpGraph) *graph = NULL;
         Kernel *running = NULL;
         NcHashmapIter map_iter = { 0 };
         const char *kernel_type = NULL;
         KernelArray *typed_kernels = NULL;
         NcArray *removals = NULL;
+        NcArray *installs = NULL;
+        NcArray *reasons = NULL;
+        NcArray *entries = NULL;
+        NcArray *initrds = NULL;
+        NcArray *keep = NULL;
+        autofree(CbmRetentionPolicy) *policy = NULL;
         Kernel *new_default = NULL;
         const SystemKernel *system_kernel = NULL;
+        const CbmInstallContext *ctx = NULL;
+        CbmOp *barrier = NULL;
+        CbmOp *set_default = NULL;
+        CbmOp *reconcile = NULL;
+        CbmOp *entry = NULL;
+        bool running_optional = false;
         bool ret = false;
         bool bootloader_updated = false;
+        int n_deferred = 0;
 
         LOG_DEBUG("Now beginning update_native");
 
+        n_deferred = boot_manager_count_deferred(self, self->sysconfig->prefix);
+        if (n_deferred > 0) {
+                LOG_INFO("Resuming %d steps deferred by the previous update", n_deferred);
+        }
+
         /* Grab the available kernels */
         kernels = boot_manager_get_kernels(self);
         if (!kernels || kernels->len == 0) {
@@ -175,11 +309,7 @@ static bool boot_manager_update_native(BootManager *self)
         /* Get them sorted */
         nc_array_qsort(kernels, kernel_compare_reverse);
 
-        running = boot_manager_get_running_kernel(self, kernels);
-        /* Try fallback comparison */
-        if (!running) {
-                running = boot_manager_get_running_kernel_fallback(self, kernels);
-        }
+        running = boot_manager_select_running(self, kernels);
 
         system_kernel = boot_manager_get_system_kernel(self);
 
@@ -206,115 +336,67 @@ static bool boot_manager_update_native(BootManager *self)
                 bootloader_updated = true;
         }
 
-        if (!boot_manager_copy_initrd_freestanding(self)) {
-                LOG_ERROR("Failed to copying freestanding initrd");
-                return false;
-        }
-
-        /* This is mostly to allow a repair-situation */
-        if (running) {
-                /* Not necessarily fatal. */
-                if (!boot_manager_install_kernel(self, running)) {
-                        LOG_ERROR("Failed to repair running kernel");
-                } else {
-                        LOG_SUCCESS("update_native: Repaired running kernel %s",
-                                    running->source.path);
-                }
+        /* Evaluated once per type below */
+        policy = cbm_retention_policy_load(self->sysconfig->prefix);
+        removals = nc_array_new();
+        installs = nc_array_new();
+        reasons = nc_array_new();
+        initrds = nc_array_new();
+        graph = cbm_op_graph_new();
+        if (!policy || !removals || !installs || !reasons || !initrds || !graph) {
+                DECLARE_OOM();
+                goto cleanup;
         }
+        graph->kernels = kernels;
 
         nc_hashmap_iter_init(mapped_kernels, &map_iter);
         while (nc_hashmap_iter_next(&map_iter, (void **)&kernel_type, (void **)&typed_kernels)) {
                 Kernel *tip = NULL;
-                Kernel *last_good = NULL;
 
                 LOG_DEBUG("update_native: Checking kernels for type %s", kernel_type);
 
                 /* Sort this kernel set highest to lowest */
                 nc_array_qsort(typed_kernels, kernel_compare_reverse);
 
-                /* Get the default kernel selection */
-                tip = boot_manager_get_default_for_type(self, typed_kernels, kernel_type);
-                if (!tip) {
-                        LOG_ERROR("Could not find default kernel for type %s, using highest relno",
-                                  kernel_type);
-                        /* Fallback to highest release number */
-                        tip = nc_array_get(typed_kernels, 0);
-                } else {
-                        LOG_INFO("update_native: Default kernel for type %s is %s",
-                                 kernel_type,
-                                 tip->source.path);
+                /* Get the default kernel selection, which must be installed */
+                tip = boot_manager_select_tip(self, typed_kernels, kernel_type);
+                if (!nc_array_add(installs, tip) || !nc_array_add(reasons, "default")) {
+                        DECLARE_OOM();
+                        goto cleanup;
                 }
 
-                /* Ensure this tip kernel is installed */
-                if (!boot_manager_install_kernel(self, tip)) {
-                        LOG_FATAL("Failed to install default-%s kernel: %s",
-                                  tip->meta.ktype,
-                                  tip->source.path);
+                /* Evaluate the retention policy for this type. Only allow garbage
+                 * collection when we know the running kernel */
+                keep = nc_array_new();
+                if (!keep) {
+                        DECLARE_OOM();
                         goto cleanup;
                 }
-                LOG_SUCCESS("update_native: Installed tip for %s: %s",
-                            kernel_type,
-                            tip->source.path);
-
-                /* Last known booting kernel, might be null. */
-                last_good = boot_manager_get_last_booted(self, typed_kernels);
-
-                /* Ensure this guy is still installed/repaired */
-                if (last_good) {
-                        if (!boot_manager_install_kernel(self, last_good)) {
-                                LOG_FATAL("Failed to install last-good kernel: %s",
-                                          last_good->source.path);
-                                goto cleanup;
-                        }
-                        LOG_SUCCESS("update_native: Installed last_good kernel (%s) (%s)",
-                                    kernel_type,
-                                    last_good->source.path);
-                } else {
-                        LOG_DEBUG("update_native: No last_good kernel for type %s", kernel_type);
+                if (!cbm_retention_plan(policy,
+                                        typed_kernels,
+                                        running,
+                                        tip,
+                                        keep,
+                                        running ? removals : NULL)) {
+                        nc_array_free(&keep, NULL);
+                        goto cleanup;
                 }
 
-                /* Only allow garbage collection when we know the running kernel */
-                if (running) {
-                        for (uint16_t i = 0; i < typed_kernels->len; i++) {
-                                Kernel *tk = nc_array_get(typed_kernels, i);
-                                LOG_DEBUG("update_native: Analyzing for type %s: %s",
-                                          kernel_type,
-                                          tk->source.path);
-                                /* Preserve running kernel */
-                                if (tk == running) {
-                                        LOG_DEBUG("update_native: Skipping running kernel");
-                                        continue;
-                                }
-                                LOG_INFO("update_native: not-running: %s", tk->source.path);
-                                /* Preserve tip */
-                                if (tip && tk == tip) {
-                                        LOG_DEBUG("update_native: Skipping default-%s: %s",
-                                                  kernel_type,
-                                                  tk->source.path);
-                                        continue;
-                                }
-                                LOG_INFO("update_native: not-default-%s: %s",
-                                         kernel_type,
-                                         tk->source.path);
-                                /* Preserve last running */
-                                if (last_good && tk == last_good) {
-                                        LOG_DEBUG("update_native: Skipping last_good kernel");
-                                        continue;
-                                }
-                                LOG_INFO("update_native: not-last-booted: %s", tk->source.path);
-                                if (!removals) {
-                                        removals = nc_array_new();
-                                }
-                                /* Schedule removal of kernel - regardless of install status */
-                                if (!nc_array_add(removals, tk)) {
-                                        DECLARE_OOM();
-                                        goto cleanup;
-                                }
-                                LOG_INFO("update_native: Proposed for deletion from %s: %s",
-                                         kernel_type,
-                                         tk->source.path);
+                /* Everything else we keep, i.e. the last known booting kernel,
+                 * must still be installed/repaired */
+                for (int i = 0; i < keep->len; i++) {
+                        Kernel *tk = nc_array_get(keep, i);
+
+                        if (tk == tip || tk == running) {
+                                continue;
+                        }
+                        if (!nc_array_add(installs, tk) || !nc_array_add(reasons, "retained")) {
+                                DECLARE_OOM();
+                                nc_array_free(&keep, NULL);
+                                goto cleanup;
                         }
                 }
+                nc_array_free(&keep, NULL);
         }
 
         /* Might return NULL */
@@ -328,54 +410,196 @@ static bool boot_manager_update_native(BootManager *self)
                 new_default = boot_manager_get_default_for_type(self, kernels, running->meta.ktype);
         }
 
-        if (new_default) {
-                if (!boot_manager_set_default_kernel(self, new_default)) {
-                        LOG_ERROR("Failed to set the default kernel to: %s",
-                                  new_default ? new_default->source.path : "<timeout mode>");
+        /* The running kernel is repaired first. This is mostly to allow a
+         * repair-situation, and is not fatal unless it is also required */
+        running_optional = running != NULL;
+        for (int i = 0; running && i < installs->len; i++) {
+                if (nc_array_get(installs, i) == running) {
+                        running_optional = false;
+                }
+        }
+
+        ctx = boot_manager_prepare_install_context(self);
+        if (!ctx) {
+                goto cleanup;
+        }
+
+        /* Blob copies, all of which may proceed concurrently */
+        if (running_optional) {
+                boot_manager_graph_add_kernel(graph, ctx, running, "running", true);
+        }
+        for (int i = 0; i < installs->len; i++) {
+                boot_manager_graph_add_kernel(graph,
+                                              ctx,
+                                              nc_array_get(installs, i),
+                                              nc_array_get(reasons, i),
+                                              false);
+        }
+
+        /* Only the freestanding initrds that changed, stale ones are reconciled */
+        self->manifest = cbm_manifest_load(self->sysconfig->prefix);
+        if (!boot_manager_reconcile_initrds_freestanding(self, ctx, initrds)) {
+                goto cleanup;
+        }
+        for (int i = 0; i < initrds->len; i++) {
+                const char *initrd_target = nc_array_get(initrds, i);
+                autofree(char) *initrd_source = NULL;
+
+                initrd_source = string_printf("%s/%s",
+                                              self->initrd_freestanding_dir,
+                                              (char *)nc_hashmap_get(self->initrd_freestanding,
+                                                                     initrd_target));
+                cbm_op_graph_add_copy(graph, NULL, "freestanding", initrd_source, initrd_target);
+        }
+
+        /* Everything is on disk before any entry refers to it */
+        barrier = cbm_op_graph_add(graph, CBM_OP_SYNC, NULL, NULL);
+        for (int i = 0; i < graph->ops->len - 1; i++) {
+                CbmOp *op = nc_array_get(graph->ops, i);
+
+                if (op->kind == CBM_OP_COMMIT) {
+                        cbm_op_depends(barrier, op);
+                }
+        }
+
+        /* Bootloader entries, in the order they were planned */
+        entries = nc_array_new();
+        if (!entries) {
+                DECLARE_OOM();
+                goto cleanup;
+        }
+        if (running_optional) {
+                entry = boot_manager_graph_add_entry(graph, barrier, running, "running", true);
+                if (!nc_array_add(entries, entry)) {
+                        DECLARE_OOM();
                         goto cleanup;
                 }
+        }
+        for (int i = 0; i < installs->len; i++) {
+                entry = boot_manager_graph_add_entry(graph,
+                                                     barrier,
+                                                     nc_array_get(installs, i),
+                                                     nc_array_get(reasons, i),
+                                                     false);
+                if (!nc_array_add(entries, entry)) {
+                        DECLARE_OOM();
+                        goto cleanup;
+                }
+        }
 
-                LOG_SUCCESS("update_native: Default kernel for %s is %s",
-                            new_default->meta.ktype,
-                            new_default->source.path);
+        /* Then the default, once every entry exists */
+        if (new_default) {
+                set_default = cbm_op_graph_add(graph, CBM_OP_DEFAULT, new_default, NULL);
+                for (int i = 0; i < entries->len; i++) {
+                        cbm_op_depends(set_default, nc_array_get(entries, i));
+                }
         } else if (running) {
                 LOG_INFO("update_native: No possible default kernel for %s", running->meta.ktype);
         } else {
                 LOG_INFO("No kernel available for any type");
         }
 
-        if (bootloader_updated) {
-                ret = true;
+        /* Housekeeping comes last and may be deferred by a deadline. It is
+         * queued cheapest first so that a tight budget gets the most done.
+         * Like garbage collection, only reconcile when we know the running
+         * kernel, as it may be booted from files no known kernel accounts for. */
+        if (running) {
+                reconcile = cbm_op_graph_add(graph, CBM_OP_RECONCILE, NULL, NULL);
+
+                /* Not fatal, just highly undesirable */
+                reconcile->optional = true;
+                reconcile->deferrable = true;
+                reconcile->estimate_us = 4 * CBM_PLAN_DELETE_US;
+                boot_manager_graph_after_entries(reconcile, set_default, entries);
+        } else {
+                LOG_DEBUG("Not reconciling the boot partition without a running kernel");
         }
 
-        if (!removals) {
-                /* We're done. */
+        /* And only then remove the older kernels */
+        for (int i = 0; i < removals->len; i++) {
+                Kernel *k = nc_array_get(removals, i);
+                CbmOp *remove = cbm_op_graph_add(graph, CBM_OP_REMOVE, k, NULL);
+
+                /* Blob, initrd and entry, the config, and queueing the rest */
+                remove->deferrable = true;
+                remove->estimate_us =
+                    3 * CBM_PLAN_DELETE_US + CBM_PLAN_CONFIG_US + CBM_PLAN_DEFER_US;
+                remove->inputs = boot_manager_kernel_input_entries(k);
+                boot_manager_graph_after_entries(remove, set_default, entries);
+        }
+        if (removals->len == 0) {
                 LOG_DEBUG("No kernel removals found");
+        }
+
+        graph->deadline_us = self->deadline_us;
+        if (!boot_manager_run_op_graph(self, ctx, graph, CBM_OP_GRAPH_MAX_WORKERS)) {
+                boot_manager_record_deferred(self, graph);
+                cbm_manifest_save(self->manifest);
                 goto cleanup;
         }
+        boot_manager_record_deferred(self, graph);
+        cbm_manifest_save(self->manifest);
+        for (int i = 0; i < graph->ops->len; i++) {
+                const CbmOp *op = nc_array_get(graph->ops, i);
 
-        /* Now remove the older kernels */
-        for (uint16_t i = 0; i < removals->len; i++) {
-                Kernel *k = nc_array_get(removals, i);
-                LOG_INFO("update_native: Garbage collecting %s: %s", k->meta.ktype, k->source.path);
-                if (!boot_manager_remove_kernel(self, k)) {
-                        LOG_ERROR("Failed to remove kernel: %s", k->source.path);
-                        ret = false;
-                        goto cleanup;
+                if (op->kind == CBM_OP_REMOVE && op->state == CBM_OP_DONE) {
+                        *removed += op->inputs;
                 }
         }
+        if (graph->deferred > 0) {
+                LOG_INFO("Deferred %d steps to the next update", graph->deferred);
+        }
+
+        /* The kernel parts worked, return status from bootloader update */
+        ret = bootloader_updated;
 
 cleanup:
-        if (!boot_manager_remove_initrd_freestanding(self)) {
-                ret = false;
-                LOG_ERROR("Failed to remove old freestanding initrd");
-        }
+        cbm_manifest_free(self->manifest);
+        self->manifest = NULL;
         if (removals) {
                 nc_array_free(&removals, NULL);
         }
+        if (installs) {
+                nc_array_free(&installs, NULL);
+        }
+        if (reasons) {
+                nc_array_free(&reasons, NULL);
+        }
+        if (entries) {
+                nc_array_free(&entries, NULL);
+        }
+        if (initrds) {
+                nc_array_free(&initrds, NULL);
+        }
         return ret;
 }
 
+Kernel *boot_manager_select_running(BootManager *self, KernelArray *kernels)
+{
+        Kernel *running = boot_manager_get_running_kernel(self, kernels);
+
+        /* Try fallback comparison */
+        if (!running) {
+                running = boot_manager_get_running_kernel_fallback(self, kernels);
+        }
+        return running;
+}
+
+Kernel *boot_manager_select_tip(BootManager *self, KernelArray *typed_kernels,
+                                const char *kernel_type)
+{
+        Kernel *tip = boot_manager_get_default_for_type(self, typed_kernels, kernel_type);
+
+        if (!tip) {
+                LOG_ERROR("Could not find default kernel for type %s, using highest relno",
+                          kernel_type);
+                /* Fallback to highest release number */
+                return nc_array_get(typed_kernels, 0);
+        }
+        LOG_INFO("update_native: Default kernel for type %s is %s", kernel_type, tip->source.path);
+        return tip;
+}
+
 /**
  * Handle the update logic for the bootloader as both methods require the
  * same calls.
@@ -0,0 +1,649 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "log.h"
+#include "nica/files.h"
+#include "sha256.h"
+
+static const char *cbm_verify_status_names[CBM_VERIFY_MAX] = {
+        [CBM_VERIFY_OK] = "ok",         [CBM_VERIFY_MISMATCH] = "mismatch",
+        [CBM_VERIFY_MISSING] = "missing", [CBM_VERIFY_ORPHAN] = "orphan",
+        [CBM_VERIFY_UNREADABLE] = "unreadable",
+};
+
+/**
+ * A file an update would leave on the boot partition
+ */
+typedef struct CbmVerifyEntry {
+        char *target;
+        char *source;          /**<NULL if generated */
+        bool required;         /**<Reported missing if absent, else checked only if present */
+        CbmVerifyStatus status;
+} CbmVerifyEntry;
+
+/**
+ * Every target copied from one source, so that the source is read once
+ */
+typedef struct CbmVerifyJob {
+        const char *source;
+        NcArray *entries; /**<CbmVerifyEntry, owned by the verifier */
+} CbmVerifyJob;
+
+typedef struct CbmVerifier {
+        BootManager *manager;
+        CbmManifest *manifest; /**<Source digests, saving a read of unchanged sources */
+        NcHashmap *expected;   /**<Target to CbmVerifyEntry */
+        NcHashmap *jobs;       /**<Source to CbmVerifyJob */
+        NcArray *orphans;      /**<Paths named as ours that nothing expects */
+        bool required;         /**<Whether files now being listed must be installed */
+
+        /* Shared with the workers */
+        pthread_mutex_t lock;
+        CbmVerifyJob **queue;
+        int n_queue;
+        int next;
+        uint64_t bytes_read;
+} CbmVerifier;
+
+static void cbm_verify_entry_free(void *v)
+{
+        CbmVerifyEntry *entry = v;
+
+        if (!entry) {
+                return;
+        }
+        free(entry->target);
+        free(entry->source);
+        free(entry);
+}
+
+static void cbm_verify_job_free(void *v)
+{
+        CbmVerifyJob *job = v;
+
+        if (!job) {
+                return;
+        }
+        nc_array_free(&job->entries, NULL);
+        free(job);
+}
+
+static void cbm_verify_item_free(void *v)
+{
+        CbmVerifyItem *item = v;
+
+        if (!item) {
+                return;
+        }
+        free(item->target);
+        free(item->source);
+        free(item);
+}
+
+/**
+ * Expect @target on the boot partition, copied from @source unless it is
+ * NULL. A target listed more than once is only checked once.
+ */
+static void cbm_verify_expect(CbmVerifier *v, const char *source, const char *target)
+{
+        CbmVerifyEntry *entry = NULL;
+        CbmVerifyJob *job = NULL;
+
+        entry = nc_hashmap_get(v->expected, target);
+        if (entry) {
+                entry->required |= v->required;
+                return;
+        }
+        entry = calloc(1, sizeof(*entry));
+        OOM_CHECK(entry);
+        entry->target = strdup(target);
+        OOM_CHECK(entry->target);
+        entry->required = v->required;
+        OOM_CHECK(nc_hashmap_put(v->expected, entry->target, entry));
+        if (!source) {
+                return;
+        }
+        entry->source = strdup(source);
+        OOM_CHECK(entry->source);
+
+        job = nc_hashmap_get(v->jobs, source);
+        if (!job) {
+                job = calloc(1, sizeof(*job));
+                OOM_CHECK(job);
+                job->source = entry->source;
+                job->entries = nc_array_new();
+                OOM_CHECK(job->entries);
+                OOM_CHECK(nc_hashmap_put(v->jobs, (void *)job->source, job));
+        }
+        OOM_CHECK(nc_array_add(job->entries, entry));
+}
+
+static void cbm_verify_bootloader_file(const char *source, const char *target, void *userdata)
+{
+        CbmVerifier *v = userdata;
+
+        cbm_verify_expect(v, source, target);
+}
+
+static bool cbm_verify_wanted(NcArray *wanted, const Kernel *kernel)
+{
+        for (int i = 0; i < wanted->len; i++) {
+                if (nc_array_get(wanted, i) == kernel) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Select the kernels an update keeps installed, as boot_manager_update_native()
+ * does: the running kernel, the default of each type and what the retention
+ * policy keeps. In image mode every kernel is installed.
+ */
+static bool cbm_verify_select(BootManager *self, KernelArray *kernels, NcArray *wanted)
+{
+        autofree(NcHashmap) *mapped_kernels = NULL;
+        autofree(CbmRetentionPolicy) *policy = NULL;
+        NcHashmapIter map_iter = { 0 };
+        const char *kernel_type = NULL;
+        KernelArray *typed_kernels = NULL;
+        Kernel *running = NULL;
+
+        if (self->image_mode) {
+                for (int i = 0; i < kernels->len; i++) {
+                        OOM_CHECK(nc_array_add(wanted, nc_array_get(kernels, i)));
+                }
+                return true;
+        }
+
+        running = boot_manager_select_running(self, kernels);
+        if (running) {
+                OOM_CHECK(nc_array_add(wanted, running));
+        }
+        mapped_kernels = boot_manager_map_kernels(self, kernels);
+        policy = cbm_retention_policy_load(self->sysconfig->prefix);
+        if (!mapped_kernels || !policy) {
+                return false;
+        }
+
+        nc_hashmap_iter_init(mapped_kernels, &map_iter);
+        while (nc_hashmap_iter_next(&map_iter, (void **)&kernel_type, (void **)&typed_kernels)) {
+                NcArray *keep = NULL;
+                Kernel *tip = NULL;
+
+                nc_array_qsort(typed_kernels, kernel_compare_reverse);
+                tip = boot_manager_select_tip(self, typed_kernels, kernel_type);
+                if (tip) {
+                        OOM_CHECK(nc_array_add(wanted, tip));
+                }
+                keep = nc_array_new();
+                OOM_CHECK(keep);
+                if (!cbm_retention_plan(policy, typed_kernels, running, tip, keep, NULL)) {
+                        nc_array_free(&keep, NULL);
+                        return false;
+                }
+                for (int i = 0; i < keep->len; i++) {
+                        OOM_CHECK(nc_array_add(wanted, nc_array_get(keep, i)));
+                }
+                nc_array_free(&keep, NULL);
+        }
+        return true;
+}
+
+/**
+ * Check every target of @job, hashing the source at most once and only if
+ * some target has the right size to match it
+ */
+static void cbm_verify_run_job(CbmVerifier *v, CbmVerifyJob *job, uint64_t *bytes)
+{
+        uint8_t source_digest[CBM_SHA256_LEN];
+        bool have_digest = false;
+        bool source_ok = true;
+        struct stat src = { 0 };
+
+        if (stat(job->source, &src) != 0) {
+                LOG_DEBUG("verify: Cannot stat %s: %s", job->source, strerror(errno));
+                source_ok = false;
+        }
+
+        for (int i = 0; i < job->entries->len; i++) {
+                CbmVerifyEntry *entry = nc_array_get(job->entries, i);
+                uint8_t digest[CBM_SHA256_LEN];
+                struct stat st = { 0 };
+
+                if (stat(entry->target, &st) != 0) {
+                        entry->status = CBM_VERIFY_MISSING;
+                        continue;
+                }
+                if (!source_ok) {
+                        entry->status = CBM_VERIFY_UNREADABLE;
+                        continue;
+                }
+                /* Shared with the source, there is nothing to compare */
+                if (st.st_dev == src.st_dev && st.st_ino == src.st_ino) {
+                        entry->status = CBM_VERIFY_OK;
+                        continue;
+                }
+                if (st.st_size != src.st_size) {
+                        entry->status = CBM_VERIFY_MISMATCH;
+                        continue;
+                }
+                if (!have_digest) {
+                        have_digest = cbm_manifest_source_digest(v->manifest,
+                                                                 job->source,
+                                                                 entry->target,
+                                                                 source_digest);
+                }
+                if (!have_digest) {
+                        if (!cbm_sha256_file_at(AT_FDCWD, job->source, false, source_digest)) {
+                                LOG_DEBUG("verify: Cannot read %s: %s",
+                                          job->source,
+                                          strerror(errno));
+                                source_ok = false;
+                                entry->status = CBM_VERIFY_UNREADABLE;
+                                continue;
+                        }
+                        *bytes += (uint64_t)src.st_size;
+                        have_digest = true;
+                }
+
+                /* What is on the disk, not what an earlier read left cached */
+                if (!cbm_sha256_file_at(AT_FDCWD, entry->target, true, digest)) {
+                        LOG_DEBUG("verify: Cannot read %s: %s", entry->target, strerror(errno));
+                        entry->status = CBM_VERIFY_UNREADABLE;
+                        continue;
+                }
+                *bytes += (uint64_t)st.st_size;
+                entry->status = memcmp(digest, source_digest, CBM_SHA256_LEN) == 0
+                                    ? CBM_VERIFY_OK
+                                    : CBM_VERIFY_MISMATCH;
+        }
+}
+
+static void *cbm_verify_worker(void *data)
+{
+        CbmVerifier *v = data;
+        uint64_t bytes = 0;
+
+        for (;;) {
+                CbmVerifyJob *job = NULL;
+
+                pthread_mutex_lock(&v->lock);
+                if (v->next < v->n_queue) {
+                        job = v->queue[v->next++];
+                }
+                pthread_mutex_unlock(&v->lock);
+                if (!job) {
+                        break;
+                }
+                cbm_verify_run_job(v, job, &bytes);
+        }
+
+        pthread_mutex_lock(&v->lock);
+        v->bytes_read += bytes;
+        pthread_mutex_unlock(&v->lock);
+        return NULL;
+}
+
+/**
+ * Hash with a fixed number of workers, so memory is bounded by their read
+ * buffers however many files there are
+ */
+static void cbm_verify_run(CbmVerifier *v)
+{
+        pthread_t threads[CBM_OP_GRAPH_MAX_WORKERS];
+        NcHashmapIter iter = { 0 };
+        const char *source = NULL;
+        CbmVerifyJob *job = NULL;
+        unsigned int started = 0;
+
+        v->queue = calloc((size_t)nc_hashmap_size(v->jobs) + 1, sizeof(CbmVerifyJob *));
+        OOM_CHECK(v->queue);
+        nc_hashmap_iter_init(v->jobs, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&source, (void **)&job)) {
+                v->queue[v->n_queue++] = job;
+        }
+
+        /* The calling thread is always a worker, the rest are best effort */
+        for (unsigned int i = 1; i < CBM_OP_GRAPH_MAX_WORKERS && (int)i < v->n_queue; i++) {
+                if (pthread_create(&threads[started], NULL, cbm_verify_worker, v) != 0) {
+                        break;
+                }
+                started++;
+        }
+        cbm_verify_worker(v);
+        for (unsigned int i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        free(v->queue);
+        v->queue = NULL;
+}
+
+static void cbm_verify_orphan(__cbm_unused__ int dirfd, const char *dir, const char *name,
+                              void *userdata)
+{
+        CbmVerifier *v = userdata;
+
+        OOM_CHECK(nc_array_add(v->orphans, string_printf("%s/%s", dir, name)));
+}
+
+static int cbm_verify_item_compare(const void *a, const void *b)
+{
+        const CbmVerifyItem *ia = *(const CbmVerifyItem **)a;
+        const CbmVerifyItem *ib = *(const CbmVerifyItem **)b;
+
+        return strcmp(ia->target, ib->target);
+}
+
+static void cbm_verify_report_add(CbmVerifyReport *report, CbmVerifyStatus status,
+                                  const char *target, const char *source)
+{
+        CbmVerifyItem *item = calloc(1, sizeof(*item));
+
+        OOM_CHECK(item);
+        item->status = status;
+        item->target = strdup(target);
+        OOM_CHECK(item->target);
+        if (source) {
+                item->source = strdup(source);
+                OOM_CHECK(item->source);
+        }
+        OOM_CHECK(nc_array_add(report->items, item));
+        report->counts[status]++;
+}
+
+static void cbm_verify_collect(CbmVerifier *v, KernelArray *kernels, const char *boot_dir,
+                               const char *dest_dir, bool is_uefi)
+{
+        BootManager *self = v->manager;
+        NcArray *wanted = NULL;
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+        void *val = NULL;
+
+        wanted = nc_array_new();
+        OOM_CHECK(wanted);
+        if (!cbm_verify_select(self, kernels, wanted)) {
+                LOG_WARNING("verify: Cannot tell which kernels should be installed");
+        }
+
+        /* Kernels an update would not install are still checked if present,
+         * nothing removes them until the running kernel is known */
+        for (int i = 0; i < kernels->len; i++) {
+                const Kernel *kernel = nc_array_get(kernels, i);
+                const char *initrd_source = kernel->source.user_initrd_file
+                                                ? kernel->source.user_initrd_file
+                                                : kernel->source.initrd_file;
+                autofree(char) *kfile = NULL;
+
+                v->required = cbm_verify_wanted(wanted, kernel);
+                kfile = string_printf("%s/%s",
+                                      dest_dir,
+                                      is_uefi ? kernel->target.path : kernel->target.legacy_path);
+                cbm_verify_expect(v, kernel->source.path, kfile);
+                if (initrd_source && kernel->target.initrd_path) {
+                        autofree(char) *initrd = NULL;
+
+                        initrd = string_printf("%s/%s", dest_dir, kernel->target.initrd_path);
+                        cbm_verify_expect(v, initrd_source, initrd);
+                }
+                if (self->bootloader->list_files) {
+                        self->bootloader->list_files(self,
+                                                     kernel,
+                                                     cbm_verify_bootloader_file,
+                                                     v);
+                }
+        }
+
+        v->required = true;
+        if (self->bootloader->list_files) {
+                self->bootloader->list_files(self, NULL, cbm_verify_bootloader_file, v);
+        }
+        if (self->initrd_freestanding) {
+                nc_hashmap_iter_init(self->initrd_freestanding, &iter);
+                while (nc_hashmap_iter_next(&iter, &key, &val)) {
+                        autofree(char) *source = NULL;
+                        autofree(char) *target = NULL;
+
+                        source = string_printf("%s/%s",
+                                               self->initrd_freestanding_dir,
+                                               (char *)val);
+                        target = string_printf("%s/%s", dest_dir, (char *)key);
+                        cbm_verify_expect(v, source, target);
+                }
+        }
+
+        /* Ours by name, but not installed for any kernel we know of */
+        (void)boot_manager_find_stale(self,
+                                      boot_dir,
+                                      dest_dir,
+                                      is_uefi,
+                                      kernels,
+                                      cbm_verify_orphan,
+                                      v);
+        nc_array_free(&wanted, NULL);
+}
+
+static void cbm_verify_fill(CbmVerifier *v, CbmVerifyReport *report)
+{
+        NcHashmapIter iter = { 0 };
+        const char *target = NULL;
+        CbmVerifyEntry *entry = NULL;
+
+        nc_hashmap_iter_init(v->expected, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&target, (void **)&entry)) {
+                /* Generated files can only be checked for presence */
+                if (!entry->source) {
+                        entry->status = nc_file_exists(entry->target) ? CBM_VERIFY_OK
+                                                                      : CBM_VERIFY_MISSING;
+                }
+                if (entry->status == CBM_VERIFY_MISSING && !entry->required) {
+                        continue;
+                }
+                cbm_verify_report_add(report, entry->status, entry->target, entry->source);
+        }
+        for (int i = 0; i < v->orphans->len; i++) {
+                cbm_verify_report_add(report, CBM_VERIFY_ORPHAN, nc_array_get(v->orphans, i), NULL);
+        }
+        nc_array_qsort(report->items, cbm_verify_item_compare);
+}
+
+CbmVerifyReport *boot_manager_verify(BootManager *self)
+{
+        assert(self != NULL);
+        autofree(KernelArray) *kernels = NULL;
+        autofree(char) *mount_dir = NULL;
+        const CbmInstallContext *ctx = NULL;
+        CbmVerifyReport *report = NULL;
+        CbmVerifier v = {.manager = self, .lock = PTHREAD_MUTEX_INITIALIZER };
+        int did_mount = 0;
+
+        if (!self->bootloader || !cbm_is_sysconfig_sane(self->sysconfig)) {
+                return NULL;
+        }
+
+        kernels = boot_manager_get_kernels(self);
+        if (!kernels || kernels->len == 0) {
+                LOG_ERROR("No kernels discovered in %s, bailing", self->kernel_dir);
+                return NULL;
+        }
+        nc_array_qsort(kernels, kernel_compare_reverse);
+
+        if (self->image_mode) {
+                autofree(char) *boot_dir = boot_manager_get_boot_dir(self);
+                OOM_CHECK_RET(boot_dir, NULL);
+                if (!nc_file_exists(boot_dir)) {
+                        LOG_ERROR("Cannot find boot directory, ensure it is mounted: %s",
+                                  boot_dir);
+                        return NULL;
+                }
+                if (!boot_manager_set_boot_dir(self, boot_dir)) {
+                        return NULL;
+                }
+        } else {
+                did_mount = detect_and_mount_boot(self, &mount_dir);
+                if (did_mount < 0) {
+                        return NULL;
+                }
+        }
+
+        ctx = boot_manager_prepare_install_context(self);
+        if (!ctx) {
+                goto cleanup;
+        }
+
+        report = calloc(1, sizeof(CbmVerifyReport));
+        if (!report) {
+                DECLARE_OOM();
+                goto cleanup;
+        }
+        report->prefix = strdup(self->sysconfig->prefix);
+        report->bootloader = self->bootloader->name;
+        report->items = nc_array_new();
+        v.expected = nc_hashmap_new_full(nc_string_hash,
+                                         nc_string_compare,
+                                         NULL,
+                                         cbm_verify_entry_free);
+        v.jobs = nc_hashmap_new_full(nc_string_hash, nc_string_compare, NULL, cbm_verify_job_free);
+        v.orphans = nc_array_new();
+        if (!report->prefix || !report->items || !v.expected || !v.jobs || !v.orphans) {
+                DECLARE_OOM();
+                abort();
+        }
+        if (!self->image_mode) {
+                v.manifest = cbm_manifest_load(self->sysconfig->prefix);
+        }
+
+        cbm_verify_collect(&v, kernels, ctx->boot_dir, ctx->dest_dir, ctx->is_uefi);
+        cbm_verify_run(&v);
+        report->bytes_read = v.bytes_read;
+        cbm_verify_fill(&v, report);
+
+        nc_hashmap_free(v.jobs);
+        nc_hashmap_free(v.expected);
+        nc_array_free(&v.orphans, free);
+        cbm_manifest_free(v.manifest);
+
+cleanup:
+        pthread_mutex_destroy(&v.lock);
+        boot_manager_drop_install_context(self);
+        if (did_mount > 0) {
+                umount_boot(mount_dir);
+        }
+        cbm_case_cache_clear(self->case_cache);
+        return report;
+}
+
+void cbm_verify_report_free(CbmVerifyReport *report)
+{
+        if (!report) {
+                return;
+        }
+        nc_array_free(&report->items, cbm_verify_item_free);
+        free(report->prefix);
+        free(report);
+}
+
+static void cbm_verify_write_json(const CbmVerifyReport *report, FILE *out)
+{
+        fputs("{\n  \"prefix\": ", out);
+        cbm_json_write_string(out, report->prefix);
+        fputs(",\n  \"bootloader\": ", out);
+        cbm_json_write_string(out, report->bootloader);
+        fprintf(out, ",\n  \"bytes_read\": %" PRIu64 ",\n  \"counts\": {", report->bytes_read);
+        for (int i = 0; i < CBM_VERIFY_MAX; i++) {
+                fprintf(out,
+                        "%s\"%s\": %d",
+                        i ? ", " : "",
+                        cbm_verify_status_names[i],
+                        report->counts[i]);
+        }
+        fputs("},\n  \"items\": [", out);
+
+        for (int i = 0; i < report->items->len; i++) {
+                const CbmVerifyItem *item = nc_array_get(report->items, i);
+
+                fputs(i ? ",\n    {\"status\": " : "\n    {\"status\": ", out);
+                cbm_json_write_string(out, cbm_verify_status_names[item->status]);
+                fputs(", \"target\": ", out);
+                cbm_json_write_string(out, item->target);
+                fputs(", \"source\": ", out);
+                cbm_json_write_string(out, item->source);
+                fputc('}', out);
+        }
+        fputs(report->items->len ? "\n  ]\n}\n" : "]\n}\n", out);
+}
+
+static void cbm_verify_write_text(const CbmVerifyReport *report, FILE *out)
+{
+        for (int i = 0; i < report->items->len; i++) {
+                const CbmVerifyItem *item = nc_array_get(report->items, i);
+
+                if (item->status == CBM_VERIFY_OK) {
+                        continue;
+                }
+                fprintf(out, "  %-10s %s", cbm_verify_status_names[item->status], item->target);
+                if (item->source) {
+                        fprintf(out, " <- %s", item->source);
+                }
+                fputc('\n', out);
+        }
+        fprintf(out,
+                "%d files checked, %" PRIu64
+                " bytes read: %d ok, %d mismatched, %d missing, %d orphaned, %d unreadable\n",
+                report->items->len,
+                report->bytes_read,
+                report->counts[CBM_VERIFY_OK],
+                report->counts[CBM_VERIFY_MISMATCH],
+                report->counts[CBM_VERIFY_MISSING],
+                report->counts[CBM_VERIFY_ORPHAN],
+                report->counts[CBM_VERIFY_UNREADABLE]);
+}
+
+bool cbm_verify_report_write(const CbmVerifyReport *report, FILE *out, bool json)
+{
+        if (!report || !out) {
+                return false;
+        }
+        if (json) {
+                cbm_verify_write_json(report, out);
+        } else {
+                cbm_verify_write_text(report, out);
+        }
+        return fflush(out) == 0 && !ferror(out);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -17,16 +17,23 @@
 #include <string.h>
 
 #include "cli.h"
+#include "util.h"
 
 static struct option default_opts[] = { { "path", required_argument, 0, 'p' },
                                         { "image", no_argument, 0, 'i' },
                                         { 0, 0, 0, 0 } };
 
-bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image)
+bool cli_args_init_full(int *argc, char ***argv, char **root, bool *forced_image,
+                        const struct option *extra_opts, cli_option_callback callback,
+                        void *userdata)
 {
+        autofree(char) *_root = NULL;
+        struct option *opts = NULL;
+        size_t n_default = sizeof(default_opts) / sizeof(default_opts[0]) - 1;
+        size_t n_extra = 0;
         int o_in = 0;
         int c;
-        char *_root = NULL;
+        bool ret = false;
 
         /* We actually want to use getopt, so rewind one for getopt */;
         --(*argv);
@@ -36,9 +43,21 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                 return false;
         }
 
+        while (extra_opts && extra_opts[n_extra].name) {
+                n_extra++;
+        }
+        opts = calloc(n_default + n_extra + 1, sizeof(struct option));
+        if (!opts) {
+                return false;
+        }
+        memcpy(opts, default_opts, n_default * sizeof(struct option));
+        if (n_extra) {
+                memcpy(opts + n_default, extra_opts, n_extra * sizeof(struct option));
+        }
+
         /* Allow setting the root */
         while (true) {
-                c = getopt_long(*argc, *argv, "ip:", default_opts, &o_in);
+                c = getopt_long(*argc, *argv, "ip:", opts, &o_in);
                 if (c == -1) {
                         break;
                 }
@@ -46,10 +65,7 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                 case 0:
                 case 'p':
                         if (optarg) {
-                                if (_root) {
-                                        free(_root);
-                                        _root = NULL;
-                                }
+                                free(_root);
                                 _root = strdup(optarg);
                         }
                         break;
@@ -60,22 +76,28 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                         break;
                 case '?':
                         goto bail;
-                        break;
                 default:
-                        abort();
+                        if (!callback || !callback(c, optarg, userdata)) {
+                                goto bail;
+                        }
+                        break;
                 }
         }
         *argc -= optind;
 
         if (_root) {
                 *root = _root;
+                _root = NULL;
         }
-        return true;
+        ret = true;
 bail:
-        if (_root) {
-                free(_root);
-        }
-        return false;
+        free(opts);
+        return ret;
+}
+
+bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image)
+{
+        return cli_args_init_full(argc, argv, root, forced_image, NULL, NULL, NULL);
 }
 
 /*
@@ -11,6 +11,7 @@
 
 #pragma once
 
+#include <getopt.h>
 #include <stdbool.h>
 
 typedef bool (*subcommand_callback)(int argc, char **argv);
@@ -26,6 +27,20 @@ typedef struct SubCommand {
 
 bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image);
 
+/**
+ * Handle one command specific option, @val being its getopt value and @arg
+ * its argument, if any. Return false to reject it.
+ */
+typedef bool (*cli_option_callback)(int val, const char *arg, void *userdata);
+
+/**
+ * As cli_default_args_init, additionally accepting the long options in
+ * @extra_opts (terminated by a zeroed entry), which are passed to @callback
+ */
+bool cli_args_init_full(int *argc, char ***argv, char **root, bool *forced_image,
+                        const struct option *extra_opts, cli_option_callback callback,
+                        void *userdata);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
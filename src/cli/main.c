@@ -18,9 +18,11 @@
 #include "nica/hashmap.h"
 #include "util.h"
 
+#include "ops/gc.h"
 #include "ops/report_booted.h"
 #include "ops/timeout.h"
 #include "ops/update.h"
+#include "ops/verify.h"
 #include "ops/kernels.h"
 
 static SubCommand cmd_update;
@@ -31,6 +33,8 @@ static SubCommand cmd_get_timeout;
 static SubCommand cmd_report_booted;
 static SubCommand cmd_list_kernels;
 static SubCommand cmd_set_kernel;
+static SubCommand cmd_gc;
+static SubCommand cmd_verify;
 static char *binary_name = NULL;
 static NcHashmap *g_commands = NULL;
 static bool explicit_help = false;
@@ -112,9 +116,18 @@ and register them with the UEFI boot manager. Older, unused kernels will\n\
 be automatically garbage collected.\n\
 \n\
 If necessary, the bootloader will be updated and/or installed during this\n\
-time.",
+time.\n\
+\n\
+With --plan nothing is changed. Instead every copy, compare, configuration\n\
+write, EFI variable write, external command and deletion the update would\n\
+perform is listed with its size, along with an estimated duration.\n\
+\n\
+With --deadline the kernels, entries and default are always updated, but\n\
+removal of old kernels and other housekeeping that would take longer than\n\
+the given number of seconds is left for the next update.",
                 .callback = cbm_command_update,
-                .usage = " [--path=/path/to/filesystem/root]",
+                .usage = " [--path=/path/to/filesystem/root] [--plan[=text|json]] "
+                         "[--deadline=seconds]",
                 .requires_root = true
         };
 
@@ -205,6 +218,45 @@ kernel for the next time the system boots.",
                 return EXIT_FAILURE;
         }
 
+        /* Finish removing garbage collected kernels */
+        cmd_gc = (SubCommand){
+                .name = "gc",
+                .blurb = "Remove leftovers of garbage collected kernels",
+                .help = "The \"update\" command removes old kernels from the boot directory\n\
+straight away, and queues their modules, headers, System.map and vmlinux\n\
+files for removal. This command removes everything queued, at idle I/O\n\
+priority, and is normally run by the accompanying systemd unit.",
+                .callback = cbm_command_gc,
+                .usage = " [--path=/path/to/filesystem/root]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_gc.name, &cmd_gc)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
+        /* Check the boot partition against what an update would install */
+        cmd_verify = (SubCommand){
+                .name = "verify",
+                .blurb = "Check the installed kernels and bootloader for damage",
+                .help = "Compare every kernel, initrd and bootloader file installed in the boot\n\
+directory with the file it was copied from, and check that each boot entry\n\
+and the bootloader configuration exist. Files that differ, are missing, or\n\
+are named as ours but belong to no known kernel are listed, and the command\n\
+fails if there are any. Nothing is changed.\n\
+\n\
+With --json every file checked is listed, with its status.",
+                .callback = cbm_command_verify,
+                .usage = " [--path=/path/to/filesystem/root] [--json]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_verify.name, &cmd_verify)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
         /* Version */
         cmd_version = (SubCommand){
                 .name = "version",
@@ -0,0 +1,64 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cli.h"
+#include "gc-queue.h"
+#include "gc.h"
+#include "iosched.h"
+#include "log.h"
+#include "util.h"
+
+bool cbm_command_gc(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(char) *realp = NULL;
+        CbmIoPolicy io_policy = { 0 };
+
+        if (!cli_default_args_init(&argc, &argv, &root, NULL)) {
+                return false;
+        }
+
+        realp = realpath(root ? root : "/", NULL);
+        if (!realp) {
+                LOG_FATAL("Path specified does not exist: %s", root);
+                return false;
+        }
+
+        /* Stay out of the way of everything else touching the disk, unless
+         * configured otherwise */
+        cbm_io_policy_load(streq(realp, "/") ? NULL : realp, &io_policy);
+        if (io_policy.io_class[CBM_IO_PHASE_REMOVE] == CBM_IO_CLASS_NONE) {
+                io_policy.io_class[CBM_IO_PHASE_REMOVE] = CBM_IO_CLASS_IDLE;
+        }
+        cbm_io_policy_set(&io_policy);
+        cbm_io_set_phase(CBM_IO_PHASE_REMOVE);
+
+        return cbm_gc_queue_drain(streq(realp, "/") ? NULL : realp);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -13,6 +13,8 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -21,13 +23,78 @@
 #include "log.h"
 #include "nica/files.h"
 
+/**
+ * How the update was asked to run
+ */
+typedef enum {
+        UPDATE_MODE_APPLY = 0, /**<Perform the update */
+        UPDATE_MODE_PLAN,      /**<Print what the update would do */
+        UPDATE_MODE_PLAN_JSON, /**<Emit what the update would do as JSON */
+} UpdateMode;
+
+typedef struct UpdateOptions {
+        UpdateMode mode;
+        uint64_t budget_us; /**<Time allowed for the update, 0 for no limit */
+} UpdateOptions;
+
+#define UPDATE_OPT_PLAN 256
+#define UPDATE_OPT_DEADLINE 257
+
+static struct option update_opts[] = { { "plan", optional_argument, 0, UPDATE_OPT_PLAN },
+                                       { "deadline", required_argument, 0, UPDATE_OPT_DEADLINE },
+                                       { 0, 0, 0, 0 } };
+
+static bool update_parse_deadline(const char *arg, UpdateOptions *opts)
+{
+        char *end = NULL;
+        unsigned long long seconds;
+
+        errno = 0;
+        seconds = strtoull(arg, &end, 10);
+        if (errno != 0 || end == arg || *end != '\0' || seconds == 0 ||
+            seconds > UINT64_MAX / 1000000) {
+                fprintf(stderr, "Invalid deadline '%s', expected a number of seconds\n", arg);
+                return false;
+        }
+        opts->budget_us = seconds * 1000000;
+        return true;
+}
+
+static bool update_parse_option(int val, const char *arg, void *userdata)
+{
+        UpdateOptions *opts = userdata;
+
+        if (val == UPDATE_OPT_DEADLINE) {
+                return update_parse_deadline(arg, opts);
+        }
+        if (val != UPDATE_OPT_PLAN) {
+                return false;
+        }
+        if (!arg || streq(arg, "text")) {
+                opts->mode = UPDATE_MODE_PLAN;
+        } else if (streq(arg, "json")) {
+                opts->mode = UPDATE_MODE_PLAN_JSON;
+        } else {
+                fprintf(stderr, "Unknown plan format '%s', expected text or json\n", arg);
+                return false;
+        }
+        return true;
+}
+
 bool cbm_command_update(int argc, char **argv)
 {
         autofree(char) *root = NULL;
         autofree(BootManager) *manager = NULL;
         bool forced_image = false;
+        UpdateOptions opts = { 0 };
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image)) {
+        if (!cli_args_init_full(&argc,
+                                &argv,
+                                &root,
+                                &forced_image,
+                                update_opts,
+                                update_parse_option,
+                                &opts)) {
                 return false;
         }
 
@@ -36,6 +103,8 @@ bool cbm_command_update(int argc, char **argv)
                 DECLARE_OOM();
                 return false;
         }
+        /* The clock starts now, probing and mounting count against it */
+        boot_manager_set_deadline(manager, opts.budget_us);
 
         if (!boot_manager_detect_kernel_dir(root)) {
                 fprintf(stderr, "No kernels detected on system to update\n");
@@ -55,24 +124,37 @@ bool cbm_command_update(int argc, char **argv)
                 } else {
                         boot_manager_set_image_mode(manager, forced_image);
                 }
-
-                /* CBM will check this again, we just needed to check for
-                 * image mode.. */
-                if (!boot_manager_set_prefix(manager, root)) {
-                        return false;
-                }
         } else {
                 boot_manager_set_image_mode(manager, forced_image);
-                /* Default to "/", bail if it doesn't work. */
-                if (!boot_manager_set_prefix(manager, "/")) {
-                        return false;
-                }
+        }
+
+        /* Most updates are triggered by unrelated changes, bail before any
+         * probing or mounting if nothing we depend on has changed */
+        if (opts.mode == UPDATE_MODE_APPLY &&
+            boot_manager_update_is_current(manager, root ? root : "/")) {
+                LOG_INFO("Nothing changed since the last update");
+                return true;
+        }
+
+        /* CBM will check this again, we just needed to check for
+         * image mode.. Default to "/", bail if it doesn't work. */
+        if (!boot_manager_set_prefix(manager, root ? root : "/")) {
+                return false;
         }
         /* Grab the available freestanding initrd */
         if (!boot_manager_enumerate_initrds_freestanding(manager)) {
                 return false;
         }
 
+        if (opts.mode != UPDATE_MODE_APPLY) {
+                autofree(CbmUpdatePlan) *plan = boot_manager_plan_update(manager);
+
+                if (!plan) {
+                        return false;
+                }
+                return cbm_update_plan_write(plan, stdout, opts.mode == UPDATE_MODE_PLAN_JSON);
+        }
+
         /* Let CBM take care of the rest */
         return boot_manager_update(manager);
 }
@@ -0,0 +1,110 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "log.h"
+#include "verify.h"
+
+#define VERIFY_OPT_JSON 256
+
+static struct option verify_opts[] = { { "json", no_argument, 0, VERIFY_OPT_JSON },
+                                       { 0, 0, 0, 0 } };
+
+static bool verify_parse_option(int val, __cbm_unused__ const char *arg, void *userdata)
+{
+        if (val != VERIFY_OPT_JSON) {
+                return false;
+        }
+        *(bool *)userdata = true;
+        return true;
+}
+
+bool cbm_command_verify(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        autofree(CbmVerifyReport) *report = NULL;
+        bool forced_image = false;
+        bool json = false;
+
+        if (!cli_args_init_full(&argc,
+                                &argv,
+                                &root,
+                                &forced_image,
+                                verify_opts,
+                                verify_parse_option,
+                                &json)) {
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        if (!boot_manager_detect_kernel_dir(root)) {
+                fprintf(stderr, "No kernels detected on system to verify\n");
+                return true;
+        }
+        if (root) {
+                autofree(char) *realp = NULL;
+
+                realp = realpath(root, NULL);
+                if (!realp) {
+                        LOG_FATAL("Path specified does not exist: %s", root);
+                        return false;
+                }
+                /* Anything not / is image mode */
+                if (!streq(realp, "/")) {
+                        boot_manager_set_image_mode(manager, true);
+                } else {
+                        boot_manager_set_image_mode(manager, forced_image);
+                }
+        } else {
+                boot_manager_set_image_mode(manager, forced_image);
+        }
+
+        if (!boot_manager_set_prefix(manager, root ? root : "/")) {
+                return false;
+        }
+        if (!boot_manager_enumerate_initrds_freestanding(manager)) {
+                return false;
+        }
+
+        report = boot_manager_verify(manager);
+        if (!report || !cbm_verify_report_write(report, stdout, json)) {
+                return false;
+        }
+        /* Anything short of a clean bill of health is a failure */
+        return report->counts[CBM_VERIFY_OK] == report->items->len;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,215 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "util.h"
+
+/**
+ * Default chunk size, enough for all the paths of a typical kernel operation
+ */
+#define CBM_ARENA_CHUNK_SIZE 8192
+
+/**
+ * Alignment of every allocation
+ */
+#define CBM_ARENA_ALIGN (sizeof(max_align_t))
+
+typedef struct CbmArenaChunk {
+        struct CbmArenaChunk *prev; /**<Previously filled chunk */
+        size_t size;                /**<Usable bytes in data */
+        size_t used;                /**<Bytes handed out from data */
+        max_align_t data[];
+} CbmArenaChunk;
+
+struct CbmArena {
+        CbmArenaChunk *head;  /**<Chunk currently being allocated from */
+        CbmArenaChunk *first; /**<Always retained, even over a reset */
+};
+
+static CbmArenaChunk *cbm_arena_chunk_new(CbmArenaChunk *prev, size_t size)
+{
+        CbmArenaChunk *chunk = NULL;
+
+        chunk = malloc(sizeof(CbmArenaChunk) + size);
+        OOM_CHECK(chunk);
+        chunk->prev = prev;
+        chunk->size = size;
+        chunk->used = 0;
+        return chunk;
+}
+
+CbmArena *cbm_arena_new(void)
+{
+        CbmArena *ret = NULL;
+
+        ret = calloc(1, sizeof(CbmArena));
+        OOM_CHECK(ret);
+        ret->first = ret->head = cbm_arena_chunk_new(NULL, CBM_ARENA_CHUNK_SIZE);
+        return ret;
+}
+
+void cbm_arena_free(CbmArena *self)
+{
+        CbmArenaChunk *chunk = NULL;
+
+        if (!self) {
+                return;
+        }
+        chunk = self->head;
+        while (chunk) {
+                CbmArenaChunk *prev = chunk->prev;
+                free(chunk);
+                chunk = prev;
+        }
+        free(self);
+}
+
+void *cbm_arena_alloc(CbmArena *self, size_t size)
+{
+        size_t aligned = (size + CBM_ARENA_ALIGN - 1) & ~(CBM_ARENA_ALIGN - 1);
+        void *ret = NULL;
+
+        if (self->head->size - self->head->used < aligned) {
+                size_t chunk_size = aligned > CBM_ARENA_CHUNK_SIZE ? aligned : CBM_ARENA_CHUNK_SIZE;
+                self->head = cbm_arena_chunk_new(self->head, chunk_size);
+        }
+
+        ret = (char *)self->head->data + self->head->used;
+        self->head->used += aligned;
+        return ret;
+}
+
+char *cbm_arena_strdup(CbmArena *self, const char *s)
+{
+        size_t len = strlen(s);
+        char *ret = cbm_arena_alloc(self, len + 1);
+
+        memcpy(ret, s, len + 1);
+        return ret;
+}
+
+char *cbm_arena_printf(CbmArena *self, const char *fmt, ...)
+{
+        CbmArenaChunk *chunk = self->head;
+        size_t avail = chunk->size - chunk->used;
+        char *ret = (char *)chunk->data + chunk->used;
+        va_list va;
+        int len;
+
+        /* Optimistically render into the free space of the current chunk */
+        va_start(va, fmt);
+        len = vsnprintf(ret, avail, fmt, va);
+        va_end(va);
+        if (len < 0) {
+                DECLARE_OOM();
+                abort();
+        }
+        if ((size_t)len < avail) {
+                char *dst = cbm_arena_alloc(self, (size_t)len + 1);
+
+                /* Alignment padding may have pushed it to a new chunk */
+                if (dst != ret) {
+                        memcpy(dst, ret, (size_t)len + 1);
+                }
+                return dst;
+        }
+
+        ret = cbm_arena_alloc(self, (size_t)len + 1);
+        va_start(va, fmt);
+        vsnprintf(ret, (size_t)len + 1, fmt, va);
+        va_end(va);
+        return ret;
+}
+
+char *cbm_arena_join(CbmArena *self, const char *first, ...)
+{
+        va_list va;
+        const char *p = NULL;
+        size_t len = 0;
+        char *ret = NULL;
+        char *c = NULL;
+
+        /* Upper bound: every component plus a separator each */
+        va_start(va, first);
+        for (p = first; p; p = va_arg(va, const char *)) {
+                len += strlen(p) + 1;
+        }
+        va_end(va);
+
+        ret = c = cbm_arena_alloc(self, len + 1);
+
+        va_start(va, first);
+        for (p = first; p; p = va_arg(va, const char *)) {
+                size_t plen = strlen(p);
+
+                if (c != ret) {
+                        /* Exactly one separator at each seam */
+                        while (plen > 0 && *p == '/') {
+                                ++p;
+                                --plen;
+                        }
+                        if (c[-1] != '/') {
+                                *c++ = '/';
+                        }
+                }
+                memcpy(c, p, plen);
+                c += plen;
+        }
+        va_end(va);
+        *c = '\0';
+
+        return ret;
+}
+
+CbmArenaMark cbm_arena_mark(CbmArena *self)
+{
+        return (CbmArenaMark){.chunk = self->head, .used = self->head->used };
+}
+
+void cbm_arena_rewind(CbmArena *self, CbmArenaMark mark)
+{
+        while (self->head != mark.chunk && self->head != self->first) {
+                CbmArenaChunk *prev = self->head->prev;
+                free(self->head);
+                self->head = prev;
+        }
+        if (self->head == mark.chunk) {
+                self->head->used = mark.used;
+        } else {
+                self->head->used = 0;
+        }
+}
+
+void cbm_arena_reset(CbmArena *self)
+{
+        cbm_arena_rewind(self, (CbmArenaMark){.chunk = self->first, .used = 0 });
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,98 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+
+#include "nica/util.h"
+
+/**
+ * A CbmArena is a bump allocator for short-lived strings, such as the
+ * paths built while installing or removing a kernel. Nothing is freed
+ * individually: callers take a mark before an operation and rewind to
+ * it afterwards, releasing everything allocated in between.
+ *
+ * Like string_printf, allocation failure results in an abort.
+ */
+typedef struct CbmArena CbmArena;
+
+/**
+ * Position within an arena, see cbm_arena_mark
+ */
+typedef struct CbmArenaMark {
+        void *chunk;
+        size_t used;
+} CbmArenaMark;
+
+/**
+ * Construct a new, empty arena
+ */
+CbmArena *cbm_arena_new(void);
+
+/**
+ * Free the arena and everything allocated from it
+ */
+void cbm_arena_free(CbmArena *self);
+
+/**
+ * Allocate @size bytes, suitably aligned for any type
+ */
+void *cbm_arena_alloc(CbmArena *self, size_t size);
+
+/**
+ * Copy @s into the arena
+ */
+char *cbm_arena_strdup(CbmArena *self, const char *s);
+
+/**
+ * printf into the arena
+ */
+char *cbm_arena_printf(CbmArena *self, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Join the NULL terminated list of path components with a single '/'
+ * between each, i.e. ("/boot/", "/EFI", "Boot", NULL) gives "/boot/EFI/Boot"
+ */
+char *cbm_arena_join(CbmArena *self, const char *first, ...) __attribute__((sentinel));
+
+/**
+ * Record the current position of the arena
+ */
+CbmArenaMark cbm_arena_mark(CbmArena *self);
+
+/**
+ * Release everything allocated since @mark was taken
+ */
+void cbm_arena_rewind(CbmArena *self, CbmArenaMark mark);
+
+/**
+ * Release everything allocated from the arena, keeping the first chunk
+ */
+void cbm_arena_reset(CbmArena *self);
+
+DEF_AUTOFREE(CbmArena, cbm_arena_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
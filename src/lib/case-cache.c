@@ -0,0 +1,310 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "case-cache.h"
+#include "nica/array.h"
+#include "nica/hashmap.h"
+#include "util.h"
+
+/**
+ * Listing of a single directory
+ */
+typedef struct CbmCaseDir {
+        NcHashmap *names; /**<Lowercased name -> on-disk name */
+        bool missing;     /**<Directory did not exist when listed */
+} CbmCaseDir;
+
+struct CbmCaseCache {
+        NcHashmap *dirs; /**<Directory path -> CbmCaseDir */
+};
+
+static void cbm_case_dir_free(void *v)
+{
+        CbmCaseDir *dir = v;
+
+        if (!dir) {
+                return;
+        }
+        nc_hashmap_free(dir->names);
+        free(dir);
+}
+
+static char *cbm_case_fold(const char *name)
+{
+        char *ret = strdup(name);
+
+        OOM_CHECK(ret);
+        for (char *c = ret; *c; c++) {
+                *c = (char)tolower((unsigned char)*c);
+        }
+        return ret;
+}
+
+/**
+ * Add @name to the listing, keeping the first spelling seen as readdir
+ * order decides the winner for nc_build_case_correct_path too.
+ */
+static void cbm_case_dir_add(CbmCaseDir *dir, const char *name)
+{
+        char *key = cbm_case_fold(name);
+        char *val = NULL;
+
+        if (nc_hashmap_contains(dir->names, key)) {
+                free(key);
+                return;
+        }
+        val = strdup(name);
+        OOM_CHECK(val);
+        if (!nc_hashmap_put(dir->names, key, val)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+static CbmCaseDir *cbm_case_cache_list(CbmCaseCache *self, const char *path)
+{
+        DIR *dirp = NULL;
+        struct dirent *ent = NULL;
+        CbmCaseDir *dir = NULL;
+        char *key = NULL;
+
+        dir = nc_hashmap_get(self->dirs, path);
+        if (dir) {
+                return dir;
+        }
+
+        dir = calloc(1, sizeof(CbmCaseDir));
+        OOM_CHECK(dir);
+        dir->names = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        OOM_CHECK(dir->names);
+
+        dirp = opendir(path);
+        if (!dirp) {
+                dir->missing = true;
+        } else {
+                while ((ent = readdir(dirp)) != NULL) {
+                        if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                                continue;
+                        }
+                        cbm_case_dir_add(dir, ent->d_name);
+                }
+                closedir(dirp);
+        }
+
+        key = strdup(path);
+        OOM_CHECK(key);
+        if (!nc_hashmap_put(self->dirs, key, dir)) {
+                DECLARE_OOM();
+                abort();
+        }
+        return dir;
+}
+
+CbmCaseCache *cbm_case_cache_new(void)
+{
+        CbmCaseCache *ret = NULL;
+
+        ret = calloc(1, sizeof(CbmCaseCache));
+        OOM_CHECK(ret);
+        ret->dirs = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, cbm_case_dir_free);
+        OOM_CHECK(ret->dirs);
+        return ret;
+}
+
+void cbm_case_cache_free(CbmCaseCache *self)
+{
+        if (!self) {
+                return;
+        }
+        nc_hashmap_free(self->dirs);
+        free(self);
+}
+
+void cbm_case_cache_clear(CbmCaseCache *self)
+{
+        if (!self) {
+                return;
+        }
+        nc_hashmap_free(self->dirs);
+        self->dirs =
+            nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, cbm_case_dir_free);
+        OOM_CHECK(self->dirs);
+}
+
+char *cbm_case_cache_build_path(CbmCaseCache *self, const char *root, ...)
+{
+        autofree(CbmCaseCache) *temp = NULL;
+        char *path = NULL;
+        const char *p = NULL;
+        bool missing = false;
+        size_t len;
+        va_list ap;
+
+        if (!root) {
+                return NULL;
+        }
+        if (!self) {
+                temp = cbm_case_cache_new();
+                self = temp;
+        }
+
+        path = strdup(root);
+        OOM_CHECK(path);
+        len = strlen(path);
+        while (len > 1 && path[len - 1] == '/') {
+                path[--len] = '\0';
+        }
+
+        va_start(ap, root);
+        while ((p = va_arg(ap, const char *)) != NULL) {
+                const char *actual = NULL;
+                char *next = NULL;
+
+                if (!missing) {
+                        CbmCaseDir *dir = cbm_case_cache_list(self, path);
+                        autofree(char) *key = cbm_case_fold(p);
+
+                        actual = dir->missing ? NULL : nc_hashmap_get(dir->names, key);
+                }
+                if (!actual) {
+                        /* Not found, use what we have for the rest */
+                        missing = true;
+                        actual = p;
+                }
+                next = string_printf("%s/%s", path, actual);
+                free(path);
+                path = next;
+        }
+        va_end(ap);
+
+        return path;
+}
+
+/**
+ * Split @path into its parent directory (returned) and @name
+ */
+static char *cbm_case_cache_split(const char *path, const char **name)
+{
+        const char *slash = strrchr(path, '/');
+        char *parent = NULL;
+
+        if (!slash || slash == path || !slash[1]) {
+                return NULL;
+        }
+        parent = strndup(path, (size_t)(slash - path));
+        OOM_CHECK(parent);
+        *name = slash + 1;
+        return parent;
+}
+
+void cbm_case_cache_note_created(CbmCaseCache *self, const char *path)
+{
+        autofree(char) *parent = NULL;
+        const char *name = NULL;
+        CbmCaseDir *dir = NULL;
+
+        if (!self || !path || !(parent = cbm_case_cache_split(path, &name))) {
+                return;
+        }
+        dir = nc_hashmap_get(self->dirs, parent);
+        if (!dir) {
+                return;
+        }
+        if (dir->missing) {
+                /* The parent now exists, so list it afresh next time */
+                cbm_case_cache_invalidate(self, parent);
+                return;
+        }
+        cbm_case_dir_add(dir, name);
+}
+
+void cbm_case_cache_note_removed(CbmCaseCache *self, const char *path)
+{
+        autofree(char) *parent = NULL;
+        autofree(char) *key = NULL;
+        const char *name = NULL;
+        CbmCaseDir *dir = NULL;
+
+        if (!self || !path || !(parent = cbm_case_cache_split(path, &name))) {
+                return;
+        }
+        dir = nc_hashmap_get(self->dirs, parent);
+        if (!dir) {
+                return;
+        }
+        key = cbm_case_fold(name);
+        nc_hashmap_remove(dir->names, key);
+}
+
+/**
+ * Whether @a is @b, or a directory above or below it
+ */
+static bool cbm_case_cache_related(const char *a, const char *b)
+{
+        size_t la = strlen(a);
+        size_t lb = strlen(b);
+        size_t l = la < lb ? la : lb;
+
+        if (strncmp(a, b, l) != 0) {
+                return false;
+        }
+        if (la == lb) {
+                return true;
+        }
+        return la < lb ? b[l] == '/' : a[l] == '/';
+}
+
+void cbm_case_cache_invalidate(CbmCaseCache *self, const char *path)
+{
+        NcArray *stale = NULL;
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+
+        if (!self || !path) {
+                return;
+        }
+
+        stale = nc_array_new();
+        OOM_CHECK(stale);
+
+        nc_hashmap_iter_init(self->dirs, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, NULL)) {
+                if (cbm_case_cache_related(key, path) && !nc_array_add(stale, key)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        for (int i = 0; i < stale->len; i++) {
+                nc_hashmap_remove(self->dirs, nc_array_get(stale, i));
+        }
+        nc_array_free(&stale, NULL);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
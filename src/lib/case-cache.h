@@ -0,0 +1,88 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+#include "nica/util.h"
+
+/**
+ * A CbmCaseCache resolves paths on case-insensitive filesystems (i.e. the
+ * vfat ESP) the same way nc_build_case_correct_path does, but reads each
+ * directory only once. Every directory visited is listed with a single
+ * readdir and kept as a map of lowercased names to on-disk names.
+ *
+ * Callers that create or remove entries must tell the cache, see
+ * cbm_case_cache_note_created, cbm_case_cache_note_removed and
+ * cbm_case_cache_invalidate.
+ */
+typedef struct CbmCaseCache CbmCaseCache;
+
+/**
+ * Construct a new, empty cache
+ */
+CbmCaseCache *cbm_case_cache_new(void);
+
+/**
+ * Free the cache and all listings
+ */
+void cbm_case_cache_free(CbmCaseCache *self);
+
+/**
+ * Drop all listings, i.e. at the end of a session
+ */
+void cbm_case_cache_clear(CbmCaseCache *self);
+
+/**
+ * Build a path from @root and the NULL terminated components following it,
+ * using the on-disk case for any component that already exists. Once a
+ * component is missing the remainder are used as given.
+ *
+ * @param self Cache to use, or NULL to skip caching
+ *
+ * @return A newly allocated path
+ */
+char *cbm_case_cache_build_path(CbmCaseCache *self, const char *root, ...)
+    __attribute__((sentinel(0)));
+
+/**
+ * Record that the file @path was created, adding it to its parent listing
+ */
+void cbm_case_cache_note_created(CbmCaseCache *self, const char *path);
+
+/**
+ * Record that the file @path was removed from its parent listing
+ */
+void cbm_case_cache_note_removed(CbmCaseCache *self, const char *path);
+
+/**
+ * Forget every listing at, above or below @path. Use this after creating
+ * or removing directories, where more than one listing may change.
+ */
+void cbm_case_cache_invalidate(CbmCaseCache *self, const char *path);
+
+DEF_AUTOFREE(CbmCaseCache, cbm_case_cache_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
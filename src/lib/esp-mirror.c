@@ -0,0 +1,582 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blkid_stub.h"
+#include "config.h"
+#include "esp-mirror.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+#include "system_stub.h"
+#include "util.h"
+
+/**
+ * GPT partition type of an EFI System Partition, as reported by blkid
+ */
+#define CBM_ESP_TYPE_GUID "c12a7328-f81f-11d2-ba4b-00a0c93ec93b"
+
+/**
+ * Identity of a file on the primary boot partition. Mirrors are usually
+ * FAT, which cannot hold the same timestamps, so the manifest records the
+ * source's rather than the copy's.
+ */
+typedef struct CbmMirrorEntry {
+        uint64_t size;
+        int64_t mtime_sec;
+        long mtime_nsec;
+} CbmMirrorEntry;
+
+/**
+ * Recorded for files whose copy failed, so they are retried and still owned
+ */
+static CbmMirrorEntry cbm_esp_mirror_unknown = { 0 };
+
+static bool cbm_esp_mirror_is_esp(const char *devnode)
+{
+        blkid_probe probe = NULL;
+        const char *value = NULL;
+        bool ret = false;
+
+        probe = cbm_blkid_new_probe_from_filename(devnode);
+        if (!probe) {
+                return false;
+        }
+        cbm_blkid_probe_enable_superblocks(probe, 1);
+        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
+        cbm_blkid_probe_enable_partitions(probe, 1);
+        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
+
+        if (cbm_blkid_do_safeprobe(probe) == 0 &&
+            cbm_blkid_probe_lookup_value(probe, "PART_ENTRY_TYPE", &value, NULL) == 0) {
+                ret = strcasecmp(value, CBM_ESP_TYPE_GUID) == 0;
+        }
+        cbm_blkid_free_probe(probe);
+        return ret;
+}
+
+/**
+ * Whether anything, such as an md array, is built on top of the block
+ * device @name
+ */
+static bool cbm_esp_mirror_has_holders(const char *class_dir, const char *name)
+{
+        autofree(char) *path = NULL;
+        struct dirent *ent = NULL;
+        bool ret = false;
+        DIR *dir = NULL;
+
+        path = string_printf("%s/%s/holders", class_dir, name);
+        dir = opendir(path);
+        if (!dir) {
+                return false;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                if (!streq(ent->d_name, ".") && !streq(ent->d_name, "..")) {
+                        ret = true;
+                        break;
+                }
+        }
+        closedir(dir);
+        return ret;
+}
+
+/**
+ * Append @entry to @list unless it, or @exclude, already names the same
+ * file
+ */
+static void cbm_esp_mirror_add(NcArray **list, const char *entry, const char *exclude)
+{
+        autofree(char) *real = realpath(entry, NULL);
+        const char *key = real ? real : entry;
+        char *dup = NULL;
+
+        if (exclude && streq(key, exclude)) {
+                LOG_DEBUG("Not mirroring %s onto itself", entry);
+                return;
+        }
+        for (int i = 0; *list && i < (*list)->len; i++) {
+                if (streq(nc_array_get(*list, i), key)) {
+                        return;
+                }
+        }
+        if (!*list) {
+                *list = nc_array_new();
+                OOM_CHECK(*list);
+        }
+        dup = strdup(key);
+        OOM_CHECK(dup);
+        OOM_CHECK(nc_array_add(*list, dup));
+}
+
+NcArray *cbm_esp_mirror_discover(const char *exclude)
+{
+        autofree(char) *class_dir = NULL;
+        autofree(char) *exclude_real = NULL;
+        struct dirent *ent = NULL;
+        NcArray *ret = NULL;
+        DIR *dir = NULL;
+
+        class_dir = string_printf("%s/class/block", cbm_system_get_sysfs_path());
+        dir = opendir(class_dir);
+        if (!dir) {
+                LOG_WARNING("Cannot list block devices in %s: %s", class_dir, strerror(errno));
+                return NULL;
+        }
+        if (exclude) {
+                exclude_real = realpath(exclude, NULL);
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *partition = NULL;
+                autofree(char) *devnode = NULL;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+                partition = string_printf("%s/%s/partition", class_dir, ent->d_name);
+                if (!nc_file_exists(partition) ||
+                    cbm_esp_mirror_has_holders(class_dir, ent->d_name)) {
+                        continue;
+                }
+                /* sysfs spells nested device nodes, such as cciss/c0d0p1, with a '!' */
+                devnode = string_printf("%s/%s", cbm_system_get_devfs_path(), ent->d_name);
+                for (char *c = devnode; *c; c++) {
+                        if (*c == '!') {
+                                *c = '/';
+                        }
+                }
+                if (!cbm_esp_mirror_is_esp(devnode)) {
+                        continue;
+                }
+                LOG_DEBUG("Discovered ESP %s", devnode);
+                cbm_esp_mirror_add(&ret, devnode, exclude_real ? exclude_real : exclude);
+        }
+        closedir(dir);
+        return ret;
+}
+
+/**
+ * What esp.conf is read into
+ */
+typedef struct CbmMirrorConf {
+        const char *primary_device;
+        char *primary;
+        NcArray *mirrors;
+} CbmMirrorConf;
+
+static bool cbm_esp_mirror_parse_line(const char *key, const char *value, void *userdata)
+{
+        CbmMirrorConf *conf = userdata;
+
+        if (!streq(key, "mirror")) {
+                errno = ENOENT;
+                return false;
+        }
+        if (*value == '\0') {
+                return false;
+        }
+        if (streq(value, CBM_ESP_MIRROR_AUTO)) {
+                NcArray *found = cbm_esp_mirror_discover(conf->primary_device);
+
+                for (int i = 0; found && i < found->len; i++) {
+                        cbm_esp_mirror_add(&conf->mirrors, nc_array_get(found, i), conf->primary);
+                }
+                nc_array_free(&found, free);
+                return true;
+        }
+        cbm_esp_mirror_add(&conf->mirrors, value, conf->primary);
+        return true;
+}
+
+NcArray *cbm_esp_mirror_load(const char *prefix, const char *primary_device)
+{
+        autofree(char) *path = NULL;
+        CbmMirrorConf conf = {.primary_device = primary_device };
+
+        if (primary_device) {
+                conf.primary = realpath(primary_device, NULL);
+        }
+        path = string_printf("%s%s/esp.conf", prefix ? prefix : "", KERNEL_CONF_DIRECTORY);
+        if (!cbm_config_read(path, cbm_esp_mirror_parse_line, &conf) && errno != ENOENT) {
+                LOG_WARNING("Unable to open %s, not mirroring: %s", path, strerror(errno));
+        }
+        free(conf.primary);
+        return conf.mirrors;
+}
+
+static bool cbm_esp_mirror_entry_equal(const CbmMirrorEntry *a, const CbmMirrorEntry *b)
+{
+        return a->size == b->size && a->mtime_sec == b->mtime_sec &&
+               a->mtime_nsec == b->mtime_nsec;
+}
+
+/**
+ * Bootloader configuration, which must never refer to a blob that is not
+ * on the mirror yet
+ */
+static bool cbm_esp_mirror_is_config(const char *rel)
+{
+        const char *ext = strrchr(rel, '.');
+
+        return ext && (strcasecmp(ext, ".conf") == 0 || strcasecmp(ext, ".cfg") == 0);
+}
+
+/**
+ * Record every regular file below the open directory @fd, which is
+ * consumed, into @files by its path relative to the tree root
+ */
+static bool cbm_esp_mirror_scan(NcHashmap *files, int fd, const char *rel)
+{
+        struct dirent *ent = NULL;
+        bool ret = true;
+        DIR *dir = NULL;
+
+        dir = fdopendir(fd);
+        if (!dir) {
+                close(fd);
+                return false;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *path = NULL;
+                CbmMirrorEntry *entry = NULL;
+                struct stat st = { 0 };
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+                if (*rel == '\0' && strncmp(ent->d_name,
+                                            CBM_ESP_MIRROR_MANIFEST,
+                                            strlen(CBM_ESP_MIRROR_MANIFEST)) == 0) {
+                        continue;
+                }
+                if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                        LOG_ERROR("Cannot stat %s: %s", ent->d_name, strerror(errno));
+                        ret = false;
+                        continue;
+                }
+                path = *rel ? string_printf("%s/%s", rel, ent->d_name) : strdup(ent->d_name);
+                OOM_CHECK(path);
+
+                if (S_ISDIR(st.st_mode)) {
+                        int child = openat(dirfd(dir),
+                                           ent->d_name,
+                                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+                        if (child < 0 || !cbm_esp_mirror_scan(files, child, path)) {
+                                ret = false;
+                        }
+                        continue;
+                }
+                if (!S_ISREG(st.st_mode)) {
+                        continue;
+                }
+                entry = calloc(1, sizeof(*entry));
+                OOM_CHECK(entry);
+                entry->size = (uint64_t)st.st_size;
+                entry->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+                entry->mtime_nsec = st.st_mtim.tv_nsec;
+                OOM_CHECK(nc_hashmap_put(files, path, entry));
+                path = NULL;
+        }
+        closedir(dir);
+        return ret;
+}
+
+/**
+ * Load the manifest of the mirror at @dirfd into @recorded. A missing or
+ * unreadable manifest owns nothing, so nothing will be removed.
+ */
+static void cbm_esp_mirror_read_manifest(int dirfd, NcHashmap *recorded)
+{
+        autofree(FILE) *fp = NULL;
+        char *line = NULL;
+        size_t n = 0;
+        ssize_t r;
+        int fd;
+
+        fd = openat(dirfd, CBM_ESP_MIRROR_MANIFEST, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return;
+        }
+        fp = fdopen(fd, "r");
+        if (!fp) {
+                close(fd);
+                return;
+        }
+        while ((r = getline(&line, &n, fp)) > 0) {
+                CbmMirrorEntry parsed = { 0 };
+                CbmMirrorEntry *entry = NULL;
+                char *path = NULL;
+                int off = 0;
+
+                if (line[r - 1] == '\n') {
+                        line[r - 1] = '\0';
+                }
+                if (sscanf(line,
+                           "%" SCNu64 " %" SCNd64 ".%ld %n",
+                           &parsed.size,
+                           &parsed.mtime_sec,
+                           &parsed.mtime_nsec,
+                           &off) != 3 ||
+                    line[off] == '\0') {
+                        continue;
+                }
+                path = strdup(line + off);
+                entry = malloc(sizeof(*entry));
+                OOM_CHECK(path);
+                OOM_CHECK(entry);
+                *entry = parsed;
+                OOM_CHECK(nc_hashmap_put(recorded, path, entry));
+        }
+        free(line);
+}
+
+static bool cbm_esp_mirror_write_manifest(int dirfd, NcHashmap *manifest)
+{
+        autofree(FILE) *fp = NULL;
+        NcHashmapIter iter = { 0 };
+        CbmMirrorEntry *entry = NULL;
+        const char *tmp = CBM_ESP_MIRROR_MANIFEST ".TmpWrite";
+        char *path = NULL;
+        int fd;
+
+        fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        fp = fdopen(fd, "w");
+        if (!fp) {
+                close(fd);
+                return false;
+        }
+        nc_hashmap_iter_init(manifest, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&path, (void **)&entry)) {
+                fprintf(fp,
+                        "%" PRIu64 " %" PRId64 ".%09ld %s\n",
+                        entry->size,
+                        entry->mtime_sec,
+                        entry->mtime_nsec,
+                        path);
+        }
+        if (fflush(fp) != 0) {
+                (void)unlinkat(dirfd, tmp, 0);
+                return false;
+        }
+        /* vfat protect */
+        cbm_sync();
+        if (renameat(dirfd, tmp, dirfd, CBM_ESP_MIRROR_MANIFEST) != 0) {
+                (void)unlinkat(dirfd, tmp, 0);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Create the directories leading up to @rel below @dirfd
+ */
+static bool cbm_esp_mirror_mkdir_parents(int dirfd, const char *rel)
+{
+        autofree(char) *path = strdup(rel);
+
+        OOM_CHECK(path);
+        for (char *s = strchr(path, '/'); s; s = strchr(s + 1, '/')) {
+                *s = '\0';
+                if (mkdirat(dirfd, path, 00755) != 0 && errno != EEXIST) {
+                        return false;
+                }
+                *s = '/';
+        }
+        return true;
+}
+
+/**
+ * Remove the directories leading up to @rel below @dirfd, deepest first,
+ * for as long as they are empty
+ */
+static void cbm_esp_mirror_prune_parents(int dirfd, const char *rel)
+{
+        autofree(char) *path = strdup(rel);
+        char *s = NULL;
+
+        OOM_CHECK(path);
+        while ((s = strrchr(path, '/')) != NULL) {
+                *s = '\0';
+                if (unlinkat(dirfd, path, AT_REMOVEDIR) != 0) {
+                        break;
+                }
+        }
+}
+
+bool cbm_esp_mirror_sync(const char *primary, const char *mirror)
+{
+        NcHashmap *files = NULL;
+        NcHashmap *recorded = NULL;
+        NcHashmap *manifest = NULL;
+        NcArray *staged = NULL;
+        NcHashmapIter iter = { 0 };
+        CbmMirrorEntry *entry = NULL;
+        char *rel = NULL;
+        int src_fd = -1;
+        int dst_fd = -1;
+        int copied = 0;
+        int removed = 0;
+        bool ret = true;
+
+        src_fd = open(primary, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (src_fd < 0) {
+                LOG_ERROR("Cannot open boot directory %s: %s", primary, strerror(errno));
+                return false;
+        }
+        dst_fd = open(mirror, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dst_fd < 0) {
+                LOG_ERROR("Cannot open mirror %s: %s", mirror, strerror(errno));
+                close(src_fd);
+                return false;
+        }
+
+        files = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        recorded = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        manifest = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        staged = nc_array_new();
+        OOM_CHECK(files);
+        OOM_CHECK(recorded);
+        OOM_CHECK(manifest);
+        OOM_CHECK(staged);
+
+        /* Never remove anything on the strength of a partial listing */
+        if (!cbm_esp_mirror_scan(files, src_fd, "")) {
+                LOG_ERROR("Cannot list %s, not mirroring it to %s", primary, mirror);
+                ret = false;
+                goto out;
+        }
+        cbm_esp_mirror_read_manifest(dst_fd, recorded);
+
+        /* Stage whatever the mirror is missing, or has an older copy of */
+        nc_hashmap_iter_init(files, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&rel, (void **)&entry)) {
+                CbmMirrorEntry *old = nc_hashmap_get(recorded, rel);
+                autofree(char) *src = NULL;
+                struct stat st = { 0 };
+
+                if (old && cbm_esp_mirror_entry_equal(old, entry) &&
+                    fstatat(dst_fd, rel, &st, 0) == 0 && (uint64_t)st.st_size == entry->size) {
+                        OOM_CHECK(nc_hashmap_put(manifest, rel, entry));
+                        continue;
+                }
+                src = string_printf("%s/%s", primary, rel);
+                if (!cbm_esp_mirror_mkdir_parents(dst_fd, rel) ||
+                    !copy_file_stage_at(src, dst_fd, rel, 00644)) {
+                        LOG_ERROR("Cannot copy %s to %s: %s", src, mirror, strerror(errno));
+                        ret = false;
+                        if (old) {
+                                OOM_CHECK(nc_hashmap_put(manifest, rel, &cbm_esp_mirror_unknown));
+                        }
+                        continue;
+                }
+                OOM_CHECK(nc_array_add(staged, rel));
+        }
+
+        /* Blobs first, then the configuration that refers to them */
+        for (int pass = 0; pass < 2; pass++) {
+                for (int i = 0; i < staged->len; i++) {
+                        rel = nc_array_get(staged, i);
+                        if (cbm_esp_mirror_is_config(rel) != (pass == 1)) {
+                                continue;
+                        }
+                        if (!copy_file_commit_at(dst_fd, rel)) {
+                                LOG_ERROR("Cannot replace %s on %s: %s",
+                                          rel,
+                                          mirror,
+                                          strerror(errno));
+                                copy_file_abort_at(dst_fd, rel);
+                                ret = false;
+                                if (nc_hashmap_contains(recorded, rel)) {
+                                        OOM_CHECK(nc_hashmap_put(manifest,
+                                                                 rel,
+                                                                 &cbm_esp_mirror_unknown));
+                                }
+                                continue;
+                        }
+                        OOM_CHECK(nc_hashmap_put(manifest, rel, nc_hashmap_get(files, rel)));
+                        ++copied;
+                }
+        }
+        if (copied) {
+                cbm_sync();
+        }
+
+        /* Then the reverse: configuration first, so nothing points at a removed blob */
+        for (int pass = 0; pass < 2; pass++) {
+                nc_hashmap_iter_init(recorded, &iter);
+                while (nc_hashmap_iter_next(&iter, (void **)&rel, (void **)&entry)) {
+                        if (cbm_esp_mirror_is_config(rel) != (pass == 0) ||
+                            nc_hashmap_contains(files, rel)) {
+                                continue;
+                        }
+                        if (unlinkat(dst_fd, rel, 0) != 0 && errno != ENOENT) {
+                                LOG_ERROR("Cannot remove %s from %s: %s",
+                                          rel,
+                                          mirror,
+                                          strerror(errno));
+                                ret = false;
+                                OOM_CHECK(nc_hashmap_put(manifest, rel, entry));
+                                continue;
+                        }
+                        cbm_esp_mirror_prune_parents(dst_fd, rel);
+                        ++removed;
+                }
+        }
+
+        if (copied || removed || !ret) {
+                if (!cbm_esp_mirror_write_manifest(dst_fd, manifest)) {
+                        LOG_ERROR("Cannot record the manifest of %s: %s", mirror, strerror(errno));
+                        ret = false;
+                }
+                cbm_sync();
+        }
+        LOG_INFO("Mirrored %s to %s: %d copied, %d removed", primary, mirror, copied, removed);
+
+out:
+        nc_array_free(&staged, NULL);
+        nc_hashmap_free(manifest);
+        nc_hashmap_free(recorded);
+        nc_hashmap_free(files);
+        close(dst_fd);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,74 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+#include "nica/array.h"
+
+/**
+ * Records, at the root of each mirror, what we copied there and the identity
+ * of its source on the primary boot partition
+ */
+#define CBM_ESP_MIRROR_MANIFEST ".clr-boot-manager.mirror"
+
+/**
+ * Configured in place of a device to mirror onto every other ESP found
+ */
+#define CBM_ESP_MIRROR_AUTO "auto"
+
+/**
+ * Load the mirrors configured for @prefix in KERNEL_CONF_DIRECTORY/esp.conf,
+ * one "mirror = <device or directory>" per line. "auto" expands to every
+ * partition discovered by cbm_esp_mirror_discover.
+ *
+ * @param primary_device The boot device being updated, never a mirror
+ *
+ * @return A newly allocated array of strings, or NULL if there are none
+ */
+NcArray *cbm_esp_mirror_load(const char *prefix, const char *primary_device);
+
+/**
+ * Find every partition typed as an EFI System Partition, other than
+ * @exclude. Members of a RAID or any other stacked device are skipped, the
+ * device built on top of them already mirrors itself.
+ *
+ * @return A newly allocated array of device nodes, or NULL if there are none
+ */
+NcArray *cbm_esp_mirror_discover(const char *exclude);
+
+/**
+ * Bring the tree at @mirror in step with @primary.
+ *
+ * Only files that are new or changed since the manifest on @mirror was last
+ * written are copied, and only files listed in that manifest are ever
+ * removed. Bootloader configuration is installed after, and removed before,
+ * everything else.
+ *
+ * @return true if @mirror now matches @primary
+ */
+bool cbm_esp_mirror_sync(const char *primary, const char *mirror);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
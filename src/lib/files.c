@@ -19,10 +19,13 @@
 #include <glob.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
@@ -31,11 +34,25 @@
 
 #include "blkid_stub.h"
 #include "files.h"
+#include "iosched.h"
 #include "log.h"
 #include "nica/files.h"
+#include "sha256.h"
 #include "system_stub.h"
 #include "util.h"
 
+/**
+ * Share all extents of one file with another, see ioctl_ficlone(2)
+ */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/**
+ * Chunk size for hashed copies when the I/O policy does not set one
+ */
+#define CBM_COPY_HASH_CHUNK (1024 * 1024)
+
 /**
  * Legacy boot bit, i.e. partition flag on a GPT disk
  */
@@ -47,6 +64,17 @@
  */
 static bool cbm_should_sync = true;
 
+/**
+ * Whether copies may share the data of their source, disabled in testing to
+ * exercise the byte copy paths
+ */
+static bool cbm_should_share = true;
+
+/**
+ * Test only: make every verified copy read back differently
+ */
+static bool cbm_readback_fault = false;
+
 void cbm_sync(void)
 {
         if (cbm_should_sync) {
@@ -55,15 +83,34 @@ void cbm_sync(void)
 }
 
 bool cbm_files_match(const char *p1, const char *p2)
+{
+        return cbm_files_match_at(p1, AT_FDCWD, p2);
+}
+
+bool cbm_files_match_at(const char *p1, int dirfd, const char *p2)
+{
+        return cbm_files_match_hashed_at(p1, dirfd, p2, NULL);
+}
+
+bool cbm_files_match_hashed_at(const char *p1, int dirfd, const char *p2,
+                               uint8_t digest[CBM_SHA256_LEN])
 {
         autofree(CbmMappedFile) *m1 = CBM_MAPPED_FILE_INIT;
         autofree(CbmMappedFile) *m2 = CBM_MAPPED_FILE_INIT;
+        struct stat s1 = { 0 };
+        struct stat s2 = { 0 };
+
+        /* A hardlinked install is the source, no need to compare them */
+        if (stat(p1, &s1) == 0 && fstatat(dirfd, p2, &s2, 0) == 0 && s1.st_dev == s2.st_dev &&
+            s1.st_ino == s2.st_ino) {
+                return !digest || cbm_sha256_file_at(AT_FDCWD, p1, false, digest);
+        }
 
         if (!cbm_mapped_file_open(p1, m1)) {
                 return false;
         }
 
-        if (!cbm_mapped_file_open(p2, m2)) {
+        if (!cbm_mapped_file_openat(dirfd, p2, m2)) {
                 return false;
         }
 
@@ -73,10 +120,18 @@ bool cbm_files_match(const char *p1, const char *p2)
         }
 
         /* Compare both buffers */
-        if (memcmp(m1->buffer, m2->buffer, m1->length) == 0) {
-                return true;
+        if (memcmp(m1->buffer, m2->buffer, m1->length) != 0) {
+                return false;
         }
-        return false;
+        /* Still mapped, so hashing it is no second read */
+        if (digest) {
+                CbmSha256 ctx;
+
+                cbm_sha256_init(&ctx);
+                cbm_sha256_update(&ctx, m1->buffer, m1->length);
+                cbm_sha256_final(&ctx, digest);
+        }
+        return true;
 }
 
 char *get_boot_device()
@@ -344,7 +399,13 @@ end:
 
 bool file_get_text(const char *path, char **out_buf)
 {
-        autofree(CbmMappedFile) *mapped_file = CBM_MAPPED_FILE_INIT;
+        struct stat st = { 0 };
+        autofree(char) *buffer = NULL;
+        size_t length = 0;
+        size_t offset = 0;
+        ssize_t r;
+        int fd = -1;
+        bool ret = false;
 
         if (!out_buf) {
                 return false;
@@ -352,18 +413,159 @@ bool file_get_text(const char *path, char **out_buf)
 
         *out_buf = NULL;
 
-        if (!cbm_mapped_file_open(path, mapped_file)) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
                 return false;
         }
+        if (fstat(fd, &st) != 0) {
+                goto end;
+        }
+        length = (size_t)st.st_size;
 
-        *out_buf = strdup(mapped_file->buffer);
-        if (!*out_buf) {
+        /* Read straight into the result, no intermediate mapping */
+        buffer = malloc(length + 1);
+        if (!buffer) {
+                goto end;
+        }
+        while (offset < length) {
+                r = pread(fd, buffer + offset, length - offset, (off_t)offset);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        goto end;
+                }
+                offset += (size_t)r;
+        }
+        buffer[length] = '\0';
+
+        *out_buf = buffer;
+        buffer = NULL;
+        ret = true;
+end:
+        close(fd);
+        return ret;
+}
+
+bool cbm_file_content_equals(const char *path, const char *buf, size_t len)
+{
+        struct stat st = { 0 };
+        char chunk[4096];
+        size_t offset = 0;
+        ssize_t r;
+        int fd = -1;
+        bool ret = false;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
                 return false;
         }
-        return true;
+
+        /* Different sizes can never match, don't bother reading */
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size != len) {
+                goto end;
+        }
+
+        while (offset < len) {
+                size_t want = len - offset < sizeof(chunk) ? len - offset : sizeof(chunk);
+
+                r = pread(fd, chunk, want, (off_t)offset);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        goto end;
+                }
+                if (memcmp(chunk, buf + offset, (size_t)r) != 0) {
+                        goto end;
+                }
+                offset += (size_t)r;
+        }
+        ret = true;
+end:
+        close(fd);
+        return ret;
 }
 
 bool copy_file(const char *src, const char *target, mode_t mode)
+{
+        return copy_file_at(src, AT_FDCWD, target, mode);
+}
+
+/**
+ * Reserve @size bytes for the new file @fd before writing it, so that the
+ * filesystem can pick one contiguous run up front rather than growing it
+ * piecemeal. On vfat that is a single cluster chain and one pass over the
+ * FAT. The size is kept, so nothing is written twice.
+ *
+ * @return false only if the space is not there, on ENOSPC and friends
+ */
+static bool copy_file_preallocate(int fd, off_t size)
+{
+        if (size <= 0 || fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+                return true;
+        }
+        return errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL;
+}
+
+/**
+ * Round @chunk to whole allocation units of @fd, which on vfat are clusters
+ */
+static size_t copy_file_align_chunk(int fd, size_t chunk)
+{
+        struct stat st = { 0 };
+        size_t unit;
+
+        if (fstat(fd, &st) != 0 || st.st_blksize <= 0) {
+                return chunk;
+        }
+        unit = (size_t)st.st_blksize;
+        if (chunk < unit) {
+                return unit;
+        }
+        return chunk - chunk % unit;
+}
+
+/**
+ * Copy @sz bytes in chunks, throttled to the configured rate. Each chunk is
+ * handed to writeback as soon as it is written, and the previous one waited
+ * on, so a large copy never builds up a backlog of dirty pages for the next
+ * sync to flush all at once.
+ */
+static bool copy_file_paced(int sfd, int dfd, off_t sz, size_t chunk)
+{
+        off_t offset = 0;
+        off_t prev = 0;
+        ssize_t written;
+
+        while (offset < sz) {
+                size_t n = (size_t)(sz - offset) < chunk ? (size_t)(sz - offset) : chunk;
+
+                cbm_io_throttle(n);
+                written = sendfile(dfd, sfd, NULL, n);
+                if (written < 0) {
+                        return false;
+                }
+                if (written == 0) {
+                        errno = EIO;
+                        return false;
+                }
+                (void)sync_file_range(dfd, offset, written, SYNC_FILE_RANGE_WRITE);
+                if (offset > prev) {
+                        (void)sync_file_range(dfd,
+                                              prev,
+                                              offset - prev,
+                                              SYNC_FILE_RANGE_WAIT_BEFORE |
+                                                  SYNC_FILE_RANGE_WRITE |
+                                                  SYNC_FILE_RANGE_WAIT_AFTER);
+                        prev = offset;
+                }
+                offset += written;
+        }
+        return true;
+}
+
+bool copy_file_at(const char *src, int dirfd, const char *target, mode_t mode)
 {
         struct stat sst = { 0 };
         ssize_t sz;
@@ -371,16 +573,23 @@ bool copy_file(const char *src, const char *target, mode_t mode)
         int dfd = -1;
         bool ret = false;
         ssize_t written;
+        size_t chunk = cbm_io_chunk_size();
 
-        sfd = open(src, O_RDONLY);
+        sfd = open(src, O_RDONLY | O_CLOEXEC);
         if (sfd < 0) {
                 return false;
         }
-        dfd = open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
+        dfd = openat(dirfd, target, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, mode);
         if (dfd < 0) {
                 goto end;
         }
-        if (fstat(sfd, &sst) != 0) {
+        if (fstat(sfd, &sst) != 0 || !copy_file_preallocate(dfd, sst.st_size)) {
+                goto end;
+        }
+
+        if (chunk > 0) {
+                chunk = copy_file_align_chunk(dfd, chunk);
+                ret = copy_file_paced(sfd, dfd, sst.st_size, chunk);
                 goto end;
         }
 
@@ -397,31 +606,98 @@ bool copy_file(const char *src, const char *target, mode_t mode)
         ret = true;
 
 end:
-        if (sfd > 0) {
+        if (sfd >= 0) {
                 close(sfd);
         }
-        if (dfd > 0) {
+        if (dfd >= 0) {
                 close(dfd);
         }
         return ret;
 }
 
+/**
+ * Whether @target, relative to @dirfd, would be created on the filesystem
+ * holding the file described by @st
+ */
+static bool copy_file_same_fs_at(const struct stat *st, int dirfd, const char *target)
+{
+        autofree(char) *parent = strdup(target);
+        struct stat pst = { 0 };
+        char *slash = NULL;
+
+        if (!parent) {
+                return false;
+        }
+        slash = strrchr(parent, '/');
+        if (slash) {
+                slash[slash == parent ? 1 : 0] = '\0';
+        }
+        if (fstatat(dirfd, slash ? parent : ".", &pst, 0) != 0) {
+                return false;
+        }
+        return pst.st_dev == st->st_dev;
+}
+
+bool copy_file_share_at(const char *src, int dirfd, const char *target, mode_t mode)
+{
+        struct stat st = { 0 };
+        bool cloned = false;
+        int sfd = -1;
+        int dfd = -1;
+
+        if (!cbm_should_share || stat(src, &st) != 0 || !S_ISREG(st.st_mode) ||
+            !copy_file_same_fs_at(&st, dirfd, target)) {
+                return false;
+        }
+        (void)unlinkat(dirfd, target, 0);
+
+        /* A reflink is a file of its own that happens to share the blocks */
+        sfd = open(src, O_RDONLY | O_CLOEXEC);
+        if (sfd >= 0) {
+                dfd = openat(dirfd, target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+                if (dfd >= 0) {
+                        cloned = ioctl(dfd, FICLONE, sfd) == 0;
+                        close(dfd);
+                        if (!cloned) {
+                                (void)unlinkat(dirfd, target, 0);
+                        }
+                }
+                close(sfd);
+        }
+        if (cloned) {
+                return true;
+        }
+
+        /* Otherwise ext4 and friends can still point a second name at it,
+         * but that shares the mode too and so must already be the right one */
+        if ((st.st_mode & 07777) != (mode & 07777)) {
+                return false;
+        }
+        return linkat(AT_FDCWD, src, dirfd, target, AT_SYMLINK_FOLLOW) == 0;
+}
+
 bool copy_file_atomic(const char *src, const char *target, mode_t mode)
+{
+        return copy_file_atomic_at(src, AT_FDCWD, target, mode);
+}
+
+bool copy_file_atomic_at(const char *src, int dirfd, const char *target, mode_t mode)
 {
         autofree(char) *new_name = NULL;
         struct stat st = { 0 };
 
         new_name = string_printf("%s.TmpWrite", target);
 
-        if (!copy_file(src, new_name, mode)) {
-                (void)unlink(new_name);
+        if (!copy_file_share_at(src, dirfd, new_name, mode) &&
+            !copy_file_at(src, dirfd, new_name, mode)) {
+                (void)unlinkat(dirfd, new_name, 0);
                 return false;
         }
         cbm_sync();
 
         /* Delete target if needed  */
-        if (stat(target, &st) == 0) {
-                if (!S_ISDIR(st.st_mode) && unlink(target) != 0) {
+        if (fstatat(dirfd, target, &st, 0) == 0) {
+                if (!S_ISDIR(st.st_mode) && unlinkat(dirfd, target, 0) != 0) {
                         return false;
                 }
                 cbm_sync();
@@ -429,7 +705,7 @@ bool copy_file_atomic(const char *src, const char *target, mode_t mode)
                 errno = 0;
         }
 
-        if (rename(new_name, target) != 0) {
+        if (renameat(dirfd, new_name, dirfd, target) != 0) {
                 return false;
         }
         /* vfat protect */
@@ -438,6 +714,304 @@ bool copy_file_atomic(const char *src, const char *target, mode_t mode)
         return true;
 }
 
+bool copy_file_stage_at(const char *src, int dirfd, const char *target, mode_t mode)
+{
+        autofree(char) *new_name = NULL;
+        int fd = -1;
+        bool ret = false;
+
+        new_name = string_printf("%s.TmpWrite", target);
+
+        /* Nothing was written, the barrier after commit covers the new name */
+        if (copy_file_share_at(src, dirfd, new_name, mode)) {
+                return true;
+        }
+        if (!copy_file_at(src, dirfd, new_name, mode)) {
+                goto fail;
+        }
+        if (!cbm_should_sync) {
+                return true;
+        }
+        fd = openat(dirfd, new_name, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+                goto fail;
+        }
+        ret = fdatasync(fd) == 0;
+        close(fd);
+        if (ret) {
+                return true;
+        }
+fail:
+        (void)unlinkat(dirfd, new_name, 0);
+        return false;
+}
+
+/**
+ * Write all of @buf to @fd
+ */
+static bool copy_file_write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t r = write(fd, buf, len);
+
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        return false;
+                }
+                buf += r;
+                len -= (size_t)r;
+        }
+        return true;
+}
+
+bool copy_file_stage_hashed_at(const char *src, int dirfd, const char *target, mode_t mode,
+                               uint8_t digest[CBM_SHA256_LEN])
+{
+        autofree(char) *new_name = NULL;
+        uint8_t check[CBM_SHA256_LEN];
+        struct stat st = { 0 };
+        CbmSha256 ctx;
+        size_t chunk = cbm_io_chunk_size();
+        bool paced = chunk > 0;
+        char *buf = NULL;
+        off_t offset = 0;
+        int sfd = -1;
+        int dfd = -1;
+        int saved_errno;
+        ssize_t r;
+
+        new_name = string_printf("%s.TmpWrite", target);
+
+        /* Nothing written means nothing to verify, only the hash to record */
+        if (copy_file_share_at(src, dirfd, new_name, mode)) {
+                if (cbm_sha256_file_at(AT_FDCWD, src, false, digest)) {
+                        return true;
+                }
+                goto fail;
+        }
+
+        sfd = open(src, O_RDONLY | O_CLOEXEC);
+        if (sfd < 0 || fstat(sfd, &st) != 0) {
+                goto fail;
+        }
+        dfd = openat(dirfd, new_name, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, mode);
+        if (dfd < 0 || !copy_file_preallocate(dfd, st.st_size)) {
+                goto fail;
+        }
+        chunk = copy_file_align_chunk(dfd, paced ? chunk : CBM_COPY_HASH_CHUNK);
+        buf = malloc(chunk);
+        if (!buf) {
+                goto fail;
+        }
+        (void)posix_fadvise(sfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        /* Hash the stream as it is copied, so the source is only read once */
+        cbm_sha256_init(&ctx);
+        for (;;) {
+                r = read(sfd, buf, chunk);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r < 0) {
+                        goto fail;
+                }
+                if (r == 0) {
+                        break;
+                }
+                cbm_sha256_update(&ctx, buf, (size_t)r);
+                cbm_io_throttle((size_t)r);
+                if (!copy_file_write_all(dfd, buf, (size_t)r)) {
+                        goto fail;
+                }
+                if (paced) {
+                        (void)sync_file_range(dfd, offset, r, SYNC_FILE_RANGE_WRITE);
+                }
+                offset += r;
+        }
+        cbm_sha256_final(&ctx, digest);
+        if (cbm_should_sync && fdatasync(dfd) != 0) {
+                goto fail;
+        }
+        close(dfd);
+        dfd = -1;
+
+        /* Read back what reached the disk, not the pages we just wrote */
+        if (!cbm_sha256_file_at(dirfd, new_name, true, check)) {
+                goto fail;
+        }
+        if (cbm_readback_fault) {
+                check[0] ^= 0xff;
+        }
+        if (memcmp(check, digest, CBM_SHA256_LEN) != 0) {
+                LOG_ERROR("Copy of %s to %s does not read back as written", src, target);
+                errno = EIO;
+                goto fail;
+        }
+        free(buf);
+        close(sfd);
+        return true;
+
+fail:
+        saved_errno = errno;
+        free(buf);
+        if (sfd >= 0) {
+                close(sfd);
+        }
+        if (dfd >= 0) {
+                close(dfd);
+        }
+        (void)unlinkat(dirfd, new_name, 0);
+        errno = saved_errno;
+        return false;
+}
+
+bool copy_file_commit_at(int dirfd, const char *target)
+{
+        autofree(char) *new_name = NULL;
+        struct stat st = { 0 };
+
+        new_name = string_printf("%s.TmpWrite", target);
+
+        /* Same replacement as copy_file_atomic_at. The staged copy was
+         * flushed by its stage and the caller syncs once after the last
+         * commit, but the unlink must still reach vfat before the rename */
+        if (fstatat(dirfd, target, &st, 0) == 0 && !S_ISDIR(st.st_mode)) {
+                if (unlinkat(dirfd, target, 0) != 0) {
+                        return false;
+                }
+                cbm_sync();
+        }
+        return renameat(dirfd, new_name, dirfd, target) == 0;
+}
+
+void copy_file_abort_at(int dirfd, const char *target)
+{
+        autofree(char) *new_name = NULL;
+
+        new_name = string_printf("%s.TmpWrite", target);
+        (void)unlinkat(dirfd, new_name, 0);
+}
+
+/**
+ * Write @len bytes of @buf to the temporary name for @dst, paced like any
+ * other copy, and flush it
+ */
+static bool copy_file_write_temp(const char *buf, size_t len, const char *dst, mode_t mode)
+{
+        autofree(char) *new_name = string_printf("%s.TmpWrite", dst);
+        size_t chunk = cbm_io_chunk_size();
+        size_t offset = 0;
+        bool ret = false;
+        int fd;
+
+        fd = open(new_name, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, mode);
+        if (fd < 0) {
+                return false;
+        }
+        if (!copy_file_preallocate(fd, (off_t)len)) {
+                goto end;
+        }
+        if (chunk) {
+                chunk = copy_file_align_chunk(fd, chunk);
+        }
+        while (offset < len) {
+                size_t n = len - offset;
+                ssize_t r;
+
+                if (chunk && n > chunk) {
+                        n = chunk;
+                }
+                cbm_io_throttle(n);
+                r = write(fd, buf + offset, n);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        goto end;
+                }
+                offset += (size_t)r;
+        }
+        ret = !cbm_should_sync || fdatasync(fd) == 0;
+end:
+        close(fd);
+        if (!ret) {
+                (void)unlink(new_name);
+        }
+        return ret;
+}
+
+bool copy_file_fanout(const char *src, const char *const *dsts, size_t n_dsts, mode_t mode,
+                      bool *copied)
+{
+        autofree(CbmMappedFile) *source = CBM_MAPPED_FILE_INIT;
+        bool *staged = NULL;
+        bool ret = true;
+
+        if (!cbm_mapped_file_open(src, source)) {
+                return false;
+        }
+        staged = calloc(n_dsts ? n_dsts : 1, sizeof(bool));
+        OOM_CHECK_RET(staged, false);
+
+        /* One pass over the source: compare each destination, staging a
+         * new copy of those that differ */
+        for (size_t i = 0; i < n_dsts && ret; i++) {
+                autofree(CbmMappedFile) *dest = CBM_MAPPED_FILE_INIT;
+
+                if (cbm_mapped_file_open(dsts[i], dest) && dest->length == source->length &&
+                    memcmp(dest->buffer, source->buffer, source->length) == 0) {
+                        continue;
+                }
+                if (!copy_file_write_temp(source->buffer, source->length, dsts[i], mode)) {
+                        LOG_ERROR("Failed to write %s: %s", dsts[i], strerror(errno));
+                        ret = false;
+                        break;
+                }
+                staged[i] = true;
+        }
+
+        /* Then replace them as copy_file_atomic would, one at a time */
+        for (size_t i = 0; i < n_dsts; i++) {
+                autofree(char) *new_name = NULL;
+                struct stat st = { 0 };
+
+                if (copied) {
+                        copied[i] = false;
+                }
+                if (!staged[i]) {
+                        continue;
+                }
+                new_name = string_printf("%s.TmpWrite", dsts[i]);
+                if (!ret) {
+                        (void)unlink(new_name);
+                        continue;
+                }
+                if (stat(dsts[i], &st) == 0 && !S_ISDIR(st.st_mode)) {
+                        if (unlink(dsts[i]) != 0) {
+                                (void)unlink(new_name);
+                                ret = false;
+                                continue;
+                        }
+                        cbm_sync();
+                }
+                if (rename(new_name, dsts[i]) != 0) {
+                        (void)unlink(new_name);
+                        ret = false;
+                        continue;
+                }
+                if (copied) {
+                        copied[i] = true;
+                }
+        }
+        /* vfat protect */
+        cbm_sync();
+
+        free(staged);
+        return ret;
+}
+
 bool cbm_is_mounted(const char *path)
 {
         autofree(FILE_MNT) *tab = NULL;
@@ -505,7 +1079,27 @@ void cbm_set_sync_filesystems(bool should_sync)
         cbm_should_sync = should_sync;
 }
 
+void cbm_set_share_files(bool should_share)
+{
+        cbm_should_share = should_share;
+}
+
+void cbm_set_readback_fault(bool fault)
+{
+        cbm_readback_fault = fault;
+}
+
+/**
+ * Stands in for the mapping of an empty file, which mmap() refuses
+ */
+static char cbm_mapped_file_empty[1];
+
 bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
+{
+        return cbm_mapped_file_openat(AT_FDCWD, path, file);
+}
+
+bool cbm_mapped_file_openat(int dirfd, const char *path, CbmMappedFile *file)
 {
         if (!file) {
                 return false;
@@ -515,7 +1109,7 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
         ssize_t length = -1;
         char *buffer = NULL;
 
-        fd = open(path, O_RDONLY);
+        fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
         if (fd < 0) {
                 return false;
         }
@@ -525,8 +1119,16 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
         }
         length = st.st_size;
 
+        /* Nothing to map, but an empty file is still a valid one */
+        if (length == 0) {
+                file->length = 0;
+                file->buffer = cbm_mapped_file_empty;
+                file->fd = fd;
+                return true;
+        }
+
         buffer = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (!buffer) {
+        if (buffer == MAP_FAILED) {
                 close(fd);
                 return false;
         }
@@ -538,10 +1140,13 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
 
 void cbm_mapped_file_close(CbmMappedFile *file)
 {
-        if (!file) {
+        /* Never opened: fd is 0 here, which is not ours to close */
+        if (!file || !file->buffer) {
                 return;
         }
-        munmap(file->buffer, file->length);
+        if (file->buffer != cbm_mapped_file_empty) {
+                munmap(file->buffer, file->length);
+        }
         close(file->fd);
         memset(file, 0, sizeof(CbmMappedFile));
 }
@@ -560,6 +1165,52 @@ bool cbm_path_check(const char *path, const char *resolved)
         return streq(p, resolved);
 }
 
+int cbm_file_fragments_at(int dirfd, const char *path)
+{
+        const uint32_t batch = 32;
+        struct fiemap *map = NULL;
+        uint64_t next_physical = 0;
+        int fragments = 0;
+        bool last = false;
+        int fd;
+
+        fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+        map = calloc(1, sizeof(*map) + batch * sizeof(struct fiemap_extent));
+        if (!map) {
+                close(fd);
+                return -1;
+        }
+
+        while (!last) {
+                map->fm_length = FIEMAP_MAX_OFFSET - map->fm_start;
+                map->fm_extent_count = batch;
+                if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+                        fragments = -1;
+                        break;
+                }
+                if (map->fm_mapped_extents == 0) {
+                        break;
+                }
+                for (uint32_t i = 0; i < map->fm_mapped_extents; i++) {
+                        const struct fiemap_extent *e = &map->fm_extents[i];
+
+                        /* Extents are capped in size, only a jump is a new fragment */
+                        if (fragments == 0 || e->fe_physical != next_physical) {
+                                ++fragments;
+                        }
+                        next_physical = e->fe_physical + e->fe_length;
+                        map->fm_start = e->fe_logical + e->fe_length;
+                        last = (e->fe_flags & FIEMAP_EXTENT_LAST) != 0;
+                }
+        }
+        free(map);
+        close(fd);
+        return fragments;
+}
+
 bool cbm_is_dir_empty(const char *path)
 {
         DIR *dir = NULL;
@@ -17,8 +17,14 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 
+#include "sha256.h"
 #include "util.h"
 
+/**
+ * Persistent state of clr-boot-manager, relative to the root prefix
+ */
+#define CBM_STATE_DIR "/var/lib/clr-boot-manager"
+
 typedef FILE FILE_MNT;
 
 DEF_AUTOFREE(FILE_MNT, endmntent)
@@ -71,6 +77,18 @@ char *get_legacy_boot_device(char *path);
  */
 bool cbm_files_match(const char *p1, const char *p2);
 
+/**
+ * As cbm_files_match, with @p2 resolved relative to the directory @dirfd
+ */
+bool cbm_files_match_at(const char *p1, int dirfd, const char *p2);
+
+/**
+ * As cbm_files_match_at, also storing the SHA-256 of @p1 in @digest, if
+ * set, when they match. The hash is taken from the compared copy.
+ */
+bool cbm_files_match_hashed_at(const char *p1, int dirfd, const char *p2,
+                               uint8_t digest[CBM_SHA256_LEN]);
+
 /**
  * Return the parent path for a given file
  *
@@ -102,6 +120,14 @@ bool file_set_text(const char *path, char *text);
  */
 bool file_get_text(const char *path, char **out_buf);
 
+/**
+ * Determine whether the file at @path holds exactly @len bytes of @buf.
+ * No allocation is performed, and a size mismatch returns before reading.
+ *
+ * @return True if the file exists and the content is identical
+ */
+bool cbm_file_content_equals(const char *path, const char *buf, size_t len);
+
 /**
  * Simple utility to copy path @src to path @dst, with mode @mode
  *
@@ -119,6 +145,26 @@ bool file_get_text(const char *path, char **out_buf);
  */
 bool copy_file(const char *src, const char *dst, mode_t mode);
 
+/**
+ * As copy_file, with @dst resolved relative to the directory @dirfd
+ */
+bool copy_file_at(const char *src, int dirfd, const char *dst, mode_t mode);
+
+/**
+ * Create @dst, relative to @dirfd, without copying any data: a reflink of
+ * @src where the filesystem supports them, otherwise a hardlink to it. Only
+ * possible when both are on the same filesystem, such as a /boot without a
+ * partition of its own.
+ *
+ * @note A hardlink is @src itself, so @dst must only ever be replaced by
+ * rename and never written in place, and is only made when @src already
+ * has @mode. Any existing @dst is removed.
+ *
+ * @return true if @dst now shares the data of @src, false if it must be
+ * copied instead
+ */
+bool copy_file_share_at(const char *src, int dirfd, const char *dst, mode_t mode);
+
 /**
  * Wrapper around copy_file to ensure an atomic update of files. This requires
  * that a new file first be written with a new unique name, and only when this
@@ -126,10 +172,68 @@ bool copy_file(const char *src, const char *dst, mode_t mode);
  * renaming our newly copied file to match the originally intended filename.
  *
  * This is designed to make the file replacement operation as atomic as
- * possible.
+ * possible. When @dst is on the same filesystem as @src the new file shares
+ * its data, see copy_file_share_at.
  */
 bool copy_file_atomic(const char *src, const char *dst, mode_t mode);
 
+/**
+ * As copy_file_atomic, with @dst resolved relative to the directory @dirfd.
+ * The temporary file, unlink and rename all happen within @dirfd.
+ */
+bool copy_file_atomic_at(const char *src, int dirfd, const char *dst, mode_t mode);
+
+/**
+ * The first half of copy_file_atomic_at, for callers batching many copies:
+ * write @src to the temporary name for @dst within @dirfd and flush that one
+ * file, without a filesystem wide sync. On the same filesystem the data is
+ * shared instead of written, see copy_file_share_at.
+ */
+bool copy_file_stage_at(const char *src, int dirfd, const char *dst, mode_t mode);
+
+/**
+ * As copy_file_stage_at, also storing the SHA-256 of @src in @digest. The
+ * hash is taken while copying, then the temporary file is read back once,
+ * bypassing the page cache, and must hash the same.
+ */
+bool copy_file_stage_hashed_at(const char *src, int dirfd, const char *dst, mode_t mode,
+                               uint8_t digest[CBM_SHA256_LEN]);
+
+/**
+ * The second half: replace @dst with its staged copy. Only the removal of an
+ * existing @dst is synced, callers issue one barrier once every staged file
+ * is committed.
+ */
+bool copy_file_commit_at(int dirfd, const char *dst);
+
+/**
+ * Discard a staged copy of @dst that will not be committed
+ */
+void copy_file_abort_at(int dirfd, const char *dst);
+
+/**
+ * Install @src at every one of @dsts, as copy_file_atomic would, reading the
+ * source only once. Each destination is compared against the source in the
+ * same pass and left untouched when identical.
+ *
+ * @param copied If not NULL, receives for each destination whether it was
+ * (re)written
+ *
+ * @return true if every destination now matches @src
+ */
+bool copy_file_fanout(const char *src, const char *const *dsts, size_t n_dsts, mode_t mode,
+                      bool *copied);
+
+/**
+ * Count the physically discontiguous runs @path, relative to @dirfd, is
+ * stored in. Firmware reads a blob in one fragment much faster than one
+ * scattered across the disk.
+ *
+ * @return The number of fragments, 0 for an empty file, or -1 if the
+ * filesystem cannot tell
+ */
+int cbm_file_fragments_at(int dirfd, const char *path);
+
 /**
  * Attempt to determine if the given path is actually mounted or not
  *
@@ -152,6 +256,18 @@ bool cbm_system_has_uefi(void);
  */
 void cbm_set_sync_filesystems(bool should_sync);
 
+/**
+ * Override whether copies may share data with their source, see
+ * copy_file_share_at.
+ */
+void cbm_set_share_files(bool should_share);
+
+/**
+ * For testing: make every copy verified by copy_file_stage_hashed_at read
+ * back wrong
+ */
+void cbm_set_readback_fault(bool fault);
+
 /**
  * Sync filesystem if should_sync is set
  * If not set, then this is a no-op
@@ -168,6 +284,11 @@ void cbm_mapped_file_close(CbmMappedFile *file);
  */
 bool cbm_mapped_file_open(const char *path, CbmMappedFile *file);
 
+/**
+ * Open the given CbmMappedFile relative to @dirfd and mmap the contents
+ */
+bool cbm_mapped_file_openat(int dirfd, const char *path, CbmMappedFile *file);
+
 /**
  * Cananolize @path and compare with @resolved. Returns true case paths are the same,
  * returns false otherwise.
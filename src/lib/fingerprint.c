@@ -0,0 +1,197 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fingerprint.h"
+#include "util.h"
+
+#define CBM_FNV_OFFSET 0xcbf29ce484222325ULL
+#define CBM_FNV_PRIME 0x100000001b3ULL
+
+void cbm_fingerprint_init(CbmFingerprint *fp)
+{
+        fp->hash = CBM_FNV_OFFSET;
+}
+
+void cbm_fingerprint_add(CbmFingerprint *fp, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+
+        for (size_t i = 0; i < len; i++) {
+                fp->hash ^= p[i];
+                fp->hash *= CBM_FNV_PRIME;
+        }
+}
+
+void cbm_fingerprint_add_string(CbmFingerprint *fp, const char *s)
+{
+        if (!s) {
+                cbm_fingerprint_add(fp, "\xff", 1);
+                return;
+        }
+        cbm_fingerprint_add(fp, s, strlen(s) + 1);
+}
+
+/**
+ * Only the fields that change when a file is replaced or rewritten, never
+ * atime, ctime or padding: sharing a file into the ESP as a hardlink bumps
+ * its ctime without touching the content
+ */
+static void cbm_fingerprint_add_stat(CbmFingerprint *fp, const struct stat *st)
+{
+        uint64_t fields[] = {
+                (uint64_t)st->st_dev,          (uint64_t)st->st_ino,
+                (uint64_t)st->st_mode,         (uint64_t)st->st_size,
+                (uint64_t)st->st_mtim.tv_sec,  (uint64_t)st->st_mtim.tv_nsec,
+        };
+
+        cbm_fingerprint_add(fp, fields, sizeof(fields));
+}
+
+void cbm_fingerprint_add_path(CbmFingerprint *fp, const char *path)
+{
+        struct stat st = { 0 };
+
+        if (lstat(path, &st) != 0) {
+                cbm_fingerprint_add(fp, "\0", 1);
+                return;
+        }
+        cbm_fingerprint_add_stat(fp, &st);
+}
+
+/**
+ * Hash everything below the open directory @fd, which is consumed
+ */
+static uint64_t cbm_fingerprint_dir(int fd, int depth)
+{
+        struct dirent *ent = NULL;
+        uint64_t sum = 0;
+        DIR *dir = NULL;
+
+        dir = fdopendir(fd);
+        if (!dir) {
+                close(fd);
+                return 0;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                CbmFingerprint entry;
+                struct stat st = { 0 };
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+                cbm_fingerprint_init(&entry);
+                cbm_fingerprint_add_string(&entry, ent->d_name);
+                if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                        cbm_fingerprint_add_stat(&entry, &st);
+                }
+                if (depth > 0 && S_ISDIR(st.st_mode)) {
+                        int child = openat(dirfd(dir),
+                                           ent->d_name,
+                                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        uint64_t sub = child >= 0 ? cbm_fingerprint_dir(child, depth - 1) : 0;
+
+                        cbm_fingerprint_add(&entry, &sub, sizeof(sub));
+                }
+                /* Summed so that readdir order does not matter */
+                sum += entry.hash;
+        }
+        closedir(dir);
+        return sum;
+}
+
+void cbm_fingerprint_add_tree(CbmFingerprint *fp, const char *path, int depth)
+{
+        struct stat st = { 0 };
+        uint64_t sum = 0;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                cbm_fingerprint_add_path(fp, path);
+                return;
+        }
+        cbm_fingerprint_add_stat(fp, &st);
+        sum = cbm_fingerprint_dir(fd, depth);
+        cbm_fingerprint_add(fp, &sum, sizeof(sum));
+}
+
+/**
+ * The hash of one entry of a listing, as summed by cbm_fingerprint_entries()
+ */
+static uint64_t cbm_fingerprint_entry_hash(const char *name, const struct stat *st)
+{
+        CbmFingerprint entry;
+
+        cbm_fingerprint_init(&entry);
+        cbm_fingerprint_add_string(&entry, name);
+        cbm_fingerprint_add_stat(&entry, st);
+        return entry.hash;
+}
+
+uint64_t cbm_fingerprint_entry(const char *path)
+{
+        const char *name = strrchr(path, '/');
+        struct stat st = { 0 };
+
+        if (lstat(path, &st) != 0) {
+                return 0;
+        }
+        return cbm_fingerprint_entry_hash(name ? name + 1 : path, &st);
+}
+
+uint64_t cbm_fingerprint_entries(const char *path)
+{
+        struct dirent *ent = NULL;
+        uint64_t sum = 0;
+        DIR *dir = NULL;
+
+        dir = opendir(path);
+        if (!dir) {
+                return 0;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                struct stat st = { 0 };
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+                if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                        continue;
+                }
+                sum += cbm_fingerprint_entry_hash(ent->d_name, &st);
+        }
+        closedir(dir);
+        return sum;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
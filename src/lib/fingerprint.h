@@ -0,0 +1,79 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A cheap running hash (64-bit FNV-1a) over file metadata. It is only as
+ * strong as stat: content rewritten in place with the same size and
+ * restored timestamps goes unnoticed, which is fine for detecting package
+ * installs and configuration edits.
+ */
+typedef struct CbmFingerprint {
+        uint64_t hash;
+} CbmFingerprint;
+
+void cbm_fingerprint_init(CbmFingerprint *fp);
+
+/**
+ * Mix raw bytes into @fp
+ */
+void cbm_fingerprint_add(CbmFingerprint *fp, const void *data, size_t len);
+
+/**
+ * Mix a string, including its terminator, into @fp. NULL is distinct from
+ * the empty string.
+ */
+void cbm_fingerprint_add_string(CbmFingerprint *fp, const char *s);
+
+/**
+ * Mix the identity of @path (device, inode, mode, size, mtime and ctime)
+ * into @fp. Symlinks are not followed. A missing path is recorded as such.
+ */
+void cbm_fingerprint_add_path(CbmFingerprint *fp, const char *path);
+
+/**
+ * Mix @path and the name and identity of everything in it, descending at
+ * most @depth levels into subdirectories. The result does not depend on
+ * readdir order.
+ */
+void cbm_fingerprint_add_tree(CbmFingerprint *fp, const char *path, int depth);
+
+/**
+ * Sum of the name and identity of everything directly in @path, but not of
+ * @path itself. Removing an entry takes exactly its cbm_fingerprint_entry()
+ * away from the sum, and a missing directory sums to 0.
+ */
+uint64_t cbm_fingerprint_entries(const char *path);
+
+/**
+ * What @path contributes to cbm_fingerprint_entries() of its parent, or 0
+ * when it does not exist
+ */
+uint64_t cbm_fingerprint_entry(const char *path);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
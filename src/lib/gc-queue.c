@@ -0,0 +1,319 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "gc-queue.h"
+#include "log.h"
+#include "nica/files.h"
+#include "rmtree.h"
+#include "util.h"
+
+/**
+ * New entries are appended to the queue under the lock. A collector moves
+ * them into the work file, which it owns until it finishes, so that pushes
+ * never wait on a slow removal.
+ */
+#define CBM_GC_QUEUE "gc.queue"
+#define CBM_GC_WORK "gc.queue.work"
+#define CBM_GC_LOCK "gc.lock"
+
+static char *cbm_gc_state_dir(const char *prefix)
+{
+        return string_printf("%s%s", prefix ? prefix : "", CBM_GC_STATE_DIR);
+}
+
+/**
+ * Open and exclusively lock the queue lock file in @dirfd
+ */
+static int cbm_gc_lock(int dirfd)
+{
+        int fd = openat(dirfd, CBM_GC_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 00600);
+
+        if (fd < 0) {
+                return -1;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+static bool cbm_gc_write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t r = write(fd, buf, len);
+
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                buf += r;
+                len -= (size_t)r;
+        }
+        return true;
+}
+
+bool cbm_gc_queue_push(const char *prefix, const char *source, const char *const *artifacts,
+                       size_t n_artifacts)
+{
+        autofree(char) *dir = NULL;
+        int dirfd = -1;
+        int lockfd = -1;
+        int fd = -1;
+        bool ret = false;
+
+        dir = cbm_gc_state_dir(prefix);
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_ERROR("Failed to create %s: %s", dir, strerror(errno));
+                return false;
+        }
+        dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0) {
+                LOG_ERROR("Failed to open %s: %s", dir, strerror(errno));
+                return false;
+        }
+        lockfd = cbm_gc_lock(dirfd);
+        if (lockfd < 0) {
+                LOG_ERROR("Failed to lock %s/%s: %s", dir, CBM_GC_LOCK, strerror(errno));
+                goto done;
+        }
+        fd = openat(dirfd, CBM_GC_QUEUE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 00600);
+        if (fd < 0) {
+                LOG_ERROR("Failed to open %s/%s: %s", dir, CBM_GC_QUEUE, strerror(errno));
+                goto done;
+        }
+
+        for (size_t i = 0; i < n_artifacts; i++) {
+                autofree(char) *line = NULL;
+
+                /* Tabs and newlines are the record separators */
+                if (strpbrk(source, "\t\n") || strpbrk(artifacts[i], "\t\n")) {
+                        LOG_ERROR("Cannot queue unrepresentable path: %s", artifacts[i]);
+                        goto done;
+                }
+                line = string_printf("%s\t%s\n", source, artifacts[i]);
+                if (!cbm_gc_write_all(fd, line, strlen(line))) {
+                        LOG_ERROR("Failed to write %s/%s: %s", dir, CBM_GC_QUEUE, strerror(errno));
+                        goto done;
+                }
+        }
+        if (fsync(fd) != 0) {
+                LOG_ERROR("Failed to flush %s/%s: %s", dir, CBM_GC_QUEUE, strerror(errno));
+                goto done;
+        }
+        ret = true;
+
+done:
+        if (fd >= 0) {
+                close(fd);
+        }
+        if (lockfd >= 0) {
+                close(lockfd);
+        }
+        close(dirfd);
+        return ret;
+}
+
+/**
+ * Move any pending queue entries onto the end of the work file
+ */
+static bool cbm_gc_take_queue(int dirfd)
+{
+        char buf[4096];
+        int lockfd = -1;
+        int in = -1;
+        int out = -1;
+        bool ret = false;
+        ssize_t r;
+
+        lockfd = cbm_gc_lock(dirfd);
+        if (lockfd < 0) {
+                return false;
+        }
+        in = openat(dirfd, CBM_GC_QUEUE, O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+                ret = errno == ENOENT;
+                goto done;
+        }
+        out = openat(dirfd, CBM_GC_WORK, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 00600);
+        if (out < 0) {
+                goto done;
+        }
+        while ((r = read(in, buf, sizeof(buf))) != 0) {
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        goto done;
+                }
+                if (!cbm_gc_write_all(out, buf, (size_t)r)) {
+                        goto done;
+                }
+        }
+        /* Entries must be durable in the work file before they leave the queue */
+        if (fsync(out) != 0 || unlinkat(dirfd, CBM_GC_QUEUE, 0) != 0) {
+                goto done;
+        }
+        ret = true;
+
+done:
+        if (out >= 0) {
+                close(out);
+        }
+        if (in >= 0) {
+                close(in);
+        }
+        close(lockfd);
+        return ret;
+}
+
+/**
+ * Remove a single queued artifact. Returns false to keep the entry.
+ */
+static bool cbm_gc_collect(char *entry, bool *removed)
+{
+        char *artifact = strchr(entry, '\t');
+        const char *source = entry;
+
+        if (!artifact) {
+                LOG_WARNING("Dropping malformed removal queue entry: %s", entry);
+                return true;
+        }
+        *artifact++ = '\0';
+
+        /* Same version installed again, the artifacts belong to it now */
+        if (nc_file_exists(source)) {
+                LOG_DEBUG("Kernel %s was reinstalled, keeping %s", source, artifact);
+                return true;
+        }
+        if (!nc_file_exists(artifact)) {
+                return true;
+        }
+        if (!cbm_rm_rf_parallel(artifact, 0)) {
+                LOG_ERROR("Failed to remove %s: %s", artifact, strerror(errno));
+                artifact[-1] = '\t';
+                return false;
+        }
+        LOG_INFO("Garbage collected %s", artifact);
+        *removed = true;
+        return true;
+}
+
+bool cbm_gc_queue_drain(const char *prefix)
+{
+        autofree(char) *dir = NULL;
+        autofree(FILE) *fp = NULL;
+        autofree(FILE) *retry = NULL;
+        char *line = NULL;
+        size_t n = 0;
+        ssize_t r;
+        int dirfd = -1;
+        int fd = -1;
+        bool removed = false;
+        bool kept = false;
+        bool ret = false;
+
+        dir = cbm_gc_state_dir(prefix);
+        dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0) {
+                return errno == ENOENT;
+        }
+        /* The directory lock serialises collectors, the lock file guards the queue */
+        if (flock(dirfd, LOCK_EX | LOCK_NB) != 0) {
+                ret = errno == EWOULDBLOCK;
+                if (ret) {
+                        LOG_DEBUG("Another garbage collection is running");
+                }
+                goto done;
+        }
+        if (!cbm_gc_take_queue(dirfd)) {
+                LOG_ERROR("Failed to read removal queue in %s: %s", dir, strerror(errno));
+                goto done;
+        }
+
+        fd = openat(dirfd, CBM_GC_WORK, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                ret = errno == ENOENT;
+                goto done;
+        }
+        fp = fdopen(fd, "r");
+        if (!fp) {
+                close(fd);
+                goto done;
+        }
+        fd = openat(dirfd, CBM_GC_WORK ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00600);
+        if (fd < 0 || !(retry = fdopen(fd, "w"))) {
+                LOG_ERROR("Failed to open %s/%s.tmp: %s", dir, CBM_GC_WORK, strerror(errno));
+                if (fd >= 0) {
+                        close(fd);
+                }
+                goto done;
+        }
+
+        while ((r = getline(&line, &n, fp)) > 0) {
+                if (line[r - 1] == '\n') {
+                        line[r - 1] = '\0';
+                }
+                if (line[0] == '\0') {
+                        continue;
+                }
+                if (!cbm_gc_collect(line, &removed)) {
+                        fprintf(retry, "%s\n", line);
+                        kept = true;
+                }
+        }
+        free(line);
+
+        /* One flush for everything removed above */
+        if (removed) {
+                cbm_sync();
+        }
+
+        if (!kept) {
+                unlinkat(dirfd, CBM_GC_WORK ".tmp", 0);
+                ret = unlinkat(dirfd, CBM_GC_WORK, 0) == 0;
+                goto done;
+        }
+        if (fflush(retry) != 0 || fsync(fileno(retry)) != 0 ||
+            renameat(dirfd, CBM_GC_WORK ".tmp", dirfd, CBM_GC_WORK) != 0) {
+                LOG_ERROR("Failed to update %s/%s: %s", dir, CBM_GC_WORK, strerror(errno));
+        }
+
+done:
+        close(dirfd);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
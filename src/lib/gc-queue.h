@@ -0,0 +1,61 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "files.h"
+
+/**
+ * Where the deferred removal queue lives, relative to the root prefix
+ */
+#define CBM_GC_STATE_DIR CBM_STATE_DIR
+
+/**
+ * Persist removal of @artifacts on behalf of the kernel blob @source.
+ *
+ * The entries are appended to the queue in CBM_GC_STATE_DIR under @prefix
+ * and flushed to disk before returning, so they survive a crash or reboot.
+ * Nothing is removed here.
+ *
+ * @return true if every entry was queued. On failure the caller is expected
+ * to remove the artifacts itself.
+ */
+bool cbm_gc_queue_push(const char *prefix, const char *source, const char *const *artifacts,
+                       size_t n_artifacts);
+
+/**
+ * Remove everything queued under @prefix.
+ *
+ * Entries whose kernel blob has since been reinstalled are dropped without
+ * removing anything. Entries that fail are kept for the next run. Only one
+ * collector runs at a time, a concurrent call returns immediately.
+ *
+ * @return false if any entry could not be removed
+ */
+bool cbm_gc_queue_drain(const char *prefix);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,246 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "iosched.h"
+#include "log.h"
+#include "util.h"
+
+/* Not exported by glibc, see ioprio_set(2) */
+#define CBM_IOPRIO_WHO_PROCESS 1
+#define CBM_IOPRIO_CLASS_SHIFT 13
+#define CBM_IOPRIO_LEVEL_MAX 7
+
+/**
+ * Copies are paced in chunks of this size when only a rate is given. Low
+ * rates use smaller chunks so the sleeps stay short.
+ */
+#define CBM_IO_CHUNK (1024 * 1024)
+#define CBM_IO_CHUNK_MIN (64 * 1024)
+
+static const char *cbm_io_phase_names[CBM_IO_PHASE_MAX] = {
+        [CBM_IO_PHASE_UPDATE] = "update",
+        [CBM_IO_PHASE_COPY] = "copy",
+        [CBM_IO_PHASE_REMOVE] = "remove",
+};
+
+static CbmIoPolicy cbm_io_policy = { 0 };
+
+/**
+ * Earliest time the next chunk may start, shared by every copying thread
+ */
+static pthread_mutex_t cbm_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cbm_io_next_us = 0;
+
+/**
+ * Priority the process started with, which phases without a class of their
+ * own return to. -1 until a policy is set.
+ */
+static int cbm_io_base = -1;
+
+static __thread CbmIoPhase cbm_io_phase = CBM_IO_PHASE_UPDATE;
+static __thread int cbm_io_applied = -1;
+
+/**
+ * Parse "none", "idle", or "best-effort" and "realtime" with an optional
+ * ":level"
+ */
+static bool cbm_io_parse_priority(const char *value, CbmIoClass *io_class, int *io_level)
+{
+        const char *colon = strchr(value, ':');
+        size_t len = colon ? (size_t)(colon - value) : strlen(value);
+        CbmIoClass parsed;
+        char *end = NULL;
+        long level = 4;
+
+        if (len == 4 && strncmp(value, "none", len) == 0 && !colon) {
+                parsed = CBM_IO_CLASS_NONE;
+                level = 0;
+        } else if (len == 4 && strncmp(value, "idle", len) == 0 && !colon) {
+                parsed = CBM_IO_CLASS_IDLE;
+                level = 0;
+        } else if (len == 11 && strncmp(value, "best-effort", len) == 0) {
+                parsed = CBM_IO_CLASS_BEST_EFFORT;
+        } else if (len == 8 && strncmp(value, "realtime", len) == 0) {
+                parsed = CBM_IO_CLASS_REALTIME;
+        } else {
+                return false;
+        }
+        if (colon) {
+                errno = 0;
+                level = strtol(colon + 1, &end, 10);
+                if (errno != 0 || end == colon + 1 || *end != '\0' || level < 0 ||
+                    level > CBM_IOPRIO_LEVEL_MAX) {
+                        return false;
+                }
+        }
+        *io_class = parsed;
+        *io_level = (int)level;
+        return true;
+}
+
+static bool cbm_io_parse_line(const char *key, const char *value, void *userdata)
+{
+        CbmIoPolicy *policy = userdata;
+
+        for (int i = 0; i < CBM_IO_PHASE_MAX; i++) {
+                size_t len = strlen(cbm_io_phase_names[i]);
+
+                if (strncmp(key, cbm_io_phase_names[i], len) == 0 &&
+                    streq(key + len, "_priority")) {
+                        return cbm_io_parse_priority(value,
+                                                     &policy->io_class[i],
+                                                     &policy->io_level[i]);
+                }
+        }
+        if (streq(key, "copy_rate")) {
+                return cbm_parse_bytes(value, &policy->copy_rate);
+        }
+        if (streq(key, "writeback")) {
+                return cbm_parse_bytes(value, &policy->writeback);
+        }
+        errno = ENOENT;
+        return false;
+}
+
+void cbm_io_policy_load(const char *prefix, CbmIoPolicy *policy)
+{
+        autofree(char) *path = NULL;
+
+        memset(policy, 0, sizeof(*policy));
+
+        path = string_printf("%s%s/io.conf", prefix ? prefix : "", KERNEL_CONF_DIRECTORY);
+        if (!cbm_config_read(path, cbm_io_parse_line, policy) && errno != ENOENT) {
+                LOG_WARNING("Unable to open %s, using default I/O scheduling: %s",
+                            path,
+                            strerror(errno));
+        }
+}
+
+static int cbm_io_get_priority(void)
+{
+        return (int)syscall(SYS_ioprio_get, CBM_IOPRIO_WHO_PROCESS, 0);
+}
+
+void cbm_io_policy_set(const CbmIoPolicy *policy)
+{
+        if (policy) {
+                cbm_io_policy = *policy;
+        } else {
+                memset(&cbm_io_policy, 0, sizeof(cbm_io_policy));
+        }
+        if (cbm_io_base < 0) {
+                cbm_io_base = cbm_io_get_priority();
+        }
+        pthread_mutex_lock(&cbm_io_lock);
+        cbm_io_next_us = 0;
+        pthread_mutex_unlock(&cbm_io_lock);
+}
+
+CbmIoPhase cbm_io_set_phase(CbmIoPhase phase)
+{
+        CbmIoPhase prev = cbm_io_phase;
+        int value = cbm_io_base;
+
+        cbm_io_phase = phase;
+        if (cbm_io_policy.io_class[phase] != CBM_IO_CLASS_NONE) {
+                value = ((int)cbm_io_policy.io_class[phase] << CBM_IOPRIO_CLASS_SHIFT) |
+                        cbm_io_policy.io_level[phase];
+        }
+        if (value < 0) {
+                return prev;
+        }
+        /* New threads inherit whatever their creator was running at */
+        if (cbm_io_applied < 0) {
+                cbm_io_applied = cbm_io_get_priority();
+        }
+        if (value == cbm_io_applied) {
+                return prev;
+        }
+
+        /* Only the calling thread changes, concurrent phases keep their own */
+        if (syscall(SYS_ioprio_set, CBM_IOPRIO_WHO_PROCESS, 0, value) != 0) {
+                LOG_DEBUG("Unable to set I/O priority for %s: %s",
+                          cbm_io_phase_names[phase],
+                          strerror(errno));
+                return prev;
+        }
+        cbm_io_applied = value;
+        return prev;
+}
+
+size_t cbm_io_chunk_size(void)
+{
+        uint64_t chunk = cbm_io_policy.writeback;
+
+        if (cbm_io_policy.copy_rate) {
+                if (!chunk) {
+                        chunk = CBM_IO_CHUNK;
+                }
+                /* At least four chunks a second */
+                if (chunk > cbm_io_policy.copy_rate / 4) {
+                        chunk = cbm_io_policy.copy_rate / 4;
+                }
+        }
+        if (chunk && chunk < CBM_IO_CHUNK_MIN) {
+                chunk = CBM_IO_CHUNK_MIN;
+        }
+        return (size_t)chunk;
+}
+
+void cbm_io_throttle(size_t bytes)
+{
+        uint64_t now, start;
+
+        if (!cbm_io_policy.copy_rate) {
+                return;
+        }
+
+        /* Reserve the next slot, so concurrent copies share the rate */
+        now = cbm_log_now_us();
+        pthread_mutex_lock(&cbm_io_lock);
+        start = cbm_io_next_us > now ? cbm_io_next_us : now;
+        cbm_io_next_us = start + (uint64_t)bytes * 1000000 / cbm_io_policy.copy_rate;
+        pthread_mutex_unlock(&cbm_io_lock);
+
+        if (start > now) {
+                struct timespec ts = {.tv_sec = (time_t)((start - now) / 1000000),
+                                      .tv_nsec = (long)((start - now) % 1000000) * 1000 };
+
+                while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+                        ;
+                }
+        }
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,94 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * What a thread is doing, each may be given its own I/O priority
+ */
+typedef enum {
+        CBM_IO_PHASE_UPDATE = 0, /**<Everything not listed below */
+        CBM_IO_PHASE_COPY,       /**<Comparing and copying blobs to the boot partition */
+        CBM_IO_PHASE_REMOVE,     /**<Removing kernel trees */
+        CBM_IO_PHASE_MAX
+} CbmIoPhase;
+
+/**
+ * I/O scheduling classes, as understood by ioprio_set(2)
+ */
+typedef enum {
+        CBM_IO_CLASS_NONE = 0,    /**<Leave the priority derived from the nice level */
+        CBM_IO_CLASS_REALTIME,    /**<Always served first */
+        CBM_IO_CLASS_BEST_EFFORT, /**<The usual class, by level */
+        CBM_IO_CLASS_IDLE,        /**<Only served when the disk is otherwise idle */
+} CbmIoClass;
+
+/**
+ * Declarative I/O scheduling, read from KERNEL_CONF_DIRECTORY/io.conf
+ */
+typedef struct CbmIoPolicy {
+        CbmIoClass io_class[CBM_IO_PHASE_MAX]; /**<Class per phase */
+        int io_level[CBM_IO_PHASE_MAX];        /**<Level 0 (highest) to 7 per phase */
+        uint64_t copy_rate;                    /**<Copy throughput in bytes/s, 0 for no limit */
+        uint64_t writeback;                    /**<Copy chunk to start writeback on, 0 for none */
+} CbmIoPolicy;
+
+/**
+ * Load the I/O policy for @prefix into @policy. A missing file, or any
+ * line that cannot be parsed, leaves the defaults: no priority changes and
+ * no throttling.
+ */
+void cbm_io_policy_load(const char *prefix, CbmIoPolicy *policy);
+
+/**
+ * Use @policy for every following copy and phase change in this process.
+ * NULL restores the defaults.
+ */
+void cbm_io_policy_set(const CbmIoPolicy *policy);
+
+/**
+ * Switch the calling thread into @phase, applying its I/O priority when
+ * that differs from the current phase.
+ *
+ * @return The previous phase, to be restored by the caller
+ */
+CbmIoPhase cbm_io_set_phase(CbmIoPhase phase);
+
+/**
+ * Size of the chunks copies should be written in for pacing, or 0 when
+ * neither throttling nor writeback pacing are configured
+ */
+size_t cbm_io_chunk_size(void);
+
+/**
+ * Account for @bytes about to be copied, sleeping as needed to keep all
+ * copies in the process within the configured rate
+ */
+void cbm_io_throttle(size_t bytes);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
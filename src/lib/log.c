@@ -11,28 +11,171 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "nica/util.h"
 
 static FILE *log_file = NULL;
-static CbmLogLevel min_log_level;
+static bool log_text_enabled = true;
+static CbmLogLevel text_min_level = CBM_LOG_ERROR;
+CbmLogLevel cbm_log_min_level = CBM_LOG_ERROR;
+
+/* Connected datagram socket for the journal sink, or -1 */
+static int journal_fd = -1;
 
 #define PACKAGE_NAME_SHORT "cbm"
 
+/**
+ * Size of the on-stack buffer used to render a single log line. Longer
+ * lines fall back to a heap allocation.
+ */
+#define CBM_LOG_LINE_MAX 1024
+
+/**
+ * Size of the shared sink that batches rendered lines between flushes
+ */
+#define CBM_LOG_SINK_SIZE 16384
+
+/**
+ * Lowest level sent to the journal when CBM_DEBUG doesn't ask for more
+ */
+#define CBM_LOG_JOURNAL_LEVEL CBM_LOG_INFO
+
+static struct {
+        pthread_mutex_t lock;
+        size_t len;
+        char buffer[CBM_LOG_SINK_SIZE];
+} log_sink = {.lock = PTHREAD_MUTEX_INITIALIZER, .len = 0 };
+
+/**
+ * Performance fields carried by cbm_log_metric records
+ */
+typedef struct CbmLogMetric {
+        uint64_t duration_us;
+        uint64_t bytes;
+} CbmLogMetric;
+
+/**
+ * Per-thread fields attached to journal records
+ */
+static _Thread_local struct {
+        char phase[64];
+        char kernel[256];
+} log_context;
+
 static const char *log_str_table[] = {[CBM_LOG_DEBUG] = "DEBUG",     [CBM_LOG_INFO] = "INFO",
                                       [CBM_LOG_SUCCESS] = "SUCCESS", [CBM_LOG_ERROR] = "ERROR",
                                       [CBM_LOG_WARNING] = "WARNING", [CBM_LOG_FATAL] = "FATAL" };
 
+/**
+ * syslog priorities for the journal PRIORITY field
+ */
+static const char *log_priority_table[] = {[CBM_LOG_DEBUG] = "7",   [CBM_LOG_INFO] = "6",
+                                           [CBM_LOG_SUCCESS] = "5", [CBM_LOG_ERROR] = "3",
+                                           [CBM_LOG_WARNING] = "4", [CBM_LOG_FATAL] = "2" };
+
+/**
+ * Write out the sink contents. Caller must hold the sink lock.
+ */
+static void cbm_log_sink_flush_locked(void)
+{
+        if (log_sink.len == 0 || !log_file) {
+                return;
+        }
+        if (fwrite(log_sink.buffer, 1, log_sink.len, log_file) != log_sink.len) {
+                /* Forcibly fall back to stderr with the error */
+                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream\n", stderr);
+        }
+        fflush(log_file);
+        log_sink.len = 0;
+}
+
+/**
+ * Append a rendered line to the sink, flushing as required
+ */
+static void cbm_log_sink_write(const char *line, size_t len, bool flush)
+{
+        pthread_mutex_lock(&log_sink.lock);
+
+        if (log_sink.len + len > sizeof(log_sink.buffer)) {
+                cbm_log_sink_flush_locked();
+        }
+
+        if (len > sizeof(log_sink.buffer)) {
+                /* Too big to batch, write it directly */
+                if (log_file) {
+                        if (fwrite(line, 1, len, log_file) != len) {
+                                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream\n",
+                                      stderr);
+                        }
+                        fflush(log_file);
+                }
+        } else {
+                memcpy(log_sink.buffer + log_sink.len, line, len);
+                log_sink.len += len;
+                if (flush) {
+                        cbm_log_sink_flush_locked();
+                }
+        }
+
+        pthread_mutex_unlock(&log_sink.lock);
+}
+
+void cbm_log_flush(void)
+{
+        pthread_mutex_lock(&log_sink.lock);
+        cbm_log_sink_flush_locked();
+        pthread_mutex_unlock(&log_sink.lock);
+}
+
+/**
+ * Flush and hold the sink across fork(), so that the child neither inherits
+ * buffered lines nor a lock taken by a thread it doesn't have
+ */
+static void cbm_log_fork_prepare(void)
+{
+        pthread_mutex_lock(&log_sink.lock);
+        cbm_log_sink_flush_locked();
+}
+
+static void cbm_log_fork_release(void)
+{
+        pthread_mutex_unlock(&log_sink.lock);
+}
+
+/**
+ * The journal wants INFO and above even when the text sink is quieter
+ */
+static void cbm_log_update_min_level(void)
+{
+        cbm_log_min_level = text_min_level;
+        if (journal_fd >= 0 && cbm_log_min_level > CBM_LOG_JOURNAL_LEVEL) {
+                cbm_log_min_level = CBM_LOG_JOURNAL_LEVEL;
+        }
+}
+
 void cbm_log_init(FILE *log)
 {
         const char *env_level = NULL;
-        log_file = log;
         unsigned int nlog_level = CBM_LOG_ERROR;
 
+        /* Anything pending belongs to the previous log file */
+        cbm_log_flush();
+        log_file = log;
+
         env_level = getenv("CBM_DEBUG");
         if (env_level) {
                 /* =1 becomes 0 */
@@ -41,15 +184,96 @@ void cbm_log_init(FILE *log)
         if (nlog_level >= CBM_LOG_MAX) {
                 nlog_level = CBM_LOG_FATAL;
         }
-        min_log_level = nlog_level;
+        text_min_level = nlog_level;
+        cbm_log_update_min_level();
+}
+
+bool cbm_log_journal_open(const char *socket_path)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX };
+        const char *path = socket_path ? socket_path : CBM_JOURNAL_SOCKET;
+        int fd = -1;
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                return false;
+        }
+        memcpy(addr.sun_path, path, strlen(path) + 1);
+
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return false;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                close(fd);
+                return false;
+        }
+
+        cbm_log_journal_close();
+        journal_fd = fd;
+        cbm_log_update_min_level();
+        return true;
+}
+
+void cbm_log_journal_close(void)
+{
+        if (journal_fd >= 0) {
+                close(journal_fd);
+                journal_fd = -1;
+        }
+        log_text_enabled = true;
+        cbm_log_update_min_level();
 }
 
 /**
- * Ensure we're always at least initialised with stderr
+ * Determine if stderr is the journal, as described by $JOURNAL_STREAM
+ */
+static bool cbm_log_stderr_is_journal(void)
+{
+        const char *stream = getenv("JOURNAL_STREAM");
+        unsigned long long dev = 0, ino = 0;
+        struct stat st = { 0 };
+
+        if (!stream || sscanf(stream, "%llu:%llu", &dev, &ino) != 2) {
+                return false;
+        }
+        if (fstat(STDERR_FILENO, &st) != 0) {
+                return false;
+        }
+        return (unsigned long long)st.st_dev == dev && (unsigned long long)st.st_ino == ino;
+}
+
+/**
+ * Ensure we're always at least initialised with stderr, and that nothing
+ * buffered is lost at exit or duplicated into forked children.
  */
 __attribute__((constructor)) static void cbm_log_first_init(void)
 {
         cbm_log_init(stderr);
+        atexit(cbm_log_flush);
+        pthread_atfork(cbm_log_fork_prepare, cbm_log_fork_release, cbm_log_fork_release);
+
+        /* Running as a service, so speak to the journal directly */
+        if (cbm_log_stderr_is_journal() && cbm_log_journal_open(NULL)) {
+                log_text_enabled = false;
+        }
+}
+
+void cbm_log_set_phase(const char *phase)
+{
+        snprintf(log_context.phase, sizeof(log_context.phase), "%s", phase ? phase : "");
+}
+
+void cbm_log_set_kernel(const char *kernel)
+{
+        snprintf(log_context.kernel, sizeof(log_context.kernel), "%s", kernel ? kernel : "");
+}
+
+uint64_t cbm_log_now_us(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
 }
 
 static inline const char *cbm_log_level_str(CbmLogLevel l)
@@ -60,39 +284,198 @@ static inline const char *cbm_log_level_str(CbmLogLevel l)
         return "unknown";
 }
 
-void cbm_log(CbmLogLevel level, const char *filename, int lineno, const char *format, ...)
+/**
+ * Send a single record to the journal as one native protocol datagram.
+ * Returns false if the journal did not take it, so that the caller can
+ * fall back to the text sink.
+ */
+static bool cbm_log_journal_send(CbmLogLevel level, const char *filename, int lineno,
+                                 const CbmLogMetric *metric, const char *msg, size_t msg_len)
+{
+        char fields[1024];
+        char msg_size[8];
+        struct iovec iov[5];
+        struct msghdr mh = { 0 };
+        int len = 0;
+        int n = 0;
+
+        n = snprintf(fields,
+                     sizeof(fields),
+                     "PRIORITY=%s\nSYSLOG_IDENTIFIER=%s\nCODE_FILE=%s\nCODE_LINE=%d\n",
+                     level <= CBM_LOG_FATAL ? log_priority_table[level] : "6",
+                     PACKAGE_NAME_SHORT,
+                     filename,
+                     lineno);
+        if (n < 0 || (size_t)n >= sizeof(fields)) {
+                return false;
+        }
+        len = n;
+
+        if (log_context.phase[0]) {
+                n = snprintf(fields + len,
+                             sizeof(fields) - (size_t)len,
+                             "CBM_PHASE=%s\n",
+                             log_context.phase);
+                len = (n < 0 || (size_t)n >= sizeof(fields) - (size_t)len) ? len : len + n;
+        }
+        if (log_context.kernel[0]) {
+                n = snprintf(fields + len,
+                             sizeof(fields) - (size_t)len,
+                             "CBM_KERNEL=%s\n",
+                             log_context.kernel);
+                len = (n < 0 || (size_t)n >= sizeof(fields) - (size_t)len) ? len : len + n;
+        }
+        if (metric) {
+                n = snprintf(fields + len,
+                             sizeof(fields) - (size_t)len,
+                             "CBM_DURATION_US=%" PRIu64 "\nCBM_BYTES=%" PRIu64 "\n",
+                             metric->duration_us,
+                             metric->bytes);
+                len = (n < 0 || (size_t)n >= sizeof(fields) - (size_t)len) ? len : len + n;
+        }
+
+        iov[0].iov_base = fields;
+        iov[0].iov_len = (size_t)len;
+
+        if (memchr(msg, '\n', msg_len)) {
+                /* Binary-safe form: name, newline, little endian 64-bit size */
+                uint64_t size = msg_len;
+
+                for (size_t i = 0; i < sizeof(msg_size); i++) {
+                        msg_size[i] = (char)((size >> (8 * i)) & 0xff);
+                }
+                iov[1].iov_base = "MESSAGE\n";
+                iov[1].iov_len = strlen("MESSAGE\n");
+                iov[2].iov_base = msg_size;
+                iov[2].iov_len = sizeof(msg_size);
+                mh.msg_iovlen = 3;
+        } else {
+                iov[1].iov_base = "MESSAGE=";
+                iov[1].iov_len = strlen("MESSAGE=");
+                mh.msg_iovlen = 2;
+        }
+        iov[mh.msg_iovlen].iov_base = (void *)msg;
+        iov[mh.msg_iovlen].iov_len = msg_len;
+        mh.msg_iovlen++;
+        iov[mh.msg_iovlen].iov_base = "\n";
+        iov[mh.msg_iovlen].iov_len = 1;
+        mh.msg_iovlen++;
+        mh.msg_iov = iov;
+
+        return sendmsg(journal_fd, &mh, MSG_NOSIGNAL) >= 0;
+}
+
+/**
+ * Render and dispatch a record to the enabled sinks
+ */
+static void cbm_log_emit(CbmLogLevel level, const char *filename, int lineno,
+                         const CbmLogMetric *metric, const char *format, va_list vargs)
 {
         const char *displ = NULL;
+        va_list copy;
+        char line[CBM_LOG_LINE_MAX];
+        autofree(char) *msg = NULL;
+        int prefix_len = 0;
+        int msg_len = 0;
+        size_t len = 0;
+        bool sent = false;
+
+        displ = cbm_log_level_str(level);
+
+        prefix_len = snprintf(line,
+                              sizeof(line),
+                              "[%s] %s (%s:L%d): ",
+                              displ,
+                              PACKAGE_NAME_SHORT,
+                              filename,
+                              lineno);
+        if (prefix_len < 0 || (size_t)prefix_len >= sizeof(line)) {
+                goto fail;
+        }
+
+        va_copy(copy, vargs);
+        msg_len = vsnprintf(line + prefix_len, sizeof(line) - (size_t)prefix_len, format, copy);
+        va_end(copy);
+        if (msg_len < 0) {
+                goto fail;
+        }
+
+        len = (size_t)prefix_len + (size_t)msg_len;
+        if (len + 1 >= sizeof(line)) {
+                /* Didn't fit on the stack, render it again on the heap */
+                if (vasprintf(&msg, format, vargs) < 0) {
+                        msg = NULL;
+                        goto fail;
+                }
+        }
+
+        if (journal_fd >= 0) {
+                sent = cbm_log_journal_send(level,
+                                            filename,
+                                            lineno,
+                                            metric,
+                                            msg ? msg : line + prefix_len,
+                                            (size_t)msg_len);
+        }
+
+        /* A record the journal refused still goes out as text */
+        if ((!log_text_enabled && sent) || level < text_min_level) {
+                return;
+        }
+
+        if (msg) {
+                autofree(char) *rend = NULL;
+
+                if (asprintf(&rend,
+                             "[%s] %s (%s:L%d): %s\n",
+                             displ,
+                             PACKAGE_NAME_SHORT,
+                             filename,
+                             lineno,
+                             msg) < 0) {
+                        goto fail;
+                }
+                cbm_log_sink_write(rend, strlen(rend), level >= CBM_LOG_ERROR);
+                return;
+        }
+
+        line[len++] = '\n';
+        cbm_log_sink_write(line, len, level >= CBM_LOG_ERROR);
+        return;
+
+fail:
+        cbm_log_flush();
+        if (log_file) {
+                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream\n", log_file);
+        }
+}
+
+void cbm_log(CbmLogLevel level, const char *filename, int lineno, const char *format, ...)
+{
         va_list vargs;
-        autofree(char) *rend = NULL;
 
         /* Respect minimum log level */
-        if (level < min_log_level) {
+        if (!cbm_log_enabled(level)) {
                 return;
         }
 
-        displ = cbm_log_level_str(level);
-
         va_start(vargs, format);
+        cbm_log_emit(level, filename, lineno, NULL, format, vargs);
+        va_end(vargs);
+}
 
-        if (vasprintf(&rend, format, vargs) < 0) {
-                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream", log_file);
-                goto clean_args;
-        }
+void cbm_log_metric(CbmLogLevel level, const char *filename, int lineno, uint64_t duration_us,
+                    uint64_t bytes, const char *format, ...)
+{
+        va_list vargs;
+        CbmLogMetric metric = {.duration_us = duration_us, .bytes = bytes };
 
-        if (fprintf(log_file,
-                    "[%s] %s (%s:L%d): %s\n",
-                    displ,
-                    PACKAGE_NAME_SHORT,
-                    filename,
-                    lineno,
-                    rend) < 0) {
-                /* Forcibly fall back to stderr with the error */
-                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream", stderr);
-                goto clean_args;
+        if (!cbm_log_enabled(level)) {
+                return;
         }
 
-clean_args:
+        va_start(vargs, format);
+        cbm_log_emit(level, filename, lineno, &metric, format, vargs);
         va_end(vargs);
 }
 
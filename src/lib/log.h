@@ -13,8 +13,15 @@
 
 #define _GNU_SOURCE
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/**
+ * Default location of the journald native protocol socket
+ */
+#define CBM_JOURNAL_SOCKET "/run/systemd/journal/socket"
+
 typedef enum {
         CBM_LOG_DEBUG = 0,
         CBM_LOG_INFO,
@@ -25,6 +32,21 @@ typedef enum {
         CBM_LOG_MAX /* Unused */
 } CbmLogLevel;
 
+/**
+ * Current minimum log level, exposed only so that the LOG_* macros can
+ * filter messages before evaluating their arguments. Use cbm_log_init()
+ * to change it.
+ */
+extern CbmLogLevel cbm_log_min_level;
+
+/**
+ * Determine whether a message at the given level would be emitted
+ */
+static inline bool cbm_log_enabled(CbmLogLevel level)
+{
+        return level >= cbm_log_min_level;
+}
+
 /**
  * Re-initialise the logging functionality, to use a different file descriptor
  * for logging
@@ -36,39 +58,101 @@ void cbm_log_init(FILE *log);
 /**
  * Log current status/error to stderr. It is recommended to use the
  * macros to achieve this.
+ *
+ * Messages are batched in an internal buffer, which is flushed when an
+ * error, warning or fatal message is logged, when it fills up, and at exit.
  */
 void cbm_log(CbmLogLevel level, const char *file, int line, const char *format, ...)
     __attribute__((format(printf, 4, 5)));
 
+/**
+ * Write any buffered log messages out to the log file
+ */
+void cbm_log_flush(void);
+
+/**
+ * Log a message carrying performance fields (CBM_DURATION_US, CBM_BYTES)
+ * for the structured journal sink. The text sink only sees the message.
+ */
+void cbm_log_metric(CbmLogLevel level, const char *file, int line, uint64_t duration_us,
+                    uint64_t bytes, const char *format, ...)
+    __attribute__((format(printf, 6, 7)));
+
+/**
+ * Start sending each log record as one journald native protocol datagram
+ * to the given socket, or CBM_JOURNAL_SOCKET if NULL.
+ *
+ * @note This is already called at startup when stderr is connected to the
+ * journal, in which case the text sink is silenced to avoid duplicates.
+ * Records the journal fails to take are still written as text.
+ */
+bool cbm_log_journal_open(const char *socket_path);
+
+/**
+ * Stop sending records to the journal
+ */
+void cbm_log_journal_close(void);
+
+/**
+ * Set the CBM_PHASE field attached to subsequent records from this thread.
+ * Pass NULL to clear it.
+ */
+void cbm_log_set_phase(const char *phase);
+
+/**
+ * Set the CBM_KERNEL field attached to subsequent records from this thread.
+ * Pass NULL to clear it.
+ */
+void cbm_log_set_kernel(const char *kernel);
+
+/**
+ * Monotonic timestamp in microseconds, for computing CBM_DURATION_US
+ */
+uint64_t cbm_log_now_us(void);
+
+/**
+ * Only call cbm_log (and evaluate the arguments) if the level is enabled
+ */
+#define cbm_log_at(level, ...)                                                               \
+        (cbm_log_enabled(level) ? cbm_log(level, __FILE__, __LINE__, __VA_ARGS__) : (void)0)
+
 /**
  * Log a simple debug message
  */
-#define LOG_DEBUG(...) (cbm_log(CBM_LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_DEBUG(...) cbm_log_at(CBM_LOG_DEBUG, __VA_ARGS__)
 
 /**
  * Log an informational message
  */
-#define LOG_INFO(...) (cbm_log(CBM_LOG_INFO, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_INFO(...) cbm_log_at(CBM_LOG_INFO, __VA_ARGS__)
 
 /**
  * Log success
  */
-#define LOG_SUCCESS(...) (cbm_log(CBM_LOG_SUCCESS, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_SUCCESS(...) cbm_log_at(CBM_LOG_SUCCESS, __VA_ARGS__)
 
 /**
  * Log a non-fatal error
  */
-#define LOG_ERROR(...) (cbm_log(CBM_LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_ERROR(...) cbm_log_at(CBM_LOG_ERROR, __VA_ARGS__)
 
 /**
  * Log a fatal error
  */
-#define LOG_FATAL(...) (cbm_log(CBM_LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_FATAL(...) cbm_log_at(CBM_LOG_FATAL, __VA_ARGS__)
 
 /**
  * Log a warning message that must always be seen
  */
-#define LOG_WARNING(...) (cbm_log(CBM_LOG_WARNING, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_WARNING(...) cbm_log_at(CBM_LOG_WARNING, __VA_ARGS__)
+
+/**
+ * Log an informational message with duration and byte count fields
+ */
+#define LOG_METRIC(duration_us, bytes, ...)                                                      \
+        (cbm_log_enabled(CBM_LOG_INFO)                                                           \
+             ? cbm_log_metric(CBM_LOG_INFO, __FILE__, __LINE__, duration_us, bytes, __VA_ARGS__) \
+             : (void)0)
 
 #define check_common_ret_val(level, exp, ret_val, ...)                  \
   do {                                                                  \
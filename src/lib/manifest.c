@@ -0,0 +1,375 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "manifest.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+#include "util.h"
+
+/**
+ * Enough of stat to notice a file being replaced or rewritten
+ */
+typedef struct CbmFileId {
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_sec;
+        long mtime_nsec;
+} CbmFileId;
+
+typedef struct CbmManifestEntry {
+        char *source;
+        uint8_t digest[CBM_SHA256_LEN];
+        CbmFileId source_id;
+        CbmFileId target_id;
+} CbmManifestEntry;
+
+struct CbmManifest {
+        char *path;
+        NcHashmap *entries; /**<Target path to CbmManifestEntry */
+        pthread_mutex_t lock;
+        bool dirty;
+};
+
+static void cbm_manifest_entry_free(void *v)
+{
+        CbmManifestEntry *entry = v;
+
+        if (!entry) {
+                return;
+        }
+        free(entry->source);
+        free(entry);
+}
+
+static bool cbm_manifest_file_id(const char *path, CbmFileId *id)
+{
+        struct stat st = { 0 };
+
+        if (stat(path, &st) != 0) {
+                return false;
+        }
+        id->ino = (uint64_t)st.st_ino;
+        id->size = (uint64_t)st.st_size;
+        id->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+        id->mtime_nsec = st.st_mtim.tv_nsec;
+        return true;
+}
+
+/**
+ * Inode numbers on vfat are made up when it is mounted, so they are only
+ * compared for sources
+ */
+static bool cbm_manifest_file_id_equal(const CbmFileId *a, const CbmFileId *b, bool by_inode)
+{
+        return (!by_inode || a->ino == b->ino) && a->size == b->size &&
+               a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/**
+ * Parse "<sha256> <id> <id>\t<source>\t<target>", where an id is
+ * "<ino> <size> <sec>.<nsec>". @line is modified.
+ */
+static bool cbm_manifest_parse_line(CbmManifest *self, char *line)
+{
+        CbmManifestEntry *entry = NULL;
+        CbmFileId s = { 0 };
+        CbmFileId t = { 0 };
+        char hex[CBM_SHA256_HEX_LEN] = { 0 };
+        char *source = NULL;
+        char *target = NULL;
+
+        source = strchr(line, '\t');
+        if (!source) {
+                return false;
+        }
+        *source++ = '\0';
+        target = strchr(source, '\t');
+        if (!target || target == source) {
+                return false;
+        }
+        *target++ = '\0';
+        if (*target == '\0') {
+                return false;
+        }
+        if (sscanf(line,
+                   "%64s %" SCNu64 " %" SCNu64 " %" SCNd64 ".%ld %" SCNu64 " %" SCNu64
+                   " %" SCNd64 ".%ld",
+                   hex,
+                   &s.ino,
+                   &s.size,
+                   &s.mtime_sec,
+                   &s.mtime_nsec,
+                   &t.ino,
+                   &t.size,
+                   &t.mtime_sec,
+                   &t.mtime_nsec) != 9) {
+                return false;
+        }
+
+        entry = calloc(1, sizeof(*entry));
+        OOM_CHECK(entry);
+        if (!cbm_sha256_from_hex(hex, entry->digest)) {
+                free(entry);
+                return false;
+        }
+        entry->source = strdup(source);
+        target = strdup(target);
+        OOM_CHECK(entry->source);
+        OOM_CHECK(target);
+        entry->source_id = s;
+        entry->target_id = t;
+        OOM_CHECK(nc_hashmap_put(self->entries, target, entry));
+        return true;
+}
+
+CbmManifest *cbm_manifest_load(const char *prefix)
+{
+        CbmManifest *self = NULL;
+        autofree(FILE) *fp = NULL;
+        char *line = NULL;
+        size_t n = 0;
+        ssize_t r;
+
+        self = calloc(1, sizeof(*self));
+        OOM_CHECK_RET(self, NULL);
+        self->path = string_printf("%s%s", prefix ? prefix : "", CBM_MANIFEST_FILE);
+        self->entries = nc_hashmap_new_full(nc_string_hash,
+                                            nc_string_compare,
+                                            free,
+                                            cbm_manifest_entry_free);
+        OOM_CHECK(self->entries);
+        pthread_mutex_init(&self->lock, NULL);
+
+        fp = fopen(self->path, "re");
+        if (!fp) {
+                return self;
+        }
+        while ((r = getline(&line, &n, fp)) > 0) {
+                if (line[r - 1] == '\n') {
+                        line[r - 1] = '\0';
+                }
+                if (!cbm_manifest_parse_line(self, line)) {
+                        LOG_DEBUG("Ignoring malformed entry in %s", self->path);
+                        self->dirty = true;
+                }
+        }
+        free(line);
+        return self;
+}
+
+void cbm_manifest_free(CbmManifest *self)
+{
+        if (!self) {
+                return;
+        }
+        nc_hashmap_free(self->entries);
+        pthread_mutex_destroy(&self->lock);
+        free(self->path);
+        free(self);
+}
+
+bool cbm_manifest_trusts(CbmManifest *self, const char *source, const char *target)
+{
+        const CbmManifestEntry *entry = NULL;
+        CbmFileId s = { 0 };
+        CbmFileId t = { 0 };
+        bool ret = false;
+
+        if (!self || !cbm_manifest_file_id(source, &s) || !cbm_manifest_file_id(target, &t)) {
+                return false;
+        }
+        pthread_mutex_lock(&self->lock);
+        entry = nc_hashmap_get(self->entries, target);
+        ret = entry && streq(entry->source, source) &&
+              cbm_manifest_file_id_equal(&entry->source_id, &s, true) &&
+              cbm_manifest_file_id_equal(&entry->target_id, &t, false);
+        pthread_mutex_unlock(&self->lock);
+        return ret;
+}
+
+bool cbm_manifest_source_digest(CbmManifest *self, const char *source, const char *target,
+                                uint8_t digest[CBM_SHA256_LEN])
+{
+        const CbmManifestEntry *entry = NULL;
+        CbmFileId s = { 0 };
+        bool ret = false;
+
+        if (!self || !cbm_manifest_file_id(source, &s)) {
+                return false;
+        }
+        pthread_mutex_lock(&self->lock);
+        entry = nc_hashmap_get(self->entries, target);
+        ret = entry && streq(entry->source, source) &&
+              cbm_manifest_file_id_equal(&entry->source_id, &s, true);
+        if (ret) {
+                memcpy(digest, entry->digest, CBM_SHA256_LEN);
+        }
+        pthread_mutex_unlock(&self->lock);
+        return ret;
+}
+
+void cbm_manifest_record(CbmManifest *self, const char *source, const char *target,
+                         const uint8_t digest[CBM_SHA256_LEN])
+{
+        CbmManifestEntry *entry = NULL;
+        char *key = NULL;
+
+        if (!self) {
+                return;
+        }
+        entry = calloc(1, sizeof(*entry));
+        OOM_CHECK(entry);
+        if (!cbm_manifest_file_id(source, &entry->source_id) ||
+            !cbm_manifest_file_id(target, &entry->target_id)) {
+                cbm_manifest_entry_free(entry);
+                cbm_manifest_forget(self, target);
+                return;
+        }
+        memcpy(entry->digest, digest, CBM_SHA256_LEN);
+        entry->source = strdup(source);
+        key = strdup(target);
+        OOM_CHECK(entry->source);
+        OOM_CHECK(key);
+
+        pthread_mutex_lock(&self->lock);
+        nc_hashmap_remove(self->entries, key);
+        OOM_CHECK(nc_hashmap_put(self->entries, key, entry));
+        self->dirty = true;
+        pthread_mutex_unlock(&self->lock);
+}
+
+bool cbm_manifest_lookup(CbmManifest *self, const char *target, uint8_t digest[CBM_SHA256_LEN],
+                         const char **source)
+{
+        const CbmManifestEntry *entry = NULL;
+
+        if (!self) {
+                return false;
+        }
+        pthread_mutex_lock(&self->lock);
+        entry = nc_hashmap_get(self->entries, target);
+        if (entry) {
+                memcpy(digest, entry->digest, CBM_SHA256_LEN);
+                if (source) {
+                        *source = entry->source;
+                }
+        }
+        pthread_mutex_unlock(&self->lock);
+        return entry != NULL;
+}
+
+void cbm_manifest_forget(CbmManifest *self, const char *target)
+{
+        if (!self) {
+                return;
+        }
+        pthread_mutex_lock(&self->lock);
+        if (nc_hashmap_remove(self->entries, target)) {
+                self->dirty = true;
+        }
+        pthread_mutex_unlock(&self->lock);
+}
+
+static void cbm_manifest_write_id(FILE *fp, const CbmFileId *id)
+{
+        fprintf(fp,
+                " %" PRIu64 " %" PRIu64 " %" PRId64 ".%09ld",
+                id->ino,
+                id->size,
+                id->mtime_sec,
+                id->mtime_nsec);
+}
+
+bool cbm_manifest_save(CbmManifest *self)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *tmp = NULL;
+        autofree(FILE) *fp = NULL;
+        NcHashmapIter iter = { 0 };
+        CbmManifestEntry *entry = NULL;
+        const char *target = NULL;
+        bool ret = false;
+
+        if (!self) {
+                return true;
+        }
+        pthread_mutex_lock(&self->lock);
+        if (!self->dirty) {
+                ret = true;
+                goto out;
+        }
+
+        dir = strdup(self->path);
+        OOM_CHECK(dir);
+        *strrchr(dir, '/') = '\0';
+        tmp = string_printf("%s.tmp", self->path);
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_DEBUG("Cannot record the install manifest in %s: %s", dir, strerror(errno));
+                goto out;
+        }
+        fp = fopen(tmp, "we");
+        if (!fp) {
+                LOG_DEBUG("Cannot record the install manifest in %s: %s", tmp, strerror(errno));
+                goto out;
+        }
+
+        nc_hashmap_iter_init(self->entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&target, (void **)&entry)) {
+                char hex[CBM_SHA256_HEX_LEN];
+
+                /* Whatever removed it should have said so, but don't carry it forever */
+                if (!nc_file_exists(target)) {
+                        continue;
+                }
+                cbm_sha256_to_hex(entry->digest, hex);
+                fputs(hex, fp);
+                cbm_manifest_write_id(fp, &entry->source_id);
+                cbm_manifest_write_id(fp, &entry->target_id);
+                fprintf(fp, "\t%s\t%s\n", entry->source, target);
+        }
+        if (fflush(fp) != 0 || rename(tmp, self->path) != 0) {
+                LOG_DEBUG("Cannot record the install manifest in %s: %s",
+                          self->path,
+                          strerror(errno));
+                (void)unlink(tmp);
+                goto out;
+        }
+        self->dirty = false;
+        ret = true;
+out:
+        pthread_mutex_unlock(&self->lock);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
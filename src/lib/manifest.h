@@ -0,0 +1,99 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+#include "files.h"
+#include "nica/util.h"
+#include "sha256.h"
+
+/**
+ * Where the manifest lives, relative to the root prefix
+ */
+#define CBM_MANIFEST_FILE CBM_STATE_DIR "/install.manifest"
+
+/**
+ * A CbmManifest records, for every blob installed to the boot partition,
+ * the source it was copied from and the SHA-256 of its content, along with
+ * the identity (inode, size and mtime) of both as of the install. While
+ * neither identity changes the install is known to be intact without
+ * reading either file. The inode of a target is not part of its identity,
+ * vfat numbers them anew on every mount.
+ *
+ * Targets are absolute paths. All functions are safe to call concurrently,
+ * and accept a NULL manifest as one that records nothing.
+ */
+typedef struct CbmManifest CbmManifest;
+
+/**
+ * Load the manifest for @prefix. A missing or corrupt manifest is empty.
+ */
+CbmManifest *cbm_manifest_load(const char *prefix);
+
+void cbm_manifest_free(CbmManifest *self);
+
+/**
+ * Whether @target still holds the content @source had when it was
+ * recorded, judging by their identities alone
+ */
+bool cbm_manifest_trusts(CbmManifest *self, const char *source, const char *target);
+
+/**
+ * Record that @target now holds @source, whose content hashes to @digest.
+ * Both are stat'd now, so this must follow the final rename.
+ */
+void cbm_manifest_record(CbmManifest *self, const char *source, const char *target,
+                         const uint8_t digest[CBM_SHA256_LEN]);
+
+/**
+ * Fetch the digest recorded for @target when it was installed from @source,
+ * provided @source is unchanged since. @target itself is not consulted, it
+ * may have been damaged since.
+ */
+bool cbm_manifest_source_digest(CbmManifest *self, const char *source, const char *target,
+                                uint8_t digest[CBM_SHA256_LEN]);
+
+/**
+ * Fetch the digest recorded for @target, and optionally the source it was
+ * copied from, which is owned by the manifest
+ */
+bool cbm_manifest_lookup(CbmManifest *self, const char *target, uint8_t digest[CBM_SHA256_LEN],
+                         const char **source);
+
+/**
+ * Forget about @target, e.g. because it was removed
+ */
+void cbm_manifest_forget(CbmManifest *self, const char *target);
+
+/**
+ * Write the manifest back if it changed, dropping entries whose target no
+ * longer exists
+ */
+bool cbm_manifest_save(CbmManifest *self);
+
+DEF_AUTOFREE(CbmManifest, cbm_manifest_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
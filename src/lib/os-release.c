@@ -11,6 +11,7 @@
 
 #include "os-release.h"
 #include "config.h"
+#include "files.h"
 #include "log.h"
 #include "nica/files.h"
 
@@ -18,6 +19,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 /**
  * Statically defined fields for correctness of implementation
@@ -34,6 +36,21 @@ static const char *os_release_fields[] = {
             [OS_RELEASE_BUG_REPORT_URL] = "BUG_REPORT_URL",
 };
 
+/**
+ * Location of a value within the mapped file
+ */
+typedef struct CbmOsReleaseSlice {
+        size_t offset;
+        size_t length;
+        bool set;
+} CbmOsReleaseSlice;
+
+struct CbmOsRelease {
+        CbmMappedFile file;                        /**<Mapped os-release file */
+        CbmOsReleaseSlice fields[OS_RELEASE_MAX];  /**<Known keys found in the file */
+        char *values[OS_RELEASE_MAX];              /**<Terminated copies, made on lookup */
+};
+
 /**
  * Return a sane fallback key if one isn't provided in the config.
  */
@@ -56,129 +73,119 @@ static const char *cbm_os_release_fallback_value(CbmOsReleaseKey key)
 }
 
 /**
- * Do the actual hard work of parsing the os-release file.
+ * Map a key (case insensitive) to a known field, or OS_RELEASE_MIN
  */
-static bool cbm_os_release_parse(CbmOsRelease *self, const char *path)
+static CbmOsReleaseKey cbm_os_release_lookup_key(const char *key, size_t len)
 {
-        autofree(FILE) *f = NULL;
-        size_t sn;
-        ssize_t r = 0;
-        char *buf = NULL;
-        bool ret = true;
-
-        f = fopen(path, "r");
-        if (!f) {
-                if (errno != ENOENT) {
-                        LOG_ERROR("Unable to open %s: %s", path, strerror(errno));
+        for (int i = OS_RELEASE_MIN + 1; i < OS_RELEASE_MAX; i++) {
+                if (strlen(os_release_fields[i]) == len &&
+                    strncasecmp(os_release_fields[i], key, len) == 0) {
+                        return (CbmOsReleaseKey)i;
                 }
-                return false;
         }
+        return OS_RELEASE_MIN;
+}
 
-        while ((r = getline(&buf, &sn, f)) > 0) {
-                ssize_t cur = 0;
-                size_t val_len = 0;
-                size_t incr = 0;
-                char *key = NULL;
-                autofree(char) *value = NULL;
-
-                /* Strip newlines */
-                if (r >= 1 && buf[r - 1] == '\n') {
-                        buf[r - 1] = '\0';
-                        --r;
-                }
-
-                char *l = buf;
-                char *c = NULL;
-
-                /* Skip empty lines */
-                if (r < 1) {
-                        goto next_line;
-                }
+/**
+ * Record a single line of the mapping, if it assigns a known key
+ */
+static void cbm_os_release_parse_line(CbmOsRelease *self, const char *l, size_t r)
+{
+        const char *buf = self->file.buffer;
+        const char *c = NULL;
+        size_t val_len = 0;
+        size_t val_off = 0;
+        CbmOsReleaseKey key;
+
+        /* Skip the starting whitespace */
+        while (r > 0 && isspace(*l)) {
+                ++l;
+                --r;
+        }
 
-                /* Skip the starting whitespace */
-                while (isspace(*l)) {
-                        ++l;
-                        if (!*l) {
-                                break;
-                        }
-                }
+        /* Skip empty lines and comments */
+        if (r < 1 || l[0] == '#') {
+                return;
+        }
 
-                /* Skip a comment */
-                if (l[0] == '#') {
-                        goto next_line;
-                }
+        /* Strip trailing whitespace */
+        while (r > 0 && isspace(l[r - 1])) {
+                --r;
+        }
 
-                /* Reset length */
-                cur = (l - buf);
-                r -= cur;
+        /* Look for assignment */
+        c = memchr(l, '=', r);
+        if (!c) {
+                return;
+        }
 
-                /* Strip trailing whitespace */
-                l = rstrip(l, (size_t *)&r);
+        /* Skip empty keys and empty values */
+        val_len = r - (size_t)((c - l) + 1);
+        if (c - l < 1 || val_len < 1) {
+                return;
+        }
 
-                /* May now be an empty line */
-                if (r < 1) {
-                        goto next_line;
-                }
+        key = cbm_os_release_lookup_key(l, (size_t)(c - l));
+        if (key == OS_RELEASE_MIN) {
+                return;
+        }
 
-                /* Look for assignment */
-                c = memchr(l, '=', (size_t)r);
-                if (!c) {
-                        goto next_line;
-                }
+        val_off = (size_t)(c + 1 - buf);
 
-                /* Skip empty value */
-                val_len = (size_t)(r - ((c - l) + 1));
-                if (val_len < 1) {
-                        goto next_line;
-                }
+        /* Strip the quotes */
+        if (buf[val_off + val_len - 1] == '\'' || buf[val_off + val_len - 1] == '\"') {
+                --val_len;
+        }
+        if (val_len > 0 && (buf[val_off] == '\'' || buf[val_off] == '\"')) {
+                ++val_off;
+                --val_len;
+        }
 
-                /* Skip empty keys */
-                if (c - l < 1) {
-                        goto next_line;
-                }
+        /* Later assignments win */
+        self->fields[key] = (CbmOsReleaseSlice){.offset = val_off, .length = val_len, .set = true };
+}
 
-                key = strndup(l, (size_t)(c - l));
-                value = strndup(c + 1, val_len);
+/**
+ * Do the actual hard work of parsing the os-release file.
+ */
+static bool cbm_os_release_parse(CbmOsRelease *self, const char *path)
+{
+        const char *buf = NULL;
+        const char *end = NULL;
+        const char *l = NULL;
 
-                /* Fix the key to always be upper case */
-                char *tkey = key;
-                while (*tkey != '\0') {
-                        *tkey = (char)toupper(*tkey);
-                        ++tkey;
+        if (!cbm_mapped_file_open(path, &self->file)) {
+                if (errno != ENOENT) {
+                        LOG_ERROR("Unable to open %s: %s", path, strerror(errno));
                 }
+                return false;
+        }
 
-                if (value[val_len - 1] == '\'' || value[val_len - 1] == '\"') {
-                        value[val_len - 1] = '\0';
-                }
+        buf = self->file.buffer;
+        end = buf + self->file.length;
 
-                if (value[0] == '\'' || value[0] == '\"') {
-                        incr = 1;
-                }
+        for (l = buf; l < end;) {
+                const char *nl = memchr(l, '\n', (size_t)(end - l));
+                const char *eol = nl ? nl : end;
 
-                if (!nc_hashmap_put(self, key, strdup(value + incr))) {
-                        ret = false;
-                        break;
-                }
-        next_line:
-                free(buf);
-                buf = NULL;
+                cbm_os_release_parse_line(self, l, (size_t)(eol - l));
+                l = eol + 1;
         }
 
-        if (buf) {
-                free(buf);
-                buf = NULL;
-        }
-        return ret;
+        return true;
 }
 
 CbmOsRelease *cbm_os_release_new(const char *path)
 {
-        NcHashmap *ret = NULL;
+        CbmOsRelease *ret = NULL;
 
-        ret = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        ret = calloc(1, sizeof(CbmOsRelease));
+        if (!ret) {
+                return NULL;
+        }
         if (!cbm_os_release_parse(ret, path)) {
-                cbm_os_release_free(ret);
-                return nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+                /* Leave it empty, so lookups give the fallbacks */
+                memset(ret, 0, sizeof(CbmOsRelease));
         }
 
         return ret;
@@ -189,7 +196,7 @@ CbmOsRelease *cbm_os_release_new_for_root(const char *root)
         static const char *files[] = { "etc/os-release", "usr/lib/os-release" };
         CbmOsRelease *release = NULL;
 
-        /* Loop the files until one parses, otherwise return an empty NcHashmap */
+        /* Loop the files until one parses, otherwise return an empty CbmOsRelease */
         for (size_t i = 0; i < ARRAY_SIZE(files); i++) {
                 autofree(char) *p = NULL;
 
@@ -205,18 +212,26 @@ CbmOsRelease *cbm_os_release_new_for_root(const char *root)
                 }
         }
 
-        return nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        return calloc(1, sizeof(CbmOsRelease));
 }
 
 void cbm_os_release_free(CbmOsRelease *self)
 {
-        nc_hashmap_free(self);
+        if (!self) {
+                return;
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(self->values); i++) {
+                free(self->values[i]);
+        }
+        if (self->file.buffer) {
+                cbm_mapped_file_close(&self->file);
+        }
+        free(self);
 }
 
 const char *cbm_os_release_get_value(CbmOsRelease *self, CbmOsReleaseKey key)
 {
-        const char *strkey = NULL;
-        const char *ret = NULL;
+        CbmOsReleaseSlice *slice = NULL;
 
         /* Guard against any malloc failures */
         if (!self) {
@@ -227,13 +242,22 @@ const char *cbm_os_release_get_value(CbmOsRelease *self, CbmOsReleaseKey key)
                 return NULL;
         }
 
-        strkey = os_release_fields[key];
-        ret = nc_hashmap_get(self, strkey);
-        if (!ret) {
-                ret = cbm_os_release_fallback_value(key);
+        if (self->values[key]) {
+                return self->values[key];
         }
 
-        return ret;
+        slice = &self->fields[key];
+        if (!slice->set) {
+                return cbm_os_release_fallback_value(key);
+        }
+
+        /* The mapping isn't terminated, so hand out a copy of the slice */
+        self->values[key] = strndup(self->file.buffer + slice->offset, slice->length);
+        if (!self->values[key]) {
+                return cbm_os_release_fallback_value(key);
+        }
+
+        return self->values[key];
 }
 
 /*
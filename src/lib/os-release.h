@@ -13,7 +13,6 @@
 
 #define _GNU_SOURCE
 
-#include "nica/hashmap.h"
 #include "util.h"
 
 typedef enum {
@@ -31,13 +30,13 @@ typedef enum {
 } CbmOsReleaseKey;
 
 /**
- * OsRelease is simply a hashmap with forced lower keys,
- * and some handy accessor methods.
- *
  * A CbmOsRelease is parsed from an /etc/os-release style file to provide
  * OS version and name information.
+ *
+ * The file is mapped and scanned once, recording only the well known keys
+ * as slices into the mapping. Unknown keys are skipped.
  */
-typedef NcHashmap CbmOsRelease;
+typedef struct CbmOsRelease CbmOsRelease;
 
 /**
  * Create a new CbmOsRelease by parsing the given os-release file
@@ -73,7 +72,7 @@ const char *cbm_os_release_get_value(CbmOsRelease *self, CbmOsReleaseKey key);
 void cbm_os_release_free(CbmOsRelease *self);
 
 /* Convenience function */
-DEF_AUTOFREE(CbmOsRelease, nc_hashmap_free)
+DEF_AUTOFREE(CbmOsRelease, cbm_os_release_free)
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
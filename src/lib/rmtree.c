@@ -0,0 +1,272 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "iosched.h"
+#include "log.h"
+#include "rmtree.h"
+#include "util.h"
+
+/**
+ * A directory still to be emptied and removed. It stays alive until every
+ * subdirectory queued from it has been removed, then removes itself and
+ * releases its parent.
+ */
+typedef struct CbmRmDir {
+        char *path;              /**<Path of this directory, for logging and the root */
+        char *name;              /**<Name within the parent directory */
+        int fd;                  /**<Open on this directory once scanned, else -1 */
+        struct CbmRmDir *parent; /**<Directory this was found in, NULL for the root */
+        struct CbmRmDir *next;   /**<Queue link */
+        int pending;             /**<Own scan plus outstanding subdirectories */
+} CbmRmDir;
+
+typedef struct CbmRmTree {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        CbmRmDir *queue; /**<Directories waiting to be scanned */
+        bool done;       /**<The root has been removed, or failed to be */
+        int error;       /**<First errno seen */
+} CbmRmTree;
+
+static CbmRmDir *cbm_rm_dir_new(const char *path, const char *name, CbmRmDir *parent)
+{
+        CbmRmDir *ret = calloc(1, sizeof(CbmRmDir));
+
+        OOM_CHECK(ret);
+        ret->path = strdup(path);
+        ret->name = strdup(name);
+        OOM_CHECK(ret->path);
+        OOM_CHECK(ret->name);
+        ret->fd = -1;
+        ret->parent = parent;
+        ret->pending = 1;
+        return ret;
+}
+
+/**
+ * Remember the first failure, the walk continues regardless
+ */
+static void cbm_rm_tree_fail(CbmRmTree *tree, const char *path, int error)
+{
+        if (error == ENOENT) {
+                return;
+        }
+        LOG_DEBUG("Failed to remove %s: %s", path, strerror(error));
+        pthread_mutex_lock(&tree->lock);
+        if (!tree->error) {
+                tree->error = error;
+        }
+        pthread_mutex_unlock(&tree->lock);
+}
+
+static void cbm_rm_tree_push(CbmRmTree *tree, CbmRmDir *dir)
+{
+        pthread_mutex_lock(&tree->lock);
+        dir->parent->pending++;
+        dir->next = tree->queue;
+        tree->queue = dir;
+        pthread_cond_signal(&tree->cond);
+        pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * Drop one reference on @dir, removing it and walking up the tree for
+ * every directory that is now empty
+ */
+static void cbm_rm_tree_release(CbmRmTree *tree, CbmRmDir *dir)
+{
+        int r;
+
+        pthread_mutex_lock(&tree->lock);
+        while (dir && --dir->pending == 0) {
+                CbmRmDir *parent = dir->parent;
+
+                pthread_mutex_unlock(&tree->lock);
+                if (dir->fd >= 0) {
+                        close(dir->fd);
+                }
+
+                /* The parent is still pending on us, so its fd is open */
+                if (parent) {
+                        r = unlinkat(parent->fd, dir->name, AT_REMOVEDIR);
+                } else {
+                        r = rmdir(dir->path);
+                }
+                if (r != 0) {
+                        cbm_rm_tree_fail(tree, dir->path, errno);
+                }
+                free(dir->path);
+                free(dir->name);
+                free(dir);
+                pthread_mutex_lock(&tree->lock);
+
+                if (!parent) {
+                        tree->done = true;
+                        pthread_cond_broadcast(&tree->cond);
+                }
+                dir = parent;
+        }
+        pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * Empty a single directory of everything but subdirectories, which are
+ * queued for any worker to pick up
+ */
+static void cbm_rm_tree_scan(CbmRmTree *tree, CbmRmDir *dir)
+{
+        const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+        struct dirent *ent = NULL;
+        DIR *dirp = NULL;
+        int fd;
+
+        /* Relative to the parent, so a rename above can't redirect us */
+        dir->fd = dir->parent ? openat(dir->parent->fd, dir->name, flags) : open(dir->path, flags);
+        if (dir->fd < 0) {
+                cbm_rm_tree_fail(tree, dir->path, errno);
+                return;
+        }
+
+        /* The stream gets its own fd, ours is kept for the subdirectories */
+        fd = fcntl(dir->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0 || !(dirp = fdopendir(fd))) {
+                cbm_rm_tree_fail(tree, dir->path, errno);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return;
+        }
+
+        while ((ent = readdir(dirp)) != NULL) {
+                bool is_dir = ent->d_type == DT_DIR;
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+                if (ent->d_type == DT_UNKNOWN) {
+                        struct stat st = { 0 };
+
+                        if (fstatat(dir->fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                                is_dir = S_ISDIR(st.st_mode);
+                        }
+                }
+                if (is_dir) {
+                        autofree(char) *child = string_printf("%s/%s", dir->path, ent->d_name);
+
+                        cbm_rm_tree_push(tree, cbm_rm_dir_new(child, ent->d_name, dir));
+                        continue;
+                }
+                if (unlinkat(dir->fd, ent->d_name, 0) != 0) {
+                        int error = errno;
+                        autofree(char) *child = string_printf("%s/%s", dir->path, ent->d_name);
+
+                        cbm_rm_tree_fail(tree, child, error);
+                }
+        }
+        closedir(dirp);
+}
+
+static void *cbm_rm_tree_worker(void *data)
+{
+        CbmRmTree *tree = data;
+        CbmIoPhase io_phase = cbm_io_set_phase(CBM_IO_PHASE_REMOVE);
+
+        for (;;) {
+                CbmRmDir *dir = NULL;
+
+                pthread_mutex_lock(&tree->lock);
+                while (!tree->queue && !tree->done) {
+                        pthread_cond_wait(&tree->cond, &tree->lock);
+                }
+                if (!tree->queue) {
+                        pthread_mutex_unlock(&tree->lock);
+                        break;
+                }
+                dir = tree->queue;
+                tree->queue = dir->next;
+                pthread_mutex_unlock(&tree->lock);
+
+                cbm_rm_tree_scan(tree, dir);
+                cbm_rm_tree_release(tree, dir);
+        }
+        cbm_io_set_phase(io_phase);
+        return NULL;
+}
+
+bool cbm_rm_rf_parallel(const char *path, unsigned int workers)
+{
+        CbmRmTree tree = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+        pthread_t threads[CBM_RMTREE_MAX_WORKERS];
+        unsigned int started = 0;
+        struct stat st = { 0 };
+
+        if (lstat(path, &st) != 0) {
+                return errno == ENOENT;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+                return unlink(path) == 0;
+        }
+
+        if (workers == 0) {
+                long n = sysconf(_SC_NPROCESSORS_ONLN);
+                workers = n > 0 ? (unsigned int)n : 1;
+        }
+        if (workers > CBM_RMTREE_MAX_WORKERS) {
+                workers = CBM_RMTREE_MAX_WORKERS;
+        }
+
+        tree.queue = cbm_rm_dir_new(path, path, NULL);
+
+        /* The calling thread is always a worker, the rest are best effort */
+        for (unsigned int i = 1; i < workers; i++) {
+                if (pthread_create(&threads[started], NULL, cbm_rm_tree_worker, &tree) != 0) {
+                        break;
+                }
+                started++;
+        }
+        cbm_rm_tree_worker(&tree);
+
+        for (unsigned int i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&tree.lock);
+        pthread_cond_destroy(&tree.cond);
+
+        if (tree.error) {
+                errno = tree.error;
+                return false;
+        }
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,52 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+
+/**
+ * Upper bound on removal threads, beyond this the filesystem journal is
+ * the bottleneck rather than syscall latency
+ */
+#define CBM_RMTREE_MAX_WORKERS 8
+
+/**
+ * Recursively remove @path, like nc_rm_rf, for large trees such as kernel
+ * modules and headers.
+ *
+ * Directories are read with fdopendir and their entries removed with
+ * unlinkat relative to the directory fd. Subdirectories are fanned out
+ * across up to @workers threads (0 picks one per CPU, up to
+ * CBM_RMTREE_MAX_WORKERS). Symlinks are removed, never followed.
+ *
+ * No sync is performed; callers issue a single flush once all removals
+ * are complete.
+ *
+ * @return true if @path no longer exists. On failure errno is set to the
+ * first error met, and as much of the tree as possible is removed.
+ */
+bool cbm_rm_rf_parallel(const char *path, unsigned int workers);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
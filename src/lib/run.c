@@ -0,0 +1,303 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "run.h"
+
+/**
+ * Output of the command is split into lines of at most this many bytes
+ */
+#define CBM_RUN_LINE_MAX 1024
+
+/**
+ * One captured output stream of the command
+ */
+typedef struct CbmRunStream {
+        int fd;                      /**<Read end of the pipe, -1 at EOF */
+        CbmLogLevel level;           /**<Level its lines are logged at */
+        size_t len;                  /**<Bytes pending in line */
+        char line[CBM_RUN_LINE_MAX]; /**<Incomplete last line */
+} CbmRunStream;
+
+static void cbm_run_stream_flush(CbmRunStream *stream, const char *name)
+{
+        if (stream->len == 0) {
+                return;
+        }
+        cbm_log_at(stream->level, "%s: %.*s", name, (int)stream->len, stream->line);
+        stream->len = 0;
+}
+
+/**
+ * Read what is available on @stream, logging each complete line
+ */
+static void cbm_run_stream_read(CbmRunStream *stream, const char *name)
+{
+        char buf[4096];
+        ssize_t r;
+
+        r = read(stream->fd, buf, sizeof(buf));
+        if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+                return;
+        }
+        if (r <= 0) {
+                cbm_run_stream_flush(stream, name);
+                close(stream->fd);
+                stream->fd = -1;
+                return;
+        }
+        for (ssize_t i = 0; i < r; i++) {
+                if (buf[i] == '\n') {
+                        cbm_run_stream_flush(stream, name);
+                        continue;
+                }
+                if (stream->len == sizeof(stream->line)) {
+                        cbm_run_stream_flush(stream, name);
+                }
+                stream->line[stream->len++] = buf[i];
+        }
+}
+
+static int cbm_run_timeout_ms(int timeout_ms)
+{
+        const char *env = NULL;
+        char *end = NULL;
+        long secs;
+
+        if (timeout_ms > 0) {
+                return timeout_ms;
+        }
+        env = getenv("CBM_COMMAND_TIMEOUT");
+        if (env) {
+                secs = strtol(env, &end, 10);
+                if (end != env && *end == '\0' && secs > 0 && secs < INT32_MAX / 1000) {
+                        return (int)secs * 1000;
+                }
+                LOG_WARNING("Ignoring invalid CBM_COMMAND_TIMEOUT: %s", env);
+        }
+        return CBM_RUN_TIMEOUT_MS;
+}
+
+int cbm_run_command(char *const *argv, int timeout_ms)
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        CbmRunStream streams[2] = {
+                {.fd = -1, .level = CBM_LOG_DEBUG },
+                {.fd = -1, .level = CBM_LOG_INFO },
+        };
+        int out[2] = { -1, -1 };
+        int err[2] = { -1, -1 };
+        struct rusage usage = { 0 };
+        const char *name = NULL;
+        uint64_t start = 0;
+        uint64_t deadline = 0;
+        bool timed_out = false;
+        bool reaped = false;
+        int status = 0;
+        int ret = -1;
+        pid_t pid = -1;
+
+        if (!argv || !argv[0]) {
+                errno = EINVAL;
+                return -1;
+        }
+        name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+        timeout_ms = cbm_run_timeout_ms(timeout_ms);
+
+        if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+                LOG_ERROR("Failed to create pipes for %s: %s", name, strerror(errno));
+                goto close_pipes;
+        }
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+
+        /* Its own process group, so a timeout takes down its children too */
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+
+        LOG_DEBUG("Running %s", argv[0]);
+        start = cbm_log_now_us();
+        errno = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (errno != 0) {
+                LOG_ERROR("Failed to run %s: %s", argv[0], strerror(errno));
+                goto close_pipes;
+        }
+
+        close(out[1]);
+        close(err[1]);
+        out[1] = err[1] = -1;
+        streams[0].fd = out[0];
+        streams[1].fd = err[0];
+        out[0] = err[0] = -1;
+        deadline = start + (uint64_t)timeout_ms * 1000;
+
+        /* Drain output until both pipes close or we run out of time */
+        while (streams[0].fd >= 0 || streams[1].fd >= 0) {
+                struct pollfd fds[2] = {
+                        {.fd = streams[0].fd, .events = POLLIN },
+                        {.fd = streams[1].fd, .events = POLLIN },
+                };
+                uint64_t now = cbm_log_now_us();
+                int n;
+
+                if (now >= deadline) {
+                        timed_out = true;
+                        break;
+                }
+                n = poll(fds, 2, (int)((deadline - now + 999) / 1000));
+                if (n < 0 && errno != EINTR) {
+                        break;
+                }
+                for (int i = 0; n > 0 && i < 2; i++) {
+                        if (fds[i].revents) {
+                                cbm_run_stream_read(&streams[i], name);
+                        }
+                }
+        }
+
+        /* The pipes may close early, the process still has to exit in time */
+        while (!timed_out) {
+                pid_t r = wait4(pid, &status, WNOHANG, &usage);
+
+                if (r == pid) {
+                        reaped = true;
+                        break;
+                }
+                if (r < 0 && errno != EINTR) {
+                        break;
+                }
+                if (cbm_log_now_us() >= deadline) {
+                        timed_out = true;
+                        break;
+                }
+                (void)poll(NULL, 0, 10);
+        }
+        if (timed_out) {
+                LOG_ERROR("%s did not finish within %d seconds, killing it",
+                          name,
+                          timeout_ms / 1000);
+                (void)kill(-pid, SIGKILL);
+        }
+        while (!reaped && wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {
+                ;
+        }
+        for (int i = 0; i < 2; i++) {
+                if (streams[i].fd >= 0) {
+                        cbm_run_stream_flush(&streams[i], name);
+                        close(streams[i].fd);
+                }
+        }
+
+        LOG_METRIC(cbm_log_now_us() - start, 0, "Ran %s", name);
+        LOG_DEBUG("%s: user %ld.%06lds, system %ld.%06lds, max rss %ldKiB",
+                  name,
+                  (long)usage.ru_utime.tv_sec,
+                  (long)usage.ru_utime.tv_usec,
+                  (long)usage.ru_stime.tv_sec,
+                  (long)usage.ru_stime.tv_usec,
+                  usage.ru_maxrss);
+
+        if (timed_out) {
+                errno = ETIMEDOUT;
+        } else if (WIFEXITED(status)) {
+                ret = WEXITSTATUS(status);
+                if (ret != 0) {
+                        LOG_DEBUG("%s exited with status %d", name, ret);
+                }
+        } else if (WIFSIGNALED(status)) {
+                LOG_ERROR("%s was killed by signal %d", name, WTERMSIG(status));
+                errno = EINTR;
+        }
+        return ret;
+
+close_pipes:
+        for (int i = 0; i < 2; i++) {
+                if (out[i] >= 0) {
+                        close(out[i]);
+                }
+                if (err[i] >= 0) {
+                        close(err[i]);
+                }
+        }
+        return -1;
+}
+
+char **cbm_argv_new(const char *arg, ...)
+{
+        va_list va;
+        char **argv = NULL;
+        size_t n = 0;
+
+        va_start(va, arg);
+        for (const char *a = arg; a; a = va_arg(va, const char *)) {
+                n++;
+        }
+        va_end(va);
+
+        argv = calloc(n + 1, sizeof(char *));
+        OOM_CHECK(argv);
+
+        n = 0;
+        va_start(va, arg);
+        for (const char *a = arg; a; a = va_arg(va, const char *)) {
+                argv[n] = strdup(a);
+                OOM_CHECK(argv[n]);
+                n++;
+        }
+        va_end(va);
+        return argv;
+}
+
+void cbm_argv_free(char **argv)
+{
+        if (!argv) {
+                return;
+        }
+        for (char **a = argv; *a; a++) {
+                free(*a);
+        }
+        free(argv);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
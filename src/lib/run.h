@@ -0,0 +1,61 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include "util.h"
+
+/**
+ * Default limit on an external command, in milliseconds. The
+ * CBM_COMMAND_TIMEOUT environment variable overrides it, in seconds.
+ */
+#define CBM_RUN_TIMEOUT_MS (5 * 60 * 1000)
+
+/**
+ * Run @argv directly via posix_spawn, without a shell. argv[0] must be an
+ * absolute path.
+ *
+ * stdin is /dev/null. stdout and stderr are captured line by line into the
+ * log, at debug and info level respectively. The wall time, CPU time and
+ * peak RSS of the command are logged when it exits. A command still
+ * running after @timeout_ms (0 for the default) is killed, together with
+ * anything it spawned.
+ *
+ * @return The exit status of the command, or -1 if it could not be run,
+ * was killed by a signal or timed out
+ */
+int cbm_run_command(char *const *argv, int timeout_ms);
+
+/**
+ * Build a NULL terminated, heap allocated argv from the NULL terminated
+ * argument list, copying each argument
+ */
+char **cbm_argv_new(const char *arg, ...);
+
+/**
+ * Free an argv returned by cbm_argv_new()
+ */
+void cbm_argv_free(char **argv);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
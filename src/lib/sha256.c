@@ -0,0 +1,265 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sha256.h"
+
+/**
+ * Files are read through a buffer of this size, whatever their length
+ */
+#define CBM_SHA256_READ_SIZE (256 * 1024)
+
+static const uint32_t cbm_sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2,
+};
+
+static inline uint32_t cbm_sha256_ror(uint32_t x, unsigned n)
+{
+        return (x >> n) | (x << (32 - n));
+}
+
+static void cbm_sha256_block(CbmSha256 *ctx, const uint8_t *p)
+{
+        uint32_t w[64];
+        uint32_t a, b, c, d, e, f, g, h;
+
+        for (int i = 0; i < 16; i++) {
+                w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+                       (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+                uint32_t s0 = cbm_sha256_ror(w[i - 15], 7) ^ cbm_sha256_ror(w[i - 15], 18) ^
+                              (w[i - 15] >> 3);
+                uint32_t s1 = cbm_sha256_ror(w[i - 2], 17) ^ cbm_sha256_ror(w[i - 2], 19) ^
+                              (w[i - 2] >> 10);
+
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        a = ctx->state[0];
+        b = ctx->state[1];
+        c = ctx->state[2];
+        d = ctx->state[3];
+        e = ctx->state[4];
+        f = ctx->state[5];
+        g = ctx->state[6];
+        h = ctx->state[7];
+
+        for (int i = 0; i < 64; i++) {
+                uint32_t s1 = cbm_sha256_ror(e, 6) ^ cbm_sha256_ror(e, 11) ^ cbm_sha256_ror(e, 25);
+                uint32_t ch = (e & f) ^ (~e & g);
+                uint32_t t1 = h + s1 + ch + cbm_sha256_k[i] + w[i];
+                uint32_t s0 = cbm_sha256_ror(a, 2) ^ cbm_sha256_ror(a, 13) ^ cbm_sha256_ror(a, 22);
+                uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                uint32_t t2 = s0 + maj;
+
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+        }
+
+        ctx->state[0] += a;
+        ctx->state[1] += b;
+        ctx->state[2] += c;
+        ctx->state[3] += d;
+        ctx->state[4] += e;
+        ctx->state[5] += f;
+        ctx->state[6] += g;
+        ctx->state[7] += h;
+}
+
+void cbm_sha256_init(CbmSha256 *ctx)
+{
+        static const uint32_t initial[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+
+        memcpy(ctx->state, initial, sizeof(initial));
+        ctx->length = 0;
+        ctx->used = 0;
+}
+
+void cbm_sha256_update(CbmSha256 *ctx, const void *data, size_t len)
+{
+        const uint8_t *p = data;
+
+        ctx->length += len;
+        if (ctx->used) {
+                size_t n = sizeof(ctx->block) - ctx->used;
+
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(ctx->block + ctx->used, p, n);
+                ctx->used += n;
+                p += n;
+                len -= n;
+                if (ctx->used < sizeof(ctx->block)) {
+                        return;
+                }
+                cbm_sha256_block(ctx, ctx->block);
+                ctx->used = 0;
+        }
+        while (len >= sizeof(ctx->block)) {
+                cbm_sha256_block(ctx, p);
+                p += sizeof(ctx->block);
+                len -= sizeof(ctx->block);
+        }
+        memcpy(ctx->block, p, len);
+        ctx->used = len;
+}
+
+void cbm_sha256_final(CbmSha256 *ctx, uint8_t digest[CBM_SHA256_LEN])
+{
+        uint64_t bits = ctx->length * 8;
+
+        ctx->block[ctx->used++] = 0x80;
+        if (ctx->used > sizeof(ctx->block) - 8) {
+                memset(ctx->block + ctx->used, 0, sizeof(ctx->block) - ctx->used);
+                cbm_sha256_block(ctx, ctx->block);
+                ctx->used = 0;
+        }
+        memset(ctx->block + ctx->used, 0, sizeof(ctx->block) - 8 - ctx->used);
+        for (int i = 0; i < 8; i++) {
+                ctx->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        cbm_sha256_block(ctx, ctx->block);
+
+        for (int i = 0; i < 8; i++) {
+                digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+                digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+                digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+                digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+        }
+}
+
+bool cbm_sha256_file_at(int dirfd, const char *path, bool uncached,
+                        uint8_t digest[CBM_SHA256_LEN])
+{
+        CbmSha256 ctx;
+        uint8_t *buf = NULL;
+        bool ret = false;
+        ssize_t r;
+        int fd;
+
+        fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        buf = malloc(CBM_SHA256_READ_SIZE);
+        if (!buf) {
+                goto end;
+        }
+        if (uncached) {
+                (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        cbm_sha256_init(&ctx);
+        for (;;) {
+                r = read(fd, buf, CBM_SHA256_READ_SIZE);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r < 0) {
+                        goto end;
+                }
+                if (r == 0) {
+                        break;
+                }
+                cbm_sha256_update(&ctx, buf, (size_t)r);
+        }
+        cbm_sha256_final(&ctx, digest);
+        ret = true;
+
+        /* Nobody needs a boot blob cached once it is verified */
+        if (uncached) {
+                (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+end:
+        free(buf);
+        close(fd);
+        return ret;
+}
+
+void cbm_sha256_to_hex(const uint8_t digest[CBM_SHA256_LEN], char hex[CBM_SHA256_HEX_LEN])
+{
+        static const char digits[] = "0123456789abcdef";
+
+        for (int i = 0; i < CBM_SHA256_LEN; i++) {
+                hex[i * 2] = digits[digest[i] >> 4];
+                hex[i * 2 + 1] = digits[digest[i] & 0xf];
+        }
+        hex[CBM_SHA256_LEN * 2] = '\0';
+}
+
+static int cbm_sha256_nibble(char c)
+{
+        if (c >= '0' && c <= '9') {
+                return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+                return c - 'A' + 10;
+        }
+        return -1;
+}
+
+bool cbm_sha256_from_hex(const char *hex, uint8_t digest[CBM_SHA256_LEN])
+{
+        for (int i = 0; i < CBM_SHA256_LEN; i++) {
+                int hi = cbm_sha256_nibble(hex[i * 2]);
+                int lo = hi < 0 ? -1 : cbm_sha256_nibble(hex[i * 2 + 1]);
+
+                if (lo < 0) {
+                        return false;
+                }
+                digest[i] = (uint8_t)(hi << 4 | lo);
+        }
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
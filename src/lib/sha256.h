@@ -0,0 +1,82 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CBM_SHA256_LEN 32
+
+/**
+ * Length of a hex encoded digest, including the terminator
+ */
+#define CBM_SHA256_HEX_LEN (CBM_SHA256_LEN * 2 + 1)
+
+/**
+ * Running SHA-256 (FIPS 180-4) over a stream, to tell whether blobs on the
+ * boot partition are intact without keeping a second copy to compare with
+ */
+typedef struct CbmSha256 {
+        uint32_t state[8];
+        uint64_t length;  /**<Bytes hashed so far */
+        uint8_t block[64];
+        size_t used;      /**<Bytes buffered in block */
+} CbmSha256;
+
+void cbm_sha256_init(CbmSha256 *ctx);
+
+/**
+ * Hash @len bytes of @data into @ctx
+ */
+void cbm_sha256_update(CbmSha256 *ctx, const void *data, size_t len);
+
+/**
+ * Finish hashing and store the result in @digest. @ctx must be initialised
+ * again before reuse.
+ */
+void cbm_sha256_final(CbmSha256 *ctx, uint8_t digest[CBM_SHA256_LEN]);
+
+/**
+ * Hash the file at @path, relative to @dirfd, reading it once in bounded
+ * chunks.
+ *
+ * @param uncached Drop the file from the page cache first, so the result
+ * reflects what is on the disk rather than what was just written to it
+ */
+bool cbm_sha256_file_at(int dirfd, const char *path, bool uncached,
+                        uint8_t digest[CBM_SHA256_LEN]);
+
+/**
+ * Encode @digest into @hex as lowercase hexadecimal
+ */
+void cbm_sha256_to_hex(const uint8_t digest[CBM_SHA256_LEN], char hex[CBM_SHA256_HEX_LEN]);
+
+/**
+ * Decode exactly CBM_SHA256_LEN * 2 hex digits from @hex into @digest
+ */
+bool cbm_sha256_from_hex(const char *hex, uint8_t digest[CBM_SHA256_LEN]);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -18,6 +18,7 @@
 
 #include "files.h"
 #include "log.h"
+#include "run.h"
 
 /**
  * Factory function to convert a dev_t to the full device path
@@ -52,7 +53,7 @@ static const char *cbm_get_devfs_path(void)
 static CbmSystemOps default_system_ops = {
         .mount = mount,
         .umount = umount,
-        .system = system,
+        .run = cbm_run_command,
         .is_mounted = cbm_is_mounted,
         .get_mountpoint_for_device = cbm_get_mountpoint_for_device,
         .devnode_to_devpath = cbm_devnode_to_devpath,
@@ -82,7 +83,7 @@ void cbm_system_set_vtable(CbmSystemOps *ops)
         assert(system_ops->umount != NULL);
         assert(system_ops->is_mounted != NULL);
         assert(system_ops->get_mountpoint_for_device != NULL);
-        assert(system_ops->system != NULL);
+        assert(system_ops->run != NULL);
         assert(system_ops->devnode_to_devpath != NULL);
         assert(system_ops->get_sysfs_path != NULL);
         assert(system_ops->get_devfs_path != NULL);
@@ -99,9 +100,9 @@ int cbm_system_umount(const char *target)
         return system_ops->umount(target);
 }
 
-int cbm_system_system(const char *command)
+int cbm_system_run(char *const *argv, int timeout_ms)
 {
-        return system_ops->system(command);
+        return system_ops->run(argv, timeout_ms);
 }
 
 bool cbm_system_is_mounted(const char *target)
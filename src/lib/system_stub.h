@@ -32,7 +32,7 @@ typedef struct CbmSystemOps {
         char *(*get_mountpoint_for_device)(const char *device);
 
         /* exec family */
-        int (*system)(const char *command);
+        int (*run)(char *const *argv, int timeout_ms);
 
         /* dev utility */
         char *(*devnode_to_devpath)(dev_t t);
@@ -76,9 +76,9 @@ char *cbm_system_get_mountpoint_for_device(const char *device);
 int cbm_system_umount(const char *target);
 
 /**
- * Wrap the system() call
+ * Run an external command, see cbm_run_command()
  */
-int cbm_system_system(const char *command);
+int cbm_system_run(char *const *argv, int timeout_ms);
 
 /**
  * Resolve the path for a given dev_t
@@ -12,8 +12,10 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 
+#include "log.h"
 #include "util.h"
 
 char *rstrip(char *a, size_t *len)
@@ -56,6 +58,139 @@ char *string_printf(const char *fmt, ...)
         return ret;
 }
 
+/**
+ * Strip leading and trailing whitespace in place
+ */
+static char *cbm_config_strip(char *s)
+{
+        char *e = NULL;
+
+        while (isspace((unsigned char)*s)) {
+                s++;
+        }
+        e = s + strlen(s);
+        while (e > s && isspace((unsigned char)e[-1])) {
+                *--e = '\0';
+        }
+        return s;
+}
+
+bool cbm_config_read(const char *path, cbm_config_func func, void *userdata)
+{
+        autofree(FILE) *fp = NULL;
+        char *line = NULL;
+        size_t n = 0;
+        int lineno = 0;
+
+        fp = fopen(path, "re");
+        if (!fp) {
+                return false;
+        }
+        while (getline(&line, &n, fp) > 0) {
+                char *key = NULL;
+                char *value = NULL;
+                char *eq = NULL;
+
+                ++lineno;
+                key = cbm_config_strip(line);
+                if (*key == '\0' || *key == '#') {
+                        continue;
+                }
+                eq = strchr(key, '=');
+                if (!eq) {
+                        LOG_WARNING("%s:%d: expected key = value", path, lineno);
+                        continue;
+                }
+                *eq = '\0';
+                key = cbm_config_strip(key);
+                value = cbm_config_strip(eq + 1);
+
+                errno = 0;
+                if (func(key, value, userdata)) {
+                        continue;
+                }
+                if (errno == ENOENT) {
+                        LOG_WARNING("%s:%d: unknown key '%s'", path, lineno, key);
+                } else {
+                        LOG_WARNING("%s:%d: invalid value '%s' for %s", path, lineno, value, key);
+                }
+        }
+        free(line);
+        return true;
+}
+
+bool cbm_parse_bytes(const char *value, uint64_t *out)
+{
+        char *end = NULL;
+        unsigned long long v;
+        unsigned shift = 0;
+
+        if (*value == '-') {
+                return false;
+        }
+        errno = 0;
+        v = strtoull(value, &end, 10);
+        if (errno != 0 || end == value) {
+                return false;
+        }
+        switch (toupper((unsigned char)*end)) {
+        case '\0':
+                break;
+        case 'K':
+                shift = 10;
+                break;
+        case 'M':
+                shift = 20;
+                break;
+        case 'G':
+                shift = 30;
+                break;
+        default:
+                return false;
+        }
+        if (*end && end[1] != '\0') {
+                return false;
+        }
+        if (shift && v > (UINT64_MAX >> shift)) {
+                return false;
+        }
+        *out = (uint64_t)v << shift;
+        return true;
+}
+
+void cbm_json_write_string(FILE *out, const char *s)
+{
+        if (!s) {
+                fputs("null", out);
+                return;
+        }
+        fputc('"', out);
+        for (const unsigned char *c = (const unsigned char *)s; *c; c++) {
+                switch (*c) {
+                case '"':
+                        fputs("\\\"", out);
+                        break;
+                case '\\':
+                        fputs("\\\\", out);
+                        break;
+                case '\n':
+                        fputs("\\n", out);
+                        break;
+                case '\t':
+                        fputs("\\t", out);
+                        break;
+                default:
+                        if (*c < 0x20) {
+                                fprintf(out, "\\u%04x", *c);
+                        } else {
+                                fputc(*c, out);
+                        }
+                        break;
+                }
+        }
+        fputc('"', out);
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
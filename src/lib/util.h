@@ -16,6 +16,7 @@
 #include "nica/util.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,6 +66,31 @@ char *rstrip(char *a, size_t *len);
  */
 char *string_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
+/**
+ * Handle one setting of a configuration file, both sides already stripped.
+ * Return false to have the value reported as invalid, after setting errno
+ * to ENOENT if it is the key that is unknown.
+ */
+typedef bool (*cbm_config_func)(const char *key, const char *value, void *userdata);
+
+/**
+ * Pass every "key = value" line of @path to @func, skipping blank lines and
+ * # comments and warning about anything malformed or rejected.
+ *
+ * @return false with errno set if @path could not be opened
+ */
+bool cbm_config_read(const char *path, cbm_config_func func, void *userdata);
+
+/**
+ * Parse a byte size with an optional K, M or G suffix (powers of 1024)
+ */
+bool cbm_parse_bytes(const char *value, uint64_t *out);
+
+/**
+ * Write @s to @out as a quoted and escaped JSON string, or null
+ */
+void cbm_json_write_string(FILE *out, const char *s);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
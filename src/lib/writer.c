@@ -14,25 +14,41 @@
 #include "writer.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "nica/files.h"
 
 bool cbm_writer_open(CbmWriter *writer)
+{
+        return cbm_writer_open_sized(writer, CBM_WRITER_DEFAULT_CAPACITY);
+}
+
+bool cbm_writer_open_sized(CbmWriter *writer, size_t capacity)
 {
         if (!writer) {
                 return false;
         }
 
-        if (writer->buffer || writer->memstream) {
+        if (writer->buffer || writer->open) {
                 return false;
         }
 
-        writer->memstream = open_memstream(&writer->buffer, &writer->buffer_n);
-        if (!writer->memstream) {
+        writer->buffer = malloc(capacity + 1);
+        if (!writer->buffer) {
                 writer->error = ENOMEM;
                 return false;
         }
+        writer->buffer[0] = '\0';
+        writer->buffer_n = 0;
+        writer->capacity = capacity + 1;
+        writer->open = true;
 
         return true;
 }
@@ -51,49 +67,110 @@ void cbm_writer_close(CbmWriter *self)
         if (!self) {
                 return;
         }
-        if (!self->memstream) {
-                return;
+        self->open = false;
+}
+
+/**
+ * Ensure there is room for @len more bytes plus the terminator, setting
+ * the error state on failure
+ */
+static bool cbm_writer_reserve(CbmWriter *self, size_t len)
+{
+        size_t need = self->buffer_n + len + 1;
+        size_t capacity = self->capacity;
+        char *buffer = NULL;
+
+        if (need <= capacity) {
+                return true;
+        }
+        while (capacity < need) {
+                capacity *= 2;
+        }
+        buffer = realloc(self->buffer, capacity);
+        if (!buffer) {
+                self->error = ENOMEM;
+                return false;
         }
-        fclose(self->memstream);
-        self->memstream = NULL;
+        self->buffer = buffer;
+        self->capacity = capacity;
+        return true;
 }
 
-void cbm_writer_append(CbmWriter *self, const char *s)
+/**
+ * Check the writer can accept more data
+ */
+static bool cbm_writer_can_append(CbmWriter *self)
 {
         if (!self || self->error != 0) {
-                return;
+                return false;
         }
 
-        /* Set EBADF as we tried to use a closed memstream */
-        if (!self->memstream) {
+        /* Set EBADF as we tried to use a closed writer */
+        if (!self->open) {
                 self->error = EBADF;
-                return;
+                return false;
         }
+        return true;
+}
 
-        if (fprintf(self->memstream, "%s", s) < 0) {
-                self->error = errno;
+void cbm_writer_append(CbmWriter *self, const char *s)
+{
+        if (!s) {
+                return;
         }
+        cbm_writer_append_n(self, s, strlen(s));
 }
 
-void cbm_writer_append_printf(CbmWriter *self, const char *fmt, ...)
+void cbm_writer_append_n(CbmWriter *self, const char *s, size_t len)
 {
-        if (!self || self->error != 0) {
+        if (!cbm_writer_can_append(self)) {
                 return;
         }
-
-        /* Set EBADF as we tried to use a closed memstream */
-        if (!self->memstream) {
-                self->error = EBADF;
+        if (!cbm_writer_reserve(self, len)) {
                 return;
         }
+        memcpy(self->buffer + self->buffer_n, s, len);
+        self->buffer_n += len;
+        self->buffer[self->buffer_n] = '\0';
+}
 
+void cbm_writer_append_printf(CbmWriter *self, const char *fmt, ...)
+{
         va_list va;
+        int len;
 
+        if (!cbm_writer_can_append(self)) {
+                return;
+        }
+
+        /* Optimistically render into the free space */
         va_start(va, fmt);
-        if (vfprintf(self->memstream, fmt, va) < 0) {
+        len = vsnprintf(self->buffer + self->buffer_n, self->capacity - self->buffer_n, fmt, va);
+        va_end(va);
+        if (len < 0) {
                 self->error = errno;
+                self->buffer[self->buffer_n] = '\0';
+                return;
         }
+        if ((size_t)len < self->capacity - self->buffer_n) {
+                self->buffer_n += (size_t)len;
+                return;
+        }
+
+        /* Didn't fit, grow and go again */
+        if (!cbm_writer_reserve(self, (size_t)len)) {
+                self->buffer[self->buffer_n] = '\0';
+                return;
+        }
+        va_start(va, fmt);
+        len = vsnprintf(self->buffer + self->buffer_n, self->capacity - self->buffer_n, fmt, va);
         va_end(va);
+        if (len < 0) {
+                self->error = errno;
+                self->buffer[self->buffer_n] = '\0';
+                return;
+        }
+        self->buffer_n += (size_t)len;
 }
 
 int cbm_writer_error(CbmWriter *self)
@@ -105,6 +182,56 @@ int cbm_writer_error(CbmWriter *self)
         return ENOMEM;
 }
 
+bool cbm_writer_write_fd(CbmWriter *self, int fd)
+{
+        struct iovec iov = { 0 };
+        ssize_t written;
+
+        if (!self || !self->buffer || fd < 0) {
+                return false;
+        }
+
+        iov.iov_base = self->buffer;
+        iov.iov_len = self->buffer_n;
+
+        while (iov.iov_len > 0) {
+                written = writev(fd, &iov, 1);
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                iov.iov_base = (char *)iov.iov_base + written;
+                iov.iov_len -= (size_t)written;
+        }
+        return true;
+}
+
+bool cbm_writer_write_file(CbmWriter *self, const char *path)
+{
+        bool ret = false;
+        int fd = -1;
+
+        if (nc_file_exists(path) && unlink(path) < 0) {
+                return false;
+        }
+        cbm_sync();
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                goto end;
+        }
+        ret = cbm_writer_write_fd(self, fd);
+        if (close(fd) != 0) {
+                ret = false;
+        }
+end:
+        cbm_sync();
+
+        return ret;
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
@@ -11,14 +11,29 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "nica/util.h"
 
 #define _GNU_SOURCE
 
+/**
+ * Default initial capacity used by cbm_writer_open
+ */
+#define CBM_WRITER_DEFAULT_CAPACITY 512
+
+/**
+ * Rough size of a single kernel's entry in a generated bootloader config,
+ * for sizing the writer by the number of kernels
+ */
+#define CBM_WRITER_ENTRY_SIZE_HINT 1024
+
 typedef struct CbmWriter {
-        FILE *memstream;
-        char *buffer;
-        size_t buffer_n;
+        char *buffer;    /**< Always nul terminated once opened */
+        size_t buffer_n; /**< Length of the content, excluding the terminator */
+        size_t capacity; /**< Allocated size of buffer */
+        bool open;
         int error;
 } CbmWriter;
 
@@ -29,6 +44,12 @@ typedef struct CbmWriter {
  */
 bool cbm_writer_open(CbmWriter *writer);
 
+/**
+ * Open the writer with room for at least @capacity bytes of content, to
+ * avoid growing the buffer for output of a known approximate size
+ */
+bool cbm_writer_open_sized(CbmWriter *writer, size_t capacity);
+
 /**
  * Clean up a previously allocated CbmWriter
  */
@@ -45,6 +66,11 @@ void cbm_writer_close(CbmWriter *writer);
  */
 void cbm_writer_append(CbmWriter *writer, const char *s);
 
+/**
+ * Append @len bytes of @s without any formatting
+ */
+void cbm_writer_append_n(CbmWriter *writer, const char *s, size_t len);
+
 /**
  * Append, printf style, to the buffer
  */
@@ -58,6 +84,16 @@ void cbm_writer_append_printf(CbmWriter *writer, const char *fmt, ...)
  */
 int cbm_writer_error(CbmWriter *writer);
 
+/**
+ * Write the whole content to @fd
+ */
+bool cbm_writer_write_fd(CbmWriter *writer, int fd);
+
+/**
+ * Replace the file at @path with the writer's content
+ */
+bool cbm_writer_write_file(CbmWriter *writer, const char *path);
+
 /* Convenience: Automatically clean up the CbmWriter */
 DEF_AUTOFREE(CbmWriter, cbm_writer_free)
 
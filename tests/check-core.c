@@ -12,16 +12,30 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "bootman.h"
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+#include "case-cache.h"
 #include "config.h"
+#include "esp-mirror.h"
 #include "files.h"
+#include "gc-queue.h"
+#include "iosched.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "rmtree.h"
+#include "run.h"
 #include "util.h"
 #include "writer.h"
 
@@ -152,17 +166,6 @@ static int kernel_compare(const void *a, const void *b)
         return 1;
 }
 
-static int kernel_compare_reverse(const void *a, const void *b)
-{
-        const Kernel *ka = *(const Kernel **)a;
-        const Kernel *kb = *(const Kernel **)b;
-
-        if (ka->meta.release > kb->meta.release) {
-                return -1;
-        }
-        return 1;
-}
-
 START_TEST(bootman_list_kernels_modules_test)
 {
         autofree(BootManager) *m = NULL;
@@ -388,6 +391,714 @@ START_TEST(bootman_writer_mut_test)
 }
 END_TEST
 
+START_TEST(bootman_writer_file_test)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        const char *path = TOP_BUILD_DIR "/tests/writer_file";
+        char line[64] = { 0 };
+        autofree(char) *text = NULL;
+
+        memset(line, 'x', sizeof(line) - 1);
+
+        /* Tiny hint forces both append paths to grow the buffer */
+        fail_if(!cbm_writer_open_sized(writer, 2), "Failed to create writer");
+        cbm_writer_append_n(writer, "abcdef", 3);
+        cbm_writer_append_printf(writer, "-%s-%d", line, 42);
+        cbm_writer_close(writer);
+        fail_if(cbm_writer_error(writer) != 0, "Error should be 0");
+        fail_if(writer->buffer_n != strlen(writer->buffer), "Length out of sync");
+        fail_if(strncmp(writer->buffer, "abc-xxx", 7) != 0, "Returned data is incorrect");
+
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests", 00755), "Failed to create test dir");
+        fail_if(!cbm_writer_write_file(writer, path), "Failed to write file");
+        fail_if(!cbm_file_content_equals(path, writer->buffer, writer->buffer_n),
+                "Written file does not match");
+        fail_if(!file_get_text(path, &text), "Failed to read file");
+        fail_if(!streq(text, writer->buffer), "Read text does not match");
+
+        fail_if(!file_set_text(path, "abc"), "Failed to modify file");
+        fail_if(cbm_file_content_equals(path, writer->buffer, writer->buffer_n),
+                "Modified file should not match");
+        fail_if(!cbm_file_content_equals(path, "abc", 3), "Small file should match");
+        fail_if(cbm_file_content_equals(path, "abd", 3), "Same size file should not match");
+}
+END_TEST
+
+START_TEST(bootman_arena_test)
+{
+        autofree(CbmArena) *arena = cbm_arena_new();
+        CbmArenaMark mark;
+        const char *p = NULL;
+        char big[10000];
+
+        p = cbm_arena_join(arena, "/boot/", "/EFI", "org.clearlinux", "kernel-1", NULL);
+        fail_if(!streq(p, "/boot/EFI/org.clearlinux/kernel-1"), "Invalid join: %s", p);
+        p = cbm_arena_join(arena, "/boot", "", "kernel-1", NULL);
+        fail_if(!streq(p, "/boot/kernel-1"), "Invalid join with empty component: %s", p);
+
+        mark = cbm_arena_mark(arena);
+        p = cbm_arena_printf(arena, "%s-%d", "a", 1);
+        fail_if(!streq(p, "a-1"), "Invalid printf");
+
+        /* Force a new chunk, then rewind past it */
+        memset(big, 'x', sizeof(big) - 1);
+        big[sizeof(big) - 1] = '\0';
+        p = cbm_arena_strdup(arena, big);
+        fail_if(!streq(p, big), "Invalid large strdup");
+        cbm_arena_rewind(arena, mark);
+
+        p = cbm_arena_printf(arena, "%s", "b");
+        fail_if(!streq(p, "b"), "Invalid printf after rewind");
+}
+END_TEST
+
+#define CASE_ROOT TOP_BUILD_DIR "/tests/case_cache"
+
+START_TEST(bootman_case_cache_test)
+{
+        autofree(CbmCaseCache) *cache = cbm_case_cache_new();
+        autofree(char) *p = NULL;
+
+        fail_if(!prepare_test_root(CASE_ROOT, "/EFI/Boot", NULL), "Failed to create test dir");
+
+        p = cbm_case_cache_build_path(cache, CASE_ROOT, "efi", "BOOT", "bootx64.efi", NULL);
+        fail_if(!streq(p, CASE_ROOT "/EFI/Boot/bootx64.efi"), "Invalid case-correct path: %s", p);
+        free(p);
+
+        /* Created entries are visible without another listing */
+        fail_if(!file_set_text(CASE_ROOT "/EFI/Boot/BOOTX64.EFI", "blob"), "Failed to create file");
+        cbm_case_cache_note_created(cache, CASE_ROOT "/EFI/Boot/BOOTX64.EFI");
+        p = cbm_case_cache_build_path(cache, CASE_ROOT, "efi", "boot", "bootx64.efi", NULL);
+        fail_if(!streq(p, CASE_ROOT "/EFI/Boot/BOOTX64.EFI"), "Created entry not cached: %s", p);
+        free(p);
+
+        /* New directories need an invalidation */
+        fail_if(!nc_mkdir_p(CASE_ROOT "/EFI/Vendor", 00755), "Failed to create vendor dir");
+        p = cbm_case_cache_build_path(cache, CASE_ROOT, "EFI", "vendor", NULL);
+        fail_if(!streq(p, CASE_ROOT "/EFI/vendor"), "Listing should still be cached: %s", p);
+        free(p);
+        cbm_case_cache_invalidate(cache, CASE_ROOT "/EFI/Vendor");
+        p = cbm_case_cache_build_path(cache, CASE_ROOT, "EFI", "vendor", NULL);
+        fail_if(!streq(p, CASE_ROOT "/EFI/Vendor"), "Listing not invalidated: %s", p);
+
+        nc_rm_rf(CASE_ROOT);
+}
+END_TEST
+
+#define RETENTION_ROOT TOP_BUILD_DIR "/tests/retention"
+
+START_TEST(bootman_retention_test)
+{
+        autofree(CbmRetentionPolicy) *policy = NULL;
+        Kernel kernels[6] = { 0 };
+        char bpaths[6][32];
+        KernelArray *array = nc_array_new();
+        NcArray *keep = nc_array_new();
+        NcArray *removals = nc_array_new();
+
+        fail_if(!prepare_test_root(RETENTION_ROOT, KERNEL_CONF_DIRECTORY, NULL),
+                "Failed to create dir");
+        fail_if(!file_set_text(RETENTION_ROOT KERNEL_CONF_DIRECTORY "/retention.conf",
+                               "# Test policy\n"
+                               "keep_newest = 2\n"
+                               "keep_booting=1\n"
+                               "max_bytes = 1M\n"
+                               "pin = org.clearlinux.native.4.2.1-1\n"
+                               "bogus = 1\n"),
+                "Failed to write retention.conf");
+
+        policy = cbm_retention_policy_load(RETENTION_ROOT);
+        fail_if(!policy, "Failed to load policy");
+        fail_if(policy->keep_newest != 2, "Invalid keep_newest");
+        fail_if(policy->keep_booting != 1, "Invalid keep_booting");
+        fail_if(policy->max_bytes != 1024 * 1024, "Invalid max_bytes");
+        fail_if(policy->pins->len != 1, "Invalid pins");
+        policy->max_bytes = 0;
+
+        /* Releases 6..1, highest first as the planner expects */
+        for (int i = 0; i < 6; i++) {
+                snprintf(bpaths[i], sizeof(bpaths[i]), "org.clearlinux.native.4.2.1-%d", 6 - i);
+                kernels[i].meta.bpath = bpaths[i];
+                kernels[i].meta.ktype = "native";
+                kernels[i].meta.release = 6 - i;
+                kernels[i].source.path = bpaths[i];
+                fail_if(!nc_array_add(array, &kernels[i]), "Out of memory");
+        }
+        kernels[3].meta.boots = true;
+        kernels[4].meta.boots = true;
+
+        /* tip 6, newest 5, running 4, booting 3, pinned 1: only 2 goes */
+        fail_if(!cbm_retention_plan(policy, array, &kernels[2], &kernels[0], keep, removals),
+                "Failed to plan");
+        fail_if(keep->len != 5, "Expected 5 kept kernels, got %d", keep->len);
+        fail_if(removals->len != 1, "Expected 1 removal, got %d", removals->len);
+        fail_if(nc_array_get(removals, 0) != &kernels[4], "Wrong kernel removed");
+
+        nc_array_free(&array, NULL);
+        nc_array_free(&keep, NULL);
+        nc_array_free(&removals, NULL);
+        nc_rm_rf(RETENTION_ROOT);
+}
+END_TEST
+
+#define RMTREE_ROOT TOP_BUILD_DIR "/tests/rmtree"
+
+START_TEST(bootman_rmtree_test)
+{
+        const char *tree = RMTREE_ROOT "/modules";
+        const char *outside = RMTREE_ROOT "/outside";
+
+        fail_if(!prepare_test_root(RMTREE_ROOT, "/outside", NULL), "Failed to create outside dir");
+        fail_if(!file_set_text(RMTREE_ROOT "/outside/keep", "keep"), "Failed to create file");
+
+        for (int i = 0; i < 8; i++) {
+                for (int j = 0; j < 4; j++) {
+                        autofree(char) *dir = string_printf("%s/d%d/s%d", tree, i, j);
+                        autofree(char) *file = string_printf("%s/file", dir);
+
+                        fail_if(!nc_mkdir_p(dir, 00755), "Failed to create %s", dir);
+                        fail_if(!file_set_text(file, "x"), "Failed to create %s", file);
+                }
+        }
+        /* Symlinks are removed, not followed */
+        fail_if(symlink(outside, RMTREE_ROOT "/modules/d0/link") != 0, "Failed to symlink");
+
+        fail_if(!cbm_rm_rf_parallel(tree, 4), "Failed to remove tree: %s", strerror(errno));
+        fail_if(nc_file_exists(tree), "Tree should be gone");
+        fail_if(!nc_file_exists(RMTREE_ROOT "/outside/keep"), "Followed a symlink");
+
+        /* Missing trees are not an error */
+        fail_if(!cbm_rm_rf_parallel(tree, 0), "Missing tree should succeed");
+
+        nc_rm_rf(RMTREE_ROOT);
+}
+END_TEST
+
+#define GC_ROOT TOP_BUILD_DIR "/tests/gc"
+
+START_TEST(bootman_gc_queue_test)
+{
+        const char *gone[] = { GC_ROOT "/lib/modules/4.2.1-121.kvm", GC_ROOT "/System.map-121" };
+        const char *reinstalled[] = { GC_ROOT "/lib/modules/4.2.3-124.kvm" };
+
+        fail_if(!prepare_test_root(GC_ROOT,
+                                   "/lib/modules/4.2.1-121.kvm/kernel",
+                                   "/lib/modules/4.2.3-124.kvm",
+                                   NULL),
+                "mkdir failed");
+        fail_if(!file_set_text(GC_ROOT "/lib/modules/4.2.1-121.kvm/kernel/a.ko", "x"), "write");
+        fail_if(!file_set_text(GC_ROOT "/System.map-121", "x"), "write failed");
+        fail_if(!file_set_text(GC_ROOT "/kernel-124", "x"), "write failed");
+
+        /* Queueing removes nothing */
+        fail_if(!cbm_gc_queue_push(GC_ROOT, GC_ROOT "/kernel-121", gone, 2), "Failed to queue");
+        fail_if(!cbm_gc_queue_push(GC_ROOT, GC_ROOT "/kernel-124", reinstalled, 1),
+                "Failed to queue");
+        fail_if(!nc_file_exists(gone[0]), "Queued artifact removed too early");
+
+        fail_if(!cbm_gc_queue_drain(GC_ROOT), "Failed to drain queue");
+        fail_if(nc_file_exists(gone[0]), "Module tree not collected");
+        fail_if(nc_file_exists(gone[1]), "System.map not collected");
+        fail_if(!nc_file_exists(reinstalled[0]), "Reinstalled kernel lost its modules");
+        fail_if(nc_file_exists(GC_ROOT CBM_GC_STATE_DIR "/gc.queue"), "Queue not emptied");
+        fail_if(nc_file_exists(GC_ROOT CBM_GC_STATE_DIR "/gc.queue.work"), "Work not finished");
+
+        /* Nothing queued is not an error */
+        fail_if(!cbm_gc_queue_drain(GC_ROOT), "Empty drain should succeed");
+
+        nc_rm_rf(GC_ROOT);
+}
+END_TEST
+
+#define FANOUT_ROOT TOP_BUILD_DIR "/tests/fanout"
+
+START_TEST(bootman_copy_fanout_test)
+{
+        const char *dsts[] = { FANOUT_ROOT "/same", FANOUT_ROOT "/stale", FANOUT_ROOT "/missing" };
+        bool copied[ARRAY_SIZE(dsts)] = { 0 };
+        struct stat before = { 0 };
+        struct stat after = { 0 };
+
+        fail_if(!prepare_test_root(FANOUT_ROOT, NULL), "mkdir failed");
+        fail_if(!file_set_text(FANOUT_ROOT "/src", "systemd-boot"), "write failed");
+        fail_if(!file_set_text(dsts[0], "systemd-boot"), "write failed");
+        fail_if(!file_set_text(dsts[1], "systemd-boot-old"), "write failed");
+        fail_if(stat(dsts[0], &before) != 0, "stat failed");
+
+        fail_if(!copy_file_fanout(FANOUT_ROOT "/src", dsts, ARRAY_SIZE(dsts), 00644, copied),
+                "Fan out copy failed");
+        fail_if(copied[0] || !copied[1] || !copied[2], "Wrong destinations written");
+        for (size_t i = 0; i < ARRAY_SIZE(dsts); i++) {
+                fail_if(!cbm_files_match(FANOUT_ROOT "/src", dsts[i]), "Destination differs");
+        }
+        fail_if(stat(dsts[0], &after) != 0, "stat failed");
+        fail_if(before.st_ino != after.st_ino, "Identical destination was rewritten");
+        fail_if(nc_file_exists(FANOUT_ROOT "/stale.TmpWrite"), "Temporary copy left behind");
+
+        nc_rm_rf(FANOUT_ROOT);
+}
+END_TEST
+
+#define SHARE_ROOT TOP_BUILD_DIR "/tests/copy-share"
+
+START_TEST(bootman_copy_share_test)
+{
+        autofree(char) *text = NULL;
+        struct stat src = { 0 };
+        struct stat dst = { 0 };
+
+        fail_if(!prepare_test_root(SHARE_ROOT, "/boot", NULL), "mkdir failed");
+        fail_if(!file_set_text(SHARE_ROOT "/kernel-a", "kernel-a"), "write failed");
+        fail_if(!file_set_text(SHARE_ROOT "/kernel-b", "kernel-b"), "write failed");
+
+        /* Same filesystem, so no data is copied */
+        fail_if(!copy_file_share_at(SHARE_ROOT "/kernel-a", AT_FDCWD, SHARE_ROOT "/boot/k", 00644),
+                "Could not share data on one filesystem");
+        fail_if(!copy_file_atomic(SHARE_ROOT "/kernel-a", SHARE_ROOT "/boot/kernel", 00644),
+                "Atomic install failed");
+        fail_if(!cbm_files_match(SHARE_ROOT "/kernel-a", SHARE_ROOT "/boot/kernel"),
+                "Installed kernel differs");
+        fail_if(stat(SHARE_ROOT "/kernel-a", &src) != 0, "stat failed");
+        fail_if(stat(SHARE_ROOT "/boot/kernel", &dst) != 0, "stat failed");
+        fail_if(src.st_ino != dst.st_ino && src.st_nlink != 1, "Neither a hardlink nor a reflink");
+
+        /* Replacing the install never writes through to its source */
+        fail_if(!copy_file_atomic(SHARE_ROOT "/kernel-b", SHARE_ROOT "/boot/kernel", 00644),
+                "Atomic replace failed");
+        fail_if(!file_get_text(SHARE_ROOT "/kernel-a", &text), "read failed");
+        fail_if(!streq(text, "kernel-a"), "Source was modified through the install");
+
+        /* A hardlink can't have a mode of its own, so it is copied instead */
+        fail_if(chmod(SHARE_ROOT "/kernel-a", 00644) != 0, "chmod failed");
+        fail_if(!copy_file_atomic(SHARE_ROOT "/kernel-a", SHARE_ROOT "/boot/private", 00600),
+                "Atomic install failed");
+        fail_if(stat(SHARE_ROOT "/kernel-a", &src) != 0, "stat failed");
+        fail_if(stat(SHARE_ROOT "/boot/private", &dst) != 0, "stat failed");
+        fail_if(src.st_ino == dst.st_ino, "Hardlinked with a different mode");
+        fail_if((src.st_mode & 07777) != 00644, "Source mode was changed");
+        fail_if((dst.st_mode & 07777) != 00600, "Mode not applied to the install");
+
+        nc_rm_rf(SHARE_ROOT);
+}
+END_TEST
+
+START_TEST(bootman_copy_bytes_test)
+{
+        uint8_t digest[CBM_SHA256_LEN] = { 0 };
+        struct stat src = { 0 };
+        struct stat dst = { 0 };
+        int dirfd = -1;
+
+        fail_if(!prepare_test_root(SHARE_ROOT, "/boot", NULL), "mkdir failed");
+        fail_if(!file_set_text(SHARE_ROOT "/kernel-a", "kernel-a"), "write failed");
+        fail_if(!file_set_text(SHARE_ROOT "/kernel-b", "kernel-b"), "write failed");
+        dirfd = open(SHARE_ROOT "/boot", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        fail_if(dirfd < 0, "Failed to open boot dir");
+
+        /* Where sharing is not possible every path writes the bytes itself */
+        cbm_set_share_files(false);
+        fail_if(copy_file_share_at(SHARE_ROOT "/kernel-a", dirfd, "k", 00644),
+                "Shared data while disabled");
+        fail_if(!copy_file_atomic_at(SHARE_ROOT "/kernel-a", dirfd, "kernel", 00600),
+                "Atomic install failed");
+        fail_if(!copy_file_atomic_at(SHARE_ROOT "/kernel-b", dirfd, "kernel", 00600),
+                "Atomic replace failed");
+        fail_if(!cbm_files_match(SHARE_ROOT "/kernel-b", SHARE_ROOT "/boot/kernel"),
+                "Installed kernel differs");
+        fail_if(stat(SHARE_ROOT "/kernel-b", &src) != 0, "stat failed");
+        fail_if(stat(SHARE_ROOT "/boot/kernel", &dst) != 0, "stat failed");
+        fail_if(src.st_ino == dst.st_ino, "Installed as a hardlink");
+        fail_if((dst.st_mode & 07777) != 00600, "Mode not applied to the install");
+
+        fail_if(!copy_file_stage_at(SHARE_ROOT "/kernel-a", dirfd, "staged", 00644),
+                "Stage failed");
+        fail_if(!copy_file_commit_at(dirfd, "staged"), "Commit failed");
+        fail_if(!cbm_files_match(SHARE_ROOT "/kernel-a", SHARE_ROOT "/boot/staged"),
+                "Committed kernel differs");
+
+        fail_if(!copy_file_stage_hashed_at(SHARE_ROOT "/kernel-b", dirfd, "hashed", 00644, digest),
+                "Hashed stage failed");
+        fail_if(!copy_file_commit_at(dirfd, "hashed"), "Commit failed");
+        fail_if(!cbm_files_match(SHARE_ROOT "/kernel-b", SHARE_ROOT "/boot/hashed"),
+                "Committed kernel differs");
+        fail_if(nc_file_exists(SHARE_ROOT "/boot/staged.TmpWrite") ||
+                    nc_file_exists(SHARE_ROOT "/boot/hashed.TmpWrite"),
+                "Temporary copy left behind");
+        cbm_set_share_files(true);
+
+        close(dirfd);
+        nc_rm_rf(SHARE_ROOT);
+}
+END_TEST
+
+START_TEST(bootman_copy_hashed_test)
+{
+        uint8_t digest[CBM_SHA256_LEN] = { 0 };
+        uint8_t expected[CBM_SHA256_LEN] = { 0 };
+        uint8_t compared[CBM_SHA256_LEN] = { 0 };
+        autofree(char) *text = NULL;
+        int dirfd = -1;
+
+        fail_if(!prepare_test_root(SHARE_ROOT, "/boot", NULL), "mkdir failed");
+        fail_if(!file_set_text(SHARE_ROOT "/kernel-a", "kernel-a"), "write failed");
+        fail_if(!file_set_text(SHARE_ROOT "/boot/kernel", "installed"), "write failed");
+        fail_if(!cbm_sha256_file_at(AT_FDCWD, SHARE_ROOT "/kernel-a", false, expected),
+                "Hashing the source failed");
+        dirfd = open(SHARE_ROOT "/boot", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        fail_if(dirfd < 0, "Failed to open boot dir");
+        cbm_set_share_files(false);
+
+        /* A copy that doesn't read back as written is never left to commit */
+        cbm_set_readback_fault(true);
+        fail_if(copy_file_stage_hashed_at(SHARE_ROOT "/kernel-a", dirfd, "kernel", 00644, digest),
+                "Copy that read back wrong was staged");
+        cbm_set_readback_fault(false);
+        fail_if(errno != EIO, "Read back mismatch not reported");
+        fail_if(nc_file_exists(SHARE_ROOT "/boot/kernel.TmpWrite"), "Bad copy left behind");
+        fail_if(!file_get_text(SHARE_ROOT "/boot/kernel", &text), "read failed");
+        fail_if(!streq(text, "installed"), "Bad copy replaced the install");
+
+        /* The source is hashed as it is copied */
+        fail_if(!copy_file_stage_hashed_at(SHARE_ROOT "/kernel-a", dirfd, "kernel", 00644, digest),
+                "Hashed stage failed");
+        fail_if(memcmp(digest, expected, sizeof(digest)) != 0, "Copy has the wrong hash");
+        fail_if(!copy_file_commit_at(dirfd, "kernel"), "Commit failed");
+
+        /* And as it is compared */
+        fail_if(!cbm_files_match_hashed_at(SHARE_ROOT "/kernel-a", dirfd, "kernel", compared),
+                "Installed copy does not match");
+        fail_if(memcmp(compared, expected, sizeof(compared)) != 0, "Compare has the wrong hash");
+        cbm_set_share_files(true);
+
+        close(dirfd);
+        nc_rm_rf(SHARE_ROOT);
+}
+END_TEST
+
+#define MANIFEST_ROOT TOP_BUILD_DIR "/tests/manifest"
+
+START_TEST(bootman_manifest_test)
+{
+        autofree(CbmManifest) *manifest = NULL;
+        autofree(CbmManifest) *reloaded = NULL;
+        uint8_t digest[CBM_SHA256_LEN] = { 0 };
+        uint8_t stored[CBM_SHA256_LEN] = { 0 };
+        char hex[CBM_SHA256_HEX_LEN] = { 0 };
+        const char *source = NULL;
+        struct timespec times[2];
+        struct stat st = { 0 };
+        CbmSha256 ctx;
+        int dirfd;
+
+        cbm_sha256_init(&ctx);
+        cbm_sha256_update(&ctx, "abc", 3);
+        cbm_sha256_final(&ctx, digest);
+        cbm_sha256_to_hex(digest, hex);
+        fail_if(!streq(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"),
+                "Wrong SHA-256 of abc");
+
+        fail_if(!prepare_test_root(MANIFEST_ROOT, "/boot", NULL), "mkdir failed");
+        fail_if(!file_set_text(MANIFEST_ROOT "/kernel", "abc"), "write failed");
+        dirfd = open(MANIFEST_ROOT "/boot", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        fail_if(dirfd < 0, "open failed");
+
+        /* The staged copy carries the hash of what was copied */
+        memset(digest, 0, sizeof(digest));
+        fail_if(!copy_file_stage_hashed_at(MANIFEST_ROOT "/kernel", dirfd, "kernel", 00644, digest),
+                "Hashed stage failed");
+        fail_if(!copy_file_commit_at(dirfd, "kernel"), "Commit failed");
+        close(dirfd);
+        cbm_sha256_to_hex(digest, hex);
+        fail_if(!streq(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"),
+                "Staged copy has the wrong hash");
+
+        /* Trusted until either side changes, and across a reload */
+        manifest = cbm_manifest_load(MANIFEST_ROOT);
+        fail_if(cbm_manifest_trusts(manifest, MANIFEST_ROOT "/kernel", MANIFEST_ROOT "/boot/kernel"),
+                "Empty manifest trusted an install");
+        cbm_manifest_record(manifest, MANIFEST_ROOT "/kernel", MANIFEST_ROOT "/boot/kernel", digest);
+        fail_if(!cbm_manifest_save(manifest), "Saving the manifest failed");
+
+        reloaded = cbm_manifest_load(MANIFEST_ROOT);
+        fail_if(!cbm_manifest_trusts(reloaded, MANIFEST_ROOT "/kernel", MANIFEST_ROOT "/boot/kernel"),
+                "Recorded install not trusted");
+        fail_if(!cbm_manifest_lookup(reloaded, MANIFEST_ROOT "/boot/kernel", stored, &source),
+                "Recorded install not found");
+        fail_if(memcmp(stored, digest, sizeof(digest)) != 0, "Digest did not survive a reload");
+        fail_if(!streq(source, MANIFEST_ROOT "/kernel"), "Source did not survive a reload");
+
+        /* vfat numbers inodes anew on every mount, only size and mtime count */
+        fail_if(stat(MANIFEST_ROOT "/boot/kernel", &st) != 0, "stat failed");
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        fail_if(!file_set_text(MANIFEST_ROOT "/boot/renumbered", "abc"), "write failed");
+        fail_if(utimensat(AT_FDCWD, MANIFEST_ROOT "/boot/renumbered", times, 0) != 0,
+                "utimensat failed");
+        fail_if(rename(MANIFEST_ROOT "/boot/renumbered", MANIFEST_ROOT "/boot/kernel") != 0,
+                "rename failed");
+        fail_if(!cbm_manifest_trusts(reloaded, MANIFEST_ROOT "/kernel", MANIFEST_ROOT "/boot/kernel"),
+                "Install with a new inode number not trusted");
+
+        fail_if(!file_set_text(MANIFEST_ROOT "/kernel", "abd"), "write failed");
+        fail_if(cbm_manifest_trusts(reloaded, MANIFEST_ROOT "/kernel", MANIFEST_ROOT "/boot/kernel"),
+                "Changed source still trusted");
+
+        nc_rm_rf(MANIFEST_ROOT);
+}
+END_TEST
+
+#define MIRROR_ROOT TOP_BUILD_DIR "/tests/esp-mirror"
+
+START_TEST(bootman_esp_mirror_test)
+{
+        NcArray *mirrors = NULL;
+        struct stat before = { 0 };
+        struct stat after = { 0 };
+
+        fail_if(!prepare_test_root(MIRROR_ROOT,
+                                   KERNEL_CONF_DIRECTORY,
+                                   "/primary/EFI/Boot",
+                                   "/primary/loader/entries",
+                                   "/mirror",
+                                   NULL),
+                "mkdir failed");
+        fail_if(!file_set_text(MIRROR_ROOT "/" KERNEL_CONF_DIRECTORY "/esp.conf",
+                               "mirror = " MIRROR_ROOT "/mirror\n"
+                               "mirror = " MIRROR_ROOT "/mirror/\n"
+                               "mirror = " MIRROR_ROOT "/primary\n"
+                               "bogus = 1\n"),
+                "Failed to write esp.conf");
+        fail_if(!file_set_text(MIRROR_ROOT "/primary/EFI/Boot/BOOTX64.EFI", "shim"), "write failed");
+        fail_if(!file_set_text(MIRROR_ROOT "/primary/kernel-a", "kernel-a"), "write failed");
+        fail_if(!file_set_text(MIRROR_ROOT "/primary/loader/entries/a.conf", "a"), "write failed");
+        fail_if(!file_set_text(MIRROR_ROOT "/mirror/vendor.efi", "vendor"), "write failed");
+
+        /* Duplicates and the primary itself are dropped */
+        mirrors = cbm_esp_mirror_load(MIRROR_ROOT, MIRROR_ROOT "/primary");
+        fail_if(!mirrors || mirrors->len != 1, "Wrong number of mirrors");
+        nc_array_free(&mirrors, free);
+
+        fail_if(!cbm_esp_mirror_sync(MIRROR_ROOT "/primary", MIRROR_ROOT "/mirror"),
+                "Initial mirror failed");
+        fail_if(!cbm_files_match(MIRROR_ROOT "/primary/EFI/Boot/BOOTX64.EFI",
+                                 MIRROR_ROOT "/mirror/EFI/Boot/BOOTX64.EFI"),
+                "Nested file not mirrored");
+        fail_if(!cbm_files_match(MIRROR_ROOT "/primary/loader/entries/a.conf",
+                                 MIRROR_ROOT "/mirror/loader/entries/a.conf"),
+                "Entry not mirrored");
+        fail_if(!nc_file_exists(MIRROR_ROOT "/mirror/" CBM_ESP_MIRROR_MANIFEST),
+                "No manifest written");
+
+        /* Nothing changed, nothing is rewritten */
+        fail_if(stat(MIRROR_ROOT "/mirror/kernel-a", &before) != 0, "stat failed");
+        fail_if(!cbm_esp_mirror_sync(MIRROR_ROOT "/primary", MIRROR_ROOT "/mirror"),
+                "Repeated mirror failed");
+        fail_if(stat(MIRROR_ROOT "/mirror/kernel-a", &after) != 0, "stat failed");
+        fail_if(before.st_ino != after.st_ino, "Unchanged file was copied again");
+
+        /* Removals only touch what the manifest owns */
+        fail_if(unlink(MIRROR_ROOT "/primary/kernel-a") != 0, "unlink failed");
+        fail_if(!nc_rm_rf(MIRROR_ROOT "/primary/loader"), "rm failed");
+        fail_if(!file_set_text(MIRROR_ROOT "/primary/kernel-b", "kernel-b"), "write failed");
+        fail_if(!cbm_esp_mirror_sync(MIRROR_ROOT "/primary", MIRROR_ROOT "/mirror"),
+                "Incremental mirror failed");
+        fail_if(nc_file_exists(MIRROR_ROOT "/mirror/kernel-a"), "Stale kernel not removed");
+        fail_if(nc_file_exists(MIRROR_ROOT "/mirror/loader"), "Empty directory not removed");
+        fail_if(!nc_file_exists(MIRROR_ROOT "/mirror/kernel-b"), "New kernel not mirrored");
+        fail_if(!nc_file_exists(MIRROR_ROOT "/mirror/vendor.efi"), "Foreign file removed");
+
+        nc_rm_rf(MIRROR_ROOT);
+}
+END_TEST
+
+#define IOSCHED_ROOT TOP_BUILD_DIR "/tests/iosched"
+
+START_TEST(bootman_iosched_test)
+{
+        CbmIoPolicy policy = { 0 };
+        uint64_t start = 0;
+
+        fail_if(!prepare_test_root(IOSCHED_ROOT, KERNEL_CONF_DIRECTORY, NULL), "mkdir failed");
+        fail_if(!file_set_text(IOSCHED_ROOT "/" KERNEL_CONF_DIRECTORY "/io.conf",
+                               "copy_rate = 4M\n"
+                               "writeback = 256K\n"
+                               "copy_priority = idle\n"
+                               "update_priority = best-effort:7\n"
+                               "remove_priority = best-effort:9\n"
+                               "bogus = 1\n"),
+                "Failed to write io.conf");
+
+        cbm_io_policy_load(IOSCHED_ROOT, &policy);
+        fail_if(policy.copy_rate != 4 << 20, "copy_rate not parsed");
+        fail_if(policy.writeback != 256 << 10, "writeback not parsed");
+        fail_if(policy.io_class[CBM_IO_PHASE_COPY] != CBM_IO_CLASS_IDLE, "copy class wrong");
+        fail_if(policy.io_class[CBM_IO_PHASE_UPDATE] != CBM_IO_CLASS_BEST_EFFORT ||
+                    policy.io_level[CBM_IO_PHASE_UPDATE] != 7,
+                "update priority wrong");
+        fail_if(policy.io_class[CBM_IO_PHASE_REMOVE] != CBM_IO_CLASS_NONE,
+                "Out of range level should be ignored");
+
+        /* 1MiB in 256KiB chunks at 4MiB/s waits for three of them */
+        fail_if(!file_set_text(IOSCHED_ROOT "/src", "x"), "Failed to write source");
+        fail_if(truncate(IOSCHED_ROOT "/src", 1024 * 1024) != 0, "Failed to extend source");
+        cbm_io_policy_set(&policy);
+        fail_if(cbm_io_set_phase(CBM_IO_PHASE_COPY) != CBM_IO_PHASE_UPDATE, "Wrong phase");
+        start = cbm_log_now_us();
+        fail_if(!copy_file(IOSCHED_ROOT "/src", IOSCHED_ROOT "/dst", 00644), "Copy failed");
+        fail_if(cbm_log_now_us() - start < 150000, "Copy was not throttled");
+        cbm_io_policy_set(NULL);
+        cbm_io_set_phase(CBM_IO_PHASE_UPDATE);
+        fail_if(!cbm_files_match(IOSCHED_ROOT "/src", IOSCHED_ROOT "/dst"), "Copy is corrupt");
+        fail_if(cbm_file_fragments_at(AT_FDCWD, IOSCHED_ROOT "/dst") == 0,
+                "Non-empty copy reported without any data");
+
+        nc_rm_rf(IOSCHED_ROOT);
+}
+END_TEST
+
+START_TEST(bootman_run_command_test)
+{
+        char **argv = NULL;
+        uint64_t start = 0;
+
+        argv = cbm_argv_new("/bin/sh", "-c", "echo out; echo err >&2; exit 3", NULL);
+        fail_if(cbm_run_command(argv, 0) != 3, "Exit status not returned");
+        cbm_argv_free(argv);
+
+        /* Hung commands are killed, along with their children */
+        argv = cbm_argv_new("/bin/sh", "-c", "sleep 30; sleep 30", NULL);
+        start = cbm_log_now_us();
+        fail_if(cbm_run_command(argv, 200) != -1, "Timed out command should fail");
+        fail_if(errno != ETIMEDOUT, "Timeout not reported");
+        fail_if(cbm_log_now_us() - start > 5000000, "Timeout not enforced");
+        cbm_argv_free(argv);
+
+        /* No shell is involved, so this is a missing binary */
+        argv = cbm_argv_new("/nonexistent/true && true", NULL);
+        fail_if(cbm_run_command(argv, 0) != -1, "Missing binary should fail");
+        cbm_argv_free(argv);
+}
+END_TEST
+
+#define OPGRAPH_ROOT TOP_BUILD_DIR "/tests/opgraph"
+
+/**
+ * Run @graph against OPGRAPH_ROOT, with @workers threads
+ */
+static bool run_test_op_graph(CbmOpGraph *graph, unsigned int workers)
+{
+        autofree(BootManager) *m = NULL;
+        CbmInstallContext ctx = {.boot_dir = OPGRAPH_ROOT "/boot",
+                                 .dest_dir = OPGRAPH_ROOT "/boot" };
+        bool ret = false;
+
+        m = boot_manager_new();
+        fail_if(!m, "Failed to construct BootManager instance");
+        ctx.boot_fd = open(ctx.boot_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        fail_if(ctx.boot_fd < 0, "Failed to open boot dir");
+        ctx.dest_fd = ctx.boot_fd;
+        ret = boot_manager_run_op_graph(m, &ctx, graph, workers);
+        close(ctx.boot_fd);
+        return ret;
+}
+
+START_TEST(bootman_op_graph_cancel_test)
+{
+        autofree(CbmOpGraph) *graph = NULL;
+        CbmOp *stage_a = NULL;
+        CbmOp *stage_b = NULL;
+        CbmOp *barrier = NULL;
+        CbmOp *commit_a = NULL;
+        CbmOp *commit_b = NULL;
+
+        fail_if(!prepare_test_root(OPGRAPH_ROOT, "/boot", NULL), "Failed to create test dir");
+        fail_if(!file_set_text(OPGRAPH_ROOT "/a", "kernel a"), "Failed to create source");
+
+        /* Both copies must be staged before either is committed */
+        graph = cbm_op_graph_new();
+        commit_a = cbm_op_graph_add_copy(graph, NULL, NULL, OPGRAPH_ROOT "/a", "a");
+        commit_b = cbm_op_graph_add_copy(graph, NULL, NULL, OPGRAPH_ROOT "/missing", "b");
+        stage_a = commit_a->stage;
+        stage_b = commit_b->stage;
+        barrier = cbm_op_graph_add(graph, CBM_OP_SYNC, NULL, NULL);
+        cbm_op_depends(barrier, commit_b);
+
+        fail_if(run_test_op_graph(graph, 2), "Required failure should fail the run");
+        fail_if(stage_a->state != CBM_OP_DONE, "Stage of a should have run");
+        fail_if(stage_b->state != CBM_OP_FAILED, "Stage of a missing source should fail");
+        fail_if(commit_b->state != CBM_OP_SKIPPED, "Commit of a failed stage should skip");
+        fail_if(barrier->state != CBM_OP_SKIPPED, "Cancelled run should skip later ops");
+        fail_if(stage_a->staged, "Staged copy left pending");
+        fail_if(nc_file_exists(OPGRAPH_ROOT "/boot/b"), "Failed copy was installed");
+        fail_if(nc_file_exists(OPGRAPH_ROOT "/boot/b.TmpWrite"), "Failed copy left behind");
+
+        /* Cancelled before its commit, the staged copy must be aborted */
+        cbm_op_graph_free(graph);
+        graph = cbm_op_graph_new();
+        stage_a = cbm_op_graph_add(graph, CBM_OP_STAGE, NULL, NULL);
+        stage_a->source = strdup(OPGRAPH_ROOT "/a");
+        stage_a->target = strdup("c");
+        stage_b = cbm_op_graph_add(graph, CBM_OP_STAGE, NULL, NULL);
+        stage_b->source = strdup(OPGRAPH_ROOT "/missing");
+        stage_b->target = strdup("b");
+        barrier = cbm_op_graph_add(graph, CBM_OP_SYNC, NULL, NULL);
+        cbm_op_depends(barrier, stage_a);
+        cbm_op_depends(barrier, stage_b);
+        commit_a = cbm_op_graph_add(graph, CBM_OP_COMMIT, NULL, NULL);
+        commit_a->target = strdup("c");
+        commit_a->stage = stage_a;
+        cbm_op_depends(commit_a, barrier);
+
+        fail_if(run_test_op_graph(graph, 1), "Required failure should fail the run");
+        fail_if(stage_a->state != CBM_OP_DONE, "Stage of c should have run");
+        fail_if(commit_a->state != CBM_OP_SKIPPED, "Commit should be cancelled");
+        fail_if(nc_file_exists(OPGRAPH_ROOT "/boot/c"), "Cancelled copy was installed");
+        fail_if(nc_file_exists(OPGRAPH_ROOT "/boot/c.TmpWrite"), "Staged copy not aborted");
+
+        nc_rm_rf(OPGRAPH_ROOT);
+}
+END_TEST
+
+START_TEST(bootman_op_graph_optional_test)
+{
+        autofree(CbmOpGraph) *graph = NULL;
+        CbmOp *optional = NULL;
+        CbmOp *required = NULL;
+        CbmOp *deferred = NULL;
+        CbmOp *barrier = NULL;
+
+        fail_if(!prepare_test_root(OPGRAPH_ROOT, "/boot", NULL), "Failed to create test dir");
+        fail_if(!file_set_text(OPGRAPH_ROOT "/a", "kernel a"), "Failed to create source");
+
+        /* A failed optional copy only takes its own commit with it */
+        graph = cbm_op_graph_new();
+        optional = cbm_op_graph_add_copy(graph, NULL, NULL, OPGRAPH_ROOT "/missing", "b");
+        optional->optional = true;
+        optional->stage->optional = true;
+        required = cbm_op_graph_add_copy(graph, NULL, NULL, OPGRAPH_ROOT "/a", "a");
+
+        /* Past the deadline, deferrable work is left for the next run */
+        graph->deadline_us = cbm_log_now_us();
+        deferred = cbm_op_graph_add(graph, CBM_OP_SYNC, NULL, NULL);
+        deferred->deferrable = true;
+        deferred->estimate_us = 60 * 1000000UL;
+        cbm_op_depends(deferred, required);
+        barrier = cbm_op_graph_add(graph, CBM_OP_SYNC, NULL, NULL);
+        cbm_op_depends(barrier, deferred);
+
+        fail_if(!run_test_op_graph(graph, 2), "Optional failure should not fail the run");
+        fail_if(optional->stage->state != CBM_OP_FAILED, "Optional stage should fail");
+        fail_if(optional->state != CBM_OP_SKIPPED, "Optional dependent should skip");
+        fail_if(required->state != CBM_OP_DONE, "Required copy should complete");
+        fail_if(!cbm_files_match(OPGRAPH_ROOT "/a", OPGRAPH_ROOT "/boot/a"), "Copy is corrupt");
+        fail_if(deferred->state != CBM_OP_DEFERRED, "Op past the deadline not deferred");
+        fail_if(graph->deferred != 1, "Deferred op not counted");
+        fail_if(barrier->state != CBM_OP_DONE, "Ops after a deferred op should run");
+
+        nc_rm_rf(OPGRAPH_ROOT);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -412,6 +1123,22 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_writer_simple_test);
         tcase_add_test(tc, bootman_writer_printf_test);
         tcase_add_test(tc, bootman_writer_mut_test);
+        tcase_add_test(tc, bootman_writer_file_test);
+        tcase_add_test(tc, bootman_arena_test);
+        tcase_add_test(tc, bootman_case_cache_test);
+        tcase_add_test(tc, bootman_retention_test);
+        tcase_add_test(tc, bootman_rmtree_test);
+        tcase_add_test(tc, bootman_gc_queue_test);
+        tcase_add_test(tc, bootman_copy_fanout_test);
+        tcase_add_test(tc, bootman_copy_share_test);
+        tcase_add_test(tc, bootman_copy_bytes_test);
+        tcase_add_test(tc, bootman_copy_hashed_test);
+        tcase_add_test(tc, bootman_manifest_test);
+        tcase_add_test(tc, bootman_esp_mirror_test);
+        tcase_add_test(tc, bootman_iosched_test);
+        tcase_add_test(tc, bootman_run_command_test);
+        tcase_add_test(tc, bootman_op_graph_cancel_test);
+        tcase_add_test(tc, bootman_op_graph_optional_test);
         suite_add_tcase(s, tc);
 
         return s;
@@ -0,0 +1,135 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "nica/files.h"
+#include "nica/util.h"
+
+/**
+ * Bind a datagram socket standing in for journald
+ */
+static int bind_journal(char *dir, char **path)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX };
+        int fd = -1;
+
+        fail_if(!mkdtemp(dir), "Failed to create socket directory");
+        fail_if(asprintf(path, "%s/socket", dir) < 0, "Out of memory");
+        fail_if(strlen(*path) >= sizeof(addr.sun_path), "Socket path too long");
+        strcpy(addr.sun_path, *path);
+
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        fail_if(fd < 0, "Failed to create socket");
+        fail_if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0, "Failed to bind socket");
+        return fd;
+}
+
+START_TEST(cbm_log_test_journal_fields)
+{
+        char dir[] = "/tmp/cbm-log-XXXXXX";
+        autofree(char) *path = NULL;
+        char buf[4096] = { 0 };
+        static const char binary_msg[] = "MESSAGE\n\x0d\0\0\0\0\0\0\0Second\nrecord\n";
+        ssize_t r;
+        int fd;
+
+        fd = bind_journal(dir, &path);
+        fail_if(!cbm_log_journal_open(path), "Failed to open journal sink");
+
+        cbm_log_set_phase("install");
+        cbm_log_set_kernel("org.clearlinux.native.4.2.1-121");
+        LOG_METRIC(1234, 5678, "Installed %s", "kernel");
+        cbm_log_set_kernel(NULL);
+
+        r = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+        fail_if(r <= 0, "No datagram received");
+
+        fail_if(!strstr(buf, "PRIORITY=6\n"), "Missing PRIORITY");
+        fail_if(!strstr(buf, "CBM_PHASE=install\n"), "Missing CBM_PHASE");
+        fail_if(!strstr(buf, "CBM_KERNEL=org.clearlinux.native.4.2.1-121\n"), "Missing CBM_KERNEL");
+        fail_if(!strstr(buf, "CBM_DURATION_US=1234\n"), "Missing CBM_DURATION_US");
+        fail_if(!strstr(buf, "CBM_BYTES=5678\n"), "Missing CBM_BYTES");
+        fail_if(!strstr(buf, "MESSAGE=Installed kernel\n"), "Missing MESSAGE");
+
+        /* One record, one datagram, and the kernel is no longer attached */
+        LOG_ERROR("Second\nrecord");
+        memset(buf, 0, sizeof(buf));
+        r = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+        fail_if(r <= 0, "No second datagram received");
+        fail_if(strstr(buf, "CBM_KERNEL="), "Kernel field should be cleared");
+        fail_if(!memmem(buf, (size_t)r, binary_msg, sizeof(binary_msg) - 1),
+                "Multi-line MESSAGE not binary encoded");
+        fail_if(recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0, "Unexpected extra datagram");
+
+        cbm_log_journal_close();
+        close(fd);
+        nc_rm_rf(dir);
+}
+END_TEST
+
+static Suite *core_suite(void)
+{
+        Suite *s = NULL;
+        TCase *tc = NULL;
+
+        s = suite_create("cbm_log");
+        tc = tcase_create("cbm_log_functions");
+        tcase_add_test(tc, cbm_log_test_journal_fields);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
+
+int main(void)
+{
+        Suite *s;
+        SRunner *sr;
+        int fail;
+
+        /* Ensure that logging is set up properly. */
+        setenv("CBM_DEBUG", "1", 1);
+        cbm_log_init(stderr);
+
+        s = core_suite();
+        sr = srunner_create(s);
+        srunner_run_all(sr, CK_VERBOSE);
+        fail = srunner_ntests_failed(sr);
+        srunner_free(sr);
+
+        if (fail > 0) {
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
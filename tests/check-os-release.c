@@ -49,6 +49,34 @@ START_TEST(cbm_os_release_test_unquoted)
 }
 END_TEST
 
+START_TEST(cbm_os_release_test_fallback)
+{
+        autofree(CbmOsRelease) *os_release = NULL;
+
+        os_release = cbm_os_release_new(TOP_DIR "/tests/data/no-such.os-release");
+        fail_if(!os_release, "Failed to construct empty os-release");
+
+        fail_if(!streq(cbm_os_release_get_value(os_release, OS_RELEASE_NAME), "generic-linux-os"),
+                "Invalid fallback name");
+        fail_if(!streq(cbm_os_release_get_value(os_release, OS_RELEASE_VERSION_ID), "1"),
+                "Invalid fallback version");
+        fail_if(cbm_os_release_get_value(os_release, OS_RELEASE_MAX) != NULL,
+                "Out of range key should be NULL");
+}
+END_TEST
+
+START_TEST(cbm_os_release_test_empty)
+{
+        autofree(CbmOsRelease) *os_release = NULL;
+
+        os_release = cbm_os_release_new(TOP_DIR "/tests/data/empty.os-release");
+        fail_if(!os_release, "Failed to parse empty os-release file");
+
+        fail_if(!streq(cbm_os_release_get_value(os_release, OS_RELEASE_NAME), "generic-linux-os"),
+                "Invalid fallback name");
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -58,6 +86,8 @@ static Suite *core_suite(void)
         tc = tcase_create("cbm_os_release_functions");
         tcase_add_test(tc, cbm_os_release_test_quoted);
         tcase_add_test(tc, cbm_os_release_test_unquoted);
+        tcase_add_test(tc, cbm_os_release_test_fallback);
+        tcase_add_test(tc, cbm_os_release_test_empty);
         suite_add_tcase(s, tc);
 
         return s;
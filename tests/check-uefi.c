@@ -12,13 +12,18 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <libgen.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "bootloader.h"
 #include "bootman.h"
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
 #include "config.h"
 #include "files.h"
 #include "log.h"
@@ -462,6 +467,82 @@ START_TEST(bootman_uefi_initrd_freestandings_image)
 }
 END_TEST
 
+/**
+ * Only changed freestanding initrds are replaced, and those without a source
+ * are removed
+ */
+START_TEST(bootman_uefi_initrd_freestandings_sync)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path_initrd = NULL;
+        autofree(char) *contents = NULL;
+        const char *dest = BOOT_FULL "/efi/" KERNEL_NAMESPACE;
+        const char *stale = BOOT_FULL "/efi/" KERNEL_NAMESPACE "/freestanding-gone";
+        const char *target = BOOT_FULL "/efi/" KERNEL_NAMESPACE "/freestanding-00-initrd";
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        path_initrd = string_printf("%s%s/00-initrd", PLAYGROUND_ROOT, INITRD_DIRECTORY);
+        file_set_text(path_initrd, "Placeholder initrd");
+
+        /* Same size as the source, so only its contents tell them apart */
+        fail_if(!nc_mkdir_p(dest, 00755), "Failed to create %s", dest);
+        fail_if(!file_set_text(target, "Outdated!!! initrd"), "Failed to create %s", target);
+        fail_if(!file_set_text(stale, "Stale initrd"), "Failed to create %s", stale);
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        fail_if(!file_get_text(target, &contents), "Failed to read %s", target);
+        fail_if(!streq(contents, "Placeholder initrd"), "Changed initrd was not replaced");
+        fail_if(nc_file_exists(stale), "Stale initrd was not removed");
+}
+END_TEST
+
+/**
+ * Once a native update has installed it, an unchanged initrd gets no stage
+ * op, while one changed since does
+ */
+START_TEST(bootman_uefi_initrd_freestandings_native)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path_initrd = NULL;
+        const CbmInstallContext *ctx = NULL;
+        NcArray *copy = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        /* A hardlinked copy is trusted by its inode alone */
+        cbm_set_share_files(false);
+        path_initrd = string_printf("%s%s/00-initrd", PLAYGROUND_ROOT, INITRD_DIRECTORY);
+        fail_if(!file_set_text(path_initrd, "Placeholder initrd"), "Failed to create initrd");
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        cbm_set_share_files(true);
+
+        /* As the next update sees it */
+        m->manifest = cbm_manifest_load(PLAYGROUND_ROOT);
+        ctx = boot_manager_prepare_install_context(m);
+        copy = nc_array_new();
+        fail_if(!m->manifest || !ctx || !copy, "Failed to prepare the initrd diff");
+        fail_if(!boot_manager_reconcile_initrds_freestanding(m, ctx, copy), "Failed to diff initrds");
+        fail_if(copy->len != 0, "Unchanged initrd should not be staged");
+
+        fail_if(!file_set_text(path_initrd, "Different initrd"), "Failed to change initrd");
+        fail_if(!boot_manager_reconcile_initrds_freestanding(m, ctx, copy), "Failed to diff initrds");
+        fail_if(copy->len != 1, "Changed initrd should be staged");
+
+        nc_array_free(&copy, NULL);
+        boot_manager_drop_install_context(m);
+        cbm_manifest_free(m->manifest);
+        m->manifest = NULL;
+}
+END_TEST
 
 /**
  * Ensure all blobs are removed for garbage collected kernels
@@ -588,6 +669,272 @@ START_TEST(bootman_uefi_set_kernel_missing)
 }
 END_TEST
 
+/**
+ * Planning an update changes nothing, and predicts the work the update does
+ */
+START_TEST(bootman_uefi_update_plan)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(CbmUpdatePlan) *plan = NULL;
+        autofree(CbmUpdatePlan) *replan = NULL;
+        int copies = 0;
+        int deletes = 0;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        plan = boot_manager_plan_update(m);
+        fail_if(!plan, "Failed to plan update");
+        for (int i = 0; i < plan->steps->len; i++) {
+                const CbmPlanStep *step = nc_array_get(plan->steps, i);
+
+                if (step->action == CBM_PLAN_COPY) {
+                        copies++;
+                } else if (step->action == CBM_PLAN_DELETE) {
+                        fail_if(!nc_file_exists(step->target),
+                                "Planning must not remove %s",
+                                step->target);
+                        deletes++;
+                }
+        }
+        fail_if(copies == 0 || plan->copy_bytes == 0, "Plan should copy kernels");
+        fail_if(deletes == 0, "Plan should garbage collect old kernels");
+        fail_if(plan->estimate_us == 0, "Plan should have a cost");
+        fail_if(confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Planning must not install anything");
+
+        /* Once applied there is nothing left to copy or delete */
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        replan = boot_manager_plan_update(m);
+        fail_if(!replan, "Failed to plan update");
+        fail_if(replan->copy_bytes != 0, "Nothing should be left to copy");
+        for (int i = 0; i < replan->steps->len; i++) {
+                const CbmPlanStep *step = nc_array_get(replan->steps, i);
+
+                fail_if(step->action == CBM_PLAN_DELETE, "Unexpected deletion of %s", step->target);
+        }
+}
+END_TEST
+
+/**
+ * A fresh install verifies clean, and damage, orphans and missing
+ * configuration are all reported
+ */
+START_TEST(bootman_uefi_verify)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(CbmVerifyReport) *report = NULL;
+        autofree(CbmVerifyReport) *damaged = NULL;
+        autofree(char) *kernel = NULL;
+        autofree(char) *orphan = NULL;
+        autofree(char) *loader_conf = NULL;
+        autofree(char) *contents = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        report = boot_manager_verify(m);
+        fail_if(!report, "Failed to verify");
+        for (int i = 0; i < report->items->len; i++) {
+                const CbmVerifyItem *item = nc_array_get(report->items, i);
+
+                fail_if(item->status != CBM_VERIFY_OK, "Unexpected problem with %s", item->target);
+                if (!kernel && item->source && strstr(item->source, KERNEL_DIRECTORY)) {
+                        kernel = strdup(item->target);
+                } else if (!item->source && strstr(item->target, "loader.conf")) {
+                        loader_conf = strdup(item->target);
+                }
+        }
+        fail_if(!kernel || !loader_conf, "Kernel and loader.conf should be verified");
+
+        /* Same size, different content, and no longer shared with its source */
+        fail_if(!file_get_text(kernel, &contents), "Failed to read %s", kernel);
+        contents[0] = contents[0] == 'X' ? 'Y' : 'X';
+        fail_if(unlink(kernel) != 0, "Failed to remove %s", kernel);
+        fail_if(!file_set_text(kernel, contents), "Failed to damage %s", kernel);
+        orphan = string_printf("%s/kernel-%s.stale.1.0-1", dirname(kernel), KERNEL_NAMESPACE);
+        fail_if(!file_set_text(orphan, "stale"), "Failed to create %s", orphan);
+        fail_if(unlink(loader_conf) != 0, "Failed to remove %s", loader_conf);
+
+        damaged = boot_manager_verify(m);
+        fail_if(!damaged, "Failed to verify");
+        fail_if(damaged->counts[CBM_VERIFY_MISMATCH] != 1, "Damaged kernel not reported");
+        fail_if(damaged->counts[CBM_VERIFY_ORPHAN] != 1, "Orphaned kernel not reported");
+        fail_if(damaged->counts[CBM_VERIFY_MISSING] != 1, "Missing loader.conf not reported");
+        fail_if(damaged->counts[CBM_VERIFY_UNREADABLE] != 0, "Nothing should be unreadable");
+}
+END_TEST
+
+/**
+ * Files named as ours that no known kernel accounts for are removed by the
+ * next update, while everything else on the ESP is left alone
+ */
+START_TEST(bootman_uefi_reconcile)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(CbmVerifyReport) *report = NULL;
+        autofree(CbmVerifyReport) *after = NULL;
+        autofree(char) *kernel = NULL;
+        autofree(char) *entry = NULL;
+        autofree(char) *dest = NULL;
+        autofree(char) *entries = NULL;
+        char *stale[6] = { NULL };
+        char *keep[3] = { NULL };
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        report = boot_manager_verify(m);
+        fail_if(!report, "Failed to verify");
+        for (int i = 0; i < report->items->len; i++) {
+                const CbmVerifyItem *item = nc_array_get(report->items, i);
+
+                if (!kernel && item->source && strstr(item->source, KERNEL_DIRECTORY)) {
+                        kernel = strdup(item->target);
+                } else if (!entry && !item->source && strstr(item->target, "/entries/")) {
+                        entry = strdup(item->target);
+                }
+        }
+        fail_if(!kernel || !entry, "Kernel and entry should be installed");
+        dest = strdup(kernel);
+        entries = strdup(entry);
+        fail_if(!dest || !entries, "Out of memory");
+        *strrchr(dest, '/') = '\0';
+        *strrchr(entries, '/') = '\0';
+
+        stale[0] = string_printf("%s/kernel-%s.stale.1.0-1", dest, KERNEL_NAMESPACE);
+        stale[1] = string_printf("%s/initrd-%s.stale.1.0-1", dest, KERNEL_NAMESPACE);
+        stale[2] = string_printf("%s/freestanding-gone", dest);
+        stale[3] = string_printf("%s.TmpWrite", kernel);
+        stale[4] = string_printf("%s/%s-stale-1.0-1.conf",
+                                 entries,
+                                 boot_manager_get_vendor_prefix(m));
+        /* Legacy copies go once migrated, until then they may still boot */
+        stale[5] = string_printf("%s/%s", BOOT_FULL, strrchr(kernel, '/') + strlen("/kernel-"));
+        keep[0] = string_printf("%s/README", dest);
+        keep[1] = string_printf("%s/other-1.0-1.conf", entries);
+        keep[2] = string_printf("%s/%s.stale.1.0-1", BOOT_FULL, KERNEL_NAMESPACE);
+        for (size_t i = 0; i < ARRAY_SIZE(stale); i++) {
+                fail_if(!file_set_text(stale[i], "stale"), "Failed to create %s", stale[i]);
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(keep); i++) {
+                fail_if(!file_set_text(keep[i], "keep"), "Failed to create %s", keep[i]);
+        }
+
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        for (size_t i = 0; i < ARRAY_SIZE(stale); i++) {
+                fail_if(nc_file_exists(stale[i]), "Stale %s should be removed", stale[i]);
+                free(stale[i]);
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(keep); i++) {
+                fail_if(!nc_file_exists(keep[i]), "Unaccounted %s should be kept", keep[i]);
+                free(keep[i]);
+        }
+        fail_if(!nc_file_exists(kernel) || !nc_file_exists(entry), "Installed files were removed");
+
+        after = boot_manager_verify(m);
+        fail_if(!after, "Failed to verify");
+        fail_if(after->counts[CBM_VERIFY_ORPHAN] != 0, "Nothing should be left orphaned");
+}
+END_TEST
+
+/**
+ * A completed update is current until one of its inputs or the boot
+ * directory changes
+ */
+START_TEST(bootman_uefi_update_stamp)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *device = NULL;
+        autofree(char) *device_moved = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        fail_if(boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Never updated, cannot be current");
+        device = string_printf("%s/disk/by-partuuid/e90f44b5-bb8a-41af-b680-b0bf5b0f2a65",
+                               cbm_system_get_devfs_path());
+        device_moved = string_printf("%s.moved", device);
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(!boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Unchanged system should be current");
+
+        fail_if(!nc_mkdir_p(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/cmdline.d", 00755),
+                "Failed to create cmdline.d");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/cmdline.d/quiet.conf",
+                               "quiet"),
+                "Failed to write cmdline.d");
+        fail_if(boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "New cmdline.d file not noticed");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(!boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Update should be current again");
+
+        /* Unmounted between runs: the same partition is trusted as recorded */
+        fail_if(rename(BOOT_FULL, BOOT_FULL ".mounted") != 0, "Failed to move boot aside");
+        fail_if(!nc_mkdir_p(BOOT_FULL, 00755), "Failed to create empty boot dir");
+        fail_if(!boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Unmounted boot partition should be trusted");
+        fail_if(rename(device, device_moved) != 0, "Failed to move boot device aside");
+        fail_if(boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Missing boot partition cannot be current");
+        fail_if(rename(device_moved, device) != 0, "Failed to restore boot device");
+        fail_if(rmdir(BOOT_FULL) != 0, "Failed to remove empty boot dir");
+        fail_if(rename(BOOT_FULL ".mounted", BOOT_FULL) != 0, "Failed to restore boot");
+
+        fail_if(!file_set_text(BOOT_FULL "/stray", "x"), "Failed to write to boot");
+        fail_if(boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Boot directory change not noticed");
+}
+END_TEST
+
+START_TEST(bootman_uefi_update_deadline)
+{
+        autofree(BootManager) *m = NULL;
+        const char *deferred = PLAYGROUND_ROOT CBM_STATE_DIR "/update.deferred";
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+
+        fail_if(!boot_manager_set_uname(m, "4.2.1-121.kvm"), "Failed to set initial kernel");
+        fail_if(!set_kernel_default(&uefi_kernels[1]), "Failed to set kernel as default");
+        fail_if(!boot_manager_update(m), "Failed to apply initial updates");
+        fail_if(!boot_manager_set_uname(m, "4.2.3-124.kvm"), "Failed to simulate reboot");
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel booted");
+
+        /* An already expired budget still updates the boot critical parts */
+        boot_manager_set_deadline(m, 1);
+        fail_if(!boot_manager_update(m), "Failed to apply update with a deadline");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &uefi_kernels[1]),
+                "New kernel is not installed");
+        fail_if(confirm_kernel_uninstalled(m, &uefi_kernels[0]),
+                "Old kernel should have been left for the next update");
+        fail_if(!nc_file_exists(deferred), "Deferred work not recorded");
+        fail_if(boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Update with deferred work cannot be current");
+
+        /* The next update picks up where it stopped */
+        boot_manager_set_deadline(m, 0);
+        fail_if(!boot_manager_update(m), "Failed to apply deferred updates");
+        fail_if(!confirm_kernel_uninstalled(m, &uefi_kernels[0]), "Old kernel not fully removed");
+        fail_if(nc_file_exists(deferred), "Deferred record not cleared");
+        fail_if(!boot_manager_update_is_current(m, PLAYGROUND_ROOT),
+                "Update's own removals should leave it current");
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -601,12 +948,19 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_uefi_update_from_unknown);
         tcase_add_test(tc, bootman_uefi_update_image);
         tcase_add_test(tc, bootman_uefi_update_native);
+        tcase_add_test(tc, bootman_uefi_update_plan);
+        tcase_add_test(tc, bootman_uefi_verify);
+        tcase_add_test(tc, bootman_uefi_reconcile);
+        tcase_add_test(tc, bootman_uefi_update_stamp);
+        tcase_add_test(tc, bootman_uefi_update_deadline);
         tcase_add_test(tc, bootman_uefi_remove_bootloader);
         tcase_add_test(tc, bootman_uefi_namespace_migration);
         tcase_add_test(tc, bootman_uefi_ensure_removed);
         tcase_add_test(tc, bootman_uefi_initrd_freestandings);
         tcase_add_test(tc, bootman_uefi_missing_initrd_freestandings);
         tcase_add_test(tc, bootman_uefi_initrd_freestandings_image);
+        tcase_add_test(tc, bootman_uefi_initrd_freestandings_sync);
+        tcase_add_test(tc, bootman_uefi_initrd_freestandings_native);
         tcase_add_test(tc, bootman_uefi_list_kernels);
         tcase_add_test(tc, bootman_uefi_set_kernel);
         tcase_add_test(tc, bootman_uefi_set_kernel_missing);
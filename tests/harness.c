@@ -15,6 +15,7 @@
 #include <check.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -554,6 +555,33 @@ bool confirm_kernel_uninstalled(BootManager *manager, PlaygroundKernel *kernel)
         return kernel_installed_files_count(manager, kernel) == 0;
 }
 
+bool prepare_test_root(const char *root, ...)
+{
+        const char *path = NULL;
+        bool ret = true;
+        va_list va;
+
+        if (nc_file_exists(root) && !nc_rm_rf(root)) {
+                fprintf(stderr, "Failed to clean %s: %s\n", root, strerror(errno));
+                return false;
+        }
+        if (!nc_mkdir_p(root, 00755)) {
+                fprintf(stderr, "Failed to create %s: %s\n", root, strerror(errno));
+                return false;
+        }
+        va_start(va, root);
+        while (ret && (path = va_arg(va, const char *)) != NULL) {
+                autofree(char) *dir = string_printf("%s%s", root, path);
+
+                if (!nc_mkdir_p(dir, 00755)) {
+                        fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+                        ret = false;
+                }
+        }
+        va_end(va);
+        return ret;
+}
+
 bool create_timeout_conf(void)
 {
         autofree(char) *timeout_conf = NULL;
@@ -44,6 +44,12 @@ typedef struct PlaygroundConfig {
  */
 BootManager *prepare_playground(PlaygroundConfig *config);
 
+/**
+ * Start a test from an empty @root, creating each of the directories that
+ * follow, up to a NULL, below it
+ */
+bool prepare_test_root(const char *root, ...) __attribute__((sentinel));
+
 /**
  * Push a new kernel into the root
  */
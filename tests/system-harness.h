@@ -26,7 +26,7 @@ static inline int test_umount(__cbm_unused__ const char *target)
         return 0;
 }
 
-static inline int test_system(__cbm_unused__ const char *command)
+static inline int test_run(__cbm_unused__ char *const *argv, __cbm_unused__ int timeout_ms)
 {
         return 0;
 }
@@ -63,7 +63,7 @@ static const char *test_get_devfs_path(void)
 CbmSystemOps SystemTestOps = {
         .mount = test_mount,
         .umount = test_umount,
-        .system = test_system,
+        .run = test_run,
         .is_mounted = test_is_mounted,
         .get_mountpoint_for_device = test_get_mountpoint_for_device,
         .devnode_to_devpath = test_devnode_to_devpath,